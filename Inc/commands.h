@@ -6,6 +6,14 @@ typedef enum {
   Command_Request_Sensors = 0x01,
   Command_Process_LED_Segment = 0x02,
   Command_Commit_LEDs = 0x03,
+  Command_Negotiate_Framing = 0x04,
+  Command_Framed = 0x05,
+
+  // Programming a panel's firmware, see panel_program.h
+  Command_Program_Begin = 0x06,
+  Command_Program_Chunk = 0x07,
+  Command_Program_Status = 0x08,
+  Command_Program_Finish = 0x09,
 
   Command_Test_Expect_2B = 0x71,
   Command_Test_Expect_64B = 0x72,
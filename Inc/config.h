@@ -7,14 +7,114 @@
 // File for configuration #define FLAGS
 
 
-// Change these if depending on what you've got plugged in
+// Connectors discovery.h looks for panels on; change these if depending on
+// what you've got plugged in. They're only the defaults:
+// Setting_Panels_Connected (settings.h) takes over once it's set.
 #define PANEL_LEFT_CONNECTED  (1U) 
 #define PANEL_UP_CONNECTED    (1U) 
 #define PANEL_DOWN_CONNECTED  (1U)
 #define PANEL_RIGHT_CONNECTED (1U)
 
+// Set to 1 to have msgbus advance its port state machines straight from the
+// UART DMA completion interrupts. With 0, the interrupts only set flags and
+// the next stage of a request starts on the next msgbus_process_flags() call.
+#ifndef MSGBUS_ISR_DRIVEN
+#define MSGBUS_ISR_DRIVEN (0U)
+#endif
+
+// Set to 1 to ask every panel at startup whether it understands framed
+// requests (see Command_Framed in msgbus.c). Panels that do get requests with
+// data sent as a single frame, acknowledged once. Panels that don't answer
+// keep using the original command/ack/data/ack sequence.
+#ifndef MSGBUS_FAST_FRAMING
+#define MSGBUS_FAST_FRAMING (1U)
+#endif
+
+// Set to 1 to switch USART2 between the up and right connectors by rewriting
+// only the GPIO mode registers of their pins. With 0, USART2 and its DMA are
+// fully de-initialized and initialized again on every switch.
+#ifndef UART_FAST_MUX
+#define UART_FAST_MUX (1U)
+#endif
+
+// Set to 1 to keep histograms of how long msgbus requests spend in each
+// stage, per port and command (see latency.h). The host can read them with
+// HID feature reports.
+#ifndef MSGBUS_LATENCY_STATS
+#define MSGBUS_LATENCY_STATS (1U)
+#endif
+
+// Set to 1 to send sensor reports on USB start-of-frame, so the host gets one
+// report per 1ms frame with the freshest data at that point. With 0, a report
+// is sent as soon as new sensor data is in and the IN endpoint is free.
+#ifndef USB_SOF_REPORT_PACING
+#define USB_SOF_REPORT_PACING (0U)
+#endif
+
+// Set to 1 to only relay LED segments that changed to the panels, and only
+// commit the panels that were sent one. With 0, every segment received is
+// relayed and every frame commits all panels.
+#ifndef LED_DELTA_RELAY
+#define LED_DELTA_RELAY (1U)
+#endif
+
+// Milliseconds between frames rendered by the LED effects engine (effects.h).
+// Effects that don't change cost nothing on the bus with LED_DELTA_RELAY, but
+// animated ones send every segment each frame and take bus time from sensor
+// polling.
+#ifndef LED_EFFECT_INTERVAL_MS
+#define LED_EFFECT_INTERVAL_MS (10U)
+#endif
+
+// Default step detection thresholds for every sensor, in raw sensor units
+// (see steps.h). A sensor counts as pressed from STEP_PRESS_THRESHOLD up, and
+// as released again below STEP_RELEASE_THRESHOLD. The host can change them
+// per sensor through the gamepad interface's feature report.
+#ifndef STEP_PRESS_THRESHOLD
+#define STEP_PRESS_THRESHOLD (500U)
+#endif
+
+#ifndef STEP_RELEASE_THRESHOLD
+#define STEP_RELEASE_THRESHOLD (400U)
+#endif
+
+// Shortest time in microseconds between two samples of a panel kept for the
+// batched sensor report format (sensors.h). Panels answer faster than this,
+// and keeping every sample would fill the history with near duplicates
+// before the host got to see the older ones. At 500, four panels make eight
+// samples per millisecond, which fit one report as deltas.
+#ifndef SENSOR_HISTORY_SPACING_US
+#define SENSOR_HISTORY_SPACING_US (500U)
+#endif
+
+// Milliseconds settings.h waits after a setting changed before writing it to
+// flash. Every change made meanwhile goes in the same batch of writes.
+#ifndef SETTINGS_WRITE_DELAY_MS
+#define SETTINGS_WRITE_DELAY_MS (2000U)
+#endif
+
+// Requests in a row that have to time out before discovery.h takes a panel
+// offline. A sensor request times out after 2 ticks, so at 8 an unplugged
+// panel is let go of within a few tens of milliseconds.
+#ifndef DISCOVERY_MAX_TIMEOUTS
+#define DISCOVERY_MAX_TIMEOUTS (8U)
+#endif
+
+// Milliseconds discovery.h waits after taking a panel offline for timing out
+// before it looks at the panel's ready line again
+#ifndef DISCOVERY_RETRY_MS
+#define DISCOVERY_RETRY_MS (500U)
+#endif
+
+// Panels that are online, kept up to date by discovery.h
 extern uint8_t _panels_connected[4];
 
+// Takes the panels whose bits (by ComportId) are set as connected, and the
+// others as not
+void config_set_panels_connected(uint8_t mask);
+
+void config_set_panel_connected(ComportId, uint8_t connected);
+
 inline uint8_t panel_connected(ComportId port) {
     if (port == Comport_None) return 0U;
     return _panels_connected[(uint8_t)port];
@@ -0,0 +1,10 @@
+#ifndef __CRC_H
+#define __CRC_H
+
+#include "stm32f3xx.h"
+
+// CRC-32 as zlib.crc32 computes it, with the CRC unit. The length has to be a
+// multiple of 4; the data may be anywhere, flash included, and unaligned.
+uint32_t crc32(uint8_t const * data, uint32_t len);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef __CRITICAL_H
+#define __CRITICAL_H
+
+#include "stm32f3xx.h"
+
+// Short critical sections for state shared between interrupts and the main
+// thread. These nest: the previous interrupt mask is restored on exit, so
+// they're also safe to use from within interrupt handlers.
+//
+// Usage:
+//   uint32_t primask = critical_enter();
+//   ... touch shared state ...
+//   critical_exit(primask);
+
+static inline uint32_t critical_enter() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static inline void critical_exit(uint32_t primask) {
+    __set_PRIMASK(primask);
+}
+
+#endif
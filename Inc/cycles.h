@@ -0,0 +1,24 @@
+#ifndef __CYCLES_H
+#define __CYCLES_H
+
+#include "stm32f3xx.h"
+
+// Helpers around the DWT cycle counter, used for timing measurements.
+// At 72MHz the counter wraps roughly once a minute, so only ever compare
+// two readings by subtracting them (which handles the wrap correctly).
+
+// Enables the cycle counter. Safe to call more than once.
+static inline void cycles_init() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static inline uint32_t cycles_now() {
+    return DWT->CYCCNT;
+}
+
+static inline uint32_t cycles_since(uint32_t start) {
+    return DWT->CYCCNT - start;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __DISCOVERY_H
+#define __DISCOVERY_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+
+// Brings panels online as they become ready, and takes them offline when
+// they go away, in the background, so nothing waits on the slowest panel:
+//
+// - A panel raises its CK line once it's ready (see uart_panel_ready). Each
+//   tick, the ports discovery looks after that are offline have their line
+//   read, and come online as soon as it's high: panel_connected() turns true,
+//   msgbus asks the panel about framing again, and the change handler is
+//   called.
+//
+// - An online port whose line drops, as when the panel resets, goes offline
+//   again, as does one that had DISCOVERY_MAX_TIMEOUTS requests in a row time
+//   out. msgbus then drops what was queued for it and takes nothing new. A
+//   port that timed out waits DISCOVERY_RETRY_MS before its line is read
+//   again, as a panel that hung may have left it high.
+//
+// USB comes up before any of this, see init() in main.c, and the host can
+// read how each port is doing while the panels start.
+//
+// The line is polled rather than taken from an EXTI interrupt: a tick is
+// quick enough for a panel that takes milliseconds to start, and polling also
+// notices a line that's still high after a panel stopped answering.
+
+typedef enum {
+    // Not looked after, the port stays offline
+    Discovery_Unused = 0,
+
+    // Waiting for the panel's CK line
+    Discovery_Waiting,
+
+    Discovery_Online,
+
+    // Went offline after timing out, waiting to look again
+    Discovery_Retry_Wait
+} DiscoveryState;
+
+// How a port is doing. Read by the host as it is, for every port, with the
+// vendor request USB_VENDOR_REQUEST_PANEL_STATUS.
+typedef struct {
+    // DiscoveryState
+    uint8_t state;
+
+    // Whether requests to the panel are sent framed, see msgbus.h
+    uint8_t framed;
+
+    uint16_t reserved;
+
+    // Tick the port last came online at, milliseconds since startup
+    uint32_t online_at;
+
+    // Times the port came online, and went offline because its CK line
+    // dropped or its requests timed out
+    uint32_t onlines;
+    uint32_t lost_ready;
+    uint32_t timed_out;
+} DiscoveryPort;
+
+// Public, so that contents can be inspected during debugging
+extern DiscoveryPort discovery_ports[COMPORT_ID_MAX + 1];
+
+// Called when a port comes online (true) or goes offline (false)
+typedef void (* PanelChangeHandler)(ComportId, uint8_t online);
+
+// Takes every port offline, and looks after those whose bits (by ComportId)
+// are set from now on. Call after msgbus_init.
+void discovery_init(uint8_t port_mask);
+
+void discovery_set_change_handler(PanelChangeHandler);
+
+// Brings ports online or takes them offline, see above
+void discovery_tick(uint32_t now_ms);
+
+#endif
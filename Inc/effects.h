@@ -0,0 +1,90 @@
+#ifndef __EFFECTS_H
+#define __EFFECTS_H
+
+#include "stm32f3xx.h"
+#include "color.h"
+#include "leds.h"
+
+// LED effects rendered on the board, so ambient lighting needs no LED data
+// from the host. An effect is started with a small parameter message and
+// renders a frame every LED_EFFECT_INTERVAL_MS into leds_buffer(), which then
+// goes to the panels like any other frame. Every panel shows the same thing.
+//
+// Parameters, EFFECT_PARAMS_LEN bytes, little-endian:
+//   effect     - one of EffectType
+//   hue        - uint16_t, degrees, 0 to 360
+//   saturation - percent, 0 to 100
+//   lightness  - percent, 0 to 100
+//   hue_span   - uint16_t, degrees the hue moves across a panel
+//   period_ms  - uint16_t, length of one cycle of the animation; 0 stops it
+
+#define EFFECT_PARAMS_LEN (9U)
+
+typedef enum {
+    // No effect. The LEDs keep showing what they last showed.
+    Effect_None = 0x00,
+
+    // Every LED in the color
+    Effect_Solid = 0x01,
+
+    // The hue moves across each panel's LEDs by hue_span, scrolling once
+    // around the panel every period
+    Effect_Gradient = 0x02,
+
+    // Each segment in one color, hue_span apart over the panel, turning once
+    // around the color wheel every period
+    Effect_Color_Wheel = 0x03,
+
+    // A lit run of LEDs with a fading tail, going once around each panel
+    // every period
+    Effect_Chase = 0x04,
+
+    // The color fading in and out again every period
+    Effect_Pulse = 0x05,
+
+    // Fades from whatever was showing to the color over one period, then
+    // stays there
+    Effect_Fade = 0x06,
+
+    EFFECT_TYPE_COUNT
+} EffectType;
+
+typedef struct {
+    EffectType type;
+    Color_HSL color;
+    uint16_t hue_span;
+    uint16_t period_ms;
+} EffectParams;
+
+typedef struct {
+    // Frames rendered
+    uint32_t frames;
+
+    // Frames that were due but never rendered, because ticks were late
+    uint32_t frames_missed;
+
+    // Parameter messages rejected as invalid
+    uint32_t bad_params;
+} EffectStats;
+
+// Public, so that contents can be inspected during debugging
+extern EffectStats effects_stats;
+
+void effects_init();
+
+// Starts the effect described by a parameter message, replacing any running
+// one. Effect_None stops the running effect.
+// Returns false, leaving the running effect alone, if the parameters are
+// invalid.
+uint8_t effects_start(uint8_t const * params, uint16_t len);
+
+// Stops the running effect, e.g. because the host sent a frame of its own
+void effects_stop();
+
+uint8_t effects_running();
+
+// Renders and sends a frame if one is due. Call at least every millisecond
+// with HAL_GetTick().
+void effects_tick(uint32_t now_ms);
+
+#endif
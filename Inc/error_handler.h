@@ -34,8 +34,10 @@ typedef enum {
     Error_App_MsgBus_SendCpltInvalidStatus = 0x2202,
     Error_App_MsgBus_RecvCpltInvalidStatus = 0x2203,
     Error_App_MsgBus_RecvCpltNoAck         = 0x2204,
+    Error_App_MsgBus_TooManyHandlers       = 0x2207,
 
-    Error_App_ReqQueue_QueueFull           = 0x2205
+    Error_App_ReqQueue_QueueFull           = 0x2205,
+    Error_App_ReqQueue_PoolEmpty           = 0x2206
 } ErrorCode;
 
 volatile ErrorCode Panic_Error;
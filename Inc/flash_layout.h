@@ -0,0 +1,32 @@
+#ifndef __FLASH_LAYOUT_H
+#define __FLASH_LAYOUT_H
+
+#include "stm32f3xx.h"
+
+// How the 256K of flash is split up. Every region starts on a page boundary,
+// pages being FLASH_PAGE_SIZE (2K). STM32F303CCTx_FLASH.ld keeps the firmware
+// itself within FLASH_APP_LEN.
+
+// The running firmware
+#define FLASH_APP_START (FLASH_BASE)
+#define FLASH_APP_LEN (104U * 1024U)
+
+// A new firmware image is written here while the current one keeps running,
+// and only copied over it once it's been verified, see update.h
+#define FLASH_STAGING_START (FLASH_APP_START + FLASH_APP_LEN)
+#define FLASH_STAGING_LEN (FLASH_APP_LEN)
+
+// Firmware for the panel boards, relayed to them by panel_program.h. Its
+// last page holds the length and CRC of the image, written once the image
+// has been checked, so the image itself can be up to FLASH_PANEL_IMAGE_MAX.
+#define FLASH_PANEL_IMAGE_START (FLASH_STAGING_START + FLASH_STAGING_LEN)
+#define FLASH_PANEL_IMAGE_LEN (32U * 1024U)
+#define FLASH_PANEL_IMAGE_MAX (FLASH_PANEL_IMAGE_LEN - FLASH_PAGE_SIZE)
+#define FLASH_PANEL_IMAGE_INFO (FLASH_PANEL_IMAGE_START + FLASH_PANEL_IMAGE_MAX)
+
+// Settings, see settings.h. The pages take turns holding them, so the wear
+// is spread over all of them.
+#define FLASH_SETTINGS_START (FLASH_PANEL_IMAGE_START + FLASH_PANEL_IMAGE_LEN)
+#define FLASH_SETTINGS_LEN (16U * 1024U)
+
+#endif
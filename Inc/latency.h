@@ -0,0 +1,99 @@
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+#include "commands.h"
+
+// Log-scale histograms of how long msgbus requests spend in each stage,
+// per port and per command. Bucket 0 counts anything under
+// 2^(LATENCY_BUCKET_SHIFT + 1) cycles, every bucket after that covers twice
+// the range of the one before, and the last bucket counts everything beyond.
+// With the defaults below that's <3.5us up to >3.6ms at 72MHz.
+#define LATENCY_BUCKET_COUNT (12U)
+#define LATENCY_BUCKET_SHIFT (7U)
+
+#define LATENCY_PORT_COUNT (COMPORT_ID_MAX + 1)
+
+// Operations the host can ask for by sending a feature report, first byte
+#define LATENCY_OP_SELECT (0x01U)
+#define LATENCY_OP_RESET  (0x02U)
+
+// Stages of a request, in the order they happen. Except for the first and
+// last, each one is the time spent in the PortStatus of the same name.
+typedef enum {
+    // From msgbus_send_request to the request being started
+    Latency_Queued = 0,
+    Latency_Sending_Command,
+    Latency_Awaiting_Command_Ack,
+    Latency_Sending_Data,
+    Latency_Awaiting_Data_Ack,
+    Latency_Receiving,
+
+    // From msgbus_send_request to the request being done
+    Latency_Total,
+
+    LATENCY_STAGE_COUNT
+} LatencyStage;
+
+// Commands get grouped, only the ones sent in normal operation get their own
+typedef enum {
+    Latency_Command_Sensors = 0,
+    Latency_Command_LED_Segment,
+    Latency_Command_Commit_LEDs,
+    Latency_Command_Other,
+
+    LATENCY_COMMAND_COUNT
+} LatencyCommand;
+
+typedef struct {
+    // Number of requests recorded
+    uint32_t samples;
+
+    // Longest time recorded, in cycles
+    uint32_t max_cycles;
+
+    uint32_t buckets[LATENCY_BUCKET_COUNT];
+} LatencyHistogram;
+
+// Layout of the 64 byte feature report the host reads histograms with.
+// Each read returns the selected histogram and selects the next one, so
+// reading LATENCY_PORT_COUNT * LATENCY_COMMAND_COUNT * LATENCY_STAGE_COUNT
+// reports in a row after a reset or select gets all of them.
+// All multi-byte values are little-endian.
+typedef struct {
+    // Which histogram this is
+    uint8_t comport_id;
+    uint8_t command;
+    uint8_t stage;
+
+    // To interpret buckets with, see top of file
+    uint8_t bucket_count;
+    uint8_t bucket_shift;
+    uint8_t cycles_per_us;
+
+    uint8_t reserved[2];
+
+    LatencyHistogram histogram;
+} LatencyReport;
+
+// Public, so that contents can be inspected during debugging
+extern LatencyHistogram latency_histograms
+    [LATENCY_PORT_COUNT][LATENCY_COMMAND_COUNT][LATENCY_STAGE_COUNT];
+
+// Clears all histograms and selects the first one
+void latency_init();
+
+// Adds a measurement to the histogram for the given port, command and stage.
+// Safe to call from interrupts.
+void latency_record(ComportId, Commands, LatencyStage, uint32_t cycles);
+
+// Handles a feature report sent by the host, see LATENCY_OP_*.
+// Select takes port, command group and stage in the next three bytes.
+void latency_process_command(uint8_t const * buffer, uint16_t len);
+
+// Fills buffer with a LatencyReport for the selected histogram and selects
+// the next one. Returns the number of bytes written, or 0 if len is too short.
+uint16_t latency_build_report(uint8_t * buffer, uint16_t len);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __LED_CODEC_H
+#define __LED_CODEC_H
+
+#include "stm32f3xx.h"
+#include "leds.h"
+
+// Compressed encoding of LED frames. A segment as sent to a panel is a header
+// byte (panel << 6 | segment << 4 | frame, as in HID LED packets) followed by
+// LED_PIXELS_PER_SEGMENT RGB pixels.
+//
+// An encoded frame is:
+//   frame        - frame number, goes into the segment header bytes
+//   colors       - number of palette entries, 0 to 255
+//   palette      - colors * {r, g, b}
+//   segments     - SEGMENTS_PER_FRAME encoded segments, in led_buffer order
+//
+// An encoded segment is a codec byte followed by data that decodes to its
+// pixels:
+//   LedCodec_Raw      - the pixels as they are
+//   LedCodec_RLE      - runs of {count, r, g, b}, count 1 or more, until all
+//                       pixels are covered
+//   LedCodec_Palette8 - one palette index per pixel
+//   LedCodec_Palette4 - two palette indexes per byte, low nibble first; only
+//                       reaches the first 16 palette entries
+//
+// The palette is shared by the whole frame, so gradients and patterns that
+// repeat across panels only pay for their colors once.
+//
+// An encoded delta frame only carries the segments that changed since the
+// frame before it:
+//   frame        - frame number, as above
+//   mask         - little-endian uint16_t, bit n set if segment n follows
+//   colors       - as above
+//   palette      - as above
+//   segments     - one encoded segment per bit set in mask, in led_buffer
+//                  order
+// A delta with an empty mask (and no palette) just marks the end of a frame
+// in which nothing changed.
+
+#define LED_CODEC_MAX_COLORS (255U)
+
+// Largest possible encoded segment and frame: a full palette and every
+// segment sent raw
+#define LED_CODEC_MAX_SEGMENT_LEN (1 + LED_PIXEL_BYTES_PER_SEGMENT)
+#define LED_CODEC_MAX_FRAME_LEN \
+    (2 + LED_CODEC_MAX_COLORS * 3 \
+        + SEGMENTS_PER_FRAME * LED_CODEC_MAX_SEGMENT_LEN)
+#define LED_CODEC_MAX_DELTA_LEN (LED_CODEC_MAX_FRAME_LEN + 2)
+
+_Static_assert(1 + LED_PIXEL_BYTES_PER_SEGMENT == BYTES_PER_SEGMENT, "A segment is a header byte and its pixels");
+
+typedef enum {
+    LedCodec_Raw = 0x00,
+    LedCodec_RLE = 0x01,
+    LedCodec_Palette8 = 0x02,
+    LedCodec_Palette4 = 0x03,
+
+    LED_CODEC_COUNT
+} LedCodec;
+
+// Decodes an encoded frame into led_buffer (LED_ARRAY_SIZE bytes, laid out as
+// in main.c). The whole frame is checked before anything is written, so a
+// malformed frame leaves led_buffer untouched.
+// Returns true if the frame was valid and has been decoded.
+uint8_t led_codec_decode_frame(
+    uint8_t const * encoded, uint16_t len, uint8_t * led_buffer);
+
+// Like led_codec_decode_frame for a delta frame, only writing the segments it
+// carries. Those are returned in segments, bit n set for segment n.
+uint8_t led_codec_decode_delta(
+    uint8_t const * encoded, uint16_t len, uint8_t * led_buffer, 
+    uint16_t * segments);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __LED_STREAM_H
+#define __LED_STREAM_H
+
+#include "stm32f3xx.h"
+#include "leds.h"
+#include "led_codec.h"
+
+// Parser for LED data arriving as a byte stream on the vendor bulk endpoint.
+// The stream is a sequence of messages, each a 4 byte header followed by
+// `length` bytes of payload:
+//   sync   - always LED_STREAM_SYNC
+//   type   - one of LedStreamType
+//   length - payload length, little-endian
+// A header that doesn't make sense is skipped one byte at a time until the
+// next sync byte lines up, so the stream recovers from garbage on its own.
+
+#define LED_STREAM_SYNC (0xA5U)
+#define LED_STREAM_HEADER_LEN (4U)
+
+// Longest payload any message type can have
+#define LED_STREAM_MAX_PAYLOAD \
+    (LED_CODEC_MAX_DELTA_LEN > LED_ARRAY_SIZE \
+        ? LED_CODEC_MAX_DELTA_LEN : LED_ARRAY_SIZE)
+
+typedef enum {
+    // A full frame of LED_ARRAY_SIZE bytes, laid out like the 16 HID LED
+    // reports of one frame back to back
+    LedStream_Raw_Frame = 0x01,
+
+    // A full frame with each segment compressed, see led_codec.h
+    LedStream_Encoded_Frame = 0x02,
+
+    // Only the segments that changed since the previous frame, compressed
+    // like an encoded frame, see led_codec.h. Ends the frame, so it's sent
+    // even when nothing changed.
+    LedStream_Delta_Frame = 0x03,
+
+    // Parameters for an effect the board renders by itself, see effects.h.
+    // Passed to the effect handler as they are.
+    LedStream_Effect = 0x04,
+
+    // Part of a firmware update, see update.h. Passed to the update handler
+    // as it is.
+    LedStream_Update = 0x05,
+} LedStreamType;
+
+typedef struct {
+    // Complete frames handed to the frame handler
+    uint32_t frames;
+
+    // Headers rejected for a bad sync byte, type or length
+    uint32_t bad_headers;
+
+    // Bytes thrown away while looking for the next valid header
+    uint32_t skipped_bytes;
+
+    // Messages with a payload that didn't decode; the frame buffer was left
+    // alone
+    uint32_t bad_frames;
+
+    // Effect messages the effect handler accepted
+    uint32_t effects;
+
+    // Update messages the update handler accepted
+    uint32_t updates;
+} LedStreamStats;
+
+// Called after a message has been written to the frame buffer, with a bit set
+// for every segment it wrote (bit n is segment n). Delta frames can call it
+// with no bits set.
+typedef void (* LedFrameHandler)(uint16_t segments);
+
+// Called with the payload of an effect message. Returns false if it's not
+// valid, which counts as a bad frame.
+typedef uint8_t (* LedEffectHandler)(uint8_t const * params, uint16_t len);
+
+// Called with the payload of an update message. Returns false if it was
+// rejected, which counts as a bad frame.
+typedef uint8_t (* LedUpdateHandler)(uint8_t const * data, uint16_t len);
+
+// Public, so that contents can be inspected during debugging
+extern LedStreamStats led_stream_stats;
+
+// Messages get decoded into frame_buffer, LED_ARRAY_SIZE bytes laid out like
+// leds_buffer(). It's only written from led_stream_received/led_stream_feed,
+// and segments a delta frame doesn't carry keep what they had.
+void led_stream_init(uint8_t * frame_buffer, LedFrameHandler);
+
+// Sets the handler for effect messages. Without one they're dropped.
+void led_stream_set_effect_handler(LedEffectHandler);
+
+// Sets the handler for update messages. Without one they're dropped.
+void led_stream_set_update_handler(LedUpdateHandler);
+
+// Where the next bytes of the stream should be put, and how many of them the
+// parser wants at most. Data can be read straight into the returned buffer.
+uint8_t * led_stream_receive_target(uint16_t * max_len);
+
+// Tells the parser that len bytes were put in its receive target
+void led_stream_received(uint16_t len);
+
+// Convenience for when the data is already in memory: copies it in through
+// led_stream_receive_target/led_stream_received
+void led_stream_feed(uint8_t const * data, uint32_t len);
+
+#endif
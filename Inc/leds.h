@@ -0,0 +1,64 @@
+#ifndef __LEDS_H
+#define __LEDS_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+
+// Layout of the LED data for the whole platform. Each panel's LEDs are sent
+// to it in segments; a frame is every segment of every panel, stored panel
+// after panel in ComportId order.
+#define BYTES_PER_SEGMENT (64U)
+#define SEGMENTS_PER_PANEL (4U)
+#define BYTES_PER_PANEL (BYTES_PER_SEGMENT * SEGMENTS_PER_PANEL)
+#define PANELS_PER_PLATFORM (4U)
+#define SEGMENTS_PER_FRAME (SEGMENTS_PER_PANEL * PANELS_PER_PLATFORM)
+#define LED_ARRAY_SIZE (BYTES_PER_PANEL * PANELS_PER_PLATFORM)
+
+// A segment is a header byte followed by RGB pixels
+#define LED_PIXELS_PER_SEGMENT (21U)
+#define LED_PIXEL_BYTES_PER_SEGMENT (LED_PIXELS_PER_SEGMENT * 3)
+#define LED_PIXELS_PER_PANEL (LED_PIXELS_PER_SEGMENT * SEGMENTS_PER_PANEL)
+
+// Bits of a segment mask covering all segments of the given panel
+#define LEDS_PANEL_SEGMENTS(panel) (0x0FU << ((panel) * SEGMENTS_PER_PANEL))
+
+typedef struct {
+    // Segments handed to msgbus, and segments skipped for being unchanged
+    uint32_t segments_sent;
+    uint32_t segments_skipped;
+
+    // Panel commits handed to msgbus, and commits skipped because nothing on
+    // the panel changed since its last one
+    uint32_t commits_sent;
+    uint32_t commits_skipped;
+} LedStats;
+
+// Public, so that contents can be inspected during debugging
+extern LedStats leds_stats;
+
+// The LED data as last received, LED_ARRAY_SIZE bytes. Queued segment
+// requests point into it, so only write to it from the main thread.
+// Anything writing it directly has to call leds_mark_dirty afterwards.
+uint8_t * leds_buffer();
+
+void leds_init();
+
+// Copies one segment (BYTES_PER_SEGMENT bytes, header byte first) into the
+// buffer, marking it dirty if any of its LEDs changed
+void leds_write_segment(uint8_t segment, uint8_t const * data);
+
+// Marks segments (bit n is segment n) as needing to be sent to their panels
+void leds_mark_dirty(uint16_t segments);
+
+// Makes the next leds_send_dirty/leds_commit resend everything for a panel,
+// e.g. after it was (re-)connected
+void leds_mark_panel_dirty(ComportId);
+
+// Sends every dirty segment to its panel and clears its dirty bit
+void leds_send_dirty();
+
+// Commits the LEDs of every panel that was sent a segment since its last
+// commit; the other panels already show what they should
+void leds_commit();
+
+#endif
@@ -12,6 +12,18 @@
 
 #define MSG_ACKNOWLEGE (0xACU)
 
+// Second byte of a panel's answer to Command_Negotiate_Framing, after
+// MSG_ACKNOWLEGE
+#define MSG_FAST_FRAMING_VERSION (0x01U)
+
+// Bytes in a frame besides the payload: Command_Framed, the command being
+// framed, payload length and checksum
+#define FRAME_OVERHEAD_BYTES (4U)
+
+// Ticks a panel gets to answer a programming request (see panel_program.h),
+// longer than for anything else as the panel may be busy with its flash
+#define MSGBUS_PROGRAM_TIMEOUT_TICKS (20U)
+
 typedef struct {
     // Which port this response came in from
     ComportId comport_id;
@@ -26,8 +38,16 @@ typedef struct {
     // Number of bytes contained in the response; should be at least 1.
     // This number is copied from the Request struct that caused this response
     uint16_t data_length;
+
+    // Cycle count (see cycles.h) at which the response finished receiving
+    uint32_t completed_at;
 } Response;
 
+// Called with each completed response for the command it was registered for.
+// The response is only valid for the duration of the call; its data points
+// at the buffer given in the request, which the handler may keep using.
+typedef void (* ResponseHandler)(Response *);
+
 typedef enum {
     // Not been given a request to send
     Status_Idle,
@@ -61,8 +81,10 @@ typedef struct {
     // Current status (as in a state machine) of this port
     // See PortStatus for details
     PortStatus status;
-    // Whether this state is currently "selected" - as in, it's its turn
-    // to do comport things. If not selected, data can be queued for it is.
+    // Whether this state is currently "selected" - as in, it's connected to
+    // a UART and can do comport things. If not selected, data can be queued
+    // for it. Left and down have a UART each and are always selected; up and
+    // right share USART2 and take turns.
     uint8_t selected;
 
     // Request this port is currently working on, or queued for
@@ -86,19 +108,51 @@ typedef struct {
     // for more advanced recovery, perhaps?
     uint32_t timeout_count;
 
+    // Requests that timed out since one was last answered, see discovery.h
+    uint8_t timeouts_in_a_row;
+
     // Target of the "acknowledge" response byte, should be written to
     // the value of MSG_ACKNOWLEDGE by the uart to indicate receipt of a command
     // or additional data. Once read on this end, should be set back to 0x00.
     uint8_t acknowledged[2];
 
+    // Whether the panel on this port accepts framed requests; set if it
+    // answered Command_Negotiate_Framing when it came online
+    uint8_t fast_framing;
+
+    // Target of the answer to Command_Negotiate_Framing
+    uint8_t negotiate_response[2];
+
+    // Outgoing frame for the current request, if it is being sent framed
+    uint8_t frame[MAX_REQUEST_DATA_BYTES + FRAME_OVERHEAD_BYTES];
+
     // Interrupt flags to be processed
-    uint8_t interrupt_flags;
-} PortState;
+    // Set from interrupts, so only clear these inside a critical section
+    volatile uint8_t interrupt_flags;
 
-typedef struct {
-    PortState * first;
-    PortState * second;
-} PortPair;
+    // Cycle count at which the current request was started
+    uint32_t request_started_at;
+
+    // Cycles from starting a request to it reaching Status_Done, for the
+    // last request and the slowest one so far. Timed out requests are not
+    // counted. Only useful when using the debugger at the moment.
+    uint32_t last_turnaround;
+    uint32_t max_turnaround;
+    uint32_t completed_count;
+
+    // Cycle count at which the current status was entered
+    uint32_t status_entered_at;
+
+    // Cycle count at which this port last started a request, used to favour
+    // whichever of up/right has been waiting longest for USART2
+    uint32_t last_serviced_at;
+
+    // Requests completed over the last second
+    uint32_t service_rate;
+
+    // completed_count at the start of the current service rate window
+    uint32_t rate_window_count;
+} PortState;
 
 // Sets the message bus up for use
 void msgbus_init();
@@ -116,15 +170,43 @@ void msgbus_send_request(Request request);
 // and only use msgbus_get_pending_response if it returns true (non-0)
 uint8_t msgbus_have_pending_response();
 
-// Returns the oldest response from the response queue. You must check
-// msgbus_have_pending_response() before using this method. If there is no pending
-// response, Error_Handler() will be invoked.
-Response * msgbus_get_pending_response();
+// Returns the oldest response from the response queue, taking it off the
+// queue. You must check msgbus_have_pending_response() before using this
+// method; without a pending response, a blank one is returned.
+Response msgbus_get_pending_response();
+
+// Registers the function msgbus_dispatch_responses calls for responses to
+// the given command. Registering a command again replaces its handler.
+void msgbus_set_response_handler(Commands, ResponseHandler);
+
+// Takes every pending response off the queue and hands it to the handler
+// registered for its command. Responses without a handler are discarded.
+void msgbus_dispatch_responses();
 
 PortStatus msgbus_port_status(ComportId);
 
+// Whether requests to the port's panel are sent framed
+uint8_t msgbus_port_framed(ComportId);
+
 void msgbus_wait_for_idle(ComportId);
 
+// For discovery.h. A port that came online asks its panel about framing
+// again, as it may have restarted with other firmware. A port that went
+// offline drops the requests queued for it; the one in flight finishes or
+// times out as usual.
+void msgbus_port_online(ComportId);
+void msgbus_port_offline(ComportId);
+
+uint8_t msgbus_port_timeouts_in_a_row(ComportId);
+
+// Gives USART2 to whichever of the up and right ports should be serviced
+// next, if it isn't busy. Also done as part of msgbus_process_flags.
 void msgbus_switch_ports_if_done();
 
+// In programming mode, requests for anything but the Command_Program_*
+// commands and framing negotiation are dropped, so programming panels has the
+// bus to itself. Requests queued before are still sent.
+void msgbus_set_programming_mode(uint8_t);
+uint8_t msgbus_programming_mode();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,149 @@
+#ifndef __PANEL_PROGRAM_H
+#define __PANEL_PROGRAM_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+
+// Programs the panel boards with a firmware image the I/O board holds, over
+// the same UARTs as everything else, all panels at once. Left and down have a
+// UART each, up and right take turns on USART2 a request at a time. msgbus
+// goes into programming mode meanwhile, dropping everything but programming
+// requests, so the bus is the panels' for as long as it takes.
+//
+// The panel takes the image in chunks, each with a CRC, and writes them to
+// its flash in the background while the next ones arrive. It can hold a
+// window of chunks that aren't in flash yet, and every answer says how far
+// it has got, so the next chunks go out as soon as there's room. A chunk that
+// doesn't come through intact is sent again, along with any sent after it. A
+// panel that restarted or lost track says so, and is started again where its
+// flash left off, rather than from the beginning.
+//
+// Every request gets the same PANEL_PROGRAM_RESPONSE_LEN byte answer, values
+// little-endian:
+//   status, window, reserved u16, committed u32
+// where status is a ProgramStatus, window is the number of chunks the panel
+// holds before they're written, and committed the bytes of the image in its
+// flash.
+//
+//   Command_Program_Begin  - image length u32, image CRC u32. The panel keeps
+//                            what's already in flash if it's the same image,
+//                            and otherwise starts from nothing. Committed is
+//                            where the chunks have to carry on from.
+//   Command_Program_Chunk  - offset u32, PANEL_PROGRAM_CHUNK_LEN bytes of the
+//                            image (fewer for the last), then the CRC-32 of
+//                            offset and data. Chunks have to come in order,
+//                            but one the panel already took is answered
+//                            Program_OK again without being written, as its
+//                            answer may have been the part that got lost.
+//   Command_Program_Status - no data. Only the answer, to see how far the
+//                            panel has got.
+//   Command_Program_Finish - no data. Once everything is in flash, the panel
+//                            checks the whole image against its CRC, answers,
+//                            and restarts into it if it matched.
+// All CRCs are CRC-32 as zlib.crc32 computes them.
+
+#define PANEL_PROGRAM_CHUNK_LEN (48U)
+
+// Offset, chunk and CRC
+#define PANEL_PROGRAM_CHUNK_MESSAGE_LEN (4U + PANEL_PROGRAM_CHUNK_LEN + 4U)
+
+#define PANEL_PROGRAM_RESPONSE_LEN (8U)
+
+// Chunks queued for a panel at once, at most. Fewer if the panel's window is
+// smaller.
+#define PANEL_PROGRAM_SLOTS (4U)
+
+// Restarts and lost answers in a row, without the panel taking any more of
+// the image, before it's given up on
+#define PANEL_PROGRAM_MAX_RETRIES (8U)
+
+// Answer to each programming request
+typedef enum {
+    Program_OK = 0x00,
+
+    // The chunk's CRC didn't match, the chunk was dropped
+    Program_Bad_CRC = 0x01,
+
+    // The chunk doesn't start where the last one the panel took ended
+    Program_Out_Of_Order = 0x02,
+
+    // The window is full, the chunk was dropped
+    Program_Busy = 0x03,
+
+    // Erasing or writing flash failed. Programming has to begin again.
+    Program_Flash_Error = 0x04,
+
+    // Finish found an image that doesn't match its CRC. Programming has to
+    // begin again.
+    Program_Bad_Image = 0x05,
+
+    // Not programming, as after the panel restarted. Programming has to
+    // begin again.
+    Program_Not_Started = 0x06,
+} ProgramStatus;
+
+typedef enum {
+    PanelProgram_Idle = 0x00,
+
+    // Waiting for the answer to Command_Program_Begin
+    PanelProgram_Beginning = 0x01,
+
+    PanelProgram_Sending = 0x02,
+
+    // Waiting for the answer to Command_Program_Finish
+    PanelProgram_Finishing = 0x03,
+
+    // The panel has the image and restarted into it
+    PanelProgram_Done = 0x04,
+
+    // Gave up after PANEL_PROGRAM_MAX_RETRIES
+    PanelProgram_Failed = 0x05,
+} PanelProgramState;
+
+// How a panel's programming is going. Read by the host as it is, for every
+// port, with the vendor request USB_VENDOR_REQUEST_PANEL_PROGRAM_STATUS.
+typedef struct {
+    uint8_t state;
+
+    // ProgramStatus of the panel's last answer
+    uint8_t last_status;
+
+    // Times programming began again, after the first
+    uint16_t restarts;
+
+    // Chunks sent again after one of them didn't get through
+    uint16_t resent;
+
+    // Times nothing came back for a while, and whatever was on its way to the
+    // panel was sent again
+    uint16_t stalls;
+
+    // Bytes of the image in the panel's flash
+    uint32_t committed;
+} PanelProgramProgress;
+
+// Public, so that contents can be inspected during debugging
+extern PanelProgramProgress panel_program_progress[COMPORT_ID_MAX + 1];
+
+// Registers the response handlers with msgbus. Call after msgbus_init.
+void panel_program_init();
+
+// Starts programming the connected panels whose bit is set in panel_mask
+// (bit 0 for Comport_Left and so on) with the given image, which has to stay
+// where it is until programming is done. Returns false if programming is
+// already going on, if the image's length isn't a multiple of 4, or if none
+// of the panels are connected.
+uint8_t panel_program_start(
+    uint8_t const * image,
+    uint32_t len,
+    uint32_t crc,
+    uint8_t panel_mask
+);
+
+// Whether panels are being programmed
+uint8_t panel_program_active();
+
+// Catches panels that stopped answering. Call every tick.
+void panel_program_tick(uint32_t now_ms);
+
+#endif
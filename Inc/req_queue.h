@@ -3,17 +3,51 @@
 
 #include "request.h"
 
+// Maximum number of requests queued for one port. Must be a power of two.
 #define MAX_REQ_QUEUE_LENGTH (16U)
 
+// Number of requests that can be queued across all ports at the same time.
+// Enough for every port's queue to be full, like when each had its own.
+#define REQ_POOL_SIZE (MAX_REQ_QUEUE_LENGTH * (COMPORT_ID_MAX + 1))
+
+// Number of distinct keys requests are sorted by for duplicate detection
+#define REQ_QUEUE_KEY_COUNT (32U)
+
+// Requests themselves live in a pool shared by all queues; a queue is a ring
+// of indexes into that pool. To tell whether a request is already queued
+// without comparing it against every queued one, each request gets a key
+// from its command and data pointer, and the queue counts requests per key.
 typedef struct {
-    Request items[MAX_REQ_QUEUE_LENGTH];
-    int8_t front;
-    int8_t rear;
+    // Pool indexes of queued requests, starting at front
+    uint8_t entries[MAX_REQ_QUEUE_LENGTH];
+    uint8_t front;
     uint8_t count;
+
+    // Number of queued requests with each key
+    uint8_t key_counts[REQ_QUEUE_KEY_COUNT];
+
+    // Pool index of one of the queued requests with each key, only valid
+    // where key_counts is nonzero
+    uint8_t key_owners[REQ_QUEUE_KEY_COUNT];
 } RequestQueue;
 
+// Marks the whole pool as free. Call before initializing any queue.
+void req_queue_pool_init();
+
+// Sets up an empty queue at startup. Doesn't give anything back to the pool,
+// use req_queue_clear to empty a queue that's in use.
+void req_queue_init(RequestQueue *);
+
+// Drops every queued request, giving its pool entry back
+void req_queue_clear(RequestQueue *);
+
 void req_queue_add(RequestQueue *, Request);
+
+// Adds the request even if an equal one is queued already
+void req_queue_append(RequestQueue *, Request);
+
 Request req_queue_take(RequestQueue *);
-void req_queue_init(RequestQueue *);
+Request * req_queue_peek(RequestQueue *);
+Request * req_queue_peek_last(RequestQueue *);
 
-#endif
\ No newline at end of file
+#endif
@@ -26,6 +26,10 @@ typedef struct {
     // Number of bytes expected as response
     // Set to 0 to not expect any response after sending request_command + send_data
     uint16_t response_len;
+
+    // Cycle count (see cycles.h) at which the request was handed to msgbus.
+    // Set by msgbus, not part of what makes two requests equal.
+    uint32_t queued_at;
 } Request;
 
 inline Request request_create(Commands command) {
@@ -36,6 +40,7 @@ inline Request request_create(Commands command) {
     req.send_data_len = 0;
     req.response_data = NULL;
     req.response_len = 0;
+    req.queued_at = 0;
 
     return req;
 }
@@ -0,0 +1,74 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include "stm32f3xx.h"
+
+// Types of event that can be posted to the scheduler.
+// The order is the priority: when several events are pending, the one with
+// the lowest value is dispatched first. Keep sensor work ahead of LED work.
+typedef enum {
+    // A UART transfer completed; msgbus has interrupt flags to process
+    Event_MsgBus = 0,
+
+    // msgbus has one or more responses waiting in its response queue
+    Event_Response,
+
+    // TinyUSB queued device events, tud_task should run
+    Event_USB,
+
+    // Sensor data changed and should be reported to the host
+    Event_Sensor_Report,
+
+    // An LED data packet came in over USB
+    Event_LED_Packet,
+
+    // Sensor requests should be (re-)issued on the message bus
+    Event_Sensor_Poll,
+
+    // SysTick fired, used for timeouts and other periodic work
+    Event_Tick,
+
+    // A firmware update has flash to write, see update.h. Last, as the core
+    // stalls while the flash is busy.
+    Event_Flash_Write,
+
+    EVENT_TYPE_COUNT
+} EventType;
+
+typedef void (* EventHandler)(void);
+
+typedef struct {
+    // Number of times the handler for this event was run
+    uint32_t dispatched;
+
+    // Number of posts that found the event already pending, so were merged
+    // into the pending one
+    uint32_t coalesced;
+
+    // Cycles between the first post of a pending event and its dispatch
+    uint32_t last_latency;
+    uint32_t max_latency;
+} EventStats;
+
+// Public, so that contents can be inspected during debugging
+extern EventStats scheduler_stats[EVENT_TYPE_COUNT];
+
+// Sets the scheduler up for use. Clears handlers, pending events and stats.
+void scheduler_init();
+
+// Sets the function to be run when the given event is dispatched
+void scheduler_set_handler(EventType, EventHandler);
+
+// Marks an event as pending. Safe to call from interrupts.
+// Posting an event that is already pending does nothing besides counting it,
+// the handler is expected to deal with everything that happened since.
+void scheduler_post(EventType);
+
+// Runs the handler for the highest priority pending event, if any.
+// Returns true if a handler was run.
+uint8_t scheduler_dispatch();
+
+// Dispatches events forever, sleeping with WFI whenever nothing is pending
+void scheduler_run();
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef __SENSORS_H
+#define __SENSORS_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+#include "msgbus.h"
+
+#define SENSOR_RESPONSE_LEN (8U)
+#define SENSOR_PANEL_COUNT (COMPORT_ID_MAX + 1)
+
+// A panel's sensor response is this many little-endian uint16_t readings
+#define SENSOR_VALUES_PER_PANEL (SENSOR_RESPONSE_LEN / 2)
+
+#define SENSOR_REPORT_LEN (64U)
+
+// Samples per panel kept for batched reports, see PanelSensors
+#define SENSOR_HISTORY_LEN (8U)
+
+// Operation the host can ask for by sending a feature report to the vendor
+// defined HID interface, first byte. Followed by a SensorReportFormat byte.
+// Kept apart from the LATENCY_OP_* values, which share the feature report.
+#define SENSOR_OP_SET_FORMAT (0x10U)
+
+// Every this many batched reports, each panel's first entry is sent in full,
+// so a host that lost a report can pick the deltas up again
+#define SENSOR_KEYFRAME_INTERVAL (16U)
+
+typedef enum {
+    // SensorReport: the newest sample of each panel. The default, as the
+    // host utility expects it.
+    SensorFormat_Single = 0x00,
+
+    // SensorBatchHeader followed by entries: every sample kept since the
+    // last report, so the host sees what happened within a USB frame
+    SensorFormat_Batched = 0x01,
+
+    SENSOR_FORMAT_COUNT
+} SensorReportFormat;
+
+// Number of sample buffers kept per panel, see PanelSensors
+#define SENSOR_SLOT_COUNT (3U)
+
+// One panel's sensor response, as it was received
+typedef struct {
+    // Raw response bytes from the panel; DMA writes straight into this
+    uint8_t data[SENSOR_RESPONSE_LEN];
+
+    // Per-panel counter, incremented for every completed response
+    uint16_t sequence;
+
+    // Cycle count (see cycles.h) at which the response finished receiving
+    uint32_t captured_at;
+} SensorSample;
+
+// Triple-buffered samples for one panel. The three slots rotate between
+// three roles by swapping pointers, never by copying:
+//   receiving - target of the sensor request currently in flight
+//   latest    - newest complete sample, not yet picked up for a report
+//   reporting - sample being read into the USB report
+// DMA only ever writes to receiving, so latest and reporting are always
+// internally consistent.
+typedef struct {
+    SensorSample slots[SENSOR_SLOT_COUNT];
+
+    SensorSample * receiving;
+    SensorSample * latest;
+    SensorSample * reporting;
+
+    // Sequence number the next completed sample will get
+    uint16_t next_sequence;
+
+    // Whether latest holds a sample newer than reporting
+    uint8_t have_new;
+
+    // Batched format only. Ring of copies of the samples, at most one per
+    // SENSOR_HISTORY_SPACING_US: a sample coming in less than that after the
+    // newest entry was started replaces it, as long as it hasn't been
+    // reported. So the newest entry is always the latest sample.
+    SensorSample history[SENSOR_HISTORY_LEN];
+    uint32_t history_started_at;
+    uint8_t history_newest;
+    uint8_t history_unreported;
+
+    // Sequence and data of the last sample that went into a report. Batched
+    // reports send deltas against the data.
+    uint16_t reported_sequence;
+    uint8_t reported_data[SENSOR_RESPONSE_LEN];
+} PanelSensors;
+
+// Layout of the 64 byte sensor report sent to the host.
+// The first 32 bytes are unchanged from before sequence numbers were added.
+// All multi-byte values are little-endian.
+typedef struct {
+    // Raw sensor response per panel, indexed by ComportId
+    uint8_t sensors[SENSOR_PANEL_COUNT][SENSOR_RESPONSE_LEN];
+
+    // SensorSample.sequence for each panel's data above
+    uint16_t sequence[SENSOR_PANEL_COUNT];
+
+    // SensorSample.captured_at for each panel's data above
+    uint32_t captured_at[SENSOR_PANEL_COUNT];
+
+    // Cycle count at which the report was built. The host gets the exact age
+    // of each panel's sample from built_at - captured_at[i].
+    uint32_t built_at;
+
+    // Incremented for every report built, so the host can spot lost reports
+    uint16_t report_sequence;
+
+    // Age in microseconds of the newest sample in the report, saturating
+    uint16_t newest_age_us;
+} SensorReport;
+
+// Header of a batched report, followed by `count` entries of
+//   header - panel << 6 | SENSOR_ENTRY_DELTA if a delta | sequence & 0x1F
+//   age    - uint16_t, microseconds from capture to built_at, saturating
+//   data   - the raw sensor response, or for a delta one int8_t per reading:
+//            the difference to the panel's previous entry, in this report or
+//            an earlier one
+// Entries are in the order they were captured. In reports with a
+// report_sequence that's a multiple of SENSOR_KEYFRAME_INTERVAL, the first
+// entry of each panel is never a delta. Samples that don't fit are left out,
+// oldest first; the deltas then go against the last entry that was sent.
+typedef struct {
+    // SensorFormat_Batched
+    uint8_t format;
+
+    // Number of entries that follow
+    uint8_t count;
+
+    // As in SensorReport
+    uint16_t report_sequence;
+    uint32_t built_at;
+} SensorBatchHeader;
+
+#define SENSOR_ENTRY_DELTA (0x20U)
+#define SENSOR_ENTRY_SEQUENCE_MASK (0x1FU)
+#define SENSOR_ENTRY_FULL_LEN (3U + SENSOR_RESPONSE_LEN)
+#define SENSOR_ENTRY_DELTA_LEN (3U + SENSOR_VALUES_PER_PANEL)
+
+typedef struct {
+    // Reports built
+    uint32_t reports;
+
+    // Samples that went into a report, and the ones of those sent as deltas
+    uint32_t samples;
+    uint32_t delta_samples;
+
+    // Samples that never made it into a report: superseded by a newer one
+    // before a report was built, or left out of a full batched report
+    uint32_t samples_dropped;
+} SensorReportStats;
+
+// Public, so that contents can be inspected during debugging
+extern SensorReportStats sensor_report_stats;
+
+static inline uint16_t sensor_value(uint8_t const * data, uint8_t index) {
+    return data[index * 2] | (data[index * 2 + 1] << 8);
+}
+
+void sensors_init();
+
+// Where the next sensor request for the given port should put its response
+uint8_t * sensors_receive_target(ComportId);
+
+// Publishes a Command_Request_Sensors response as the panel's latest sample
+void sensors_process_response(Response *);
+
+// Whether any panel has a sample that hasn't been put in a report yet
+uint8_t sensors_have_new();
+
+// Handles a feature report sent by the host, see SENSOR_OP_SET_FORMAT.
+// Operations it doesn't know are ignored.
+void sensors_process_command(uint8_t const * buffer, uint16_t len);
+
+SensorReportFormat sensors_report_format();
+
+// Builds a report in the current format and returns it, SENSOR_REPORT_LEN
+// bytes. The returned report stays valid until the next call.
+uint8_t const * sensors_build_report();
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef __SETTINGS_H
+#define __SETTINGS_H
+
+#include "stm32f3xx.h"
+#include "steps.h"
+
+// Settings that survive a restart, kept in flash at FLASH_SETTINGS_START as a
+// log of records, the way EEPROM is emulated in flash:
+//
+// - Every setting is a uint32_t under a SettingKey. At startup, all of them
+//   are read into settings_values, so reading one is a single load, and the
+//   flash isn't looked at again until the next start.
+//
+// - Changing a setting only changes it in RAM. Once nothing has changed for
+//   SETTINGS_WRITE_DELAY_MS, the changed ones are appended to the current
+//   page as records, a few per Event_Flash_Write, so a burst of changes costs
+//   one batch of writes and other events don't wait long. The last record for
+//   a key is the one that counts.
+//
+// - Once the current page is full, the settings that aren't at their default
+//   move on to the next page, which then becomes the current one. The pages
+//   take turns like that, so no page wears out before the others. The page
+//   after the current one is erased at startup, before the panels are polled,
+//   so the core (which stalls while the flash erases) doesn't hold up sensor
+//   data then. Only the second page filled up without a restart in between
+//   has to be erased while running.
+//
+// A page starts with a header, then has records of 8 bytes: key, a check
+// halfword, and the value. Records are programmed check last, so one that
+// was cut short by a reset doesn't check out and is skipped.
+
+typedef enum {
+    // Bit per ComportId for the connectors discovery.h looks for panels on,
+    // PANEL_*_CONNECTED from config.h by default. Takes effect at the next
+    // start.
+    Setting_Panels_Connected = 0,
+
+    // Step thresholds of every sensor (see steps.h), press threshold in the
+    // low and release threshold in the high halfword. Sensor i of a panel is
+    // at Setting_Step_Thresholds + panel * STEP_SENSORS_PER_PANEL + i. Set
+    // along with the gamepad's feature report.
+    Setting_Step_Thresholds,
+
+    SETTING_COUNT = Setting_Step_Thresholds
+        + SENSOR_PANEL_COUNT * STEP_SENSORS_PER_PANEL
+} SettingKey;
+
+// Value of a Setting_Step_Thresholds setting
+#define SETTING_STEP_THRESHOLDS(press, release) \
+    ((uint32_t)(press) | ((uint32_t)(release) << 16))
+
+typedef struct {
+    uint32_t records_written;
+
+    // Times the settings moved on to the next page
+    uint32_t compactions;
+
+    // Pages erased, while running and at startup
+    uint32_t erases;
+    uint32_t startup_erases;
+
+    // Erases or writes that failed. The settings stay as they are in RAM.
+    uint32_t failures;
+} SettingsStats;
+
+// Public, so that contents can be inspected during debugging
+extern SettingsStats settings_stats;
+
+// Every setting's value, read at startup and kept up to date by settings_set
+extern uint32_t settings_values[SETTING_COUNT];
+
+static inline uint32_t settings_get(SettingKey key) {
+    return settings_values[key];
+}
+
+// Reads the settings from flash, defaults for those that were never set, and
+// erases the page the settings move on to next if it needs it. Has to run
+// before anything reads a setting.
+void settings_init();
+
+// Changes a setting, writing it to flash later
+void settings_set(SettingKey, uint32_t value);
+
+// Posts Event_Flash_Write once settings changed and stayed that way for
+// SETTINGS_WRITE_DELAY_MS
+void settings_tick(uint32_t now_ms);
+
+// Handler for Event_Flash_Write: writes a few of the changed settings, and
+// posts the event again if there are more
+void settings_write_step();
+
+#endif
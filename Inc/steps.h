@@ -0,0 +1,59 @@
+#ifndef __STEPS_H
+#define __STEPS_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+#include "sensors.h"
+
+// Step detection on the raw sensor samples, for the gamepad interface. A
+// panel's sensor response is STEP_SENSORS_PER_PANEL little-endian uint16_t
+// readings. Each sensor is pressed once its reading reaches its press
+// threshold and released once it drops below its release threshold, so noise
+// around a single threshold can't make a button chatter. A panel counts as
+// stepped on while any of its sensors is pressed.
+
+#define STEP_SENSORS_PER_PANEL SENSOR_VALUES_PER_PANEL
+
+// Thresholds for every sensor, in raw sensor units. Also the layout of the
+// gamepad interface's 64 byte feature report, which reads and sets them.
+// Multi-byte values are little-endian.
+typedef struct {
+    uint16_t press[SENSOR_PANEL_COUNT][STEP_SENSORS_PER_PANEL];
+    uint16_t release[SENSOR_PANEL_COUNT][STEP_SENSORS_PER_PANEL];
+} StepThresholds;
+
+typedef struct {
+    // Times each panel went from released to pressed
+    uint32_t presses[SENSOR_PANEL_COUNT];
+
+    // Threshold reports rejected for releasing above pressing
+    uint32_t bad_thresholds;
+} StepStats;
+
+// Public, so that contents can be inspected during debugging
+extern StepStats step_stats;
+
+// Resets all thresholds to STEP_PRESS_THRESHOLD/STEP_RELEASE_THRESHOLD and
+// every sensor to released
+void steps_init();
+
+// Runs detection on a new sample from the panel. Returns true if that changed
+// whether the panel is stepped on.
+uint8_t steps_process(ComportId, uint8_t const * data);
+
+// Releases every sensor of a panel that went offline, so its button isn't
+// left held. Returns true if it was down.
+uint8_t steps_release_panel(ComportId);
+
+// Bit per ComportId, set for panels that are stepped on
+uint8_t steps_buttons();
+
+// Copies the thresholds into buffer, returning the number of bytes written
+uint16_t steps_get_thresholds(uint8_t * buffer, uint16_t len);
+
+// Replaces the thresholds with those in a feature report. Returns false,
+// keeping the old ones, if the report is short or has a release threshold
+// above its press threshold.
+uint8_t steps_set_thresholds(uint8_t const * buffer, uint16_t len);
+
+#endif
@@ -74,15 +74,24 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID             1
+#define CFG_TUD_HID             2
 #define CFG_TUD_CDC             0
 #define CFG_TUD_MSC             0
 #define CFG_TUD_MIDI            0
-#define CFG_TUD_VENDOR          0
+#define CFG_TUD_VENDOR          1
+
+// DFU runtime, only there to restart into the ROM bootloader, see update.h
+#define CFG_TUD_DFU_RT          1
 
 // HID buffer size Should be sufficient to hold ID (if any) + Data
 #define CFG_TUD_HID_BUFSIZE     64U
 
+// Vendor bulk endpoint for LED frames. The receive FIFO holds a full frame and
+// its header, so the host can send a whole frame while the one before it is
+// still being handed to the panels.
+#define CFG_TUD_VENDOR_EPSIZE     64U
+#define CFG_TUD_VENDOR_RX_BUFSIZE 1088U
+
 #ifdef __cplusplus
  }
 #endif
@@ -1,8 +1,56 @@
 #ifndef __TUSB_HID_H
 #define __TUSB_HID_H
 
+#include "stm32f3xx.h"
+
 #define USB_SEND_REPORT_ID (0)
+#define USB_PACKET_SIZE (64U)
+
+// TinyUSB HID instances, in the order of their interfaces: the vendor defined
+// sensor/LED one and the gamepad
+#define USB_HID_INSTANCE (0U)
+#define USB_GAMEPAD_INSTANCE (1U)
+
+// Interface number of the gamepad; 0 is the vendor defined HID interface, 1 the
+// vendor bulk interface (see tusb_vendor.h)
+#define USB_GAMEPAD_INTERFACE (2U)
+
+// Gamepad input report: one byte, bit per panel in ComportId order
+#define USB_GAMEPAD_REPORT_LEN (1U)
+
+// Number of OUT reports that can be waiting to be processed. One frame of LED
+// data is 16 reports; when all slots are taken the OUT endpoint is left
+// un-armed, so the host gets NAKed and retries instead of overwriting a slot.
+// Must be a power of two.
+#define USB_OUT_SLOT_COUNT (16U)
+
+typedef struct {
+    // OUT reports put in the ring
+    uint32_t received;
 
+    // Reports dropped because the ring was full. Only SET_REPORT requests on
+    // the control endpoint can cause this, the OUT endpoint is NAKed instead.
+    uint32_t overflows;
+
+    // Times the OUT endpoint was left un-armed because the ring was full
+    uint32_t pauses;
+
+    // Most slots ever in use at once
+    uint8_t max_depth;
+} UsbOutStats;
+
+// Public, so that contents can be inspected during debugging
+extern UsbOutStats usb_out_stats;
+
+// Oldest OUT report not yet released, or NULL if there is none.
+// The slot stays valid, and keeps its contents, until usb_release_packet().
 uint8_t * usb_get_packet();
 
-#endif
\ No newline at end of file
+// Frees the slot returned by usb_get_packet() for a new report, re-arming the
+// OUT endpoint if it was paused
+void usb_release_packet();
+
+// Number of OUT reports waiting to be processed
+uint8_t usb_pending_packets();
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __TUSB_VENDOR_H
+#define __TUSB_VENDOR_H
+
+#include "stm32f3xx.h"
+
+// Interface number of the vendor (WinUSB) interface; the HID one is 0
+#define USB_VENDOR_INTERFACE (1U)
+
+// bRequest Windows uses to fetch the MS OS 2.0 descriptor set, and the
+// wIndex it sends along for it
+#define USB_VENDOR_REQUEST_MICROSOFT (0x01U)
+#define USB_MS_OS_20_DESCRIPTOR_INDEX (0x07U)
+
+// bRequest to read the firmware update's UpdateStatus, see update.h
+#define USB_VENDOR_REQUEST_UPDATE_STATUS (0x02U)
+
+// bRequest to program the panels whose bits are set in wValue with the
+// stored panel image, and to read every panel's PanelProgramProgress, see
+// panel_program.h
+#define USB_VENDOR_REQUEST_PROGRAM_PANELS (0x03U)
+#define USB_VENDOR_REQUEST_PANEL_PROGRAM_STATUS (0x04U)
+
+// bRequest to read (IN) or write (OUT) the setting with the SettingKey in
+// wValue, as a little-endian uint32_t, see settings.h
+#define USB_VENDOR_REQUEST_SETTING (0x05U)
+
+// bRequest to read every port's DiscoveryPort, which says whether its panel
+// is online, see discovery.h
+#define USB_VENDOR_REQUEST_PANEL_STATUS (0x06U)
+
+// Interface number of the DFU runtime interface, see update.h
+#define USB_DFU_INTERFACE (3U)
+
+#define MS_OS_20_DESC_LEN (0xCEU)
+
+// Length of the function subset that binds WinUSB to the DFU interface
+#define MS_OS_20_DFU_FUNCTION_LEN (0x1CU)
+
+// Defined in tusb_descriptors.c
+extern uint8_t const desc_ms_os_20[];
+
+#endif
@@ -23,6 +23,10 @@ typedef void (* ReceiveCompleteHandler)(ComportId);
 // Initializes uart functionality
 void uart_init();
 
+// Whether the panel on a port has raised its CK line, signalling it's ready.
+// Doesn't need the port to be connected to a UART.
+uint8_t uart_panel_ready(ComportId);
+
 // Ensures a given port is electrically connected to a UART peripheral
 void uart_connect_port(ComportId);
 
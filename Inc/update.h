@@ -0,0 +1,150 @@
+#ifndef __UPDATE_H
+#define __UPDATE_H
+
+#include "stm32f3xx.h"
+
+// Firmware updates over USB, without an ST-Link. There are two ways in:
+//
+// - The DFU runtime interface. A DFU detach request restarts the board into
+//   ST's ROM bootloader, which dfu-util can then flash. That always works, even
+//   if the image in flash is broken, but the ROM bootloader is slow.
+//
+// - Streamed over the vendor bulk endpoint as LedStream_Update messages (see
+//   led_stream.h). The image is written to FLASH_STAGING_START a page at a time
+//   while the next blocks come in. It is checked against its CRC with the CRC
+//   unit, and only then copied over the running firmware, from RAM. After that
+//   the board restarts into the new firmware.
+//
+// Each update message starts with an UpdateOp byte. All values are
+// little-endian.
+//   Update_Begin  - uint32_t image length, then the CRC-32 of the image, as
+//                   zlib.crc32 computes it. The length has to be a multiple of
+//                   4, so pad the image with 0xFF. Optionally followed by an
+//                   UpdateTarget byte, the I/O board's firmware without it.
+//   Update_Data   - uint32_t offset, then the data. Every block is
+//                   UPDATE_BLOCK_LEN bytes except the last, and blocks arrive
+//                   in order.
+//   Update_Finish - no payload. Once everything is in flash the CRC is
+//                   checked, and the image is installed if it matches.
+//   Update_Abort  - no payload. Drops the update.
+// The host doesn't need to pace the data. While the flash writer is behind,
+// the board stops reading from the bulk endpoint, so the host's transfers
+// just wait. UpdateStatus can be read at any time with the vendor control
+// request USB_VENDOR_REQUEST_UPDATE_STATUS.
+
+#define UPDATE_BLOCK_LEN (1024U)
+
+// Longest update message payload: op, offset and a block
+#define UPDATE_MAX_MESSAGE_LEN (1U + 4U + UPDATE_BLOCK_LEN)
+
+typedef enum {
+    // Firmware for this board, installed once it's in
+    UpdateTarget_Firmware = 0x00,
+
+    // Firmware for the panel boards. It's only stored, to be sent on to the
+    // panels with panel_program.h.
+    UpdateTarget_Panel_Image = 0x01,
+} UpdateTarget;
+
+typedef enum {
+    Update_Begin = 0x01,
+    Update_Data = 0x02,
+    Update_Finish = 0x03,
+    Update_Abort = 0x04,
+} UpdateOp;
+
+typedef enum {
+    UpdateState_Idle = 0x00,
+
+    // Between Update_Begin and the image being installed
+    UpdateState_Receiving = 0x01,
+
+    // Stopped with UpdateStatus.error set, until the next Update_Begin
+    UpdateState_Failed = 0x02,
+
+    // Copying the image over the firmware, the board restarts after
+    UpdateState_Installing = 0x03,
+
+    // A panel image was checked and stored
+    UpdateState_Stored = 0x04,
+} UpdateState;
+
+typedef enum {
+    UpdateError_None = 0x00,
+
+    // Message too short, unknown op, or not valid in the current state
+    UpdateError_Bad_Message = 0x01,
+
+    // Length of zero, not a multiple of 4, or more than the target's space
+    UpdateError_Bad_Length = 0x02,
+
+    // A block at an offset other than where the previous one ended, or of
+    // the wrong length
+    UpdateError_Out_Of_Order = 0x03,
+
+    // Erasing or programming failed, or read back something else
+    UpdateError_Flash = 0x04,
+
+    // The image in flash doesn't match the CRC from Update_Begin
+    UpdateError_Bad_CRC = 0x05,
+
+    // The CRC matched, but the vector table doesn't look like firmware for
+    // this board
+    UpdateError_Bad_Image = 0x06,
+
+    // The panel image can't be replaced while panels are being programmed
+    UpdateError_Busy = 0x07,
+} UpdateError;
+
+// Returned by USB_VENDOR_REQUEST_UPDATE_STATUS as it is
+typedef struct {
+    uint8_t state;
+    uint8_t error;
+    uint16_t reserved;
+
+    // Image bytes accepted, and those of them in flash
+    uint32_t received;
+    uint32_t written;
+
+    // CRC-32 of the image in flash, once it's been checked
+    uint32_t crc;
+} UpdateStatus;
+
+// Public, so that contents can be inspected during debugging
+extern UpdateStatus update_status;
+
+// Restarts into ST's ROM bootloader if the previous run asked for it with
+// update_request_bootloader(). Has to run first thing in main, before any
+// clocks or peripherals are set up.
+void update_check_bootloader();
+
+void update_init();
+
+// Handles the payload of a LedStream_Update message. Returns false for a
+// message that was rejected. A reason is in update_status.
+uint8_t update_process_message(uint8_t const * data, uint16_t len);
+
+// Points image at the stored panel image and returns true, or returns false
+// if there's none
+uint8_t update_panel_image(
+    uint8_t const ** image,
+    uint32_t * len,
+    uint32_t * crc
+);
+
+// Whether the stream has to wait for the flash writer before the next
+// message can be taken
+uint8_t update_blocked();
+
+// Handler for Event_Flash_Write: writes a bit of the image, checks and
+// installs it once complete
+void update_write_step();
+
+// Restarts into the ROM bootloader shortly, so the current USB request can
+// still complete
+void update_request_bootloader();
+
+// Restarts when it's time after update_request_bootloader()
+void update_tick(uint32_t now_ms);
+
+#endif
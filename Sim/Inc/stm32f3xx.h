@@ -0,0 +1,250 @@
+#ifndef __STM32F3xx_H
+#define __STM32F3xx_H
+
+// Stand-in for the device header when building for the host simulation.
+// Provides just the parts of CMSIS and the HAL that the simulated modules
+// use; peripherals are plain structs in host memory, and the HAL functions
+// are implemented in Sim/sim_hal.c on top of simulated time.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CMSIS ----------------------------------------------------------------------
+
+typedef enum {
+    USART1_IRQn = 37,
+    USART2_IRQn = 38,
+    USART3_IRQn = 39,
+    DMA1_Channel2_IRQn = 12,
+    DMA1_Channel3_IRQn = 13,
+    DMA1_Channel4_IRQn = 14,
+    DMA1_Channel5_IRQn = 15,
+    DMA1_Channel6_IRQn = 16,
+    DMA1_Channel7_IRQn = 17
+} IRQn_Type;
+
+typedef struct {
+    volatile uint32_t CTRL;
+    volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+    volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk (1UL)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+extern DWT_Type sim_dwt;
+extern CoreDebug_Type sim_core_debug;
+
+#define DWT (&sim_dwt)
+#define CoreDebug (&sim_core_debug)
+
+extern uint32_t SystemCoreClock;
+
+// Interrupts only ever run when the simulation advances time, so the mask is
+// only tracked to keep critical.h's save/restore honest
+extern uint32_t sim_primask;
+
+static inline uint32_t __get_PRIMASK(void) { return sim_primask; }
+static inline void __set_PRIMASK(uint32_t primask) { sim_primask = primask; }
+static inline void __disable_irq(void) { sim_primask = 1; }
+static inline void __enable_irq(void) { sim_primask = 0; }
+static inline void __DMB(void) { __sync_synchronize(); }
+static inline void __DSB(void) { __sync_synchronize(); }
+
+// Sleeps until the next simulated interrupt
+void __WFI(void);
+
+#define SET_BIT(REG, BIT) ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT) ((REG) &= ~(BIT))
+#define MODIFY_REG(REG, CLEARMASK, SETMASK) \
+    ((REG) = (((REG) & (~(CLEARMASK))) | (SETMASK)))
+
+// Peripherals ----------------------------------------------------------------
+
+typedef struct {
+    volatile uint32_t MODER;
+    volatile uint32_t OTYPER;
+    volatile uint32_t OSPEEDR;
+    volatile uint32_t PUPDR;
+    volatile uint32_t IDR;
+    volatile uint32_t ODR;
+    volatile uint32_t AFR[2];
+} GPIO_TypeDef;
+
+typedef struct {
+    volatile uint32_t CR1;
+    volatile uint32_t RQR;
+    volatile uint32_t ICR;
+} USART_TypeDef;
+
+extern GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+extern USART_TypeDef sim_usart1, sim_usart2, sim_usart3;
+
+#define GPIOA (&sim_gpioa)
+#define GPIOB (&sim_gpiob)
+#define GPIOC (&sim_gpioc)
+#define USART1 (&sim_usart1)
+#define USART2 (&sim_usart2)
+#define USART3 (&sim_usart3)
+
+#define USART_CR1_RE (1UL << 2)
+#define USART_CR1_TE (1UL << 3)
+#define USART_RQR_RXFRQ (1UL << 3)
+#define USART_ICR_FECF (1UL << 1)
+#define USART_ICR_NCF (1UL << 2)
+#define USART_ICR_ORECF (1UL << 3)
+
+// HAL ------------------------------------------------------------------------
+
+typedef enum {
+    HAL_OK = 0x00U,
+    HAL_ERROR = 0x01U,
+    HAL_BUSY = 0x02U,
+    HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+#define GPIO_PIN_0 ((uint16_t)0x0001)
+#define GPIO_PIN_1 ((uint16_t)0x0002)
+#define GPIO_PIN_2 ((uint16_t)0x0004)
+#define GPIO_PIN_3 ((uint16_t)0x0008)
+#define GPIO_PIN_4 ((uint16_t)0x0010)
+#define GPIO_PIN_5 ((uint16_t)0x0020)
+#define GPIO_PIN_6 ((uint16_t)0x0040)
+#define GPIO_PIN_7 ((uint16_t)0x0080)
+#define GPIO_PIN_8 ((uint16_t)0x0100)
+#define GPIO_PIN_9 ((uint16_t)0x0200)
+#define GPIO_PIN_10 ((uint16_t)0x0400)
+#define GPIO_PIN_11 ((uint16_t)0x0800)
+#define GPIO_PIN_12 ((uint16_t)0x1000)
+#define GPIO_PIN_13 ((uint16_t)0x2000)
+#define GPIO_PIN_14 ((uint16_t)0x4000)
+#define GPIO_PIN_15 ((uint16_t)0x8000)
+
+// Low two bits are the MODER field value, as on the real HAL
+#define GPIO_MODE_INPUT (0x00000000U)
+#define GPIO_MODE_OUTPUT_PP (0x00000001U)
+#define GPIO_MODE_AF_PP (0x00000002U)
+#define GPIO_MODE_ANALOG (0x00000003U)
+
+#define GPIO_NOPULL (0x00000000U)
+#define GPIO_SPEED_FREQ_LOW (0x00000000U)
+#define GPIO_SPEED_FREQ_HIGH (0x00000003U)
+#define GPIO_AF7_USART2 ((uint8_t)0x07U)
+
+typedef enum {
+    GPIO_PIN_RESET = 0U,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct {
+    uint32_t Pin;
+    uint32_t Mode;
+    uint32_t Pull;
+    uint32_t Speed;
+    uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+typedef enum {
+    HAL_UART_STATE_RESET = 0x00U,
+    HAL_UART_STATE_READY = 0x20U,
+    HAL_UART_STATE_BUSY_TX = 0x21U,
+    HAL_UART_STATE_BUSY_RX = 0x22U
+} HAL_UART_StateTypeDef;
+
+#define UART_WORDLENGTH_8B (0x00000000U)
+#define UART_STOPBITS_1 (0x00000000U)
+#define UART_STOPBITS_2 (0x00002000U)
+#define UART_PARITY_NONE (0x00000000U)
+#define UART_MODE_TX_RX (USART_CR1_TE | USART_CR1_RE)
+#define UART_HWCONTROL_NONE (0x00000000U)
+#define UART_OVERSAMPLING_8 (0x00008000U)
+#define UART_ONE_BIT_SAMPLE_DISABLE (0x00000000U)
+#define UART_ADVFEATURE_NO_INIT (0x00000000U)
+
+typedef struct {
+    uint32_t BaudRate;
+    uint32_t WordLength;
+    uint32_t StopBits;
+    uint32_t Parity;
+    uint32_t Mode;
+    uint32_t HwFlowCtl;
+    uint32_t OverSampling;
+    uint32_t OneBitSampling;
+} UART_InitTypeDef;
+
+typedef struct {
+    uint32_t AdvFeatureInit;
+} UART_AdvFeatureInitTypeDef;
+
+typedef struct {
+    USART_TypeDef * Instance;
+    UART_InitTypeDef Init;
+    UART_AdvFeatureInitTypeDef AdvancedInit;
+    volatile HAL_UART_StateTypeDef gState;
+    volatile HAL_UART_StateTypeDef RxState;
+} UART_HandleTypeDef;
+
+typedef struct {
+    uint32_t unused;
+} DMA_HandleTypeDef;
+
+#define __HAL_RCC_GPIOA_CLK_ENABLE() do { } while (0)
+#define __HAL_RCC_GPIOB_CLK_ENABLE() do { } while (0)
+#define __HAL_RCC_DMA1_CLK_ENABLE() do { } while (0)
+
+uint32_t HAL_GetTick(void);
+void HAL_IncTick(void);
+void HAL_Delay(uint32_t);
+
+void HAL_NVIC_SetPriority(IRQn_Type, uint32_t, uint32_t);
+void HAL_NVIC_EnableIRQ(IRQn_Type);
+void HAL_NVIC_DisableIRQ(IRQn_Type);
+
+void HAL_GPIO_Init(GPIO_TypeDef *, GPIO_InitTypeDef *);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *, uint16_t);
+void HAL_GPIO_WritePin(GPIO_TypeDef *, uint16_t, GPIO_PinState);
+void HAL_GPIO_TogglePin(GPIO_TypeDef *, uint16_t);
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *);
+void HAL_UART_MspInit(UART_HandleTypeDef *);
+void HAL_UART_MspDeInit(UART_HandleTypeDef *);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *, uint8_t *, uint16_t);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *, uint8_t *, uint16_t);
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef *);
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *);
+
+// Flash. Only Sim/bench_settings.c has any, mapped at FLASH_BASE, and it
+// implements these.
+
+#ifndef __IO
+#define __IO volatile
+#endif
+
+#define FLASH_BASE (0x08000000UL)
+#define FLASH_PAGE_SIZE (0x800U)
+
+#define FLASH_TYPEERASE_PAGES (0x00U)
+#define FLASH_TYPEPROGRAM_HALFWORD (0x01U)
+#define FLASH_TYPEPROGRAM_WORD (0x02U)
+
+typedef struct {
+    uint32_t TypeErase;
+    uint32_t PageAddress;
+    uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t type, uint32_t address, uint64_t data);
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *, uint32_t * page_error);
+
+// Implemented by the application (uart.c), called from simulated interrupts
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *);
+
+#endif
@@ -0,0 +1,311 @@
+#include "led_codec.h"
+#include "led_stream.h"
+#include "led_encoder.h"
+#include "color.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+
+// Compression ratio and speed of the LED frame codec (led_codec.h) on light
+// shows. Built-in shows are generated the way the pad lights up; recorded
+// shows can be given as files of raw frames, LED_ARRAY_SIZE bytes each, in
+// led_buffer layout. Every frame is encoded with the reference encoder, sent
+// through led_stream as the vendor interface would, and checked against the
+// original after decoding. The same goes for delta frames, which only carry
+// the segments that changed since the frame before.
+
+#define FRAMES_PER_SHOW (2000U)
+#define USB_PACKET_SIZE (64U)
+
+uint32_t SystemCoreClock = 72000000U;
+
+typedef void (* ShowGenerator)(uint32_t frame, uint8_t * led_buffer);
+
+typedef struct {
+    const char * name;
+    ShowGenerator generate;
+} Show;
+
+static uint8_t decoded[LED_ARRAY_SIZE];
+static uint8_t delta_decoded[LED_ARRAY_SIZE];
+static uint8_t decoded_frames = 0;
+
+static double seconds_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Shows -----------------------------------------------------------------------
+
+static uint8_t * pixel(uint8_t * led_buffer, uint8_t panel, uint8_t index) {
+    uint8_t segment = index / LED_PIXELS_PER_SEGMENT;
+    uint8_t offset = index % LED_PIXELS_PER_SEGMENT;
+
+    return led_buffer + panel * BYTES_PER_PANEL 
+        + segment * BYTES_PER_SEGMENT + 1 + offset * 3;
+}
+
+static void set_pixel(uint8_t * led_buffer, uint8_t panel, uint8_t index, Color_RGB rgb) {
+    uint8_t * p = pixel(led_buffer, panel, index);
+    p[0] = rgb.red;
+    p[1] = rgb.green;
+    p[2] = rgb.blue;
+}
+
+static Color_RGB hsl(uint16_t hue, uint8_t lightness) {
+    return color_hsl_to_rgb((Color_HSL) { hue % 360, 100, lightness });
+}
+
+// The whole pad in one color, slowly fading
+static void show_solid(uint32_t frame, uint8_t * led_buffer) {
+    Color_RGB rgb = hsl(200, 10 + (frame / 8) % 40);
+
+    for (uint8_t panel = 0; panel < PANELS_PER_PLATFORM; panel++) {
+        for (uint8_t i = 0; i < LED_PIXELS_PER_PANEL; i++) {
+            set_pixel(led_buffer, panel, i, rgb);
+        }
+    }
+}
+
+// Each panel in its own color, flashing as it's stepped on
+static void show_steps(uint32_t frame, uint8_t * led_buffer) {
+    static const uint16_t hues[PANELS_PER_PLATFORM] = { 0, 120, 240, 60 };
+
+    for (uint8_t panel = 0; panel < PANELS_PER_PLATFORM; panel++) {
+        uint32_t since_step = (frame + panel * 37) % 120;
+        uint8_t lightness = since_step < 30 ? 50 - since_step : 20;
+        Color_RGB rgb = hsl(hues[panel], lightness);
+
+        for (uint8_t i = 0; i < LED_PIXELS_PER_PANEL; i++) {
+            set_pixel(led_buffer, panel, i, rgb);
+        }
+    }
+}
+
+// Like ledtests_loop_color_wheel: each segment one hue, rotating
+static void show_color_wheel(uint32_t frame, uint8_t * led_buffer) {
+    for (uint8_t panel = 0; panel < PANELS_PER_PLATFORM; panel++) {
+        for (uint8_t i = 0; i < LED_PIXELS_PER_PANEL; i++) {
+            uint8_t segment = i / LED_PIXELS_PER_SEGMENT;
+            set_pixel(led_buffer, panel, i, hsl(frame + segment * 30, 25));
+        }
+    }
+}
+
+// A hue gradient running along each panel's LEDs, scrolling
+static void show_gradient(uint32_t frame, uint8_t * led_buffer) {
+    for (uint8_t panel = 0; panel < PANELS_PER_PLATFORM; panel++) {
+        for (uint8_t i = 0; i < LED_PIXELS_PER_PANEL; i++) {
+            set_pixel(led_buffer, panel, i, hsl(frame * 2 + i * 360 / LED_PIXELS_PER_PANEL, 30));
+        }
+    }
+}
+
+// A short lit tail chasing around each panel on a dark background
+static void show_chase(uint32_t frame, uint8_t * led_buffer) {
+    for (uint8_t panel = 0; panel < PANELS_PER_PLATFORM; panel++) {
+        uint8_t head = (frame + panel * 21) % LED_PIXELS_PER_PANEL;
+
+        for (uint8_t i = 0; i < LED_PIXELS_PER_PANEL; i++) {
+            uint8_t behind = (head + LED_PIXELS_PER_PANEL - i) % LED_PIXELS_PER_PANEL;
+            uint8_t lightness = behind < 6 ? 50 - behind * 8 : 0;
+            set_pixel(led_buffer, panel, i, hsl(300, lightness));
+        }
+    }
+}
+
+// Every pixel random: nothing to compress, the worst case
+static void show_noise(uint32_t frame, uint8_t * led_buffer) {
+    for (uint8_t panel = 0; panel < PANELS_PER_PLATFORM; panel++) {
+        for (uint8_t i = 0; i < LED_PIXELS_PER_PANEL; i++) {
+            uint8_t * p = pixel(led_buffer, panel, i);
+            p[0] = rand();
+            p[1] = rand();
+            p[2] = rand();
+        }
+    }
+}
+
+static const Show shows[] = {
+    { "solid", show_solid },
+    { "steps", show_steps },
+    { "color wheel", show_color_wheel },
+    { "gradient", show_gradient },
+    { "chase", show_chase },
+    { "noise", show_noise },
+};
+
+// Running a show --------------------------------------------------------------
+
+static void on_frame(uint16_t segments) {
+    decoded_frames++;
+}
+
+static inline uint32_t usb_packets(uint32_t len) {
+    return (len + USB_PACKET_SIZE - 1) / USB_PACKET_SIZE;
+}
+
+// Sets the segment header bytes the way the decoder rebuilds them, so frames
+// can be compared whole
+static void set_headers(uint8_t * led_buffer, uint8_t frame) {
+    for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+        led_buffer[i * BYTES_PER_SEGMENT] = ((i / SEGMENTS_PER_PANEL) << 6)
+            | ((i % SEGMENTS_PER_PANEL) << 4)
+            | (frame & 0x0F);
+    }
+}
+
+static void run_show(const char * name, uint8_t * frames, uint32_t frame_count) {
+    static uint8_t encoded[LED_CODEC_MAX_FRAME_LEN];
+    static uint8_t message[LED_STREAM_HEADER_LEN + LED_CODEC_MAX_DELTA_LEN];
+
+    uint32_t codec_counts[LED_CODEC_COUNT] = { 0 };
+    uint64_t raw_bytes = 0;
+    uint64_t encoded_bytes = 0;
+    uint64_t raw_packets = 0;
+    uint64_t encoded_packets = 0;
+    uint64_t delta_bytes = 0;
+    uint64_t delta_packets = 0;
+    uint32_t mismatches = 0;
+    double encode_seconds = 0;
+    double decode_seconds = 0;
+
+    for (uint32_t f = 0; f < frame_count; f++) {
+        uint8_t * frame = frames + f * LED_ARRAY_SIZE;
+        set_headers(frame, f);
+
+        double started = seconds_now();
+        uint16_t len = led_encode_frame(frame, f, encoded, codec_counts);
+        encode_seconds += seconds_now() - started;
+
+        uint16_t message_len = led_encode_message(
+            LedStream_Encoded_Frame, encoded, len, message);
+
+        led_stream_init(decoded, on_frame);
+        decoded_frames = 0;
+        started = seconds_now();
+        led_stream_feed(message, message_len);
+        decode_seconds += seconds_now() - started;
+
+        if (decoded_frames != 1 || memcmp(decoded, frame, LED_ARRAY_SIZE) != 0) {
+            mismatches++;
+        }
+
+        len = led_encode_delta(
+            f > 0 ? frame - LED_ARRAY_SIZE : NULL, frame, f, encoded, NULL);
+        uint16_t delta_len = led_encode_message(
+            LedStream_Delta_Frame, encoded, len, message);
+
+        // Segments a delta leaves out keep their old header byte, only the
+        // LEDs have to match
+        led_stream_init(delta_decoded, on_frame);
+        decoded_frames = 0;
+        led_stream_feed(message, delta_len);
+        set_headers(delta_decoded, f);
+
+        if (decoded_frames != 1 
+            || memcmp(delta_decoded, frame, LED_ARRAY_SIZE) != 0) {
+            mismatches++;
+        }
+
+        delta_bytes += delta_len;
+        delta_packets += usb_packets(delta_len);
+
+        raw_bytes += LED_STREAM_HEADER_LEN + LED_ARRAY_SIZE;
+        encoded_bytes += message_len;
+        raw_packets += usb_packets(LED_STREAM_HEADER_LEN + LED_ARRAY_SIZE);
+        encoded_packets += usb_packets(message_len);
+    }
+
+    uint32_t segments = frame_count * SEGMENTS_PER_FRAME;
+
+    printf(
+        "  %-12s %7.1f %7.2fx %6.1f %6.1f %7.1f %6.1f  %3.0f/%3.0f/%3.0f/%3.0f %8.1f %8.1f %s\n",
+        name,
+        (double)encoded_bytes / frame_count,
+        (double)raw_bytes / encoded_bytes,
+        (double)raw_packets / frame_count,
+        (double)encoded_packets / frame_count,
+        (double)delta_bytes / frame_count,
+        (double)delta_packets / frame_count,
+        100.0 * codec_counts[LedCodec_Raw] / segments,
+        100.0 * codec_counts[LedCodec_RLE] / segments,
+        100.0 * codec_counts[LedCodec_Palette8] / segments,
+        100.0 * codec_counts[LedCodec_Palette4] / segments,
+        encode_seconds * 1e6 / frame_count,
+        decode_seconds * 1e6 / frame_count,
+        mismatches ? "MISMATCH" : "ok"
+    );
+}
+
+static uint8_t * load_frames(const char * path, uint32_t * frame_count) {
+    FILE * file = fopen(path, "rb");
+
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    *frame_count = size / LED_ARRAY_SIZE;
+    uint8_t * frames = malloc((size_t)*frame_count * LED_ARRAY_SIZE + 1);
+
+    if (fread(frames, LED_ARRAY_SIZE, *frame_count, file) != *frame_count) {
+        perror(path);
+        exit(1);
+    }
+
+    fclose(file);
+    return frames;
+}
+
+int main(int argc, char ** argv) {
+    srand(1);
+
+    printf(
+        "Per frame: message bytes, ratio to a raw frame message, 64 byte USB\n"
+        "packets raw and encoded, delta frame bytes and packets, segment\n"
+        "codecs in %% (raw/RLE/palette8/palette4), host encode and decode time\n"
+        "in us. Raw frames take %u bytes, or %u HID reports.\n\n",
+        LED_STREAM_HEADER_LEN + LED_ARRAY_SIZE,
+        SEGMENTS_PER_FRAME
+    );
+
+    printf(
+        "  %-12s %7s %8s %6s %6s %7s %6s  %-15s %8s %8s\n",
+        "show", "bytes", "ratio", "raw", "enc", "delta", "pkts", "codecs",
+        "enc us", "dec us"
+    );
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            uint32_t frame_count;
+            uint8_t * frames = load_frames(argv[i], &frame_count);
+
+            if (frame_count > 0) run_show(argv[i], frames, frame_count);
+            free(frames);
+        }
+
+        return 0;
+    }
+
+    uint8_t * frames = malloc(FRAMES_PER_SHOW * LED_ARRAY_SIZE);
+
+    for (uint8_t s = 0; s < sizeof(shows) / sizeof(shows[0]); s++) {
+        memset(frames, 0, FRAMES_PER_SHOW * LED_ARRAY_SIZE);
+
+        for (uint32_t f = 0; f < FRAMES_PER_SHOW; f++) {
+            shows[s].generate(f, frames + f * LED_ARRAY_SIZE);
+        }
+
+        run_show(shows[s].name, frames, FRAMES_PER_SHOW);
+    }
+
+    free(frames);
+    return 0;
+}
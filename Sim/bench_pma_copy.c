@@ -0,0 +1,151 @@
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+
+// Compares the USB packet memory copy kernels against the halfword loops they
+// replaced, for 64 byte packets from word aligned and unaligned buffers, and
+// checks they copy the same bytes for every length and alignment. The PMA is
+// an array laid out as on the STM32F303: a halfword in every 32-bit slot.
+// Host timings only say which is faster, not by how much on the board.
+
+#define __IO volatile
+#define PMA_STRIDE (2u)
+
+#include "portable/st/stm32_fsdev/dcd_stm32_fsdev_pma.h"
+
+#define PACKET_LEN (64U)
+#define ROUNDS (5000000U)
+
+static __IO uint16_t pma[PACKET_LEN * PMA_STRIDE];
+
+// Previous copies ---------------------------------------------------------------
+
+static void legacy_write(__IO uint16_t * pdwVal, const uint8_t * srcVal, size_t wNBytes) {
+    uint32_t n = ((uint32_t)wNBytes + 1U) >> 1U;
+
+    for (uint32_t i = n; i != 0; i--) {
+        uint16_t temp1 = (uint16_t)*srcVal;
+        srcVal++;
+        uint16_t temp2 = temp1 | ((uint16_t)((uint16_t)((*srcVal) << 8U)));
+        *pdwVal = temp2;
+        pdwVal += PMA_STRIDE;
+        srcVal++;
+    }
+}
+
+static void legacy_read(uint8_t * dstVal, __IO const uint16_t * pdwVal, size_t wNBytes) {
+    uint32_t n = (uint32_t)wNBytes >> 1U;
+    uint32_t temp;
+
+    for (uint32_t i = n; i != 0U; i--) {
+        temp = *pdwVal;
+        pdwVal += PMA_STRIDE;
+        *dstVal++ = ((temp >> 0) & 0xFF);
+        *dstVal++ = ((temp >> 8) & 0xFF);
+    }
+
+    if (wNBytes % 2) {
+        temp = *pdwVal;
+        *dstVal++ = ((temp >> 0) & 0xFF);
+    }
+}
+
+// Checks ------------------------------------------------------------------------
+
+static uint8_t check() {
+    _Alignas(4) uint8_t src[PACKET_LEN + 8];
+    _Alignas(4) uint8_t dst[PACKET_LEN + 8];
+    _Alignas(4) uint8_t expected[PACKET_LEN + 8];
+
+    for (uint8_t i = 0; i < sizeof(src); i++) src[i] = i * 37 + 11;
+
+    for (uint8_t offset = 0; offset < 4; offset++) {
+        for (uint8_t len = 0; len <= PACKET_LEN; len++) {
+            // What's in the PMA
+            memset((void *)pma, 0xEE, sizeof(pma));
+            pma_copy_to(pma, src + offset, len);
+
+            for (uint8_t i = 0; i < len; i++) {
+                uint8_t byte = pma[(i / 2) * PMA_STRIDE] >> ((i % 2) * 8);
+
+                if (byte != src[offset + i]) {
+                    printf("write mismatch: offset %u, length %u, byte %u\n", offset, len, i);
+                    return 0;
+                }
+            }
+
+            // And what comes back out, past the end left alone
+            memset(dst, 0xEE, sizeof(dst));
+            memset(expected, 0xEE, sizeof(expected));
+            legacy_read(expected + offset, pma, len);
+            pma_copy_from(dst + offset, pma, len);
+
+            if (memcmp(dst, expected, sizeof(dst)) != 0) {
+                printf("read mismatch: offset %u, length %u\n", offset, len);
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Timing ------------------------------------------------------------------------
+
+static double seconds_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_write(void (* copy)(__IO uint16_t *, const uint8_t *, size_t), const uint8_t * src) {
+    double started = seconds_now();
+    for (uint32_t i = 0; i < ROUNDS; i++) copy(pma, src, PACKET_LEN);
+    return (seconds_now() - started) * 1e9 / ROUNDS;
+}
+
+static double time_read(void (* copy)(uint8_t *, __IO const uint16_t *, size_t), uint8_t * dst) {
+    double started = seconds_now();
+    for (uint32_t i = 0; i < ROUNDS; i++) copy(dst, pma, PACKET_LEN);
+    return (seconds_now() - started) * 1e9 / ROUNDS;
+}
+
+// Not inlined into the loops, as the driver doesn't get them inlined either
+__attribute__((noinline))
+static void new_write(__IO uint16_t * pma_buf, const uint8_t * src, size_t len) {
+    pma_copy_to(pma_buf, src, len);
+}
+
+__attribute__((noinline))
+static void new_read(uint8_t * dst, __IO const uint16_t * pma_buf, size_t len) {
+    pma_copy_from(dst, pma_buf, len);
+}
+
+int main() {
+    static _Alignas(4) uint8_t buffer[PACKET_LEN + 4];
+
+    if (!check()) return 1;
+
+    printf("Copies match for every length up to %u and alignment\n", PACKET_LEN);
+    printf("%u byte packet, ns per copy   %9s %9s\n", PACKET_LEN, "previous", "new");
+
+    printf(
+        "  to PMA, aligned              %9.2f %9.2f\n",
+        time_write(legacy_write, buffer), time_write(new_write, buffer)
+    );
+    printf(
+        "  to PMA, unaligned            %9.2f %9.2f\n",
+        time_write(legacy_write, buffer + 1), time_write(new_write, buffer + 1)
+    );
+    printf(
+        "  from PMA, aligned            %9.2f %9.2f\n",
+        time_read(legacy_read, buffer), time_read(new_read, buffer)
+    );
+    printf(
+        "  from PMA, unaligned          %9.2f %9.2f\n",
+        time_read(legacy_read, buffer + 1), time_read(new_read, buffer + 1)
+    );
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include "req_queue.h"
+#include "error_handler.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "time.h"
+
+// Compares the pooled request queue against the queue it replaced, which
+// kept full requests in each port's ring and scanned all of them for
+// duplicates. The workload is what a port sees while streaming LEDs: sensor
+// requests re-sent while still queued, LED segments and commits. Also checks
+// that clearing full queues, as a port going offline does, gives their pool
+// entries back.
+
+#define ROUNDS (2000000U)
+
+extern inline Request request_create(Commands);
+extern inline uint8_t request_equals(Request, Request);
+extern inline uint8_t request_has_data(Request *);
+extern inline uint8_t request_expects_response(Request *);
+
+uint32_t SystemCoreClock = 72000000U;
+uint32_t sim_primask = 0;
+GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+
+void HAL_Delay(uint32_t delay) {
+    fprintf(stderr, "panic 0x%04x\n", Panic_Error);
+    exit(1);
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef * gpio, uint16_t pin) { }
+
+// Previous queue ---------------------------------------------------------------
+
+typedef struct {
+    Request items[MAX_REQ_QUEUE_LENGTH];
+    int8_t front;
+    int8_t rear;
+    uint8_t count;
+} LegacyRequestQueue;
+
+static Request legacy_blank;
+
+static inline uint8_t legacy_contains(LegacyRequestQueue * queue, Request req) {
+    if (queue->count == 0) return false;
+
+    for (uint8_t i = 0; i < MAX_REQ_QUEUE_LENGTH; i++) {
+        if (request_equals(queue->items[i], req)) return true;
+    }
+
+    return false;
+}
+
+static void legacy_init(LegacyRequestQueue * queue) {
+    legacy_blank = request_create(Command_None);
+    queue->front = 0;
+    queue->rear = -1;
+    queue->count = 0;
+
+    for (uint8_t i = 0; i < MAX_REQ_QUEUE_LENGTH; i++) {
+        queue->items[i] = legacy_blank;
+    }
+}
+
+static void legacy_add(LegacyRequestQueue * queue, Request request) {
+    if (queue->count == MAX_REQ_QUEUE_LENGTH) exit(1);
+    if (legacy_contains(queue, request)) return;
+    if (queue->rear == MAX_REQ_QUEUE_LENGTH - 1) queue->rear = -1;
+
+    queue->rear++;
+    queue->items[queue->rear] = request;
+    queue->count++;
+}
+
+static Request legacy_take(LegacyRequestQueue * queue) {
+    if (queue->count == 0) return legacy_blank;
+
+    Request req = queue->items[queue->front];
+    queue->items[queue->front] = legacy_blank;
+    queue->front++;
+
+    if (queue->front == MAX_REQ_QUEUE_LENGTH) queue->front = 0;
+
+    queue->count--;
+    return req;
+}
+
+// Workload ---------------------------------------------------------------------
+
+#define WORKLOAD_LENGTH (12U)
+
+static uint8_t led_buffer[4 * 64];
+static uint8_t sensor_buffer[8];
+static Request workload[WORKLOAD_LENGTH];
+
+static void make_workload() {
+    Request sensors = request_create(Command_Request_Sensors);
+    sensors.comport_id = Comport_Left;
+    sensors.response_data = sensor_buffer;
+    sensors.response_len = sizeof(sensor_buffer);
+
+    Request commit = request_create(Command_Commit_LEDs);
+    commit.comport_id = Comport_Left;
+
+    uint8_t n = 0;
+
+    for (uint8_t segment = 0; segment < 4; segment++) {
+        Request led = request_create(Command_Process_LED_Segment);
+        led.comport_id = Comport_Left;
+        led.send_data = led_buffer + segment * 64;
+        led.send_data_len = 64;
+
+        workload[n++] = sensors;
+        workload[n++] = led;
+    }
+
+    workload[n++] = sensors;
+    workload[n++] = commit;
+    workload[n++] = sensors;
+    workload[n++] = sensors;
+}
+
+static double seconds_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    make_workload();
+
+    static LegacyRequestQueue legacy;
+    static RequestQueue pooled;
+    volatile uint32_t sink = 0;
+
+    legacy_init(&legacy);
+    req_queue_pool_init();
+    req_queue_init(&pooled);
+
+    double started = seconds_now();
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        for (uint8_t i = 0; i < WORKLOAD_LENGTH; i++) legacy_add(&legacy, workload[i]);
+        while (legacy.count > 0) sink += legacy_take(&legacy).send_data_len;
+    }
+
+    double legacy_seconds = seconds_now() - started;
+    started = seconds_now();
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        for (uint8_t i = 0; i < WORKLOAD_LENGTH; i++) req_queue_add(&pooled, workload[i]);
+        while (pooled.count > 0) sink += req_queue_take(&pooled).send_data_len;
+    }
+
+    double pooled_seconds = seconds_now() - started;
+
+    // Far more full queues than the pool holds; a leak runs it dry and panics
+    for (uint32_t round = 0; round < REQ_POOL_SIZE; round++) {
+        for (uint8_t i = 0; i < MAX_REQ_QUEUE_LENGTH; i++) {
+            Request led = request_create(Command_Process_LED_Segment);
+            led.comport_id = Comport_Left;
+            led.send_data = led_buffer + i * 16;
+            led.send_data_len = 16;
+
+            req_queue_add(&pooled, led);
+        }
+
+        if (pooled.count != MAX_REQ_QUEUE_LENGTH) {
+            printf("round %u: %u requests queued\n", round, pooled.count);
+            return 1;
+        }
+
+        req_queue_clear(&pooled);
+    }
+
+    double operations = (double)ROUNDS * WORKLOAD_LENGTH;
+
+    printf("%u rounds of %u adds (6 of them duplicates) and 6 takes\n", ROUNDS, WORKLOAD_LENGTH);
+    printf("  previous queue  %7.2f ns per add, takes included\n", legacy_seconds * 1e9 / operations);
+    printf("  pooled queue    %7.2f ns per add, takes included\n", pooled_seconds * 1e9 / operations);
+    printf("Filled and cleared a queue %u times without running out of entries\n", REQ_POOL_SIZE);
+
+    return sink == 0;
+}
@@ -0,0 +1,402 @@
+#include "scheduler.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "getopt.h"
+
+// Replays recorded event traces through the scheduler (scheduler.c), and
+// through a model of the busy-poll loop it replaced, and reports how long
+// each type of event waited between being posted and its handler running.
+//
+// A trace is a text file with a post per line, "<cycle> <event>": the cycle
+// count since startup the event was posted at, and its EventType. Lines
+// starting with # are skipped. io-sim records one with --record-trace; on the
+// board, the DWT cycle counter gives the same.
+//
+// Events are posted at the cycle they were recorded at, also while a handler
+// runs, as the interrupts posting them would. Handlers take --handler-cycles,
+// or what --cost gives their event. The poll loop visits every event in the
+// order run() did, a visit to an event that isn't pending taking
+// --poll-cycles.
+
+#define MAX_COSTS (EVENT_TYPE_COUNT)
+
+uint32_t SystemCoreClock = 72000000U;
+uint32_t sim_primask = 0;
+DWT_Type sim_dwt;
+CoreDebug_Type sim_core_debug;
+
+void __WFI(void) { }
+
+static const char * event_names[EVENT_TYPE_COUNT] = {
+    "msgbus", "response", "usb", "sensor report",
+    "led packet", "sensor poll", "tick", "flash write"
+};
+
+// Order run() in main.c polled in before the scheduler: the bus flags and
+// responses, sensor reports, LED data, sensor requests, then USB. Ticks and
+// flash writes came last, from the SysTick handler and the update code.
+static const EventType poll_order[EVENT_TYPE_COUNT] = {
+    Event_MsgBus, Event_Response, Event_Sensor_Report, Event_LED_Packet,
+    Event_Sensor_Poll, Event_USB, Event_Tick, Event_Flash_Write
+};
+
+typedef struct {
+    uint64_t at;
+    uint8_t event;
+} TracePost;
+
+typedef struct {
+    uint32_t * latencies;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t posts;
+    uint32_t coalesced;
+} Latencies;
+
+static TracePost * trace = NULL;
+static uint32_t trace_len = 0;
+static uint32_t next_post = 0;
+
+static uint32_t handler_cycles[EVENT_TYPE_COUNT];
+static uint32_t poll_cycles = 50;
+
+static uint64_t now = 0;
+static Latencies latencies[EVENT_TYPE_COUNT];
+
+static void (* post)(EventType);
+
+static inline double cycles_to_us(uint64_t cycles) {
+    return (double)cycles / (SystemCoreClock / 1000000U);
+}
+
+static void add_latency(EventType event, uint32_t cycles) {
+    Latencies * l = &latencies[event];
+
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 1024;
+        l->latencies = realloc(l->latencies, l->capacity * sizeof(uint32_t));
+
+        if (l->latencies == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    l->latencies[l->count++] = cycles;
+}
+
+static void reset_latencies() {
+    for (uint8_t i = 0; i < EVENT_TYPE_COUNT; i++) {
+        free(latencies[i].latencies);
+        latencies[i] = (Latencies) { 0 };
+    }
+}
+
+// Posts what the trace has up to the current cycle
+static void post_due() {
+    while (next_post < trace_len && trace[next_post].at <= now) {
+        sim_dwt.CYCCNT = (uint32_t)now;
+        latencies[trace[next_post].event].posts++;
+        post((EventType)trace[next_post].event);
+        next_post++;
+    }
+}
+
+// Lets the given cycles pass, posting events as they come due
+static void run_cpu(uint32_t cycles) {
+    uint64_t end = now + cycles;
+
+    while (next_post < trace_len && trace[next_post].at <= end) {
+        if (trace[next_post].at > now) now = trace[next_post].at;
+        post_due();
+    }
+
+    now = end;
+    sim_dwt.CYCCNT = (uint32_t)now;
+}
+
+// Sleeps until the next post, if there is one
+static uint8_t wait_for_post() {
+    if (next_post == trace_len) return false;
+
+    if (trace[next_post].at > now) now = trace[next_post].at;
+    post_due();
+    return true;
+}
+
+static void start_replay() {
+    now = trace_len ? trace[0].at : 0;
+    next_post = 0;
+    sim_dwt.CYCCNT = (uint32_t)now;
+    reset_latencies();
+}
+
+// Scheduler -------------------------------------------------------------------
+
+static EventType dispatched;
+
+#define HANDLER(event) static void on_##event() { dispatched = event; }
+
+HANDLER(Event_MsgBus)
+HANDLER(Event_Response)
+HANDLER(Event_USB)
+HANDLER(Event_Sensor_Report)
+HANDLER(Event_LED_Packet)
+HANDLER(Event_Sensor_Poll)
+HANDLER(Event_Tick)
+HANDLER(Event_Flash_Write)
+
+static void replay_scheduler() {
+    scheduler_init();
+    scheduler_set_handler(Event_MsgBus, on_Event_MsgBus);
+    scheduler_set_handler(Event_Response, on_Event_Response);
+    scheduler_set_handler(Event_USB, on_Event_USB);
+    scheduler_set_handler(Event_Sensor_Report, on_Event_Sensor_Report);
+    scheduler_set_handler(Event_LED_Packet, on_Event_LED_Packet);
+    scheduler_set_handler(Event_Sensor_Poll, on_Event_Sensor_Poll);
+    scheduler_set_handler(Event_Tick, on_Event_Tick);
+    scheduler_set_handler(Event_Flash_Write, on_Event_Flash_Write);
+
+    post = scheduler_post;
+    start_replay();
+    post_due();
+
+    while (true) {
+        if (scheduler_dispatch()) {
+            add_latency(dispatched, scheduler_stats[dispatched].last_latency);
+            run_cpu(handler_cycles[dispatched]);
+        } else if (!wait_for_post()) {
+            break;
+        }
+    }
+
+    for (uint8_t i = 0; i < EVENT_TYPE_COUNT; i++) {
+        latencies[i].coalesced = scheduler_stats[i].coalesced;
+    }
+}
+
+// Poll loop -------------------------------------------------------------------
+
+static uint32_t poll_pending = 0;
+static uint64_t poll_posted_at[EVENT_TYPE_COUNT];
+
+static void poll_post(EventType event) {
+    if (poll_pending & (1U << event)) {
+        latencies[event].coalesced++;
+        return;
+    }
+
+    poll_pending |= 1U << event;
+    poll_posted_at[event] = now;
+}
+
+static void replay_poll_loop() {
+    uint8_t position = 0;
+
+    post = poll_post;
+    poll_pending = 0;
+    start_replay();
+    post_due();
+
+    while (true) {
+        if (poll_pending == 0) {
+            // Nothing to do until the next post; work out where the loop has
+            // got to by then, rather than going round it
+            uint64_t from = now;
+
+            if (!wait_for_post()) break;
+
+            position = (position + (now - from) / poll_cycles) % EVENT_TYPE_COUNT;
+        }
+
+        EventType event = poll_order[position];
+        position = (position + 1) % EVENT_TYPE_COUNT;
+
+        if (poll_pending & (1U << event)) {
+            poll_pending &= ~(1U << event);
+            add_latency(event, now - poll_posted_at[event]);
+            run_cpu(handler_cycles[event]);
+        } else {
+            run_cpu(poll_cycles);
+        }
+    }
+}
+
+// Report ----------------------------------------------------------------------
+
+static int compare_latencies(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(Latencies * l, uint32_t percent) {
+    if (l->count == 0) return 0.0;
+
+    return cycles_to_us(l->latencies[(uint64_t)(l->count - 1) * percent / 100U]);
+}
+
+static void print_latencies(const char * name) {
+    printf("\n%s\n", name);
+    printf(
+        "  %-14s %10s %10s %10s %10s %10s\n",
+        "event", "dispatched", "coalesced", "p50 us", "p99 us", "max us"
+    );
+
+    for (uint8_t i = 0; i < EVENT_TYPE_COUNT; i++) {
+        Latencies * l = &latencies[i];
+
+        if (l->posts == 0) continue;
+
+        qsort(l->latencies, l->count, sizeof(uint32_t), compare_latencies);
+        printf(
+            "  %-14s %10u %10u %10.1f %10.1f %10.1f\n",
+            event_names[i],
+            l->count,
+            l->coalesced,
+            percentile_us(l, 50),
+            percentile_us(l, 99),
+            l->count ? cycles_to_us(l->latencies[l->count - 1]) : 0.0
+        );
+    }
+}
+
+// Trace files -----------------------------------------------------------------
+
+static int load_trace(const char * path) {
+    FILE * file = fopen(path, "r");
+    char line[128];
+    uint32_t capacity = 0;
+    uint32_t line_number = 0;
+
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    trace_len = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long at;
+        unsigned event;
+
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        if (sscanf(line, "%llu %u", &at, &event) != 2
+            || event >= EVENT_TYPE_COUNT
+            || (trace_len > 0 && at < trace[trace_len - 1].at)) {
+
+            fprintf(stderr, "%s:%u: expected \"<cycle> <event>\", in order\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+
+        if (trace_len == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            trace = realloc(trace, capacity * sizeof(TracePost));
+
+            if (trace == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+
+        trace[trace_len++] = (TracePost) { at, event };
+    }
+
+    fclose(file);
+    return true;
+}
+
+static void usage(const char * name) {
+    fprintf(stderr,
+        "usage: %s [options] trace...\n"
+        "  --handler-cycles N   cycles each event handler takes (500)\n"
+        "  --cost EVENT=N       cycles the handler for EVENT (an EventType)\n"
+        "                       takes instead, may be given more than once\n"
+        "  --poll-cycles N      cycles the poll loop takes to look at an event\n"
+        "                       that isn't pending (50)\n"
+        "Traces have a post per line: \"<cycle> <event>\", see --record-trace\n"
+        "in io-sim\n",
+        name
+    );
+}
+
+int main(int argc, char ** argv) {
+    static const struct option options[] = {
+        { "handler-cycles", required_argument, NULL, 'c' },
+        { "cost", required_argument, NULL, 'e' },
+        { "poll-cycles", required_argument, NULL, 'p' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    uint32_t default_cycles = 500;
+    uint32_t costs[MAX_COSTS][2];
+    uint8_t cost_count = 0;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 'c': default_cycles = strtoul(optarg, NULL, 0); break;
+            case 'p': poll_cycles = strtoul(optarg, NULL, 0); break;
+            case 'e': {
+                unsigned event, cycles;
+
+                if (cost_count == MAX_COSTS
+                    || sscanf(optarg, "%u=%u", &event, &cycles) != 2
+                    || event >= EVENT_TYPE_COUNT) {
+
+                    usage(argv[0]);
+                    return 2;
+                }
+
+                costs[cost_count][0] = event;
+                costs[cost_count][1] = cycles;
+                cost_count++;
+                break;
+            }
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    if (optind == argc || poll_cycles == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (uint8_t i = 0; i < EVENT_TYPE_COUNT; i++) {
+        handler_cycles[i] = default_cycles;
+    }
+
+    for (uint8_t i = 0; i < cost_count; i++) {
+        handler_cycles[costs[i][0]] = costs[i][1];
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (!load_trace(argv[i])) return 1;
+
+        double seconds = trace_len
+            ? (double)(trace[trace_len - 1].at - trace[0].at) / SystemCoreClock
+            : 0.0;
+
+        printf("%s: %u posts over %.2f s\n", argv[i], trace_len, seconds);
+
+        replay_scheduler();
+        print_latencies("Scheduler");
+
+        replay_poll_loop();
+        print_latencies("Poll loop");
+
+        if (i + 1 < argc) printf("\n");
+    }
+
+    reset_latencies();
+    free(trace);
+    return 0;
+}
@@ -0,0 +1,231 @@
+#include "stdint.h"
+#include "stdbool.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "settings.h"
+#include "flash_layout.h"
+#include "scheduler.h"
+#include "config.h"
+
+// Checks the settings store (settings.c) against flash that behaves like the
+// STM32F303's: erasing sets a page to 0xFF, and programming a halfword that
+// isn't erased fails. Flash is mapped at its address on the board, so the
+// store runs unchanged. Goes through many batches of changes, restarting
+// after each, and cuts the power at random halfwords along the way, checking
+// every setting reads back as either its old or its new value. Then makes
+// enough changes without a restart to fill several pages. Reports how
+// the erases spread over the pages, and the most flash work any one
+// Event_Flash_Write did.
+
+#define FLASH_LEN (256U * 1024U)
+#define PAGE_COUNT (FLASH_SETTINGS_LEN / FLASH_PAGE_SIZE)
+#define ROUNDS (20000U)
+
+// Halfword programming and page erase times on the board, in microseconds
+#define PROGRAM_US (53U)
+#define ERASE_US (30000U)
+
+static uint32_t now_ms = 0;
+static uint8_t posted = false;
+static uint8_t locked = true;
+
+// Halfwords left before the power goes, or -1 to keep it on
+static int32_t power_left = -1;
+
+static uint32_t page_erases[PAGE_COUNT];
+
+// Flash work of the Event_Flash_Write being run, and the most of any so far
+static uint32_t step_us = 0;
+static uint32_t max_step_us = 0;
+static uint32_t runtime_erases = 0;
+
+static uint32_t random_state = 1;
+
+static uint32_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+// Stand-ins for the HAL and scheduler ---------------------------------------
+
+uint32_t HAL_GetTick(void) {
+    return now_ms;
+}
+
+void scheduler_post(EventType event) {
+    if (event == Event_Flash_Write) posted = true;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+    locked = false;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+    locked = true;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t type, uint32_t address, uint64_t data) {
+    uint16_t * halfword = (uint16_t *)(uintptr_t)address;
+
+    if (locked || type != FLASH_TYPEPROGRAM_HALFWORD || *halfword != 0xFFFF) {
+        return HAL_ERROR;
+    }
+
+    if (power_left == 0) return HAL_ERROR;
+    if (power_left > 0) power_left--;
+
+    *halfword = (uint16_t)data;
+    step_us += PROGRAM_US;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef * erase, uint32_t * page_error) {
+    if (locked || power_left == 0) return HAL_ERROR;
+
+    memset((void *)(uintptr_t)erase->PageAddress, 0xFF, FLASH_PAGE_SIZE);
+    page_erases[(erase->PageAddress - FLASH_SETTINGS_START) / FLASH_PAGE_SIZE]++;
+    step_us += ERASE_US;
+    return HAL_OK;
+}
+
+// Checks ------------------------------------------------------------------------
+
+// Lets the delay pass and runs Event_Flash_Write until the store is done
+static void flush() {
+    now_ms += SETTINGS_WRITE_DELAY_MS;
+    posted = false;
+    settings_tick(now_ms);
+
+    while (posted) {
+        posted = false;
+        step_us = 0;
+        settings_write_step();
+
+        if (step_us >= ERASE_US) {
+            runtime_erases++;
+        } else if (step_us > max_step_us) {
+            max_step_us = step_us;
+        }
+    }
+}
+
+static void restart() {
+    power_left = -1;
+    settings_init();
+}
+
+static uint8_t check_all(uint32_t const * expected, uint32_t round) {
+    for (uint16_t key = 0; key < SETTING_COUNT; key++) {
+        if (settings_get((SettingKey)key) != expected[key]) {
+            printf(
+                "round %u: setting %u is 0x%08x, expected 0x%08x\n",
+                round, key, settings_get((SettingKey)key), expected[key]
+            );
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main() {
+    static uint32_t expected[SETTING_COUNT];
+    static uint32_t previous[SETTING_COUNT];
+    uint32_t power_cuts = 0;
+    uint32_t startup_erases = 0;
+
+    void * flash = mmap(
+        (void *)FLASH_BASE, FLASH_LEN, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0
+    );
+
+    if (flash != (void *)FLASH_BASE) {
+        printf("Couldn't map flash at 0x%08lx\n", FLASH_BASE);
+        return 1;
+    }
+
+    memset(flash, 0xFF, FLASH_LEN);
+
+    // Blank flash has every setting at its default
+    restart();
+    memcpy(expected, settings_values, sizeof(expected));
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        memcpy(previous, expected, sizeof(previous));
+
+        // A burst of changes, some of them back and forth
+        uint8_t changes = 1 + next_random() % 8;
+
+        for (uint8_t i = 0; i < changes; i++) {
+            uint16_t key = next_random() % SETTING_COUNT;
+            uint32_t value = next_random() % 4 == 0 ? previous[key] : next_random();
+
+            settings_set((SettingKey)key, value);
+            expected[key] = value;
+        }
+
+        // Now and then the power goes somewhere in the middle of writing
+        uint8_t cut = next_random() % 8 == 0;
+        if (cut) power_left = next_random() % 24;
+
+        flush();
+        uint8_t power_went = cut && power_left == 0;
+
+        restart();
+        startup_erases += settings_stats.startup_erases;
+
+        if (!power_went) {
+            if (!check_all(expected, round)) return 1;
+            continue;
+        }
+
+        // Cut short: each setting is where it was or where it was going
+        power_cuts++;
+
+        for (uint16_t key = 0; key < SETTING_COUNT; key++) {
+            uint32_t value = settings_get((SettingKey)key);
+
+            if (value != expected[key] && value != previous[key]) {
+                printf("round %u: setting %u torn to 0x%08x\n", round, key, value);
+                return 1;
+            }
+
+            expected[key] = value;
+        }
+    }
+
+    // Long enough without a restart to fill page after page
+    for (uint32_t round = 0; round < ROUNDS / 10; round++) {
+        uint16_t key = next_random() % SETTING_COUNT;
+        uint32_t value = next_random();
+
+        settings_set((SettingKey)key, value);
+        expected[key] = value;
+        flush();
+    }
+
+    restart();
+    if (!check_all(expected, ROUNDS)) return 1;
+
+    printf(
+        "%u rounds of changes, each followed by a restart, %u of them cut short,\n"
+        "then %u changes without one\n",
+        ROUNDS, power_cuts, ROUNDS / 10
+    );
+    printf("Every setting read back as written, or as before a cut\n\n");
+
+    printf("Erases per page  ");
+    for (uint8_t i = 0; i < PAGE_COUNT; i++) printf(" %u", page_erases[i]);
+    printf("\n");
+
+    printf("Erased at startup %u, while running %u\n", startup_erases, runtime_erases);
+    printf("Most flash work in one Event_Flash_Write without an erase: %u us\n", max_step_us);
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include "led_encoder.h"
+#include "stdbool.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define FRAME_PIXELS (SEGMENTS_PER_FRAME * LED_PIXELS_PER_SEGMENT)
+
+typedef struct {
+    uint32_t rgb;
+    uint16_t uses;
+} ColorCount;
+
+typedef struct {
+    ColorCount colors[FRAME_PIXELS];
+    uint16_t count;
+} FramePalette;
+
+static inline uint32_t pixel_rgb(uint8_t const * pixel) {
+    return (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+}
+
+static inline uint8_t const * segment_pixels(uint8_t const * led_buffer, uint8_t segment) {
+    return led_buffer + segment * BYTES_PER_SEGMENT + 1;
+}
+
+static int by_uses(void const * a, void const * b) {
+    ColorCount const * ca = a;
+    ColorCount const * cb = b;
+
+    if (ca->uses != cb->uses) return cb->uses - ca->uses;
+    return ca->rgb < cb->rgb ? -1 : ca->rgb > cb->rgb;
+}
+
+// Every distinct color in the given segments, most used first
+static void count_colors(
+    uint8_t const * led_buffer, uint16_t segments, FramePalette * palette) {
+
+    palette->count = 0;
+
+    for (uint8_t s = 0; s < SEGMENTS_PER_FRAME; s++) {
+        if (!(segments & (1U << s))) continue;
+
+        uint8_t const * pixels = segment_pixels(led_buffer, s);
+
+        for (uint8_t i = 0; i < LED_PIXELS_PER_SEGMENT; i++) {
+            uint32_t rgb = pixel_rgb(pixels + i * 3);
+            uint16_t c = 0;
+
+            while (c < palette->count && palette->colors[c].rgb != rgb) c++;
+
+            if (c == palette->count) {
+                palette->colors[c] = (ColorCount) { rgb, 0 };
+                palette->count++;
+            }
+
+            palette->colors[c].uses++;
+        }
+    }
+
+    qsort(palette->colors, palette->count, sizeof(ColorCount), by_uses);
+}
+
+// Index of the color in the first `colors` palette entries, -1 if not there
+static int16_t palette_index(FramePalette * palette, uint16_t colors, uint32_t rgb) {
+    for (uint16_t c = 0; c < colors; c++) {
+        if (palette->colors[c].rgb == rgb) return c;
+    }
+
+    return -1;
+}
+
+static uint16_t encode_rle(uint8_t const * pixels, uint8_t * out) {
+    uint16_t len = 0;
+    uint8_t start = 0;
+
+    out[len++] = LedCodec_RLE;
+
+    for (uint8_t i = 1; i <= LED_PIXELS_PER_SEGMENT; i++) {
+        if (i < LED_PIXELS_PER_SEGMENT
+            && memcmp(pixels + i * 3, pixels + start * 3, 3) == 0) {
+            continue;
+        }
+
+        out[len++] = i - start;
+        memcpy(out + len, pixels + start * 3, 3);
+        len += 3;
+        start = i;
+    }
+
+    return len;
+}
+
+// Encodes a segment with the smallest codec, given the palette's first
+// `colors` entries
+static uint16_t encode_segment(
+    uint8_t const * pixels, FramePalette * palette, uint16_t colors,
+    uint8_t * out, LedCodec * codec) {
+
+    uint8_t indexes[LED_PIXELS_PER_SEGMENT];
+    uint8_t in_palette = colors > 0;
+    uint8_t max_index = 0;
+    uint8_t runs = 1;
+
+    for (uint8_t i = 0; i < LED_PIXELS_PER_SEGMENT; i++) {
+        int16_t index = palette_index(palette, colors, pixel_rgb(pixels + i * 3));
+
+        if (index < 0) in_palette = false;
+        else if (index > max_index) max_index = index;
+
+        indexes[i] = index;
+
+        if (i > 0 && memcmp(pixels + i * 3, pixels + (i - 1) * 3, 3) != 0) {
+            runs++;
+        }
+    }
+
+    uint16_t raw_len = 1 + LED_PIXEL_BYTES_PER_SEGMENT;
+    uint16_t rle_len = 1 + runs * 4;
+    uint16_t palette8_len = in_palette ? 1 + LED_PIXELS_PER_SEGMENT : UINT16_MAX;
+    uint16_t palette4_len = in_palette && max_index < 16
+        ? 1 + (LED_PIXELS_PER_SEGMENT + 1) / 2
+        : UINT16_MAX;
+
+    *codec = LedCodec_Raw;
+    uint16_t best = raw_len;
+
+    if (rle_len < best) { *codec = LedCodec_RLE; best = rle_len; }
+    if (palette8_len < best) { *codec = LedCodec_Palette8; best = palette8_len; }
+    if (palette4_len < best) { *codec = LedCodec_Palette4; best = palette4_len; }
+
+    out[0] = *codec;
+
+    switch (*codec) {
+        case LedCodec_RLE:
+            return encode_rle(pixels, out);
+
+        case LedCodec_Palette8:
+            memcpy(out + 1, indexes, LED_PIXELS_PER_SEGMENT);
+            return palette8_len;
+
+        case LedCodec_Palette4:
+            memset(out + 1, 0, palette4_len - 1);
+
+            for (uint8_t i = 0; i < LED_PIXELS_PER_SEGMENT; i++) {
+                out[1 + i / 2] |= indexes[i] << ((i & 1) * 4);
+            }
+
+            return palette4_len;
+
+        default:
+            memcpy(out + 1, pixels, LED_PIXEL_BYTES_PER_SEGMENT);
+            return raw_len;
+    }
+}
+
+// Encodes the palette and the given segments, as they follow the header of an
+// encoded or delta frame
+static uint16_t encode_with_palette(
+    uint8_t const * led_buffer, uint16_t segments, FramePalette * palette,
+    uint16_t colors, uint8_t * out, LedCodec * codecs) {
+
+    uint16_t len = 0;
+    out[len++] = colors;
+
+    for (uint16_t c = 0; c < colors; c++) {
+        out[len++] = palette->colors[c].rgb >> 16;
+        out[len++] = palette->colors[c].rgb >> 8;
+        out[len++] = palette->colors[c].rgb;
+    }
+
+    for (uint8_t s = 0; s < SEGMENTS_PER_FRAME; s++) {
+        if (!(segments & (1U << s))) continue;
+
+        len += encode_segment(
+            segment_pixels(led_buffer, s), palette, colors, out + len, &codecs[s]);
+    }
+
+    return len;
+}
+
+// Encodes the given segments with whichever palette size comes out smallest
+static uint16_t encode_segments(
+    uint8_t const * led_buffer, uint16_t segments, uint8_t * out,
+    uint32_t * codec_counts) {
+
+    static FramePalette palette;
+    static uint8_t candidate[LED_CODEC_MAX_FRAME_LEN];
+
+    count_colors(led_buffer, segments, &palette);
+
+    uint16_t all = palette.count < LED_CODEC_MAX_COLORS 
+        ? palette.count : LED_CODEC_MAX_COLORS;
+    uint16_t sizes[] = { 0, all < 16 ? all : 16, all };
+
+    LedCodec codecs[SEGMENTS_PER_FRAME];
+    LedCodec best_codecs[SEGMENTS_PER_FRAME];
+    uint16_t best = UINT16_MAX;
+
+    for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (i > 0 && sizes[i] == sizes[i - 1]) continue;
+
+        uint16_t len = encode_with_palette(
+            led_buffer, segments, &palette, sizes[i], candidate, codecs);
+
+        if (len < best) {
+            best = len;
+            memcpy(out, candidate, len);
+            memcpy(best_codecs, codecs, sizeof(codecs));
+        }
+    }
+
+    if (codec_counts != NULL) {
+        for (uint8_t s = 0; s < SEGMENTS_PER_FRAME; s++) {
+            if (segments & (1U << s)) codec_counts[best_codecs[s]]++;
+        }
+    }
+
+    return best;
+}
+
+// Public functions ------------------------------------------------------------
+
+uint16_t led_encode_frame(
+    uint8_t const * led_buffer, uint8_t frame, uint8_t * out,
+    uint32_t * codec_counts) {
+
+    out[0] = frame;
+    return 1 + encode_segments(
+        led_buffer, (1U << SEGMENTS_PER_FRAME) - 1, out + 1, codec_counts);
+}
+
+uint16_t led_encode_delta(
+    uint8_t const * previous, uint8_t const * led_buffer, uint8_t frame, 
+    uint8_t * out, uint32_t * codec_counts) {
+
+    uint16_t changed = 0;
+
+    for (uint8_t s = 0; s < SEGMENTS_PER_FRAME; s++) {
+        if (previous == NULL || memcmp(
+            segment_pixels(previous, s), 
+            segment_pixels(led_buffer, s), 
+            LED_PIXEL_BYTES_PER_SEGMENT) != 0) {
+
+            changed |= 1U << s;
+        }
+    }
+
+    out[0] = frame;
+    out[1] = changed & 0xFF;
+    out[2] = changed >> 8;
+
+    return 3 + encode_segments(led_buffer, changed, out + 3, codec_counts);
+}
+
+uint16_t led_encode_message(
+    LedStreamType type, uint8_t const * payload, uint16_t len, uint8_t * out) {
+
+    out[0] = LED_STREAM_SYNC;
+    out[1] = type;
+    out[2] = len & 0xFF;
+    out[3] = len >> 8;
+
+    memcpy(out + LED_STREAM_HEADER_LEN, payload, len);
+    return LED_STREAM_HEADER_LEN + len;
+}
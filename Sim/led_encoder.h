@@ -0,0 +1,31 @@
+#ifndef __LED_ENCODER_H
+#define __LED_ENCODER_H
+
+#include "led_codec.h"
+#include "led_stream.h"
+
+// Host side reference encoder for led_codec.h. Builds a frame palette of the
+// most used colors, then picks whichever codec gives the fewest bytes for
+// each segment. A few palette sizes are tried and the smallest result kept.
+
+// Encodes a frame laid out as led_buffer into out, which must hold
+// LED_CODEC_MAX_FRAME_LEN bytes. The header byte of each segment is not
+// sent; the decoder rebuilds it from the segment's position and frame.
+// codec_counts, if not NULL, gets the codec of every segment counted in.
+uint16_t led_encode_frame(
+    uint8_t const * led_buffer, uint8_t frame, uint8_t * out,
+    uint32_t * codec_counts);
+
+// Encodes only the segments whose LEDs differ from previous as a delta frame
+// into out, which must hold LED_CODEC_MAX_DELTA_LEN bytes. With previous
+// NULL, every segment is sent.
+uint16_t led_encode_delta(
+    uint8_t const * previous, uint8_t const * led_buffer, uint8_t frame, 
+    uint8_t * out, uint32_t * codec_counts);
+
+// Wraps a payload in a led_stream message, as sent on the vendor interface.
+// out must hold LED_STREAM_HEADER_LEN + len bytes.
+uint16_t led_encode_message(
+    LedStreamType type, uint8_t const * payload, uint16_t len, uint8_t * out);
+
+#endif
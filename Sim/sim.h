@@ -0,0 +1,114 @@
+#ifndef __SIM_H
+#define __SIM_H
+
+#include "stm32f3xx.h"
+#include "uart.h"
+
+// Host simulation of the board's UARTs and the panels attached to them.
+//
+// Time only passes when the simulation is told to: sim_run_cpu charges the
+// firmware for work it did, and sim_wait_for_interrupt (also reached through
+// __WFI) skips ahead to whatever happens next. Interrupts - UART transfers
+// completing and SysTick - run at those points, at their simulated time.
+
+typedef struct {
+    // Whether there's a panel on this connector at all
+    uint8_t connected;
+
+    // Whether the panel answers Command_Negotiate_Framing
+    uint8_t supports_framing;
+
+    // Time between the last byte of a request arriving and the first byte
+    // of the answer going out, in cycles
+    uint32_t turnaround_cycles;
+
+    // Chance of a byte getting lost on the wire, either way, per million
+    uint32_t drop_ppm;
+
+    // When the panel raises its CK line to say it's ready, in cycles. It
+    // doesn't hear anything before.
+    uint64_t ready_at;
+
+    // When the panel resets, and for how long, in cycles: its CK line is low
+    // and it doesn't hear anything meanwhile. 0 for it never to reset. With
+    // a reset_period, it resets again every reset_period cycles.
+    uint64_t reset_at;
+    uint64_t reset_cycles;
+    uint64_t reset_period;
+} SimPanelConfig;
+
+typedef struct {
+    SimPanelConfig panels[COMPORT_ID_MAX + 1];
+
+    // Seed for the byte drop generator, for repeatable runs
+    uint32_t seed;
+} SimConfig;
+
+typedef struct {
+    // Bytes that never arrived, in either direction
+    uint32_t bytes_dropped;
+
+    // Bytes that arrived at a UART with no receive in progress, or at a
+    // connector USART2 wasn't switched to
+    uint32_t bytes_unexpected;
+
+    // Number of times USART2 sent on a different connector than last time
+    uint32_t usart2_switches;
+} SimStats;
+
+typedef struct {
+    uint32_t sensor_requests;
+    uint32_t led_segments;
+    uint32_t commits;
+
+    // Transfers that didn't make sense to the panel and were ignored
+    uint32_t garbled;
+
+    // Firmware chunks the panel took, and whether it got a whole image that
+    // matched its CRC
+    uint32_t program_chunks;
+    uint8_t programmed;
+} SimPanelStats;
+
+extern SimStats sim_stats;
+extern SimPanelStats sim_panel_stats[COMPORT_ID_MAX + 1];
+
+// Sets up simulated peripherals and panels. Call before uart_init.
+void sim_init(SimConfig *);
+
+// Cycles since the start of the simulation
+uint64_t sim_now();
+
+// Runs the simulated CPU for the given number of cycles
+void sim_run_cpu(uint32_t cycles);
+
+// Skips ahead to the next interrupt and runs it
+void sim_wait_for_interrupt();
+
+// Calls the given function (from "interrupt" context) once the simulation
+// reaches the given time. There's one timer; setting it again replaces it.
+void sim_set_timer(uint64_t at, void (* callback)(void));
+
+// Implemented by the application, run every millisecond like on the board
+void SysTick_Handler(void);
+
+// Panel side (sim_panel.c) ---------------------------------------------------
+
+void sim_panels_init(SimConfig *);
+
+// The panel on the given connector reset, forgetting what it was in the
+// middle of
+void sim_panel_reset(ComportId);
+
+// A transfer from the board has finished arriving at the given connector
+void sim_panel_receive(ComportId, uint8_t * data, uint16_t len);
+
+// LED segments of the panel on the given connector, in order: those it
+// received last, or with shown set, those it showed at its last commit
+uint8_t const * sim_panel_leds(ComportId, uint8_t shown);
+
+// Sends bytes from the panel on the given connector back to the board,
+// starting after its turnaround time (see sim_hal.c)
+void sim_panel_reply(ComportId, uint8_t * data, uint16_t len);
+
+#endif
@@ -0,0 +1,979 @@
+#include "sim.h"
+#include "config.h"
+#include "msgbus.h"
+#include "scheduler.h"
+#include "sensors.h"
+#include "latency.h"
+#include "leds.h"
+#include "led_stream.h"
+#include "effects.h"
+#include "steps.h"
+#include "panel_program.h"
+#include "discovery.h"
+#include "crc.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "getopt.h"
+
+// Runs the firmware's message bus against simulated panels and reports
+// how much gets through. The event handlers mirror run() in main.c, with
+// USB replaced by a host that sends LED packets at a fixed rate, or as fast
+// as the bus takes them. With --bulk, the host sends whole frames the way it
+// would on the vendor interface, through led_stream. With --changes, only some
+// segments change from one frame to the next, which --bulk sends as delta
+// frames. With --effect, the host sends nothing and the board renders an
+// LED effect by itself. With --usb-polled, sensor reports go out once a
+// millisecond, as the host polls the HID endpoint, and --batched has them
+// carry every sample since the last one. With --program-kb, the board
+// programs the panels with a firmware image of that size instead, all at
+// once, or one after the other with --program-serial. --slow-panel-ms has
+// the last panel take that long to be ready, and --reset-panel-ms has the
+// first reset every so often, to see the others carry on regardless and it
+// come back each time. --record-trace writes every event posted to a file,
+// for Sim/bench_scheduler.c to replay. Unless bytes are dropped, a run ends
+// by checking the panels got the last LED data, failing if they didn't.
+
+#define PANEL_COUNT (COMPORT_ID_MAX + 1)
+#define PACKETS_PER_FRAME SEGMENTS_PER_FRAME
+
+// With packets sent as fast as the bus takes them, the host waits for a
+// panel's queue to drop below this before sending it the next one
+#define SATURATE_QUEUE_DEPTH (2U)
+
+// Largest panel image the board stores, FLASH_PANEL_IMAGE_MAX
+#define PROGRAM_IMAGE_MAX (30U * 1024U)
+
+// How long a panel that --reset-panel-ms resets takes to come back
+#define PANEL_RESET_MS (100U)
+
+// Time the bus gets to send what's left once the host stops sending LED data
+#define LED_DRAIN_MS (50U)
+
+extern PortState port_state_left;
+extern PortState port_state_down;
+extern PortState port_state_up;
+extern PortState port_state_right;
+extern uint32_t msgbus_dropped_responses;
+
+typedef struct {
+    double seconds;
+    uint32_t led_interval_us;
+    uint32_t cpu_cycles;
+    uint8_t panel_mask;
+    uint8_t bulk;
+    uint8_t changes;
+    uint8_t effect;
+    uint8_t usb_polled;
+    uint8_t batched;
+    uint32_t program_kb;
+    uint8_t program_serial;
+    uint32_t slow_panel_ms;
+    uint32_t reset_panel_ms;
+} BenchConfig;
+
+static const char * port_names[PANEL_COUNT] = { "left", "down", "up", "right" };
+
+static const char * event_names[EVENT_TYPE_COUNT] = {
+    "msgbus", "response", "usb", "sensor report",
+    "led packet", "sensor poll", "tick", "flash write"
+};
+
+static BenchConfig bench;
+
+// Set once the host has stopped sending LED data, see check_leds
+static uint8_t leds_stopped = false;
+
+// Where --record-trace writes posts to, if given
+static FILE * trace_file = NULL;
+
+// The sim is linked with scheduler_post wrapped, so every post made outside
+// scheduler.c comes through here first
+void __real_scheduler_post(EventType);
+
+void __wrap_scheduler_post(EventType event) {
+    if (trace_file != NULL) {
+        fprintf(trace_file, "%llu %u\n", (unsigned long long)sim_now(), event);
+    }
+
+    __real_scheduler_post(event);
+}
+static PortState * port_states[PANEL_COUNT];
+
+static uint8_t host_buffer[LED_ARRAY_SIZE];
+static uint8_t stream_buffer[LED_ARRAY_SIZE];
+static uint8_t led_packet[BYTES_PER_SEGMENT];
+static uint8_t led_message[LED_STREAM_HEADER_LEN + LED_STREAM_MAX_PAYLOAD];
+static uint16_t led_message_len = 0;
+static uint8_t led_packet_pending = false;
+static uint8_t next_packet = 0;
+static uint8_t frame = 0;
+static uint32_t usb_overruns = 0;
+static uint32_t frames_handled = 0;
+
+static uint32_t sensor_polls[PANEL_COUNT];
+static uint32_t sensor_reports = 0;
+static uint32_t gamepad_reports = 0;
+
+// Requests --------------------------------------------------------------------
+
+static void send_request_sensors() {
+    Request req = request_create(Command_Request_Sensors);
+    req.response_len = SENSOR_RESPONSE_LEN;
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        req.comport_id = (ComportId)i;
+        req.response_data = sensors_receive_target((ComportId)i);
+        msgbus_send_request(req);
+    }
+}
+
+// Host side of LED packets ----------------------------------------------------
+
+static inline uint8_t panel_in_use(uint8_t panel) {
+    return bench.panel_mask & (1U << panel);
+}
+
+// Segments that change in the given frame: bench.changes of them, moving on
+// round-robin from one frame to the next
+static uint16_t changed_segments(uint8_t frame) {
+    uint16_t changed = 0;
+
+    for (uint8_t i = 0; i < bench.changes; i++) {
+        changed |= 1U << ((frame * bench.changes + i) % SEGMENTS_PER_FRAME);
+    }
+
+    return changed;
+}
+
+// Brings host_buffer up to date for the given frame
+static void update_host_buffer(uint8_t frame) {
+    uint16_t changed = changed_segments(frame);
+
+    for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+        uint8_t * segment = host_buffer + i * BYTES_PER_SEGMENT;
+
+        segment[0] = ((i / SEGMENTS_PER_PANEL) << 6)
+            | ((i % SEGMENTS_PER_PANEL) << 4)
+            | (frame & 0x0F);
+
+        if (changed & (1U << i)) {
+            memset(segment + 1, frame, BYTES_PER_SEGMENT - 1);
+        }
+    }
+}
+
+// Makes the next packet of the frame, skipping panels that aren't there
+static void make_next_packet() {
+    while (!panel_in_use(next_packet / SEGMENTS_PER_PANEL)) {
+        next_packet = (next_packet + 1) % PACKETS_PER_FRAME;
+    }
+
+    memcpy(
+        led_packet, 
+        host_buffer + next_packet * BYTES_PER_SEGMENT, 
+        BYTES_PER_SEGMENT
+    );
+
+    next_packet = (next_packet + 1) % PACKETS_PER_FRAME;
+
+    if (next_packet == 0) {
+        frame++;
+        update_host_buffer(frame);
+    }
+}
+
+// Makes a vendor interface message holding the next frame; a raw frame if
+// everything changes, otherwise a delta frame with its segments sent raw
+static void make_next_message() {
+    uint8_t * payload = led_message + LED_STREAM_HEADER_LEN;
+    uint16_t len;
+
+    update_host_buffer(frame);
+
+    if (bench.changes == SEGMENTS_PER_FRAME) {
+        led_message[1] = LedStream_Raw_Frame;
+        memcpy(payload, host_buffer, LED_ARRAY_SIZE);
+        len = LED_ARRAY_SIZE;
+    } else {
+        uint16_t changed = changed_segments(frame);
+
+        led_message[1] = LedStream_Delta_Frame;
+        payload[0] = frame;
+        payload[1] = changed & 0xFF;
+        payload[2] = changed >> 8;
+        payload[3] = 0;
+        len = 4;
+
+        for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+            if (!(changed & (1U << i))) continue;
+
+            payload[len++] = LedCodec_Raw;
+            memcpy(
+                payload + len, 
+                host_buffer + i * BYTES_PER_SEGMENT + 1, 
+                LED_PIXEL_BYTES_PER_SEGMENT
+            );
+            len += LED_PIXEL_BYTES_PER_SEGMENT;
+        }
+    }
+
+    led_message[0] = LED_STREAM_SYNC;
+    led_message[2] = len & 0xFF;
+    led_message[3] = len >> 8;
+    led_message_len = LED_STREAM_HEADER_LEN + len;
+    frame++;
+}
+
+static void deliver_led_packet() {
+    if (led_packet_pending) usb_overruns++;
+
+    if (bench.bulk) {
+        make_next_message();
+    } else {
+        make_next_packet();
+    }
+
+    led_packet_pending = true;
+    scheduler_post(Event_LED_Packet);
+}
+
+static void on_led_timer() {
+    if (leds_stopped) return;
+
+    deliver_led_packet();
+    sim_set_timer(
+        sim_now() + (uint64_t)bench.led_interval_us * (SystemCoreClock / 1000000U),
+        on_led_timer
+    );
+}
+
+// Without a fixed rate, a packet goes out whenever its panel has room
+static void feed_led_packets() {
+    if (bench.led_interval_us != 0 || led_packet_pending) return;
+
+    // Offline panels take nothing, so they can't hold the host back. With
+    // none online it waits, or it would flood the board faster than any bus
+    // and starve the ticks that bring panels online.
+    // A whole frame goes out once every online panel has room.
+    if (bench.bulk) {
+        uint8_t any_online = false;
+
+        for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+            if (!panel_in_use(i) || !panel_connected((ComportId)i)) continue;
+            if (port_states[i]->req_queue.count >= SATURATE_QUEUE_DEPTH) return;
+            any_online = true;
+        }
+
+        if (any_online) deliver_led_packet();
+        return;
+    }
+
+    uint8_t packet = next_packet;
+
+    while (!panel_in_use(packet / SEGMENTS_PER_PANEL)) {
+        packet = (packet + 1) % PACKETS_PER_FRAME;
+    }
+
+    PortState * port_state = port_states[packet / SEGMENTS_PER_PANEL];
+
+    if (panel_connected(port_state->comport_id)
+        && port_state->req_queue.count < SATURATE_QUEUE_DEPTH) {
+        deliver_led_packet();
+    }
+}
+
+// Same as process_led_data in main.c
+static void process_led_packet() {
+    static uint16_t segments_received = 0x0000;
+    static uint8_t previous_frame = 0xFF;
+
+    if (!led_packet_pending) return;
+    led_packet_pending = false;
+
+    uint8_t header = led_packet[0];
+    uint8_t panel = (header >> 6) & 0x03;
+    uint8_t segment = (header >> 4) & 0x03;
+    uint8_t packet_frame = header & 0x0F;
+
+    if (packet_frame != previous_frame) segments_received = 0x0000;
+
+    previous_frame = packet_frame;
+    segments_received |= 1 << (panel * SEGMENTS_PER_PANEL + segment);
+
+    leds_write_segment(panel * SEGMENTS_PER_PANEL + segment, led_packet);
+    leds_send_dirty();
+
+    uint16_t complete = 0;
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        if (panel_in_use(i)) complete |= 0x0F << (i * SEGMENTS_PER_PANEL);
+    }
+
+    if (segments_received == complete) {
+        segments_received = 0x0000;
+        frames_handled++;
+        leds_commit();
+    }
+}
+
+// Same as process_led_frame in main.c
+static void process_led_frame(uint16_t segments) {
+    for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+        if (!(segments & (1U << i))) continue;
+
+        leds_write_segment(i, stream_buffer + i * BYTES_PER_SEGMENT);
+    }
+
+    frames_handled++;
+    leds_send_dirty();
+    leds_commit();
+}
+
+// Event handlers, as in main.c ------------------------------------------------
+
+static void on_msgbus() {
+    msgbus_process_flags();
+    scheduler_post(Event_Sensor_Poll);
+}
+
+static void on_response() {
+    msgbus_dispatch_responses();
+}
+
+static void on_sensors_response(Response * resp) {
+    sensors_process_response(resp);
+    sensor_polls[resp->comport_id]++;
+    steps_process(resp->comport_id, resp->data);
+    if (!bench.usb_polled) scheduler_post(Event_Sensor_Report);
+}
+
+static void on_sensor_report() {
+    static uint8_t sent_buttons = 0;
+
+    if (steps_buttons() != sent_buttons) {
+        sent_buttons = steps_buttons();
+        gamepad_reports++;
+    }
+
+    if (!sensors_have_new()) return;
+
+    sensors_build_report();
+    sensor_reports++;
+}
+
+static void on_led_packet() {
+    if (!bench.bulk) {
+        process_led_packet();
+        return;
+    }
+
+    if (!led_packet_pending) return;
+    led_packet_pending = false;
+
+    led_stream_feed(led_message, led_message_len);
+}
+
+static void on_sensor_poll() {
+    send_request_sensors();
+}
+
+static void on_tick() {
+    on_msgbus();
+    effects_tick(HAL_GetTick());
+    discovery_tick(HAL_GetTick());
+    panel_program_tick(HAL_GetTick());
+}
+
+static void on_panel_change(ComportId port, uint8_t online) {
+    if (online) {
+        leds_mark_panel_dirty(port);
+    } else if (steps_release_panel(port)) {
+        scheduler_post(Event_Sensor_Report);
+    }
+}
+
+void SysTick_Handler(void) {
+    HAL_IncTick();
+    scheduler_post(Event_Tick);
+    if (bench.usb_polled) scheduler_post(Event_Sensor_Report);
+}
+
+// Reporting -------------------------------------------------------------------
+
+static inline double cycles_to_us(uint64_t cycles) {
+    return (double)cycles / (SystemCoreClock / 1000000U);
+}
+
+// Upper bound, in cycles, of the bucket holding the given fraction of samples
+static uint32_t percentile(LatencyHistogram * histogram, double fraction) {
+    uint64_t wanted = (uint64_t)(histogram->samples * fraction + 0.5);
+    uint64_t seen = 0;
+
+    for (uint8_t i = 0; i < LATENCY_BUCKET_COUNT - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen < wanted) continue;
+
+        uint32_t bound = 1U << (LATENCY_BUCKET_SHIFT + 1 + i);
+        return bound < histogram->max_cycles ? bound : histogram->max_cycles;
+    }
+
+    return histogram->max_cycles;
+}
+
+static void print_latency(const char * name, LatencyCommand command) {
+    LatencyHistogram total = { 0 };
+
+    for (uint8_t port = 0; port < PANEL_COUNT; port++) {
+        LatencyHistogram * histogram =
+            &latency_histograms[port][command][Latency_Total];
+
+        total.samples += histogram->samples;
+
+        for (uint8_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+            total.buckets[i] += histogram->buckets[i];
+        }
+
+        if (histogram->max_cycles > total.max_cycles) {
+            total.max_cycles = histogram->max_cycles;
+        }
+    }
+
+    if (total.samples == 0) return;
+
+    printf(
+        "  %-12s %9u %9.1f %9.1f %9.1f\n",
+        name,
+        total.samples,
+        cycles_to_us(percentile(&total, 0.5)),
+        cycles_to_us(percentile(&total, 0.99)),
+        cycles_to_us(total.max_cycles)
+    );
+}
+
+static void print_report(double seconds) {
+    uint32_t frames = UINT32_MAX;
+    uint32_t total_polls = 0;
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        if (!panel_in_use(i)) continue;
+        if (sim_panel_stats[i].commits < frames) frames = sim_panel_stats[i].commits;
+        total_polls += sensor_polls[i];
+    }
+
+    if (frames == UINT32_MAX) frames = 0;
+
+    // Panels that didn't change aren't committed, so count what the board
+    // took in instead
+    if (bench.changes != SEGMENTS_PER_FRAME) frames = frames_handled;
+    if (bench.effect != Effect_None) frames = effects_stats.frames;
+
+    printf(
+        "%.1f s simulated, framing %s, msgbus %s, USART2 mux %s\n\n",
+        seconds,
+        MSGBUS_FAST_FRAMING ? "on" : "off",
+        MSGBUS_ISR_DRIVEN ? "ISR-driven" : "flag-driven",
+        UART_FAST_MUX ? "fast" : "reinit"
+    );
+
+    if (bench.effect != Effect_None) {
+        printf(
+            "LED frames/s       %9.1f  (effect %u every %u ms, %u missed)\n",
+            frames / seconds,
+            bench.effect,
+            LED_EFFECT_INTERVAL_MS,
+            effects_stats.frames_missed
+        );
+    } else if (bench.led_interval_us == 0) {
+        printf(
+            "LED frames/s       %9.1f  (%s as fast as the bus takes them)\n",
+            frames / seconds,
+            bench.bulk ? "frames" : "packets"
+        );
+    } else {
+        printf(
+            "LED frames/s       %9.1f  (a %s every %u us, %u overrun)\n",
+            frames / seconds,
+            bench.bulk ? "frame" : "packet",
+            bench.led_interval_us,
+            usb_overruns
+        );
+    }
+
+    printf("Sensor polls/s     %9.1f  (", total_polls / seconds);
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        if (!panel_in_use(i)) continue;
+        printf(" %s %.1f", port_names[i], sensor_polls[i] / seconds);
+    }
+
+    printf(" )\n");
+    printf("Sensor reports/s   %9.1f\n", sensor_reports / seconds);
+    printf(
+        "Sensor samples/s   %9.1f  (%u as deltas, %u never reported)\n",
+        sensor_report_stats.samples / seconds,
+        sensor_report_stats.delta_samples,
+        sensor_report_stats.samples_dropped
+    );
+    printf("Gamepad reports/s  %9.1f\n", gamepad_reports / seconds);
+    printf(
+        "LED segments       %9u sent, %u unchanged\n",
+        leds_stats.segments_sent,
+        leds_stats.segments_skipped
+    );
+    printf(
+        "LED commits        %9u sent, %u skipped\n\n",
+        leds_stats.commits_sent,
+        leds_stats.commits_skipped
+    );
+
+    printf("Request latency, us (send to done; p50/p99 are bucket upper bounds)\n");
+    printf("  %-12s %9s %9s %9s %9s\n", "command", "samples", "p50", "p99", "max");
+    print_latency("sensors", Latency_Command_Sensors);
+    print_latency("led segment", Latency_Command_LED_Segment);
+    print_latency("commit", Latency_Command_Commit_LEDs);
+    print_latency("other", Latency_Command_Other);
+
+    printf("\nPorts (online at: when the port last came online)\n");
+    printf(
+        "  %-6s %9s %9s %9s %12s %12s %9s\n",
+        "port", "done", "timeouts", "garbled", "max turn us", "online at ms", "offline"
+    );
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        DiscoveryPort * discovery = &discovery_ports[i];
+
+        printf(
+            "  %-6s %9u %9u %9u %12.1f ",
+            port_names[i],
+            port_states[i]->completed_count,
+            port_states[i]->timeout_count,
+            sim_panel_stats[i].garbled,
+            cycles_to_us(port_states[i]->max_turnaround)
+        );
+
+        if (discovery->onlines == 0) {
+            printf("%12s ", "-");
+        } else {
+            printf("%12u ", discovery->online_at);
+        }
+
+        printf("%9u\n", discovery->lost_ready + discovery->timed_out);
+    }
+
+    printf(
+        "  USART2 switches %u, dropped responses %u, bytes dropped %u, unexpected %u\n",
+        sim_stats.usart2_switches,
+        msgbus_dropped_responses,
+        sim_stats.bytes_dropped,
+        sim_stats.bytes_unexpected
+    );
+
+    printf("\nScheduler\n");
+    printf("  %-14s %10s %10s %14s\n", "event", "dispatched", "coalesced", "max latency us");
+
+    for (uint8_t i = 0; i < EVENT_TYPE_COUNT; i++) {
+        printf(
+            "  %-14s %10u %10u %14.1f\n",
+            event_names[i],
+            scheduler_stats[i].dispatched,
+            scheduler_stats[i].coalesced,
+            cycles_to_us(scheduler_stats[i].max_latency)
+        );
+    }
+}
+
+// Checks the panel --reset-panel-ms resets came back online after every reset
+// that was over by the end, with a tick to spare
+static int check_resets(uint8_t panel) {
+    uint32_t end_ms = HAL_GetTick();
+    uint32_t resets = 0;
+
+    for (uint32_t at = bench.reset_panel_ms; at + PANEL_RESET_MS + 1 < end_ms; at += bench.reset_panel_ms) {
+        resets++;
+    }
+
+    uint32_t onlines = discovery_ports[panel].onlines;
+
+    printf(
+        "\nThe %s panel reset %u times and came online %u times\n",
+        port_names[panel],
+        resets,
+        onlines
+    );
+
+    return onlines < resets + 1;
+}
+
+// Stops the host sending LED data and gives the bus time to catch up, then
+// checks every panel has the board's last LED data, and shows it if each
+// frame was committed (--bulk). Segments change while they're on the wire
+// when LED data comes in faster than the bus takes it, so this checks none
+// of those changes get lost.
+static int check_leds() {
+    uint64_t end = sim_now() + (uint64_t)LED_DRAIN_MS * (SystemCoreClock / 1000U);
+    uint32_t stopped_ms = HAL_GetTick();
+    int failed = 0;
+
+    leds_stopped = true;
+
+    while (sim_now() < end) {
+        if (scheduler_dispatch()) {
+            sim_run_cpu(bench.cpu_cycles);
+        } else {
+            sim_wait_for_interrupt();
+        }
+    }
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        // A panel that came back while draining may not have it all yet
+        if (!panel_in_use(i) || !panel_connected((ComportId)i)) continue;
+        if (discovery_ports[i].online_at >= stopped_ms) continue;
+
+        uint8_t const * leds = leds_buffer() + i * BYTES_PER_PANEL;
+
+        if (memcmp(sim_panel_leds((ComportId)i, false), leds, BYTES_PER_PANEL) != 0
+            || (bench.bulk
+                && memcmp(sim_panel_leds((ComportId)i, true), leds, BYTES_PER_PANEL) != 0)) {
+
+            printf("\nThe %s panel doesn't have the last LED data\n", port_names[i]);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+// Panel programming -----------------------------------------------------------
+
+static const char * program_state_names[] = {
+    "idle", "beginning", "sending", "finishing", "done", "failed"
+};
+
+// Runs the event loop until the panels in use are online and have negotiated
+// framing, or time is up
+static void wait_for_panels(uint64_t end) {
+    for (uint8_t i = 0; i < PANEL_COUNT && sim_now() < end; i++) {
+        if (!panel_in_use(i)) continue;
+
+        while ((discovery_ports[i].state != Discovery_Online
+                || msgbus_port_status((ComportId)i) != Status_Idle)
+            && sim_now() < end) {
+
+            if (scheduler_dispatch()) {
+                sim_run_cpu(bench.cpu_cycles);
+            } else {
+                sim_wait_for_interrupt();
+            }
+        }
+    }
+}
+
+// Runs the event loop until programming is done or time is up
+static void run_programming(uint64_t end) {
+    while (panel_program_active() && sim_now() < end) {
+        if (scheduler_dispatch()) {
+            sim_run_cpu(bench.cpu_cycles);
+        } else {
+            sim_wait_for_interrupt();
+        }
+    }
+}
+
+static int program_panels() {
+    static uint8_t image[PROGRAM_IMAGE_MAX];
+    uint32_t len = bench.program_kb * 1024U;
+    uint64_t end = (uint64_t)(bench.seconds * SystemCoreClock);
+    double panel_seconds[PANEL_COUNT] = { 0 };
+
+    if (len > sizeof(image)) {
+        fprintf(stderr, "sim: images can be %u KB at most\n", (uint32_t)sizeof(image) / 1024U);
+        return 2;
+    }
+
+    for (uint32_t i = 0; i < len; i++) image[i] = rand();
+    uint32_t crc = crc32(image, len);
+
+    wait_for_panels(end);
+
+    if (bench.program_serial) {
+        for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+            if (!panel_in_use(i)) continue;
+
+            uint64_t started = sim_now();
+            panel_program_start(image, len, crc, 1U << i);
+            run_programming(end);
+            panel_seconds[i] = (double)(sim_now() - started) / SystemCoreClock;
+        }
+    } else {
+        panel_program_start(image, len, crc, bench.panel_mask);
+        run_programming(end);
+
+        for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+            if (panel_in_use(i)) panel_seconds[i] = (double)sim_now() / SystemCoreClock;
+        }
+    }
+
+    double seconds = (double)sim_now() / SystemCoreClock;
+
+    printf(
+        "Programmed a %u KB image %s in %.2f s, framing %s\n\n",
+        bench.program_kb,
+        bench.program_serial ? "one panel after the other" : "into all panels at once",
+        seconds,
+        MSGBUS_FAST_FRAMING ? "on" : "off"
+    );
+
+    printf(
+        "  %-6s %9s %9s %9s %9s %9s %9s %9s\n",
+        "port", "state", "seconds", "chunks", "resent", "stalls", "restarts", "timeouts"
+    );
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        if (!panel_in_use(i)) continue;
+
+        PanelProgramProgress * progress = &panel_program_progress[i];
+
+        printf(
+            "  %-6s %9s %9.2f %9u %9u %9u %9u %9u\n",
+            port_names[i],
+            sim_panel_stats[i].programmed ? "done" : program_state_names[progress->state],
+            panel_seconds[i],
+            sim_panel_stats[i].program_chunks,
+            progress->resent,
+            progress->stalls,
+            progress->restarts,
+            port_states[i]->timeout_count
+        );
+    }
+
+    printf(
+        "  USART2 switches %u, bytes dropped %u\n",
+        sim_stats.usart2_switches,
+        sim_stats.bytes_dropped
+    );
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        if (panel_in_use(i) && !sim_panel_stats[i].programmed) return 1;
+    }
+
+    return 0;
+}
+
+// Setup -----------------------------------------------------------------------
+
+static void usage(const char * name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --seconds S          simulated time to run for (10)\n"
+        "  --led-interval-us N  time between LED packets, 0 for as fast as\n"
+        "                       the bus takes them (1000, as USB full speed)\n"
+        "  --turnaround-us N    panel time from request to answer (20)\n"
+        "  --drop-ppm N         bytes lost on the wire per million (0)\n"
+        "  --panels MASK        connected panels, bit per port: left, down,\n"
+        "                       up, right (0xF)\n"
+        "  --no-framing         panels don't support framed requests\n"
+        "  --cpu-cycles N       cycles each event handler is charged (500)\n"
+        "  --seed N             seed for dropping bytes (1)\n"
+        "  --bulk               send whole frames as on the vendor interface,\n"
+        "                       --led-interval-us is then time between frames\n"
+        "  --changes N          segments that change each frame, 1 to 16 (16)\n"
+        "  --effect N           no LED data from the host, the board renders\n"
+        "                       effect N instead (see EffectType)\n"
+        "  --usb-polled         send sensor reports once a millisecond, as\n"
+        "                       the host polls, not for every sample\n"
+        "  --batched            use the batched sensor report format\n"
+        "  --program-kb N       program the panels with an N KB firmware image\n"
+        "                       instead, as far as --seconds allows\n"
+        "  --program-serial     program them one after the other\n"
+        "  --slow-panel-ms N    the last panel takes N ms to be ready (0)\n"
+        "  --reset-panel-ms N   the first panel resets every N ms, for %u ms\n"
+        "  --record-trace FILE  write the events posted to FILE, a line each:\n"
+        "                       \"<cycle> <event>\"\n",
+        name,
+        PANEL_RESET_MS
+    );
+}
+
+int main(int argc, char ** argv) {
+    static const struct option options[] = {
+        { "seconds", required_argument, NULL, 's' },
+        { "led-interval-us", required_argument, NULL, 'l' },
+        { "turnaround-us", required_argument, NULL, 't' },
+        { "drop-ppm", required_argument, NULL, 'd' },
+        { "panels", required_argument, NULL, 'p' },
+        { "no-framing", no_argument, NULL, 'n' },
+        { "cpu-cycles", required_argument, NULL, 'c' },
+        { "seed", required_argument, NULL, 'r' },
+        { "bulk", no_argument, NULL, 'b' },
+        { "changes", required_argument, NULL, 'g' },
+        { "effect", required_argument, NULL, 'e' },
+        { "usb-polled", no_argument, NULL, 'u' },
+        { "batched", no_argument, NULL, 'm' },
+        { "program-kb", required_argument, NULL, 'k' },
+        { "program-serial", no_argument, NULL, 'a' },
+        { "slow-panel-ms", required_argument, NULL, 'w' },
+        { "reset-panel-ms", required_argument, NULL, 'x' },
+        { "record-trace", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    SimConfig sim = { 0 };
+    uint32_t turnaround_us = 20;
+    uint32_t drop_ppm = 0;
+    uint8_t framing = true;
+
+    bench.seconds = 10.0;
+    bench.led_interval_us = 1000;
+    bench.cpu_cycles = 500;
+    bench.panel_mask = 0x0F;
+    bench.changes = SEGMENTS_PER_FRAME;
+    sim.seed = 1;
+
+    int option;
+
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 's': bench.seconds = strtod(optarg, NULL); break;
+            case 'l': bench.led_interval_us = strtoul(optarg, NULL, 0); break;
+            case 't': turnaround_us = strtoul(optarg, NULL, 0); break;
+            case 'd': drop_ppm = strtoul(optarg, NULL, 0); break;
+            case 'p': bench.panel_mask = strtoul(optarg, NULL, 0) & 0x0F; break;
+            case 'n': framing = false; break;
+            case 'c': bench.cpu_cycles = strtoul(optarg, NULL, 0); break;
+            case 'r': sim.seed = strtoul(optarg, NULL, 0); break;
+            case 'b': bench.bulk = true; break;
+            case 'g': bench.changes = strtoul(optarg, NULL, 0); break;
+            case 'e': bench.effect = strtoul(optarg, NULL, 0); break;
+            case 'u': bench.usb_polled = true; break;
+            case 'm': bench.batched = true; break;
+            case 'k': bench.program_kb = strtoul(optarg, NULL, 0); break;
+            case 'a': bench.program_serial = true; break;
+            case 'w': bench.slow_panel_ms = strtoul(optarg, NULL, 0); break;
+            case 'x': bench.reset_panel_ms = strtoul(optarg, NULL, 0); break;
+            case 'o':
+                trace_file = fopen(optarg, "w");
+
+                if (trace_file == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+
+                break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    if (bench.changes < 1 || bench.changes > SEGMENTS_PER_FRAME
+        || bench.effect >= EFFECT_TYPE_COUNT
+        || (bench.reset_panel_ms != 0 && bench.reset_panel_ms <= PANEL_RESET_MS)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    uint32_t cycles_per_ms = SystemCoreClock / 1000U;
+    int8_t first_panel = -1;
+    int8_t last_panel = -1;
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        sim.panels[i].connected = panel_in_use(i);
+        sim.panels[i].supports_framing = framing;
+        sim.panels[i].turnaround_cycles = turnaround_us * (SystemCoreClock / 1000000U);
+        sim.panels[i].drop_ppm = drop_ppm;
+
+        if (!panel_in_use(i)) continue;
+        if (first_panel < 0) first_panel = i;
+        last_panel = i;
+    }
+
+    if (last_panel >= 0) {
+        sim.panels[last_panel].ready_at = (uint64_t)bench.slow_panel_ms * cycles_per_ms;
+    }
+
+    if (first_panel >= 0 && bench.reset_panel_ms != 0) {
+        sim.panels[first_panel].reset_at = (uint64_t)bench.reset_panel_ms * cycles_per_ms;
+        sim.panels[first_panel].reset_cycles = (uint64_t)PANEL_RESET_MS * cycles_per_ms;
+        sim.panels[first_panel].reset_period = (uint64_t)bench.reset_panel_ms * cycles_per_ms;
+    }
+
+    port_states[Comport_Left] = &port_state_left;
+    port_states[Comport_Down] = &port_state_down;
+    port_states[Comport_Up] = &port_state_up;
+    port_states[Comport_Right] = &port_state_right;
+
+    sim_init(&sim);
+    scheduler_init();
+    uart_init();
+    msgbus_init();
+
+    // Looking on every connector, as the firmware does by default
+    discovery_init(0x0F);
+    discovery_set_change_handler(on_panel_change);
+
+    panel_program_init();
+    sensors_init();
+    steps_init();
+    leds_init();
+
+    if (bench.batched) {
+        // As the host would select it, through a feature report
+        uint8_t command[] = { SENSOR_OP_SET_FORMAT, SensorFormat_Batched };
+        sensors_process_command(command, sizeof(command));
+    }
+
+    led_stream_init(stream_buffer, process_led_frame);
+    update_host_buffer(frame);
+    effects_init();
+
+    scheduler_set_handler(Event_MsgBus, on_msgbus);
+    scheduler_set_handler(Event_Response, on_response);
+    scheduler_set_handler(Event_Sensor_Report, on_sensor_report);
+    scheduler_set_handler(Event_LED_Packet, on_led_packet);
+    scheduler_set_handler(Event_Sensor_Poll, on_sensor_poll);
+    scheduler_set_handler(Event_Tick, on_tick);
+
+    msgbus_set_response_handler(Command_Request_Sensors, on_sensors_response);
+
+    send_request_sensors();
+
+    if (bench.program_kb != 0) return program_panels();
+
+    if (bench.effect != Effect_None) {
+        // Full saturation and half lightness, the hue going once around
+        // each panel, one cycle a second
+        uint8_t params[EFFECT_PARAMS_LEN] = {
+            bench.effect, 0, 0, 100, 50, 360 & 0xFF, 360 >> 8, 1000 & 0xFF, 1000 >> 8
+        };
+
+        effects_start(params, sizeof(params));
+    } else if (bench.led_interval_us != 0) {
+        sim_set_timer(
+            sim_now() + (uint64_t)bench.led_interval_us * (SystemCoreClock / 1000000U),
+            on_led_timer
+        );
+    }
+
+    uint64_t end = (uint64_t)(bench.seconds * SystemCoreClock);
+
+    while (sim_now() < end) {
+        if (bench.effect == Effect_None) feed_led_packets();
+
+        if (scheduler_dispatch()) {
+            sim_run_cpu(bench.cpu_cycles);
+        } else {
+            sim_wait_for_interrupt();
+        }
+    }
+
+    print_report((double)sim_now() / SystemCoreClock);
+
+    // Lost bytes aren't sent again, so panels may be left with the wrong data
+    int failed = 0;
+
+    if (bench.effect == Effect_None && drop_ppm == 0) failed |= check_leds();
+    if (bench.reset_panel_ms != 0) failed |= check_resets(first_panel);
+
+    return failed;
+}
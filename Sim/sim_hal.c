@@ -0,0 +1,521 @@
+#include "sim.h"
+#include "error_handler.h"
+#include "request.h"
+#include "config.h"
+#include "crc.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Longest transfer the board ever makes, a framed LED segment
+#define SIM_TRANSFER_MAX (128U)
+
+// Bytes on their way from a panel to the board, per connector
+#define SIM_INBOUND_MAX (256U)
+
+// 2-bit GPIOx->MODER field value for alternate function
+#define MODER_AF (0x02U)
+
+// request.h and config.h use C99 inline functions, which need an external
+// definition in one translation unit for calls the compiler doesn't inline
+extern inline Request request_create(Commands);
+extern inline uint8_t request_equals(Request, Request);
+extern inline uint8_t request_has_data(Request *);
+extern inline uint8_t request_expects_response(Request *);
+extern inline uint8_t panel_connected(ComportId);
+
+typedef struct {
+    UART_HandleTypeDef * huart;
+
+    // Cycles it takes to send one byte at the configured baud rate
+    uint32_t byte_cycles;
+
+    uint8_t tx_active;
+    uint64_t tx_done_at;
+    ComportId tx_connector;
+    uint8_t tx_data[SIM_TRANSFER_MAX];
+    uint16_t tx_len;
+
+    uint8_t * rx_buffer;
+    uint16_t rx_len;
+    uint16_t rx_count;
+} SimUart;
+
+typedef struct {
+    uint64_t at;
+    uint8_t byte;
+} InboundByte;
+
+typedef struct {
+    InboundByte bytes[SIM_INBOUND_MAX];
+    uint16_t front;
+    uint16_t count;
+
+    // When the panel is done sending what it's already sending
+    uint64_t free_at;
+} Connector;
+
+DWT_Type sim_dwt;
+CoreDebug_Type sim_core_debug;
+uint32_t SystemCoreClock = 72000000U;
+uint32_t sim_primask = 0;
+
+GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+USART_TypeDef sim_usart1, sim_usart2, sim_usart3;
+
+SimStats sim_stats;
+
+static SimConfig config;
+static SimUart uarts[3];
+static Connector connectors[COMPORT_ID_MAX + 1];
+
+static uint64_t now = 0;
+static uint64_t next_tick_at = 0;
+static volatile uint32_t tick = 0;
+
+static uint64_t timer_at = 0;
+static void (* timer_callback)(void) = NULL;
+
+static uint32_t random_state = 1;
+
+static ComportId last_usart2_connector = Comport_None;
+
+// CK line of each connector, which its panel raises once it's ready
+static GPIO_TypeDef * const ready_gpio[COMPORT_ID_MAX + 1] = {
+    GPIOA, GPIOB, GPIOA, GPIOB
+};
+
+static const uint16_t ready_pin[COMPORT_ID_MAX + 1] = {
+    GPIO_PIN_8, GPIO_PIN_12, GPIO_PIN_4, GPIO_PIN_5
+};
+
+// Whether each panel was up at the last update_ready_lines
+static uint8_t panel_was_up[COMPORT_ID_MAX + 1];
+
+static inline void set_now(uint64_t at) {
+    now = at;
+    sim_dwt.CYCCNT = (uint32_t)now;
+}
+
+static inline uint32_t cycles_per_tick() {
+    return SystemCoreClock / 1000U;
+}
+
+// xorshift32, good enough for dropping bytes
+static inline uint32_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static inline uint8_t should_drop(ComportId connector) {
+    uint32_t ppm = config.panels[connector].drop_ppm;
+
+    if (ppm == 0) return false;
+    if (next_random() % 1000000U >= ppm) return false;
+
+    sim_stats.bytes_dropped++;
+    return true;
+}
+
+// Whether there's a panel on the connector that's ready and not resetting
+static inline uint8_t panel_up(ComportId connector) {
+    SimPanelConfig * panel = &config.panels[connector];
+
+    if (!panel->connected || now < panel->ready_at) return false;
+
+    if (panel->reset_cycles == 0 || now < panel->reset_at) return true;
+
+    uint64_t since_reset = now - panel->reset_at;
+    if (panel->reset_period != 0) since_reset %= panel->reset_period;
+
+    return since_reset >= panel->reset_cycles;
+}
+
+// Sets the CK lines of the panels that are up, letting panels that went down
+// forget what they were doing. Lines only change on ticks.
+static void update_ready_lines() {
+    for (uint8_t i = 0; i <= COMPORT_ID_MAX; i++) {
+        uint8_t up = panel_up((ComportId)i);
+
+        if (up) {
+            ready_gpio[i]->IDR |= ready_pin[i];
+        } else {
+            ready_gpio[i]->IDR &= ~(uint32_t)ready_pin[i];
+        }
+
+        if (panel_was_up[i] && !up) sim_panel_reset((ComportId)i);
+        panel_was_up[i] = up;
+    }
+}
+
+static inline SimUart * get_uart(USART_TypeDef * instance) {
+    if (instance == USART1) return &uarts[0];
+    if (instance == USART2) return &uarts[1];
+    return &uarts[2];
+}
+
+static inline uint8_t pin_is_af(GPIO_TypeDef * gpio, uint32_t pin) {
+    return ((gpio->MODER >> (pin * 2)) & 0x03U) == MODER_AF;
+}
+
+// Which connector USART2 is wired to right now, going by its pins' modes
+static inline ComportId usart2_connector() {
+    if (pin_is_af(GPIOA, 2) && pin_is_af(GPIOA, 3)) return Comport_Up;
+    if (pin_is_af(GPIOA, 15) && pin_is_af(GPIOB, 3)) return Comport_Right;
+    return Comport_None;
+}
+
+static inline ComportId uart_connector(SimUart * uart) {
+    if (uart == &uarts[0]) return Comport_Left;
+    if (uart == &uarts[2]) return Comport_Down;
+    return usart2_connector();
+}
+
+// UART a connector would be on, whether or not it's switched to it now
+static inline SimUart * connector_uart(ComportId connector) {
+    switch (connector) {
+        case Comport_Left: return &uarts[0];
+        case Comport_Down: return &uarts[2];
+        default: return &uarts[1];
+    }
+}
+
+// Events --------------------------------------------------------------------
+
+static void finish_transmit(SimUart * uart) {
+    uint8_t received[SIM_TRANSFER_MAX];
+    uint16_t received_len = 0;
+    ComportId connector = uart->tx_connector;
+
+    uart->tx_active = false;
+    uart->huart->gState = HAL_UART_STATE_READY;
+
+    if (connector != Comport_None && panel_up(connector)) {
+        for (uint16_t i = 0; i < uart->tx_len; i++) {
+            if (!should_drop(connector)) received[received_len++] = uart->tx_data[i];
+        }
+
+        sim_panel_receive(connector, received, received_len);
+    }
+
+    HAL_UART_TxCpltCallback(uart->huart);
+}
+
+static void deliver_byte(ComportId connector) {
+    Connector * wire = &connectors[connector];
+    uint8_t byte = wire->bytes[wire->front].byte;
+
+    wire->front = (wire->front + 1) % SIM_INBOUND_MAX;
+    wire->count--;
+
+    SimUart * uart = connector_uart(connector);
+
+    if (uart_connector(uart) != connector || uart->rx_buffer == NULL) {
+        sim_stats.bytes_unexpected++;
+        return;
+    }
+
+    uart->rx_buffer[uart->rx_count++] = byte;
+    if (uart->rx_count < uart->rx_len) return;
+
+    uart->rx_buffer = NULL;
+    uart->huart->RxState = HAL_UART_STATE_READY;
+    HAL_UART_RxCpltCallback(uart->huart);
+}
+
+static void run_tick() {
+    next_tick_at += cycles_per_tick();
+    update_ready_lines();
+    SysTick_Handler();
+}
+
+static void run_timer() {
+    void (* callback)(void) = timer_callback;
+    timer_callback = NULL;
+    callback();
+}
+
+// Runs the earliest event due at or before the given time. Returns false if
+// there was none.
+static uint8_t run_next_event(uint64_t until) {
+    uint64_t earliest = next_tick_at;
+    void (* run)(void) = run_tick;
+    SimUart * uart = NULL;
+    int8_t connector = -1;
+
+    if (timer_callback != NULL && timer_at < earliest) {
+        earliest = timer_at;
+        run = run_timer;
+    }
+
+    for (uint8_t i = 0; i < 3; i++) {
+        if (uarts[i].tx_active && uarts[i].tx_done_at < earliest) {
+            earliest = uarts[i].tx_done_at;
+            uart = &uarts[i];
+        }
+    }
+
+    for (uint8_t i = 0; i <= COMPORT_ID_MAX; i++) {
+        Connector * wire = &connectors[i];
+
+        if (wire->count > 0 && wire->bytes[wire->front].at < earliest) {
+            earliest = wire->bytes[wire->front].at;
+            connector = i;
+            uart = NULL;
+        }
+    }
+
+    if (earliest > until) return false;
+    if (earliest > now) set_now(earliest);
+
+    if (connector >= 0) {
+        deliver_byte((ComportId)connector);
+    } else if (uart != NULL) {
+        finish_transmit(uart);
+    } else {
+        run();
+    }
+
+    return true;
+}
+
+static void advance_to(uint64_t until) {
+    while (run_next_event(until));
+    if (until > now) set_now(until);
+}
+
+// Simulation API ------------------------------------------------------------
+
+void sim_init(SimConfig * sim_config) {
+    config = *sim_config;
+    random_state = config.seed != 0 ? config.seed : 1;
+
+    memset(uarts, 0, sizeof(uarts));
+    memset(connectors, 0, sizeof(connectors));
+    memset(&sim_stats, 0, sizeof(sim_stats));
+
+    // Reset values; the debug port keeps PA13-15 and PB3-4 to itself
+    sim_gpioa = (GPIO_TypeDef) { .MODER = 0xA8000000U };
+    sim_gpiob = (GPIO_TypeDef) { .MODER = 0x00000280U };
+    sim_gpioc = (GPIO_TypeDef) { 0 };
+
+    set_now(0);
+    memset(panel_was_up, 0, sizeof(panel_was_up));
+    next_tick_at = cycles_per_tick();
+    tick = 0;
+    timer_callback = NULL;
+
+    sim_panels_init(&config);
+
+    // Panels ready from the start have their CK line up straight away
+    update_ready_lines();
+}
+
+uint64_t sim_now() {
+    return now;
+}
+
+void sim_run_cpu(uint32_t cycles) {
+    advance_to(now + cycles);
+}
+
+void sim_wait_for_interrupt() {
+    run_next_event(UINT64_MAX);
+}
+
+void sim_set_timer(uint64_t at, void (* callback)(void)) {
+    timer_at = at;
+    timer_callback = callback;
+}
+
+void sim_panel_reply(ComportId connector, uint8_t * data, uint16_t len) {
+    Connector * wire = &connectors[connector];
+    uint32_t byte_cycles = connector_uart(connector)->byte_cycles;
+    uint64_t start = now + config.panels[connector].turnaround_cycles;
+
+    if (wire->free_at > start) start = wire->free_at;
+
+    for (uint16_t i = 0; i < len; i++) {
+        if (should_drop(connector)) continue;
+
+        if (wire->count == SIM_INBOUND_MAX) {
+            fprintf(stderr, "sim: inbound bytes overflowed on port %u\n", connector);
+            exit(2);
+        }
+
+        InboundByte * inbound =
+            &wire->bytes[(wire->front + wire->count) % SIM_INBOUND_MAX];
+        inbound->at = start + (uint64_t)(i + 1) * byte_cycles;
+        inbound->byte = data[i];
+        wire->count++;
+    }
+
+    wire->free_at = start + (uint64_t)len * byte_cycles;
+}
+
+void __WFI(void) {
+    sim_wait_for_interrupt();
+}
+
+// HAL -----------------------------------------------------------------------
+
+uint32_t HAL_GetTick(void) {
+    return tick;
+}
+
+void HAL_IncTick(void) {
+    tick++;
+}
+
+// Same result as the CRC unit in crc.c, a bit at a time
+uint32_t crc32(uint8_t const * data, uint32_t len) {
+    uint32_t crc = 0xFFFFFFFFU;
+
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= data[i];
+
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1U));
+        }
+    }
+
+    return ~crc;
+}
+
+void HAL_Delay(uint32_t delay) {
+    // error_loop blinks an LED forever; in the simulation, stop instead
+    if (Panic_Error != Error_None) {
+        fprintf(
+            stderr,
+            "sim: panic 0x%04x, data 0x%08x, at %.6f s\n",
+            Panic_Error,
+            Panic_Data,
+            (double)now / SystemCoreClock
+        );
+        exit(1);
+    }
+
+    advance_to(now + (uint64_t)delay * cycles_per_tick());
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type irqn, uint32_t priority, uint32_t sub) { }
+void HAL_NVIC_EnableIRQ(IRQn_Type irqn) { }
+void HAL_NVIC_DisableIRQ(IRQn_Type irqn) { }
+
+void HAL_GPIO_Init(GPIO_TypeDef * gpio, GPIO_InitTypeDef * init) {
+    for (uint32_t pin = 0; pin < 16; pin++) {
+        if (!(init->Pin & (1U << pin))) continue;
+
+        MODIFY_REG(gpio->MODER, 0x03U << (pin * 2), (init->Mode & 0x03U) << (pin * 2));
+    }
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef * gpio, uint16_t pin) {
+    return (gpio->IDR & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef * gpio, uint16_t pin, GPIO_PinState state) {
+    if (state == GPIO_PIN_SET) {
+        gpio->ODR |= pin;
+    } else {
+        gpio->ODR &= ~pin;
+    }
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef * gpio, uint16_t pin) {
+    gpio->ODR ^= pin;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef * huart) {
+    SimUart * uart = get_uart(huart->Instance);
+    uint32_t bits = 10 + (huart->Init.StopBits == UART_STOPBITS_2 ? 1 : 0);
+
+    uart->huart = huart;
+    uart->byte_cycles = (uint32_t)(((uint64_t)SystemCoreClock * bits) / huart->Init.BaudRate);
+    uart->tx_active = false;
+    uart->rx_buffer = NULL;
+
+    huart->gState = HAL_UART_STATE_READY;
+    huart->RxState = HAL_UART_STATE_READY;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef * huart) {
+    HAL_UART_Abort(huart);
+
+    huart->gState = HAL_UART_STATE_RESET;
+    huart->RxState = HAL_UART_STATE_RESET;
+
+    return HAL_OK;
+}
+
+void HAL_UART_MspInit(UART_HandleTypeDef * huart) { }
+void HAL_UART_MspDeInit(UART_HandleTypeDef * huart) { }
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(
+    UART_HandleTypeDef * huart,
+    uint8_t * data,
+    uint16_t len
+) {
+    SimUart * uart = get_uart(huart->Instance);
+
+    if (huart->gState != HAL_UART_STATE_READY) return HAL_BUSY;
+    if (len > SIM_TRANSFER_MAX) return HAL_ERROR;
+
+    memcpy(uart->tx_data, data, len);
+    uart->tx_len = len;
+    uart->tx_connector = uart_connector(uart);
+    uart->tx_done_at = now + (uint64_t)len * uart->byte_cycles;
+    uart->tx_active = true;
+
+    if (huart->Instance == USART2) {
+        if (uart->tx_connector != last_usart2_connector) {
+            if (last_usart2_connector != Comport_None) sim_stats.usart2_switches++;
+            last_usart2_connector = uart->tx_connector;
+        }
+    }
+
+    huart->gState = HAL_UART_STATE_BUSY_TX;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(
+    UART_HandleTypeDef * huart,
+    uint8_t * data,
+    uint16_t len
+) {
+    SimUart * uart = get_uart(huart->Instance);
+
+    if (huart->RxState != HAL_UART_STATE_READY) return HAL_BUSY;
+
+    uart->rx_buffer = data;
+    uart->rx_len = len;
+    uart->rx_count = 0;
+
+    huart->RxState = HAL_UART_STATE_BUSY_RX;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort(UART_HandleTypeDef * huart) {
+    HAL_UART_AbortTransmit(huart);
+    HAL_UART_AbortReceive(huart);
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef * huart) {
+    get_uart(huart->Instance)->tx_active = false;
+    huart->gState = HAL_UART_STATE_READY;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef * huart) {
+    get_uart(huart->Instance)->rx_buffer = NULL;
+    huart->RxState = HAL_UART_STATE_READY;
+
+    return HAL_OK;
+}
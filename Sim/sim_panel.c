@@ -0,0 +1,405 @@
+#include "sim.h"
+#include "msgbus.h"
+#include "commands.h"
+#include "sensors.h"
+#include "panel_program.h"
+#include "crc.h"
+#include "string.h"
+
+// Panel side of the protocol, as implemented by the panel firmware. Each
+// transfer from the board is taken as a whole: a transfer that doesn't have
+// the length the panel expects is ignored, which is also how a panel gets
+// back in step after a lost byte.
+
+#define LED_SEGMENT_BYTES (64U)
+#define LED_SEGMENTS (4U)
+
+// Panel flash, as on an STM32F072 with typical timings from its datasheet.
+// Chunks are written in the background, a page being erased when a chunk
+// reaches it.
+#define FLASH_PAGE_LEN (2048U)
+#define FLASH_ERASE_US (30000U)
+#define FLASH_HALFWORD_US (53U)
+#define FLASH_IMAGE_MAX (32U * 1024U)
+
+// Chunks the panel takes before they're in flash
+#define PROGRAM_WINDOW (4U)
+
+typedef struct {
+    uint8_t started;
+    uint32_t len;
+    uint32_t crc;
+
+    // Bytes taken, and those of them in flash
+    uint32_t accepted;
+    uint32_t committed;
+
+    // Chunks waiting for flash, oldest first: when each is written and how
+    // long it is
+    uint64_t done_at[PROGRAM_WINDOW];
+    uint16_t done_len[PROGRAM_WINDOW];
+    uint8_t pending;
+
+    // When the flash is done with the last chunk taken
+    uint64_t flash_free_at;
+
+    uint8_t image[FLASH_IMAGE_MAX];
+} SimProgram;
+
+typedef enum {
+    // Waiting for a command byte or a frame
+    Panel_Idle,
+
+    // Acknowledged a command, waiting for its data
+    Panel_Receiving_Data
+} PanelStatus;
+
+typedef struct {
+    SimPanelConfig config;
+    PanelStatus status;
+    Commands data_command;
+
+    // Changes with every sensor request, so samples can be told apart
+    uint8_t sensor_counter;
+
+    // LED segments as last received, and as shown since the last commit.
+    // A segment's header byte says which one it is.
+    uint8_t leds_received[LED_SEGMENTS * LED_SEGMENT_BYTES];
+    uint8_t leds_shown[LED_SEGMENTS * LED_SEGMENT_BYTES];
+
+    SimProgram program;
+} SimPanel;
+
+SimPanelStats sim_panel_stats[COMPORT_ID_MAX + 1];
+
+static SimPanel panels[COMPORT_ID_MAX + 1];
+
+static inline uint8_t is_program_command(Commands command) {
+    return command >= Command_Program_Begin && command <= Command_Program_Finish;
+}
+
+static void acknowledge(ComportId connector, Commands command) {
+    uint8_t ack[2] = { MSG_ACKNOWLEGE, (uint8_t)command };
+    sim_panel_reply(connector, ack, sizeof(ack));
+}
+
+static void send_sensors(ComportId connector, SimPanel * panel) {
+    uint8_t data[SENSOR_RESPONSE_LEN];
+
+    panel->sensor_counter++;
+
+    // Every reading is the counter, so consecutive samples differ by as
+    // little as a real, slowly changing pressure does
+    for (uint8_t i = 0; i < SENSOR_RESPONSE_LEN; i += 2) {
+        data[i] = panel->sensor_counter;
+        data[i + 1] = 0;
+    }
+
+    sim_panel_reply(connector, data, sizeof(data));
+    sim_panel_stats[connector].sensor_requests++;
+}
+
+// Programming -----------------------------------------------------------------
+
+static inline uint32_t read_u32(uint8_t const * data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static inline uint64_t us_to_cycles(uint32_t us) {
+    return (uint64_t)us * (SystemCoreClock / 1000000U);
+}
+
+// Moves the chunks the flash is done with over to committed
+static void update_committed(SimProgram * program) {
+    while (program->pending > 0 && program->done_at[0] <= sim_now()) {
+        program->committed += program->done_len[0];
+        program->pending--;
+
+        memmove(program->done_at, program->done_at + 1, program->pending * sizeof(uint64_t));
+        memmove(program->done_len, program->done_len + 1, program->pending * sizeof(uint16_t));
+    }
+}
+
+static ProgramStatus program_begin(SimProgram * program, uint8_t * data, uint16_t len) {
+    if (len != 8) return Program_Bad_CRC;
+
+    uint32_t image_len = read_u32(data);
+    uint32_t image_crc = read_u32(data + 4);
+
+    if (image_len > FLASH_IMAGE_MAX) return Program_Flash_Error;
+
+    // Whatever is still being written gets there
+    program->committed = program->accepted;
+    program->pending = 0;
+
+    // Another image, so what's in flash is no use
+    if (image_len != program->len || image_crc != program->crc) {
+        program->committed = 0;
+        program->accepted = 0;
+    }
+
+    program->len = image_len;
+    program->crc = image_crc;
+    program->started = true;
+    return Program_OK;
+}
+
+static ProgramStatus program_chunk(
+    ComportId connector,
+    SimProgram * program,
+    uint8_t * data,
+    uint16_t len
+) {
+    if (!program->started) return Program_Not_Started;
+    if (len < 12 || len % 4 != 0) return Program_Bad_CRC;
+    if (crc32(data, len - 4) != read_u32(data + len - 4)) return Program_Bad_CRC;
+
+    uint32_t offset = read_u32(data);
+    uint16_t chunk_len = len - 8;
+
+    if (offset + chunk_len > program->len) return Program_Out_Of_Order;
+
+    // Sent again after its answer was lost
+    if (offset + chunk_len <= program->accepted) return Program_OK;
+
+    if (offset != program->accepted) return Program_Out_Of_Order;
+
+    update_committed(program);
+    if (program->pending == PROGRAM_WINDOW) return Program_Busy;
+
+    memcpy(program->image + offset, data + 4, chunk_len);
+    program->accepted += chunk_len;
+
+    uint64_t start = program->flash_free_at > sim_now() ? program->flash_free_at : sim_now();
+    uint64_t cycles = us_to_cycles(FLASH_HALFWORD_US) * (chunk_len / 2);
+    uint32_t next_page = (offset + FLASH_PAGE_LEN - 1) / FLASH_PAGE_LEN * FLASH_PAGE_LEN;
+
+    if (next_page < offset + chunk_len) cycles += us_to_cycles(FLASH_ERASE_US);
+
+    program->flash_free_at = start + cycles;
+    program->done_at[program->pending] = program->flash_free_at;
+    program->done_len[program->pending] = chunk_len;
+    program->pending++;
+
+    sim_panel_stats[connector].program_chunks++;
+    return Program_OK;
+}
+
+static ProgramStatus program_finish(ComportId connector, SimProgram * program) {
+    if (!program->started) return Program_Not_Started;
+    if (program->committed != program->len) return Program_Busy;
+
+    program->started = false;
+
+    if (crc32(program->image, program->len) != program->crc) {
+        program->committed = 0;
+        program->accepted = 0;
+        return Program_Bad_Image;
+    }
+
+    sim_panel_stats[connector].programmed = true;
+    return Program_OK;
+}
+
+// Handles a programming command, and answers it
+static void process_program(
+    ComportId connector,
+    Commands command,
+    uint8_t * data,
+    uint16_t len
+) {
+    SimProgram * program = &panels[connector].program;
+    ProgramStatus status = Program_OK;
+
+    update_committed(program);
+
+    switch (command) {
+        case Command_Program_Begin:
+            status = program_begin(program, data, len);
+            break;
+
+        case Command_Program_Chunk:
+            status = program_chunk(connector, program, data, len);
+            break;
+
+        case Command_Program_Status:
+            if (!program->started) status = Program_Not_Started;
+            break;
+
+        case Command_Program_Finish:
+            status = program_finish(connector, program);
+            break;
+    }
+
+    uint8_t answer[PANEL_PROGRAM_RESPONSE_LEN] = {
+        status, PROGRAM_WINDOW, 0, 0,
+        program->committed, program->committed >> 8,
+        program->committed >> 16, program->committed >> 24
+    };
+
+    sim_panel_reply(connector, answer, sizeof(answer));
+}
+
+// Handles a command that came with its data, framed or not
+static void process_data(
+    ComportId connector,
+    SimPanel * panel,
+    Commands command,
+    uint8_t * data,
+    uint16_t len
+) {
+    if (command == Command_Process_LED_Segment && len == LED_SEGMENT_BYTES) {
+        uint8_t segment = (data[0] >> 4) & (LED_SEGMENTS - 1);
+
+        memcpy(panel->leds_received + segment * LED_SEGMENT_BYTES, data, len);
+        sim_panel_stats[connector].led_segments++;
+        return;
+    }
+
+    sim_panel_stats[connector].garbled++;
+}
+
+static void receive_frame(
+    ComportId connector,
+    SimPanel * panel,
+    uint8_t * data,
+    uint16_t len
+) {
+    uint8_t checksum = 0;
+
+    for (uint16_t i = 0; i < len; i++) {
+        checksum += data[i];
+    }
+
+    if (len < FRAME_OVERHEAD_BYTES
+        || data[2] != len - FRAME_OVERHEAD_BYTES
+        || checksum != 0) {
+
+        sim_panel_stats[connector].garbled++;
+        return;
+    }
+
+    Commands command = (Commands)data[1];
+
+    if (is_program_command(command)) {
+        process_program(connector, command, data + 3, data[2]);
+        return;
+    }
+
+    process_data(connector, panel, command, data + 3, data[2]);
+
+    // Other than the programming ones, none of the commands sent with data
+    // have a response
+    acknowledge(connector, command);
+}
+
+static void receive_command(ComportId connector, SimPanel * panel, Commands command) {
+    switch (command) {
+        case Command_Request_Sensors:
+            send_sensors(connector, panel);
+            break;
+
+        case Command_Process_LED_Segment:
+            acknowledge(connector, command);
+            panel->status = Panel_Receiving_Data;
+            panel->data_command = command;
+            break;
+
+        case Command_Commit_LEDs:
+            memcpy(panel->leds_shown, panel->leds_received, sizeof(panel->leds_shown));
+            sim_panel_stats[connector].commits++;
+            acknowledge(connector, command);
+            break;
+
+        case Command_Program_Begin:
+        case Command_Program_Chunk:
+            acknowledge(connector, command);
+            panel->status = Panel_Receiving_Data;
+            panel->data_command = command;
+            break;
+
+        case Command_Program_Status:
+        case Command_Program_Finish:
+            process_program(connector, command, NULL, 0);
+            break;
+
+        case Command_Negotiate_Framing:
+            if (panel->config.supports_framing) {
+                uint8_t answer[2] = { MSG_ACKNOWLEGE, MSG_FAST_FRAMING_VERSION };
+                sim_panel_reply(connector, answer, sizeof(answer));
+            }
+
+            break;
+
+        default:
+            // Test commands aren't simulated
+            sim_panel_stats[connector].garbled++;
+            break;
+    }
+}
+
+// Public functions ------------------------------------------------------------
+
+void sim_panels_init(SimConfig * config) {
+    memset(sim_panel_stats, 0, sizeof(sim_panel_stats));
+
+    for (uint8_t i = 0; i <= COMPORT_ID_MAX; i++) {
+        panels[i].config = config->panels[i];
+        panels[i].status = Panel_Idle;
+        panels[i].data_command = Command_None;
+        panels[i].sensor_counter = 0;
+        memset(panels[i].leds_received, 0, sizeof(panels[i].leds_received));
+        memset(panels[i].leds_shown, 0, sizeof(panels[i].leds_shown));
+        memset(&panels[i].program, 0, sizeof(panels[i].program));
+    }
+}
+
+void sim_panel_reset(ComportId connector) {
+    panels[connector].status = Panel_Idle;
+    panels[connector].data_command = Command_None;
+    memset(panels[connector].leds_received, 0, sizeof(panels[connector].leds_received));
+    memset(panels[connector].leds_shown, 0, sizeof(panels[connector].leds_shown));
+}
+
+uint8_t const * sim_panel_leds(ComportId connector, uint8_t shown) {
+    return shown ? panels[connector].leds_shown : panels[connector].leds_received;
+}
+
+void sim_panel_receive(ComportId connector, uint8_t * data, uint16_t len) {
+    SimPanel * panel = &panels[connector];
+
+    if (panel->status == Panel_Receiving_Data) {
+        panel->status = Panel_Idle;
+
+        if (is_program_command(panel->data_command)) {
+            process_program(connector, panel->data_command, data, len);
+            return;
+        }
+
+        if (len != LED_SEGMENT_BYTES) {
+            sim_panel_stats[connector].garbled++;
+            return;
+        }
+
+        process_data(connector, panel, panel->data_command, data, len);
+
+        // Data is acknowledged with just the one byte
+        uint8_t ack = MSG_ACKNOWLEGE;
+        sim_panel_reply(connector, &ack, 1);
+        return;
+    }
+
+    if (len == 0) return;
+
+    if (data[0] == Command_Framed) {
+        receive_frame(connector, panel, data, len);
+        return;
+    }
+
+    if (len != 1) {
+        sim_panel_stats[connector].garbled++;
+        return;
+    }
+
+    receive_command(connector, panel, (Commands)data[0]);
+}
@@ -1,7 +1,7 @@
 #include "commtests.h"
 #include "debug_leds.h"
 
-static Response * wait_for_response();
+static Response wait_for_response();
 
 static uint8_t verify_data_2bytes(uint8_t *);
 static uint8_t verify_data_64bytes(uint8_t *);
@@ -24,9 +24,9 @@ uint8_t commtest_receive_2bytes(ComportId comport_id) {
     msgbus_send_request(req);
     DBG_LED2_ON();
 
-    Response * resp = wait_for_response();
+    Response resp = wait_for_response();
 
-    if (resp->request_command != Command_Test_Expect_2B) return false;
+    if (resp.request_command != Command_Test_Expect_2B) return false;
     return verify_data_2bytes(rec_data);
 }
 
@@ -51,19 +51,19 @@ uint8_t commtest_dual_receive_2bytes(ComportId port1, ComportId port2) {
     uint8_t responses = 0;
 
     while (responses != 0B11) {
-        Response * resp = wait_for_response();
+        Response resp = wait_for_response();
 
-        if (resp->request_command != Command_Test_Expect_2B) return false;
+        if (resp.request_command != Command_Test_Expect_2B) return false;
 
         // Check if response is in fact for one of our ports
-        if (resp->comport_id != port1 && resp->comport_id != port2) {
+        if (resp.comport_id != port1 && resp.comport_id != port2) {
             return false;
         }
 
-        uint8_t offset = resp->comport_id == port1 ? 0 : 2;
+        uint8_t offset = resp.comport_id == port1 ? 0 : 2;
 
         if (verify_data_2bytes(rec_data + offset)) {
-            responses |= resp->comport_id == port1 ? 0B01 : 0B10;
+            responses |= resp.comport_id == port1 ? 0B01 : 0B10;
         }
     }
 
@@ -83,9 +83,9 @@ uint8_t commtest_receive_64bytes(ComportId comport_id) {
 
     msgbus_send_request(req);
 
-    Response * resp = wait_for_response();
+    Response resp = wait_for_response();
 
-    if (resp->request_command != Command_Test_Expect_64B) return false;
+    if (resp.request_command != Command_Test_Expect_64B) return false;
 
     return verify_data_64bytes(rec_data);
 }
@@ -112,19 +112,19 @@ uint8_t commtest_dual_receive_64bytes(ComportId port1, ComportId port2) {
     uint8_t responses = 0;
 
     while (responses != 0B11) {
-        Response * resp = wait_for_response();
+        Response resp = wait_for_response();
 
-        if (resp->request_command != Command_Test_Expect_64B) return false;
+        if (resp.request_command != Command_Test_Expect_64B) return false;
 
         // Check if response is in fact for one of our ports
-        if (resp->comport_id != port1 && resp->comport_id != port2) {
+        if (resp.comport_id != port1 && resp.comport_id != port2) {
             return false;
         }
 
-        uint8_t offset = resp->comport_id == port1 ? 0 : data_length;
+        uint8_t offset = resp.comport_id == port1 ? 0 : data_length;
 
         if (verify_data_64bytes(rec_data + offset)) {
-            responses |= resp->comport_id == port1 ? 0B01 : 0B10;
+            responses |= resp.comport_id == port1 ? 0B01 : 0B10;
         }
     }
 
@@ -149,9 +149,9 @@ uint8_t commtest_double_values(ComportId comport_id) {
 
     msgbus_send_request(req);
 
-    Response * resp = wait_for_response();
+    Response resp = wait_for_response();
 
-    if (resp->request_command != Command_Test_Double_Values) return false;
+    if (resp.request_command != Command_Test_Double_Values) return false;
 
     return verify_data_double(send_data, rec_data);
 }
@@ -185,19 +185,19 @@ uint8_t commtest_dual_double_values(ComportId port1, ComportId port2) {
     uint8_t responses = 0;
 
     while (responses != 0B11) {
-        Response * resp = wait_for_response();
+        Response resp = wait_for_response();
 
-        if (resp->request_command != Command_Test_Double_Values) return false;
+        if (resp.request_command != Command_Test_Double_Values) return false;
 
         // Check if response is in fact for one of our ports
-        if (resp->comport_id != port1 && resp->comport_id != port2) {
+        if (resp.comport_id != port1 && resp.comport_id != port2) {
             return false;
         }
 
-        uint8_t offset = resp->comport_id == port1 ? 0 : data_length;
+        uint8_t offset = resp.comport_id == port1 ? 0 : data_length;
 
         if (verify_data_double(send_data, rec_data + offset)) {
-            responses |= resp->comport_id == port1 ? 0B01 : 0B10;
+            responses |= resp.comport_id == port1 ? 0B01 : 0B10;
         }
     }
 
@@ -224,7 +224,7 @@ static uint8_t verify_data_double(uint8_t * req_data, uint8_t * resp_data) {
     return true;
 }
 
-static Response * wait_for_response() {
+static Response wait_for_response() {
     while(!msgbus_have_pending_response()) {
         msgbus_process_flags();
         msgbus_switch_ports_if_done();
@@ -1,8 +1,14 @@
 #include "config.h"
 
-uint8_t _panels_connected[4] = {
-    PANEL_LEFT_CONNECTED,
-    PANEL_DOWN_CONNECTED,
-    PANEL_UP_CONNECTED,
-    PANEL_RIGHT_CONNECTED
-};
\ No newline at end of file
+// All offline until discovery.h finds them
+uint8_t _panels_connected[4] = { 0 };
+
+void config_set_panels_connected(uint8_t mask) {
+    for (uint8_t i = 0; i < 4; i++) {
+        _panels_connected[i] = (mask >> i) & 1U;
+    }
+}
+
+void config_set_panel_connected(ComportId port, uint8_t connected) {
+    _panels_connected[(uint8_t)port] = connected;
+}
@@ -0,0 +1,24 @@
+#include "crc.h"
+#include "string.h"
+
+// Public functions ------------------------------------------------------------
+
+// The polynomial and initial value are the reset defaults. Input and output
+// are bit-reversed, input a word at a time so the bytes of a little-endian
+// word go in first to last, and the result is inverted.
+uint32_t crc32(uint8_t const * data, uint32_t len) {
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->INIT = 0xFFFFFFFFU;
+    CRC->POL = 0x04C11DB7U;
+    CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_IN_1 | CRC_CR_REV_OUT | CRC_CR_RESET;
+
+    for (uint32_t i = 0; i < len; i += 4) {
+        uint32_t word;
+
+        // A single load, the core doesn't mind unaligned ones
+        memcpy(&word, data + i, 4);
+        CRC->DR = word;
+    }
+
+    return ~CRC->DR;
+}
@@ -0,0 +1,96 @@
+#include "discovery.h"
+#include "stdbool.h"
+#include "config.h"
+#include "msgbus.h"
+
+// Public, so that contents can be inspected during debugging
+DiscoveryPort discovery_ports[COMPORT_ID_MAX + 1];
+
+static PanelChangeHandler change_handler = NULL;
+
+// Tick a port that timed out went offline at
+static uint32_t retry_from[COMPORT_ID_MAX + 1];
+
+static void go_online(ComportId port, uint32_t now_ms) {
+    DiscoveryPort * state = &discovery_ports[port];
+
+    state->state = Discovery_Online;
+    state->online_at = now_ms;
+    state->onlines++;
+
+    config_set_panel_connected(port, true);
+    msgbus_port_online(port);
+
+    if (change_handler != NULL) change_handler(port, true);
+}
+
+static void go_offline(ComportId port, DiscoveryState next) {
+    discovery_ports[port].state = next;
+    discovery_ports[port].framed = false;
+
+    config_set_panel_connected(port, false);
+    msgbus_port_offline(port);
+
+    if (change_handler != NULL) change_handler(port, false);
+}
+
+// Panel programming gives up on panels that stop answering by itself, and
+// expects lost answers along the way, so timeouts don't count then
+static inline uint8_t timed_out(ComportId port) {
+    return !msgbus_programming_mode()
+        && msgbus_port_timeouts_in_a_row(port) >= DISCOVERY_MAX_TIMEOUTS;
+}
+
+// Public functions ------------------------------------------------------------
+
+void discovery_init(uint8_t port_mask) {
+    config_set_panels_connected(0);
+
+    for (uint8_t i = 0; i <= COMPORT_ID_MAX; i++) {
+        discovery_ports[i] = (DiscoveryPort) { 0 };
+        discovery_ports[i].state = (port_mask >> i) & 1U
+            ? Discovery_Waiting
+            : Discovery_Unused;
+    }
+}
+
+void discovery_set_change_handler(PanelChangeHandler handler) {
+    change_handler = handler;
+}
+
+void discovery_tick(uint32_t now_ms) {
+    for (uint8_t i = 0; i <= COMPORT_ID_MAX; i++) {
+        ComportId port = (ComportId)i;
+        DiscoveryPort * state = &discovery_ports[i];
+
+        switch (state->state) {
+            case Discovery_Retry_Wait:
+                if (now_ms - retry_from[i] < DISCOVERY_RETRY_MS) break;
+
+                state->state = Discovery_Waiting;
+
+                // Fall through, the line may be up already
+            case Discovery_Waiting:
+                if (uart_panel_ready(port)) go_online(port, now_ms);
+                break;
+
+            case Discovery_Online:
+                // Negotiation finishes some time after coming online
+                state->framed = msgbus_port_framed(port);
+
+                if (!uart_panel_ready(port)) {
+                    state->lost_ready++;
+                    go_offline(port, Discovery_Waiting);
+                } else if (timed_out(port)) {
+                    state->timed_out++;
+                    retry_from[i] = now_ms;
+                    go_offline(port, Discovery_Retry_Wait);
+                }
+
+                break;
+
+            default:
+                break;
+        }
+    }
+}
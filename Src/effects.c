@@ -0,0 +1,219 @@
+#include "effects.h"
+#include "stdbool.h"
+#include "string.h"
+#include "config.h"
+
+// Steps in the precalculated color wheel. color_hsl_to_rgb works in doubles,
+// which this core only has in software, so it isn't called per LED.
+#define HUE_STEPS (64U)
+
+// LEDs in the fading tail of Effect_Chase, the head included
+#define CHASE_LENGTH (12U)
+
+// Animation phase, a full period is PHASE_FULL
+#define PHASE_FULL (0x10000U)
+
+// Public, so that contents can be inspected during debugging
+EffectStats effects_stats;
+
+static EffectParams params = { .type = Effect_None };
+static uint32_t started_at = 0;
+static uint32_t next_frame_at = 0;
+static uint8_t frame = 0;
+
+// The effect's color, and the whole color wheel at its saturation and
+// lightness
+static Color_RGB base_color;
+static Color_RGB hue_table[HUE_STEPS];
+
+// What the LEDs showed when Effect_Fade started
+static uint8_t fade_from[SEGMENTS_PER_FRAME][LED_PIXEL_BYTES_PER_SEGMENT];
+
+static inline uint16_t read_u16(uint8_t const * data) {
+    return data[0] | (data[1] << 8);
+}
+
+static inline Color_RGB scale(Color_RGB color, uint8_t level) {
+    color.red = (color.red * level) / 255;
+    color.green = (color.green * level) / 255;
+    color.blue = (color.blue * level) / 255;
+    return color;
+}
+
+// From one value to the other, progress 0 to 256
+static inline uint8_t blend(uint8_t from, uint8_t to, uint32_t progress) {
+    return from + ((to - from) * (int32_t)progress) / 256;
+}
+
+// hue in degrees, any value
+static inline Color_RGB wheel(uint32_t hue) {
+    return hue_table[(hue % 360) * HUE_STEPS / 360];
+}
+
+static void build_tables() {
+    base_color = color_hsl_to_rgb(params.color);
+
+    Color_HSL hsl = params.color;
+
+    for (uint8_t i = 0; i < HUE_STEPS; i++) {
+        hsl.hue = i * 360 / HUE_STEPS;
+        hue_table[i] = color_hsl_to_rgb(hsl);
+    }
+}
+
+// Position in the current period, 0 to PHASE_FULL - 1
+static inline uint32_t phase(uint32_t elapsed) {
+    if (params.period_ms == 0) return 0;
+    return (elapsed % params.period_ms) * PHASE_FULL / params.period_ms;
+}
+
+static Color_RGB render_pixel(
+    uint8_t segment, uint8_t pixel, uint32_t elapsed) {
+
+    uint8_t panel_segment = segment % SEGMENTS_PER_PANEL;
+    uint8_t index = panel_segment * LED_PIXELS_PER_SEGMENT + pixel;
+    uint32_t turn = phase(elapsed) * 360 / PHASE_FULL;
+
+    switch (params.type) {
+        case Effect_Gradient:
+            return wheel(params.color.hue
+                + params.hue_span * index / LED_PIXELS_PER_PANEL + turn);
+
+        case Effect_Color_Wheel:
+            return wheel(params.color.hue
+                + params.hue_span * panel_segment / SEGMENTS_PER_PANEL + turn);
+
+        case Effect_Chase: {
+            uint8_t head = phase(elapsed) * LED_PIXELS_PER_PANEL / PHASE_FULL;
+            uint8_t behind =
+                (head + LED_PIXELS_PER_PANEL - index) % LED_PIXELS_PER_PANEL;
+
+            if (behind >= CHASE_LENGTH) return scale(base_color, 0);
+            return scale(base_color, 255 - behind * 255 / CHASE_LENGTH);
+        }
+
+        case Effect_Pulse: {
+            // Triangle wave, up for half the period and down for the other
+            uint32_t p = phase(elapsed);
+            uint32_t level = p < PHASE_FULL / 2 ? p : PHASE_FULL - 1 - p;
+            return scale(base_color, level * 255 / (PHASE_FULL / 2));
+        }
+
+        case Effect_Fade: {
+            uint8_t const * from = fade_from[segment] + pixel * 3;
+            uint32_t progress = params.period_ms == 0
+                || elapsed >= params.period_ms
+                ? 256 : elapsed * 256 / params.period_ms;
+
+            Color_RGB rgb;
+            rgb.red = blend(from[0], base_color.red, progress);
+            rgb.green = blend(from[1], base_color.green, progress);
+            rgb.blue = blend(from[2], base_color.blue, progress);
+            return rgb;
+        }
+
+        case Effect_Solid:
+        default:
+            return base_color;
+    }
+}
+
+static void render_frame(uint32_t elapsed) {
+    uint8_t data[BYTES_PER_SEGMENT];
+
+    for (uint8_t s = 0; s < SEGMENTS_PER_FRAME; s++) {
+        data[0] = ((s / SEGMENTS_PER_PANEL) << 6)
+            | ((s % SEGMENTS_PER_PANEL) << 4)
+            | (frame & 0x0F);
+
+        for (uint8_t i = 0; i < LED_PIXELS_PER_SEGMENT; i++) {
+            Color_RGB rgb = render_pixel(s, i, elapsed);
+
+            data[1 + i * 3] = rgb.red;
+            data[2 + i * 3] = rgb.green;
+            data[3 + i * 3] = rgb.blue;
+        }
+
+        // Segments that came out the same as last frame don't go anywhere
+        leds_write_segment(s, data);
+    }
+
+    leds_send_dirty();
+    leds_commit();
+
+    frame++;
+    effects_stats.frames++;
+}
+
+// Public functions ------------------------------------------------------------
+
+void effects_init() {
+    params.type = Effect_None;
+    frame = 0;
+    effects_stats = (EffectStats) { 0 };
+}
+
+uint8_t effects_start(uint8_t const * data, uint16_t len) {
+    EffectParams new_params;
+
+    if (len != EFFECT_PARAMS_LEN || data[0] >= EFFECT_TYPE_COUNT) {
+        effects_stats.bad_params++;
+        return false;
+    }
+
+    new_params.type = (EffectType)data[0];
+    new_params.color.hue = read_u16(data + 1);
+    new_params.color.saturation = data[3];
+    new_params.color.lightness = data[4];
+    new_params.hue_span = read_u16(data + 5);
+    new_params.period_ms = read_u16(data + 7);
+
+    if (new_params.color.hue > 360
+        || new_params.color.saturation > 100
+        || new_params.color.lightness > 100) {
+
+        effects_stats.bad_params++;
+        return false;
+    }
+
+    params = new_params;
+    if (params.type == Effect_None) return true;
+
+    if (params.type == Effect_Fade) {
+        uint8_t * buffer = leds_buffer();
+
+        for (uint8_t s = 0; s < SEGMENTS_PER_FRAME; s++) {
+            memcpy(
+                fade_from[s],
+                buffer + s * BYTES_PER_SEGMENT + 1,
+                LED_PIXEL_BYTES_PER_SEGMENT
+            );
+        }
+    }
+
+    build_tables();
+
+    started_at = HAL_GetTick();
+    next_frame_at = started_at;
+    return true;
+}
+
+void effects_stop() {
+    params.type = Effect_None;
+}
+
+uint8_t effects_running() {
+    return params.type != Effect_None;
+}
+
+void effects_tick(uint32_t now_ms) {
+    if (params.type == Effect_None) return;
+    if ((int32_t)(now_ms - next_frame_at) < 0) return;
+
+    // Skip frames rather than catching up on them
+    uint32_t late = (now_ms - next_frame_at) / LED_EFFECT_INTERVAL_MS;
+    effects_stats.frames_missed += late;
+    next_frame_at += (late + 1) * LED_EFFECT_INTERVAL_MS;
+
+    render_frame(now_ms - started_at);
+}
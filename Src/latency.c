@@ -0,0 +1,137 @@
+#include "latency.h"
+#include "critical.h"
+#include "string.h"
+
+// Public, so that contents can be inspected during debugging
+LatencyHistogram latency_histograms
+    [LATENCY_PORT_COUNT][LATENCY_COMMAND_COUNT][LATENCY_STAGE_COUNT];
+
+// Histogram the next feature report read returns
+static uint8_t selected_port = 0;
+static uint8_t selected_command = 0;
+static uint8_t selected_stage = 0;
+
+_Static_assert(sizeof(LatencyReport) == 64, "Latency report must fill one HID report");
+
+static inline LatencyCommand command_group(Commands command) {
+    switch (command) {
+        case Command_Request_Sensors:
+            return Latency_Command_Sensors;
+
+        case Command_Process_LED_Segment:
+            return Latency_Command_LED_Segment;
+
+        case Command_Commit_LEDs:
+            return Latency_Command_Commit_LEDs;
+
+        default:
+            return Latency_Command_Other;
+    }
+}
+
+static inline uint8_t bucket_for(uint32_t cycles) {
+    // Highest set bit, so floor(log2(cycles)); 0 and 1 both end up in bucket 0
+    uint32_t log2 = 31 - __builtin_clz(cycles | 1U);
+
+    if (log2 <= LATENCY_BUCKET_SHIFT) return 0;
+    if (log2 - LATENCY_BUCKET_SHIFT >= LATENCY_BUCKET_COUNT) {
+        return LATENCY_BUCKET_COUNT - 1;
+    }
+
+    return log2 - LATENCY_BUCKET_SHIFT;
+}
+
+static inline void select_next() {
+    if (++selected_stage < LATENCY_STAGE_COUNT) return;
+    selected_stage = 0;
+
+    if (++selected_command < LATENCY_COMMAND_COUNT) return;
+    selected_command = 0;
+
+    if (++selected_port < LATENCY_PORT_COUNT) return;
+    selected_port = 0;
+}
+
+// Public functions ------------------------------------------------------------
+
+void latency_init() {
+    uint32_t primask = critical_enter();
+    memset(latency_histograms, 0, sizeof(latency_histograms));
+    critical_exit(primask);
+
+    selected_port = 0;
+    selected_command = 0;
+    selected_stage = 0;
+}
+
+void latency_record(
+    ComportId comport_id,
+    Commands command,
+    LatencyStage stage,
+    uint32_t cycles
+) {
+    if (comport_id >= LATENCY_PORT_COUNT) return;
+
+    LatencyHistogram * histogram =
+        &latency_histograms[comport_id][command_group(command)][stage];
+
+    uint32_t primask = critical_enter();
+
+    histogram->samples++;
+    histogram->buckets[bucket_for(cycles)]++;
+
+    if (cycles > histogram->max_cycles) {
+        histogram->max_cycles = cycles;
+    }
+
+    critical_exit(primask);
+}
+
+void latency_process_command(uint8_t const * buffer, uint16_t len) {
+    if (len < 1) return;
+
+    switch (buffer[0]) {
+        case LATENCY_OP_SELECT:
+            if (len < 4
+                || buffer[1] >= LATENCY_PORT_COUNT
+                || buffer[2] >= LATENCY_COMMAND_COUNT
+                || buffer[3] >= LATENCY_STAGE_COUNT) {
+
+                break;
+            }
+
+            selected_port = buffer[1];
+            selected_command = buffer[2];
+            selected_stage = buffer[3];
+            break;
+
+        case LATENCY_OP_RESET:
+            latency_init();
+            break;
+    }
+}
+
+uint16_t latency_build_report(uint8_t * buffer, uint16_t len) {
+    if (len < sizeof(LatencyReport)) return 0;
+
+    LatencyReport report;
+    report.comport_id = selected_port;
+    report.command = selected_command;
+    report.stage = selected_stage;
+    report.bucket_count = LATENCY_BUCKET_COUNT;
+    report.bucket_shift = LATENCY_BUCKET_SHIFT;
+    report.cycles_per_us = SystemCoreClock / 1000000U;
+    report.reserved[0] = 0;
+    report.reserved[1] = 0;
+
+    // Copy in one go, so the histogram isn't updated halfway through
+    uint32_t primask = critical_enter();
+    report.histogram =
+        latency_histograms[selected_port][selected_command][selected_stage];
+    critical_exit(primask);
+
+    memcpy(buffer, &report, sizeof(report));
+    select_next();
+
+    return sizeof(report);
+}
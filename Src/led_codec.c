@@ -0,0 +1,144 @@
+#include "led_codec.h"
+#include "stdbool.h"
+#include "string.h"
+
+typedef struct {
+    uint8_t const * colors;
+    uint8_t count;
+} Palette;
+
+// Decodes one segment's pixels into dst, or only checks the encoding if dst
+// is NULL. Returns the number of encoded bytes used, 0 if they're invalid.
+static uint16_t decode_segment(
+    uint8_t const * src, uint16_t len, Palette * palette, uint8_t * dst) {
+
+    if (len < 1) return 0;
+
+    LedCodec codec = (LedCodec)src[0];
+    uint16_t pos = 1;
+
+    switch (codec) {
+        case LedCodec_Raw: {
+            if (len < 1 + LED_PIXEL_BYTES_PER_SEGMENT) return 0;
+            if (dst) memcpy(dst, src + 1, LED_PIXEL_BYTES_PER_SEGMENT);
+            return 1 + LED_PIXEL_BYTES_PER_SEGMENT;
+        }
+
+        case LedCodec_RLE: {
+            uint8_t pixels = 0;
+
+            while (pixels < LED_PIXELS_PER_SEGMENT) {
+                if (pos + 4 > len) return 0;
+
+                uint8_t count = src[pos];
+                if (count == 0) return 0;
+                if (count > LED_PIXELS_PER_SEGMENT - pixels) return 0;
+
+                if (dst) {
+                    for (uint8_t i = 0; i < count; i++) {
+                        memcpy(dst + (pixels + i) * 3, src + pos + 1, 3);
+                    }
+                }
+
+                pixels += count;
+                pos += 4;
+            }
+
+            return pos;
+        }
+
+        case LedCodec_Palette8:
+        case LedCodec_Palette4: {
+            uint16_t index_bytes = codec == LedCodec_Palette8
+                ? LED_PIXELS_PER_SEGMENT
+                : (LED_PIXELS_PER_SEGMENT + 1) / 2;
+
+            if (pos + index_bytes > len) return 0;
+
+            for (uint8_t i = 0; i < LED_PIXELS_PER_SEGMENT; i++) {
+                uint8_t index = codec == LedCodec_Palette8
+                    ? src[pos + i]
+                    : (src[pos + i / 2] >> ((i & 1) * 4)) & 0x0F;
+
+                if (index >= palette->count) return 0;
+                if (dst) memcpy(dst + i * 3, palette->colors + index * 3, 3);
+            }
+
+            return pos + index_bytes;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+// Walks over the encoded segments, one for each bit set in segments, decoding
+// them into led_buffer if it's not NULL. encoded starts at the palette.
+// Returns true if the segments are valid.
+static uint8_t decode_segments(
+    uint8_t frame, uint16_t segments, 
+    uint8_t const * encoded, uint16_t len, uint8_t * led_buffer) {
+
+    if (len < 1) return false;
+
+    Palette palette = { .colors = encoded + 1, .count = encoded[0] };
+    uint16_t pos = 1 + palette.count * 3;
+
+    if (pos > len) return false;
+
+    for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+        if (!(segments & (1U << i))) continue;
+
+        uint8_t * segment = NULL;
+
+        if (led_buffer != NULL) {
+            uint8_t panel = i / SEGMENTS_PER_PANEL;
+
+            segment = led_buffer + i * BYTES_PER_SEGMENT;
+            segment[0] = (panel << 6) 
+                | ((i % SEGMENTS_PER_PANEL) << 4) 
+                | (frame & 0x0F);
+        }
+
+        uint16_t used = decode_segment(
+            encoded + pos, len - pos, &palette, segment ? segment + 1 : NULL);
+
+        if (used == 0) return false;
+        pos += used;
+    }
+
+    // Trailing bytes mean the host and us disagree about the format
+    return pos == len;
+}
+
+// Public functions ------------------------------------------------------------
+
+uint8_t led_codec_decode_frame(
+    uint8_t const * encoded, uint16_t len, uint8_t * led_buffer) {
+
+    if (len < 1) return false;
+
+    uint16_t all = (1U << SEGMENTS_PER_FRAME) - 1;
+    if (!decode_segments(encoded[0], all, encoded + 1, len - 1, NULL)) {
+        return false;
+    }
+
+    decode_segments(encoded[0], all, encoded + 1, len - 1, led_buffer);
+    return true;
+}
+
+uint8_t led_codec_decode_delta(
+    uint8_t const * encoded, uint16_t len, uint8_t * led_buffer, 
+    uint16_t * segments) {
+
+    if (len < 3) return false;
+
+    uint16_t mask = encoded[1] | (encoded[2] << 8);
+    if (!decode_segments(encoded[0], mask, encoded + 3, len - 3, NULL)) {
+        return false;
+    }
+
+    decode_segments(encoded[0], mask, encoded + 3, len - 3, led_buffer);
+    *segments = mask;
+    return true;
+}
@@ -0,0 +1,194 @@
+#include "led_stream.h"
+#include "stdbool.h"
+#include "string.h"
+
+// Public, so that contents can be inspected during debugging
+LedStreamStats led_stream_stats;
+
+static LedFrameHandler frame_handler = NULL;
+static LedEffectHandler effect_handler = NULL;
+static LedUpdateHandler update_handler = NULL;
+static uint8_t * frame_buffer = NULL;
+
+static uint8_t header[LED_STREAM_HEADER_LEN];
+static uint8_t payload[LED_STREAM_MAX_PAYLOAD];
+
+// Bytes received so far of the header or payload, whichever is current
+static uint16_t received = 0;
+
+// Payload length of the current message, 0 while receiving a header
+static uint16_t payload_len = 0;
+
+static inline uint16_t header_length() {
+    return header[2] | (header[3] << 8);
+}
+
+static inline uint8_t header_valid() {
+    if (header[0] != LED_STREAM_SYNC) return false;
+
+    switch ((LedStreamType)header[1]) {
+        case LedStream_Raw_Frame:
+            return header_length() == LED_ARRAY_SIZE;
+        case LedStream_Encoded_Frame:
+            return header_length() > 0 
+                && header_length() <= LED_CODEC_MAX_FRAME_LEN;
+        case LedStream_Delta_Frame:
+            return header_length() >= 4
+                && header_length() <= LED_CODEC_MAX_DELTA_LEN;
+        case LedStream_Effect:
+        case LedStream_Update:
+            return header_length() > 0
+                && header_length() <= LED_STREAM_MAX_PAYLOAD;
+        default:
+            return false;
+    }
+}
+
+static inline void process_header() {
+    if (header_valid()) {
+        payload_len = header_length();
+        received = 0;
+        return;
+    }
+
+    led_stream_stats.bad_headers++;
+
+    // Drop the first byte and keep whatever follows; the next header may
+    // start anywhere in it
+    uint8_t skip = 1;
+    while (skip < LED_STREAM_HEADER_LEN && header[skip] != LED_STREAM_SYNC) {
+        skip++;
+    }
+
+    memmove(header, header + skip, LED_STREAM_HEADER_LEN - skip);
+    received = LED_STREAM_HEADER_LEN - skip;
+    led_stream_stats.skipped_bytes += skip;
+}
+
+static inline uint8_t decode_payload(uint16_t * segments) {
+    *segments = (1U << SEGMENTS_PER_FRAME) - 1;
+
+    switch ((LedStreamType)header[1]) {
+        case LedStream_Raw_Frame:
+            memcpy(frame_buffer, payload, LED_ARRAY_SIZE);
+            return true;
+        case LedStream_Encoded_Frame:
+            return led_codec_decode_frame(payload, payload_len, frame_buffer);
+        case LedStream_Delta_Frame:
+            return led_codec_decode_delta(
+                payload, payload_len, frame_buffer, segments);
+        default:
+            return false;
+    }
+}
+
+static inline void process_effect() {
+    uint16_t len = payload_len;
+
+    payload_len = 0;
+    received = 0;
+
+    if (effect_handler == NULL) return;
+
+    if (effect_handler(payload, len)) {
+        led_stream_stats.effects++;
+    } else {
+        led_stream_stats.bad_frames++;
+    }
+}
+
+static inline void process_update() {
+    uint16_t len = payload_len;
+
+    payload_len = 0;
+    received = 0;
+
+    if (update_handler == NULL) return;
+
+    if (update_handler(payload, len)) {
+        led_stream_stats.updates++;
+    } else {
+        led_stream_stats.bad_frames++;
+    }
+}
+
+static inline void process_payload() {
+    if ((LedStreamType)header[1] == LedStream_Effect) {
+        process_effect();
+        return;
+    }
+
+    if ((LedStreamType)header[1] == LedStream_Update) {
+        process_update();
+        return;
+    }
+
+    uint16_t segments;
+    uint8_t decoded = decode_payload(&segments);
+
+    payload_len = 0;
+    received = 0;
+
+    if (!decoded) {
+        led_stream_stats.bad_frames++;
+        return;
+    }
+
+    led_stream_stats.frames++;
+
+    if (frame_handler != NULL) {
+        frame_handler(segments);
+    }
+}
+
+// Public functions ------------------------------------------------------------
+
+void led_stream_init(uint8_t * buffer, LedFrameHandler handler) {
+    frame_buffer = buffer;
+    frame_handler = handler;
+    received = 0;
+    payload_len = 0;
+    led_stream_stats = (LedStreamStats) { 0 };
+}
+
+void led_stream_set_effect_handler(LedEffectHandler handler) {
+    effect_handler = handler;
+}
+
+void led_stream_set_update_handler(LedUpdateHandler handler) {
+    update_handler = handler;
+}
+
+uint8_t * led_stream_receive_target(uint16_t * max_len) {
+    if (payload_len == 0) {
+        *max_len = LED_STREAM_HEADER_LEN - received;
+        return header + received;
+    }
+
+    *max_len = payload_len - received;
+    return payload + received;
+}
+
+void led_stream_received(uint16_t len) {
+    received += len;
+
+    if (payload_len == 0) {
+        if (received == LED_STREAM_HEADER_LEN) process_header();
+    } else {
+        if (received == payload_len) process_payload();
+    }
+}
+
+void led_stream_feed(uint8_t const * data, uint32_t len) {
+    while (len > 0) {
+        uint16_t max_len;
+        uint8_t * target = led_stream_receive_target(&max_len);
+
+        if (max_len > len) max_len = len;
+        memcpy(target, data, max_len);
+        led_stream_received(max_len);
+
+        data += max_len;
+        len -= max_len;
+    }
+}
@@ -0,0 +1,111 @@
+#include "leds.h"
+#include "stdbool.h"
+#include "string.h"
+#include "config.h"
+#include "msgbus.h"
+#include "request.h"
+
+// Public, so that contents can be inspected during debugging
+LedStats leds_stats;
+
+static uint8_t led_buffer[LED_ARRAY_SIZE];
+
+// Segments changed since they were last sent
+static uint16_t dirty_segments = 0;
+
+// Panels sent a segment since their last commit, bit per ComportId
+static uint8_t uncommitted_panels = 0;
+
+// Panels that have to be committed even without a new segment
+static uint8_t forced_panels = 0;
+
+static inline void send_segment(uint8_t segment) {
+    Request req = request_create(Command_Process_LED_Segment);
+    req.comport_id = (ComportId)(segment / SEGMENTS_PER_PANEL);
+    req.send_data = led_buffer + segment * BYTES_PER_SEGMENT;
+    req.send_data_len = BYTES_PER_SEGMENT;
+    msgbus_send_request(req);
+}
+
+static inline void send_commit(ComportId port) {
+    Request req = request_create(Command_Commit_LEDs);
+    req.comport_id = port;
+    msgbus_send_request(req);
+}
+
+// Public functions ------------------------------------------------------------
+
+uint8_t * leds_buffer() {
+    return led_buffer;
+}
+
+void leds_init() {
+    memset(led_buffer, 0, sizeof(led_buffer));
+
+    // Panels may show anything until they're first sent a frame, e.g. what
+    // the tests left on them, so the first frame goes out in full
+    dirty_segments = (1U << SEGMENTS_PER_FRAME) - 1;
+    uncommitted_panels = 0;
+    forced_panels = (1U << PANELS_PER_PLATFORM) - 1;
+    leds_stats = (LedStats) { 0 };
+}
+
+void leds_write_segment(uint8_t segment, uint8_t const * data) {
+    uint8_t * target = led_buffer + segment * BYTES_PER_SEGMENT;
+
+    // The header byte carries the frame number, which changes every frame
+    // even when the LEDs don't; only the LEDs decide whether it's dirty
+    if (!LED_DELTA_RELAY
+        || memcmp(target + 1, data + 1, BYTES_PER_SEGMENT - 1) != 0) {
+        dirty_segments |= 1U << segment;
+    } else {
+        leds_stats.segments_skipped++;
+    }
+
+    memcpy(target, data, BYTES_PER_SEGMENT);
+}
+
+void leds_mark_dirty(uint16_t segments) {
+    dirty_segments |= segments;
+}
+
+void leds_mark_panel_dirty(ComportId port) {
+    dirty_segments |= LEDS_PANEL_SEGMENTS(port);
+    forced_panels |= 1U << port;
+}
+
+void leds_send_dirty() {
+    for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+        if (!(dirty_segments & (1U << i))) continue;
+
+        // Panels that aren't there get everything again through
+        // leds_mark_panel_dirty once they are
+        if (!panel_connected((ComportId)(i / SEGMENTS_PER_PANEL))) continue;
+
+        send_segment(i);
+        uncommitted_panels |= 1U << (i / SEGMENTS_PER_PANEL);
+        leds_stats.segments_sent++;
+    }
+
+    dirty_segments = 0;
+}
+
+void leds_commit() {
+    uint8_t panels = LED_DELTA_RELAY
+        ? uncommitted_panels | forced_panels
+        : (1U << PANELS_PER_PLATFORM) - 1;
+
+    for (uint8_t i = 0; i < PANELS_PER_PLATFORM; i++) {
+        if (!panel_connected((ComportId)i)) continue;
+
+        if (panels & (1U << i)) {
+            send_commit((ComportId)i);
+            leds_stats.commits_sent++;
+        } else {
+            leds_stats.commits_skipped++;
+        }
+    }
+
+    uncommitted_panels = 0;
+    forced_panels = 0;
+}
@@ -1,5 +1,6 @@
 #include "main.h"
 #include "stdbool.h"
+#include "string.h"
 #include "uart.h"
 #include "commands.h"
 #include "msgbus.h"
@@ -11,23 +12,31 @@
 #include "tusb_config.h"
 #include "tusb.h"
 #include "tusb_hid.h"
+#include "scheduler.h"
+#include "sensors.h"
+#include "config.h"
+#include "leds.h"
+#include "led_stream.h"
+#include "effects.h"
+#include "steps.h"
+#include "update.h"
+#include "panel_program.h"
+#include "settings.h"
+#include "discovery.h"
 
 #define USB_HID_PACKET_SIZE_BYTES (64U)
-#define BYTES_PER_SEGMENT (64U)
-#define SEGMENTS_PER_PANEL (4U)
-#define BYTES_PER_PANEL (BYTES_PER_SEGMENT * SEGMENTS_PER_PANEL)
-#define PANELS_PER_PLATFORM (4U)
-#define LED_ARRAY_SIZE (BYTES_PER_PANEL * PANELS_PER_PLATFORM)
-
-#define SENSOR_RESPONSE_LEN (8U)
 
 #define COMPLETE_FRAME (0xFFFF)
 
-uint8_t sensor_buffer[USB_HID_PACKET_SIZE_BYTES];
-uint8_t usb_sensor_buffer[USB_HID_PACKET_SIZE_BYTES];
-
 volatile uint8_t last_usb_header;
 volatile uint32_t packets_fetched = 0;
+volatile uint32_t sensor_reports_sent = 0;
+volatile uint32_t gamepad_reports_sent = 0;
+
+// Messages from the vendor interface are decoded into this, and the segments
+// they carry copied over to leds_buffer(). Segments a delta frame leaves out
+// keep what they had, so they're never mistaken for changes.
+static uint8_t stream_buffer[LED_ARRAY_SIZE];
 
 static void init_system_clock(void);
 static void init_gpio(void);
@@ -36,108 +45,269 @@ static void init();
 static void run();
 static void test();
 
+// Step thresholds from the settings, which the gamepad's feature report
+// keeps up to date
+static void load_step_thresholds() {
+    StepThresholds thresholds;
+
+    for (uint8_t panel = 0; panel < SENSOR_PANEL_COUNT; panel++) {
+        for (uint8_t i = 0; i < STEP_SENSORS_PER_PANEL; i++) {
+            uint32_t value = settings_get(
+                Setting_Step_Thresholds + panel * STEP_SENSORS_PER_PANEL + i
+            );
+
+            thresholds.press[panel][i] = value;
+            thresholds.release[panel][i] = value >> 16;
+        }
+    }
+
+    steps_set_thresholds((uint8_t const *)&thresholds, sizeof(thresholds));
+}
+
 static inline void send_request_sensors() {
     Request req = request_create(Command_Request_Sensors);
     req.response_len = SENSOR_RESPONSE_LEN;
 
     req.comport_id = Comport_Left;
-    req.response_data = sensor_buffer + \
-        ((uint8_t)Comport_Left) * SENSOR_RESPONSE_LEN;
+    req.response_data = sensors_receive_target(Comport_Left);
     msgbus_send_request(req);
 
     req.comport_id = Comport_Down;
-    req.response_data = sensor_buffer + \
-        ((uint8_t)Comport_Down) * SENSOR_RESPONSE_LEN;
+    req.response_data = sensors_receive_target(Comport_Down);
     msgbus_send_request(req);
 
     req.comport_id = Comport_Up;
-    req.response_data = sensor_buffer + \
-        ((uint8_t)Comport_Up) * SENSOR_RESPONSE_LEN;
+    req.response_data = sensors_receive_target(Comport_Up);
     msgbus_send_request(req);
 
     req.comport_id = Comport_Right;
-    req.response_data = sensor_buffer + \
-        ((uint8_t)Comport_Right) * SENSOR_RESPONSE_LEN;
+    req.response_data = sensors_receive_target(Comport_Right);
     msgbus_send_request(req);
 }
 
 static inline void send_sensor_update_usb() {
-    tud_hid_report(
+    // Building the report takes the samples out of the panels' latest slots,
+    // so only do it once the endpoint can actually take the report. A busy
+    // endpoint posts Event_Sensor_Report again when the host has read it.
+    if (!tud_hid_ready() || !sensors_have_new()) return;
+
+    if (tud_hid_report(
         USB_SEND_REPORT_ID,
-        usb_sensor_buffer,
+        sensors_build_report(),
         USB_HID_PACKET_SIZE_BYTES
-    );
+    )) {
+        sensor_reports_sent++;
+    }
 }
 
-// Breaks when this is being done after a bunch of times
-static inline void process_sensor_data(Response * resp) {
-    uint8_t offset = (uint8_t)resp->comport_id * SENSOR_RESPONSE_LEN;
+static inline void send_gamepad_update_usb() {
+    static uint8_t sent_buttons = 0;
 
-    // Copy data over into usb sensor array
-    for (uint8_t i = 0; i < resp->data_length; i++) {
-        usb_sensor_buffer[offset + i] = resp->data[i];
-    }   
-}
+    uint8_t buttons = steps_buttons();
 
-static inline void send_commit_LEDs() {
-    Request req = request_create(Command_Commit_LEDs);
-    req.comport_id = Comport_Left;
-    msgbus_send_request(req);
-    req.comport_id = Comport_Down;
-    msgbus_send_request(req);
-    req.comport_id = Comport_Up;
-    msgbus_send_request(req);
-    req.comport_id = Comport_Right;
-    msgbus_send_request(req);
-}
+    // Only changes are sent; a busy endpoint posts Event_Sensor_Report again
+    // once the host has read the previous report
+    if (buttons == sent_buttons || !tud_hid_n_ready(USB_GAMEPAD_INSTANCE)) {
+        return;
+    }
 
-static inline void send_process_led_segment(uint8_t panel, uint8_t * data_ptr) {
-    Request req = request_create(Command_Process_LED_Segment);
-    req.comport_id = (ComportId)panel;
-    req.send_data = data_ptr;
-    req.send_data_len = BYTES_PER_SEGMENT;
-    msgbus_send_request(req);
+    if (tud_hid_n_report(
+        USB_GAMEPAD_INSTANCE,
+        0,
+        &buttons,
+        USB_GAMEPAD_REPORT_LEN
+    )) {
+        sent_buttons = buttons;
+        gamepad_reports_sent++;
+    }
 }
 
-static inline void process_led_data() {
+static inline void process_led_packet(uint8_t * packet) {
     static uint16_t segments_received = 0x0000;
-    static uint8_t led_buffer[LED_ARRAY_SIZE];
     static uint8_t previous_frame = 0xFF;
 
+    uint8_t header = packet[0];
+    last_usb_header = header;
+    uint8_t panel = (header >> 6) & 0x03;
+    uint8_t segment = (header >> 4) & 0x03;
+    uint8_t frame = header & 0x0F;
+
+    if (frame != previous_frame) {
+        segments_received = 0x0000;
+    }
+
+    previous_frame = frame;
+    segments_received |= (1 << (panel * PANELS_PER_PLATFORM + segment));
+
+    // LED data from the host takes over from any effect
+    effects_stop();
+
+    // Hosts send every segment over HID, but only changed ones go on to the
+    // panel
+    leds_write_segment(panel * SEGMENTS_PER_PANEL + segment, packet);
+    leds_send_dirty();
+
+    // This only runs when a packet arrives, so commit as soon as the last
+    // segment of a frame is in rather than waiting for the next packet
     if (segments_received == COMPLETE_FRAME) {
         DBG_LED3_ON();
         segments_received = 0x0000;
-        send_commit_LEDs();
+        leds_commit();
     }
+}
 
-    uint8_t * packet = usb_get_packet();
+// Frame handler for led_stream, called once a message from the vendor
+// interface has been decoded into stream_buffer. Every message is a whole
+// frame, so this commits even when a delta frame carried nothing.
+static void process_led_frame(uint16_t segments) {
+    effects_stop();
 
-    if (packet == NULL) {
-        return;
+    for (uint8_t i = 0; i < SEGMENTS_PER_FRAME; i++) {
+        if (!(segments & (1U << i))) continue;
+
+        leds_write_segment(i, stream_buffer + i * BYTES_PER_SEGMENT);
     }
 
-    uint8_t header = packet[0];
-    last_usb_header = header;
-    uint8_t panel = (header >> 6) & 0x03;
-    uint8_t segment = (header >> 4) & 0x03;
-    uint8_t frame = header & 0x0F;
+    DBG_LED3_ON();
+    leds_send_dirty();
+    leds_commit();
+}
 
-    uint16_t buffer_offset = 
-        panel * BYTES_PER_PANEL + segment * BYTES_PER_SEGMENT;
+static inline void process_led_stream() {
+    uint16_t max_len;
+    uint8_t * target = led_stream_receive_target(&max_len);
+    uint32_t len;
+
+    // Read straight into the parser's buffers; whole frames come out of
+    // process_led_frame. Reads never go past the end of a message, so
+    // stopping while the update's flash writer catches up leaves the rest in
+    // the endpoint, and the host waits. The writer posts Event_LED_Packet to
+    // get us going again.
+    while (!update_blocked() && (len = tud_vendor_read(target, max_len)) > 0) {
+        led_stream_received(len);
+        target = led_stream_receive_target(&max_len);
+    }
+}
+
+static inline void process_led_data() {
+    uint8_t * packet;
 
-    for (uint8_t i = 0; i < USB_HID_PACKET_SIZE_BYTES; i++) {
-        led_buffer[i + buffer_offset] = packet[i];
+    // Drain every waiting packet. Requests for a segment that's still queued
+    // get merged by msgbus, so this can't overrun the request queues.
+    while ((packet = usb_get_packet()) != NULL) {
+        process_led_packet(packet);
+        packets_fetched++;
+
+        // Contents are in leds_buffer() now, the slot can take the next report
+        usb_release_packet();
     }
 
-    if (frame != previous_frame) {
-        segments_received = 0x0000;
+    process_led_stream();
+}
+
+// Event handlers, see scheduler.h for their priorities
+
+static void on_msgbus() {
+    // Process interrupt flags set since we last got here
+    msgbus_process_flags();
+
+    // Ports may have become free; keep them busy with sensor requests
+    scheduler_post(Event_Sensor_Poll);
+}
+
+static void on_response() {
+    // Runs the response handlers registered in run()
+    msgbus_dispatch_responses();
+}
+
+// Response handlers, see msgbus_set_response_handler
+
+static void on_sensors_response(Response * resp) {
+    // Currently Request_Sensors is the only command that responds with data
+    // from the panel board
+    sensors_process_response(resp);
+
+    // A panel that was stepped on or off goes out on the gamepad right away,
+    // whatever the pacing of sensor reports
+    if (steps_process(resp->comport_id, resp->data)) {
+        scheduler_post(Event_Sensor_Report);
     }
 
-    previous_frame = frame;
-    segments_received |= (1 << (panel * PANELS_PER_PLATFORM + segment));
-    send_process_led_segment(panel, led_buffer + buffer_offset);
+    // With SOF pacing, reports go out on the next USB frame instead
+    if (!USB_SOF_REPORT_PACING) scheduler_post(Event_Sensor_Report);
+}
+
+static void on_usb() {
+    // Let TinyUSB process the events its interrupt queued up
+    tud_task();
+}
+
+static void on_sensor_report() {
+    // Send an update of the latest sensor readings over USB, if there is one
+    // and the endpoint is free
+    send_sensor_update_usb();
+
+    // Same for the gamepad buttons
+    send_gamepad_update_usb();
+}
+
+static void on_led_packet() {
+    // We've received LED data over USB, send it where it's got to go
+    process_led_data();
 }
 
+static void on_sensor_poll() {
+    // Request more sensor updates, always
+    send_request_sensors();
+}
+
+static void on_tick() {
+    // With no UART activity msgbus still needs to notice timeouts and
+    // switch ports, so give it a look every tick
+    on_msgbus();
+
+    // Renders a frame of the running LED effect when one is due
+    effects_tick(HAL_GetTick());
+
+    // Restarts into the bootloader once a DFU detach has been answered
+    update_tick(HAL_GetTick());
+
+    // Brings panels online once they're ready, and notices ones that went
+    // away
+    discovery_tick(HAL_GetTick());
+
+    // Catches panels that stopped answering while they're programmed
+    panel_program_tick(HAL_GetTick());
+
+    // Gets changed settings written once they've settled
+    settings_tick(HAL_GetTick());
+}
+
+// Change handler for discovery.h
+static void on_panel_change(ComportId port, uint8_t online) {
+    // A panel that came online has nothing lit yet, whatever it was sent
+    // before
+    if (online) {
+        leds_mark_panel_dirty(port);
+        return;
+    }
+
+    // One that went offline no longer says when it's stepped off
+    if (steps_release_panel(port)) scheduler_post(Event_Sensor_Report);
+}
+
+static void on_flash_write() {
+    // Writes the next bit of a firmware update, when one is coming in
+    update_write_step();
+
+    // Settings wait while an update has the flash unlocked
+    if (update_status.state != UpdateState_Receiving) settings_write_step();
+}
+
+// Called by TinyUSB when the host sends a DFU detach request
+void tud_dfu_rt_reboot_to_dfu() {
+    update_request_bootloader();
+}
 
 int main(void){
     init();
@@ -146,60 +316,81 @@ int main(void){
 }
 
 static void init() {
+    // Before anything else is set up, the ROM bootloader expects the board
+    // as it comes out of reset
+    update_check_bootloader();
+
     HAL_Init();
+    scheduler_init();
+
+    // Before anything reads a setting
+    settings_init();
+
     init_gpio();
     init_system_clock();
+
+    // USB first, so the host can start enumerating while the rest is set up
+    // and the panels start. Its interrupt only posts Event_USB, and tud_task
+    // doesn't run before run(), so none of the callbacks see anything that
+    // isn't set up yet.
+    tusb_init();
+
     uart_init();
     msgbus_init();
-    tusb_init();
+
+    // Nothing waits for the panels: they come online on ticks from here on,
+    // each as soon as it's ready, with USB serviced all the while
+    discovery_init(settings_get(Setting_Panels_Connected));
+    discovery_set_change_handler(on_panel_change);
+
+    panel_program_init();
+    sensors_init();
+    steps_init();
+    load_step_thresholds();
+    leds_init();
+    led_stream_init(stream_buffer, process_led_frame);
+    effects_init();
+    led_stream_set_effect_handler(effects_start);
+    update_init();
+    led_stream_set_update_handler(update_process_message);
     
     DBG_LED1_ON();
 }
 
 static void run() {
-    send_request_sensors();
+    scheduler_set_handler(Event_MsgBus, on_msgbus);
+    scheduler_set_handler(Event_Response, on_response);
+    scheduler_set_handler(Event_USB, on_usb);
+    scheduler_set_handler(Event_Sensor_Report, on_sensor_report);
+    scheduler_set_handler(Event_LED_Packet, on_led_packet);
+    scheduler_set_handler(Event_Sensor_Poll, on_sensor_poll);
+    scheduler_set_handler(Event_Tick, on_tick);
+    scheduler_set_handler(Event_Flash_Write, on_flash_write);
 
-    while (1) {
-        // Process any interrupt flags set since last loop
-        msgbus_process_flags();
-      
-        // If there's a new command response to process, do that
-        if (msgbus_have_pending_response()) {
-            Response * resp = msgbus_get_pending_response();
-          
-            switch (resp->request_command) {
-                case Command_Request_Sensors:
-                    // Currently Request_Sensors is the only command that
-                    // responds with data from the panel board
-                    process_sensor_data(resp);
-                    break;
-            }
-        }
-
-        // Send an update of the latest sensor readings over USB
-        send_sensor_update_usb();
+    msgbus_set_response_handler(Command_Request_Sensors, on_sensors_response);
 
-        // If we've received LED data over USB since last loop, process that,
-        // and send it where it's got to go
-        process_led_data();
+    send_request_sensors();
 
-        // Request more sensor updates, always
-        send_request_sensors();
-        
-        // Let TinyUSB process its interrupt flags
-        tud_task();
-    }
+    // Interrupts post events from here on, and we sleep when there are none
+    scheduler_run();
 }
 
 static void test() {
     // usb comms test
+    uint8_t test_report[USB_HID_PACKET_SIZE_BYTES] = {0};
+
+    for (uint8_t i = 0; i < 32; i++) {
+        test_report[i] = i;
+    }
+
     while (1) {
         tud_task();
 
-        send_sensor_update_usb();
-        for (uint8_t i = 0; i < 32; i++) {
-            usb_sensor_buffer[i] = i;
-        }
+        tud_hid_report(
+            USB_SEND_REPORT_ID,
+            test_report,
+            USB_HID_PACKET_SIZE_BYTES
+        );
 
         uint8_t * packet = usb_get_packet();
 
@@ -216,6 +407,8 @@ static void test() {
             }
         }
 
+        usb_release_packet();
+
         if (all_good) {
             DBG_LED3_ON();
         }
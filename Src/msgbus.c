@@ -4,10 +4,28 @@
 #include "req_queue.h"
 #include "error_handler.h"
 #include "config.h"
+#include "scheduler.h"
+#include "critical.h"
+#include "cycles.h"
+#include "latency.h"
+#include "string.h"
 
-#define RESPONSE_QUEUE_MAX (4U)
+// Must be a power of two no larger than 128, see queue_add
+#define RESPONSE_QUEUE_MAX (8U)
+#define RESPONSE_QUEUE_MASK (RESPONSE_QUEUE_MAX - 1)
+
+#define RESPONSE_HANDLER_MAX (8U)
 #define RESPONSE_TIMEOUT_TICKS (2U)
 
+// Weights for choosing between the up and right ports, see usart2_score.
+// Scores are in microseconds of waiting: each queued request counts as if it
+// had been waiting QUEUED_REQUEST_WEIGHT_US longer, and a queued sensor
+// request as SENSOR_REQUEST_WEIGHT_US longer on top of that.
+#define QUEUED_REQUEST_WEIGHT_US (100U)
+#define SENSOR_REQUEST_WEIGHT_US (500U)
+
+#define SERVICE_RATE_WINDOW_TICKS (1000U)
+
 #define SEND_COMPLETE_MASK (0x01U)
 #define RECEIVE_COMPLETE_MASK (0x02U)
 
@@ -19,19 +37,43 @@ PortState port_state_right;
 
 static PortState * port_states[COMPORT_ID_MAX + 1];
 
-static PortPair selected_ports;
-static PortPair unselected_ports;
+// Whichever of up and right is currently connected to USART2
+static PortState * usart2_port;
 
-static Response * queue_responses[RESPONSE_QUEUE_MAX];
-static int8_t queue_front = 0;
-static int8_t queue_rear = -1;
-static uint8_t queue_count = 0;
+static uint32_t rate_window_started_at = 0;
 
-static void switch_ports();
+// Public, so that contents can be inspected during debugging
+// Number of responses that came in while the response queue was full
+uint32_t msgbus_dropped_responses = 0;
+
+// Completed responses, copied in by value. Only one context ever adds to the
+// queue (the UART interrupts in ISR-driven mode, which don't preempt each
+// other, or the main thread otherwise) and only the main thread takes from
+// it. Each end only writes its own index, so no locking is needed.
+// The indexes run freely and wrap around; their difference is the count.
+static Response queue_responses[RESPONSE_QUEUE_MAX];
+static volatile uint8_t queue_front = 0;
+static volatile uint8_t queue_rear = 0;
+
+typedef struct {
+    Commands command;
+    ResponseHandler handler;
+} ResponseHandlerEntry;
+
+static ResponseHandlerEntry response_handlers[RESPONSE_HANDLER_MAX];
+static uint8_t response_handler_count = 0;
+
+static uint8_t programming_mode = false;
+
+static void switch_usart2_port(PortState *);
+static void schedule_usart2();
+static void service_port(PortState *);
+static void update_service_rates();
 static void start_request(Request *);
 static PortState * get_port_state(ComportId);
 
 static void check_timeout(PortState *);
+static void negotiate_framing(PortState *);
 
 // Should be given to uart as function pointers
 static void uart_on_send_complete(ComportId);
@@ -41,7 +83,7 @@ static void process_send_complete(PortState *);
 static void process_receive_complete(PortState *);
 
 static void queue_add(Response *);
-static Response * queue_take();
+static uint8_t queue_take(Response *);
 
 
 static inline Response create_response(
@@ -55,6 +97,7 @@ static inline Response create_response(
     resp.request_command = request_command;
     resp.data = data;
     resp.data_length = data_length;
+    resp.completed_at = 0;
 
     return resp;
 }
@@ -74,7 +117,17 @@ static inline void init_port_state(
     state->current_request = request_create(Command_None);
     state->current_request.comport_id = port;
     state->current_response = create_blank_response(port);
+    state->fast_framing = false;
+    state->timeouts_in_a_row = 0;
     state->interrupt_flags = 0x00;
+    state->request_started_at = 0;
+    state->last_turnaround = 0;
+    state->max_turnaround = 0;
+    state->completed_count = 0;
+    state->status_entered_at = 0;
+    state->last_serviced_at = 0;
+    state->service_rate = 0;
+    state->rate_window_count = 0;
     req_queue_init(&state->req_queue);
 }
 
@@ -86,15 +139,51 @@ static inline PortState * get_port_state(ComportId comport_id) {
     return port_states[comport_id];
 }
 
-static inline void switch_ports_if_done() {
-    PortStatus status1 = selected_ports.first->status;
-    PortStatus status2 = selected_ports.second->status;
+// Whether the port has a request in flight
+static inline uint8_t port_busy(PortState * port_state) {
+    return port_state->status != Status_Idle
+        && port_state->status != Status_Done;
+}
+
+static inline uint8_t port_has_work(PortState * port_state) {
+    return port_state->req_queue.count > 0;
+}
+
+static inline uint8_t is_programming(Request * req) {
+    return req->request_command >= Command_Program_Begin
+        && req->request_command <= Command_Program_Finish;
+}
+
+// Ticks the panel has to answer the current request before it times out
+static inline uint32_t response_timeout(PortState * port_state) {
+    return is_programming(&port_state->current_request)
+        ? MSGBUS_PROGRAM_TIMEOUT_TICKS
+        : RESPONSE_TIMEOUT_TICKS;
+}
+
+// Requests where waiting adds directly to input latency
+static inline uint8_t is_latency_sensitive(Request * req) {
+    return req->request_command == Command_Request_Sensors;
+}
+
+// How badly a port sharing USART2 wants it, see the weights at the top
+static uint32_t usart2_score(PortState * port_state) {
+    if (!port_has_work(port_state)) return 0;
 
-    if ((status1 == Status_Idle || status1 == Status_Done) &&
-        (status2 == Status_Idle || status2 == Status_Done)) {
+    uint32_t cycles_per_us = SystemCoreClock / 1000000U;
+    uint32_t score = cycles_since(port_state->last_serviced_at) / cycles_per_us;
 
-        switch_ports();
+    score += port_state->req_queue.count * QUEUED_REQUEST_WEIGHT_US;
+
+    if (is_latency_sensitive(req_queue_peek(&port_state->req_queue))) {
+        score += SENSOR_REQUEST_WEIGHT_US;
     }
+
+    return score;
+}
+
+static inline PortState * usart2_other_port() {
+    return usart2_port == &port_state_up ? &port_state_right : &port_state_up;
 }
 
 static inline void expect_acknowledge(PortState * port_state) {
@@ -118,10 +207,6 @@ static inline void clear_acknowledge_command(PortState * port_state) {
 }
 
 // Helpers for dealing with flags set by interrupts
-static inline uint8_t send_complete_is_set(PortState * port_state) {
-    return port_state->interrupt_flags & SEND_COMPLETE_MASK;
-}
-
 static inline uint8_t receive_complete_is_set(PortState * port_state) {
     return port_state->interrupt_flags & RECEIVE_COMPLETE_MASK;
 }
@@ -130,10 +215,6 @@ static inline void set_send_complete(PortState * port_state) {
     port_state->interrupt_flags |= SEND_COMPLETE_MASK;
 }
 
-static inline void reset_send_complete(PortState * port_state) {
-    port_state->interrupt_flags &= ~SEND_COMPLETE_MASK;
-}
-
 static inline void set_receive_complete(PortState * port_state) {
     port_state->interrupt_flags |= RECEIVE_COMPLETE_MASK;
 }
@@ -142,6 +223,116 @@ static inline void reset_receive_complete(PortState * port_state) {
     port_state->interrupt_flags &= ~RECEIVE_COMPLETE_MASK;
 }
 
+// Framed requests ------------------------------------------------------------
+//
+// Panels that negotiated fast framing take a request with data as one
+// transfer, rather than command byte / ack / data / ack:
+//
+//   Command_Framed, command, payload length, payload..., checksum
+//
+// The checksum makes all bytes of the frame add up to 0 (mod 256). The panel
+// answers with the request's response if it has one, otherwise with the same
+// two byte acknowledge it would give the command: MSG_ACKNOWLEGE, command.
+
+static inline uint8_t can_send_framed(PortState * port_state, Request * req) {
+    return port_state->fast_framing
+        && request_has_data(req)
+        && req->send_data_len <= MAX_REQUEST_DATA_BYTES;
+}
+
+// Writes the frame for a request into frame, returning its length
+static inline uint16_t build_frame(uint8_t * frame, Request * req) {
+    uint16_t payload_end = 3 + req->send_data_len;
+    uint8_t checksum = 0;
+
+    frame[0] = Command_Framed;
+    frame[1] = (uint8_t)req->request_command;
+    frame[2] = (uint8_t)req->send_data_len;
+    memcpy(frame + 3, req->send_data, req->send_data_len);
+
+    for (uint16_t i = 0; i < payload_end; i++) {
+        checksum += frame[i];
+    }
+
+    frame[payload_end] = (uint8_t)(0x100 - checksum);
+    return payload_end + 1;
+}
+
+static inline uint8_t check_negotiate_response(PortState * port_state) {
+    return port_state->negotiate_response[0] == MSG_ACKNOWLEGE
+        && port_state->negotiate_response[1] == MSG_FAST_FRAMING_VERSION;
+}
+
+// Reads and clears all interrupt flags at once, so a flag set by an interrupt
+// halfway through clearing another can't get lost
+static inline uint8_t take_interrupt_flags(PortState * port_state) {
+    uint32_t primask = critical_enter();
+    uint8_t flags = port_state->interrupt_flags;
+    port_state->interrupt_flags = 0x00;
+    critical_exit(primask);
+
+    return flags;
+}
+
+static inline uint8_t is_sending(PortState * port_state) {
+    return port_state->status == Status_Sending_Command
+        || port_state->status == Status_Sending_Data;
+}
+
+// Stage of a request that time spent in the given status counts towards
+static inline LatencyStage status_latency_stage(PortStatus status) {
+    switch (status) {
+        case Status_Sending_Command: return Latency_Sending_Command;
+        case Status_Awaiting_Command_Ack: return Latency_Awaiting_Command_Ack;
+        case Status_Sending_Data: return Latency_Sending_Data;
+        case Status_Awaiting_Data_Ack: return Latency_Awaiting_Data_Ack;
+        case Status_Receiving: return Latency_Receiving;
+        default: return Latency_Queued;
+    }
+}
+
+// Moves a request in progress on to its next status, recording how long it
+// spent in the previous one
+static inline void set_status(PortState * port_state, PortStatus status) {
+    uint32_t now = cycles_now();
+
+#if MSGBUS_LATENCY_STATS
+    latency_record(
+        port_state->comport_id,
+        port_state->current_request.request_command,
+        status_latency_stage(port_state->status),
+        now - port_state->status_entered_at
+    );
+#endif
+
+    port_state->status = status;
+    port_state->status_entered_at = now;
+}
+
+// Marks the current request as finished, recording how long it took
+static inline void set_done(PortState * port_state) {
+    uint32_t turnaround = cycles_since(port_state->request_started_at);
+
+    port_state->last_turnaround = turnaround;
+    port_state->completed_count++;
+    port_state->timeouts_in_a_row = 0;
+
+    if (turnaround > port_state->max_turnaround) {
+        port_state->max_turnaround = turnaround;
+    }
+
+#if MSGBUS_LATENCY_STATS
+    latency_record(
+        port_state->comport_id,
+        port_state->current_request.request_command,
+        Latency_Total,
+        cycles_since(port_state->current_request.queued_at)
+    );
+#endif
+
+    set_status(port_state, Status_Done);
+}
+
 // Whether any of the ports have interrupt flags
 static inline uint8_t any_interrupt_flags() {
     return port_state_left.interrupt_flags 
@@ -153,73 +344,110 @@ static inline uint8_t any_interrupt_flags() {
 // Processes interrupt flags that were set since the last call,
 // set by a send and/or receive transaction completing
 static inline void process_flags(PortState * port_state) {
+    uint8_t flags = take_interrupt_flags(port_state);
+
     // Note: it's important that process_send_complete is called before
     // process_receive_complete, for correct function of the state machine.
-    if (send_complete_is_set(port_state)) {
-        reset_send_complete(port_state);
+    if (flags & SEND_COMPLETE_MASK) {
         process_send_complete(port_state);
     }
 
-    if (receive_complete_is_set(port_state)) {
-        reset_receive_complete(port_state);
+    if (flags & RECEIVE_COMPLETE_MASK) {
         process_receive_complete(port_state);
     }
 }
 
+// A commit shows the segments sent before it, so one can't stand in for
+// another with segments queued in between; leds_commit counts on a commit
+// being sent after every segment it sent before. It's only merged with a
+// commit that's last in line, or, with nothing queued, one being sent.
+static void queue_commit(PortState * port_state, Request request) {
+    Request * last = req_queue_peek_last(&port_state->req_queue);
+
+    if (last != NULL) {
+        if (request_equals(*last, request)) return;
+    } else if (port_busy(port_state)
+        && request_equals(port_state->current_request, request)) {
+        return;
+    }
+
+    req_queue_append(&port_state->req_queue, request);
+}
+
 // Public functions ------------------------------------------------------------
 
 void msgbus_init() {
+    req_queue_pool_init();
+
+    // Left and down have a UART to themselves, so are always selected
     init_port_state(&port_state_left, Comport_Left, true);
+    init_port_state(&port_state_down, Comport_Down, true);
     init_port_state(&port_state_up, Comport_Up, true);
     init_port_state(&port_state_right, Comport_Right, false);
-    init_port_state(&port_state_down, Comport_Down, false);
 
     port_states[Comport_Left] = &port_state_left;
     port_states[Comport_Down] = &port_state_down;
     port_states[Comport_Up] = &port_state_up;
     port_states[Comport_Right] = &port_state_right;
 
-    selected_ports.first = &port_state_left;
-    selected_ports.second = &port_state_up;
-    unselected_ports.first = &port_state_right;
-    unselected_ports.second = &port_state_down;
+    usart2_port = &port_state_up;
+    uart_connect_port(usart2_port->comport_id);
+    rate_window_started_at = HAL_GetTick();
 
-    uart_connect_port(selected_ports.first->comport_id);
-    uart_connect_port(selected_ports.second->comport_id);
+    latency_init();
 
     uart_set_on_send_complete_handler(uart_on_send_complete);
     uart_set_on_receive_complete_handler(uart_on_receive_complete);
+
+    // Framing is negotiated as each panel comes online, see msgbus_port_online
 }
 
 void msgbus_process_flags() {
-    if (!any_interrupt_flags()) {
+#if !MSGBUS_ISR_DRIVEN
+    // In ISR-driven mode the interrupts deal with their own flags
+    if (any_interrupt_flags()) {
+        process_flags(&port_state_left);
+        process_flags(&port_state_down);
+        process_flags(&port_state_up);
+        process_flags(&port_state_right);
+    } else
+#endif
+    {
         check_timeout(&port_state_left);
         check_timeout(&port_state_down);
         check_timeout(&port_state_up);
         check_timeout(&port_state_right);
-        switch_ports_if_done();
-        return;
     }
 
-    process_flags(&port_state_left);
-    process_flags(&port_state_down);
-    process_flags(&port_state_up);
-    process_flags(&port_state_right);
+    // Ports that just finished can go straight on to their next request
+    service_port(&port_state_left);
+    service_port(&port_state_down);
+    schedule_usart2();
 
-    switch_ports_if_done();
+    update_service_rates();
 }
 
 void msgbus_send_request(Request request) {
     if (!panel_connected(request.comport_id)) return;
+    if (programming_mode && !is_programming(&request)
+        && request.request_command != Command_Negotiate_Framing) return;
 
     PortState * portState = get_port_state(request.comport_id);
+    request.queued_at = cycles_now();
 
-    // Not Idle? Stick it on the queue
+    // Busy? Stick it on the queue
     // Also if port is not selected we'll queue it for later
-    if (portState->status != Status_Idle || !portState->selected) {
-        // Only queue a request if it's not one that's currently being
-        // executed
-        if (!request_equals(portState->current_request, request)) {
+    // Interrupts never start requests, so the request queue is only ever
+    // touched from the main thread, in either MSGBUS_ISR_DRIVEN mode.
+    if (port_busy(portState) || !portState->selected) {
+        if (request.request_command == Command_Commit_LEDs) {
+            queue_commit(portState, request);
+        } else if (request.request_command == Command_Process_LED_Segment
+            || !port_busy(portState)
+            || !request_equals(portState->current_request, request)) {
+            // Only queue a request if it's not one that's currently being
+            // executed. A segment is, as its data has changed since the one
+            // on the wire was started; leds_send_dirty doesn't send it again.
             req_queue_add(&portState->req_queue, request);
         }
 
@@ -233,21 +461,86 @@ void msgbus_send_request(Request request) {
 }
 
 uint8_t msgbus_have_pending_response() {
-    return queue_count > 0;
+    return queue_rear != queue_front;
+}
+
+Response msgbus_get_pending_response() {
+    Response resp = create_blank_response(Comport_None);
+    queue_take(&resp);
+
+    return resp;
 }
 
-Response * msgbus_get_pending_response() {
-    return queue_take();
+void msgbus_set_response_handler(Commands command, ResponseHandler handler) {
+    for (uint8_t i = 0; i < response_handler_count; i++) {
+        if (response_handlers[i].command == command) {
+            response_handlers[i].handler = handler;
+            return;
+        }
+    }
+
+    if (response_handler_count == RESPONSE_HANDLER_MAX) {
+        error_panic_data(Error_App_MsgBus_TooManyHandlers, command);
+        return;
+    }
+
+    response_handlers[response_handler_count].command = command;
+    response_handlers[response_handler_count].handler = handler;
+    response_handler_count++;
+}
+
+void msgbus_dispatch_responses() {
+    Response resp;
+
+    while (queue_take(&resp)) {
+        for (uint8_t i = 0; i < response_handler_count; i++) {
+            if (response_handlers[i].command == resp.request_command) {
+                response_handlers[i].handler(&resp);
+                break;
+            }
+        }
+    }
 }
 
 void msgbus_switch_ports_if_done() {
-    switch_ports_if_done();
+    schedule_usart2();
+}
+
+void msgbus_set_programming_mode(uint8_t enabled) {
+    programming_mode = enabled;
+}
+
+uint8_t msgbus_programming_mode() {
+    return programming_mode;
 }
 
 PortStatus msgbus_port_status(ComportId comport_id) {
     return get_port_state(comport_id)->status;
 }
 
+uint8_t msgbus_port_framed(ComportId comport_id) {
+    return get_port_state(comport_id)->fast_framing;
+}
+
+void msgbus_port_online(ComportId comport_id) {
+    PortState * port_state = get_port_state(comport_id);
+
+    port_state->fast_framing = false;
+    port_state->timeouts_in_a_row = 0;
+
+#if MSGBUS_FAST_FRAMING
+    negotiate_framing(port_state);
+#endif
+}
+
+void msgbus_port_offline(ComportId comport_id) {
+    req_queue_clear(&get_port_state(comport_id)->req_queue);
+}
+
+uint8_t msgbus_port_timeouts_in_a_row(ComportId comport_id) {
+    return get_port_state(comport_id)->timeouts_in_a_row;
+}
+
 void msgbus_wait_for_idle(ComportId comport_id) {
     PortState * port_state = get_port_state(comport_id);
 
@@ -260,15 +553,55 @@ void msgbus_wait_for_idle(ComportId comport_id) {
 // Private functions -----------------------------------------------------------
 
 // Callbacks for uart interrupts
+#if MSGBUS_ISR_DRIVEN
+
+// The state machine is advanced right here, so the next stage of a request
+// starts without waiting on the main loop. The main loop still gets an event
+// to pick up responses and to switch ports.
+static void uart_on_send_complete(ComportId comport_id) {
+    PortState * port_state = get_port_state(comport_id);
+    process_send_complete(port_state);
+
+    // A quick reply can finish receiving before we've been told sending is
+    // done; that receive was held back until now, see below
+    if (receive_complete_is_set(port_state)) {
+        reset_receive_complete(port_state);
+        process_receive_complete(port_state);
+    }
+
+    scheduler_post(Event_MsgBus);
+}
+
+static void uart_on_receive_complete(ComportId comport_id) {
+    PortState * port_state = get_port_state(comport_id);
+
+    // process_send_complete must see the transfer before
+    // process_receive_complete does, as in the flag-driven mode
+    if (is_sending(port_state)) {
+        set_receive_complete(port_state);
+        return;
+    }
+
+    process_receive_complete(port_state);
+    scheduler_post(Event_MsgBus);
+}
+
+#else
+
 static void uart_on_send_complete(ComportId comport_id) {
     set_send_complete(get_port_state(comport_id));
+    scheduler_post(Event_MsgBus);
 }
 
 static void uart_on_receive_complete(ComportId comport_id) {
     set_receive_complete(get_port_state(comport_id));
+    scheduler_post(Event_MsgBus);
 }
 
-// Process interrupt flags on main thread
+#endif
+
+// Process interrupt flags, on the main thread or straight from the interrupt
+// when MSGBUS_ISR_DRIVEN is set
 
 // Process a completed UART send
 static void process_send_complete(PortState * port_state) {
@@ -278,9 +611,9 @@ static void process_send_complete(PortState * port_state) {
 
         case Status_Sending_Command:
             if (!request_has_data(req) && request_expects_response(req)) {
-                port_state->status = Status_Receiving;
+                set_status(port_state, Status_Receiving);
             } else {
-                port_state->status = Status_Awaiting_Command_Ack;
+                set_status(port_state, Status_Awaiting_Command_Ack);
             }
 
             port_state->waiting_since = HAL_GetTick();
@@ -291,9 +624,9 @@ static void process_send_complete(PortState * port_state) {
             // Finished sending additional data, now see if we should expect
             // a response right now.
             if (request_expects_response(req)) {
-                port_state->status = Status_Receiving;
+                set_status(port_state, Status_Receiving);
             } else {
-                port_state->status = Status_Awaiting_Data_Ack;
+                set_status(port_state, Status_Awaiting_Data_Ack);
             }
 
             port_state->waiting_since = HAL_GetTick();
@@ -312,17 +645,27 @@ static void process_send_complete(PortState * port_state) {
     }
 }
 
+// Something other than an ack came back. On a noisy line a panel that lost
+// part of a programming request answers it late, into the next request's
+// ack, so that one is given up on as if it had timed out. panel_program.c
+// sends whatever went missing again. Anything else is a bug, and panics.
+static void no_acknowledge(PortState * port_state) {
+    if (is_programming(&port_state->current_request)) {
+        port_state->timeout_count++;
+        set_done(port_state);
+        return;
+    }
+
+    error_panic_data(Error_App_MsgBus_RecvCpltNoAck, port_state->status);
+}
+
 static void process_receive_complete(PortState * port_state) {
     Request * req = &port_state->current_request;
 
     switch (port_state->status) {
         case Status_Awaiting_Command_Ack:
             if (!check_acknowledge(port_state)) {
-                error_panic_data(
-                    Error_App_MsgBus_RecvCpltNoAck,
-                    Status_Awaiting_Command_Ack
-                );
-
+                no_acknowledge(port_state);
                 break;
             }
 
@@ -330,11 +673,11 @@ static void process_receive_complete(PortState * port_state) {
             // We wouldn't be in awaiting ack state if we expected
             // a data response back without sending data out first.
             if (!request_has_data(req)) {
-                port_state->status = Status_Done;
+                set_done(port_state);
                 break;
             }
 
-            port_state->status = Status_Sending_Data;
+            set_status(port_state, Status_Sending_Data);
 
             // If we also expect a response, set that up first now
             if (request_expects_response(req)) {
@@ -360,27 +703,31 @@ static void process_receive_complete(PortState * port_state) {
             // If we get in this state at all, we're not expecting a data
             // response, so we can mark it done
             if (!check_acknowledge(port_state)) {
-                error_panic_data(
-                    Error_App_MsgBus_RecvCpltNoAck,
-                    Status_Awaiting_Data_Ack
-                );
-
+                no_acknowledge(port_state);
                 break;
             }
 
-            port_state->status = Status_Done;
+            set_done(port_state);
             break;
 
         case Status_Receiving:
+            // Negotiation is internal to msgbus, nobody's waiting on it
+            if (req->request_command == Command_Negotiate_Framing) {
+                port_state->fast_framing = check_negotiate_response(port_state);
+                set_done(port_state);
+                break;
+            }
+
             port_state->current_response = create_response(
                 req->comport_id,
                 req->request_command,
                 req->response_data,
                 req->response_len
             );
+            port_state->current_response.completed_at = cycles_now();
 
             queue_add(&port_state->current_response);
-            port_state->status = Status_Done;
+            set_done(port_state);
             break;
 
         default:
@@ -395,61 +742,152 @@ static void process_receive_complete(PortState * port_state) {
 }
 
 static void check_timeout(PortState * port_state) {
+    // The completion interrupt may be advancing this port at the same time
+    // (in ISR-driven mode), so check and abort in one go
+    uint32_t primask = critical_enter();
+
     switch (port_state->status) {
         case Status_Awaiting_Command_Ack:
         case Status_Awaiting_Data_Ack:
         case Status_Receiving:
             if (HAL_GetTick() - port_state->waiting_since \
-                > RESPONSE_TIMEOUT_TICKS) {
+                > response_timeout(port_state)) {
 
                 uart_abort_receive(port_state->comport_id);
                 port_state->timeout_count++;
+                if (port_state->timeouts_in_a_row < 0xFF) {
+                    port_state->timeouts_in_a_row++;
+                }
                 port_state->status = Status_Done;
             }
 
             break;
     }
+
+    critical_exit(primask);
+}
+
+// Starts the next queued request on a selected port that has finished its
+// last one. A port with nothing left to do goes back to idle.
+static void service_port(PortState * port_state) {
+    if (!port_state->selected || port_busy(port_state)) return;
+
+    if (!port_has_work(port_state)) {
+        port_state->status = Status_Idle;
+        return;
+    }
+
+    port_state->current_request = req_queue_take(&port_state->req_queue);
+    start_request(&port_state->current_request);
+}
+
+// Decides which of the up and right ports gets USART2 next, once the current
+// one has finished what it's doing. Stays put if the other port has nothing
+// to do, so an idle connector never costs a switch.
+static void schedule_usart2() {
+    if (port_busy(usart2_port)) return;
+
+    PortState * other = usart2_other_port();
+
+    if (port_has_work(other)
+        && usart2_score(other) > usart2_score(usart2_port)) {
+
+        switch_usart2_port(other);
+    }
+
+    service_port(usart2_port);
 }
 
-// Switches between selected port pairs, and starts any queued requests
-// for the ports previously unselected
-static void switch_ports() {
-    PortPair move_ports = unselected_ports;
-    unselected_ports = selected_ports;
-    selected_ports = move_ports;
+// Connects USART2 to the given port's connector, taking it away from the other
+static void switch_usart2_port(PortState * port_state) {
+    usart2_port->selected = false;
+    usart2_port->status = Status_Idle;
 
-    unselected_ports.first->selected = false;
-    unselected_ports.second->selected = false;
+    uart_connect_port(port_state->comport_id);
 
-    uart_connect_port(selected_ports.first->comport_id);
-    uart_connect_port(selected_ports.second->comport_id);
+    usart2_port = port_state;
+    usart2_port->selected = true;
+}
 
-    selected_ports.first->selected = true;
-    selected_ports.second->selected = true;
+// Once per SERVICE_RATE_WINDOW_TICKS, works out each port's service_rate
+static void update_service_rates() {
+    if (HAL_GetTick() - rate_window_started_at < SERVICE_RATE_WINDOW_TICKS) {
+        return;
+    }
 
-    unselected_ports.first->status = Status_Idle;
-    unselected_ports.second->status = Status_Idle;
+    rate_window_started_at = HAL_GetTick();
 
-    // If newly-selected ports had queued requests, start them off now
-    if (selected_ports.first->req_queue.count > 0) {
-        Request req = req_queue_take(&selected_ports.first->req_queue);
-        selected_ports.first->current_request = req;
-        start_request(&selected_ports.first->current_request);
-    } 
+    for (uint8_t i = 0; i <= COMPORT_ID_MAX; i++) {
+        PortState * port_state = port_states[i];
 
-    if (selected_ports.second->req_queue.count > 0) {
-        Request req = req_queue_take(&selected_ports.second->req_queue);
-        selected_ports.second->current_request = req;
-        start_request(&selected_ports.second->current_request);
+        port_state->service_rate =
+            port_state->completed_count - port_state->rate_window_count;
+        port_state->rate_window_count = port_state->completed_count;
     }
 }
 
+// Asks the panel whether it takes framed requests. Panels running firmware
+// from before framing existed won't answer, and time out as usual.
+static void negotiate_framing(PortState * port_state) {
+    Request req = request_create(Command_Negotiate_Framing);
+    req.comport_id = port_state->comport_id;
+    req.response_data = port_state->negotiate_response;
+    req.response_len = sizeof(port_state->negotiate_response);
+
+    port_state->negotiate_response[0] = 0x00;
+    port_state->negotiate_response[1] = 0x00;
+
+    msgbus_send_request(req);
+}
+
+// Sends a request with data as a single frame, see build_frame
+static void start_framed_request(PortState * port_state, Request * request) {
+    uint16_t frame_len = build_frame(port_state->frame, request);
+
+    // There is no separate command stage, go straight to sending data; from
+    // here the state machine is the same as for unframed requests
+    port_state->status = Status_Sending_Data;
+
+    if (request_expects_response(request)) {
+        uart_receive(
+            request->comport_id,
+            request->response_data,
+            request->response_len
+        );
+    } else {
+        expect_acknowledge_command(port_state);
+    }
+
+    uart_send(request->comport_id, port_state->frame, frame_len);
+}
+
 // Begin a new request
 static void start_request(Request * request) {
     // Assumption at this stage: request has valid comport_id
 
     PortState * port_state = get_port_state(request->comport_id);
     clear_acknowledge_command(port_state);
+    port_state->request_started_at = cycles_now();
+    port_state->last_serviced_at = port_state->request_started_at;
+    port_state->status_entered_at = port_state->request_started_at;
+
+#if MSGBUS_LATENCY_STATS
+    latency_record(
+        request->comport_id,
+        request->request_command,
+        Latency_Queued,
+        port_state->request_started_at - request->queued_at
+    );
+#endif
+
+    // Nothing is in flight on an idle port; drop flags left over from
+    // transfers that were aborted on timeout
+    port_state->interrupt_flags = 0x00;
+
+    if (can_send_framed(port_state, request)) {
+        start_framed_request(port_state, request);
+        return;
+    }
 
     port_state->status = Status_Sending_Command;
 
@@ -471,25 +909,37 @@ static void start_request(Request * request) {
     uart_send(request->comport_id, &request->request_command, 1);
 }
 
+// Copies the response onto the queue, or counts it as dropped if full
 static void queue_add(Response * resp) {
-    // Don't take more responses than max
-    if (queue_count == RESPONSE_QUEUE_MAX) return;
+    uint8_t rear = queue_rear;
+
+    if ((uint8_t)(rear - queue_front) == RESPONSE_QUEUE_MAX) {
+        msgbus_dropped_responses++;
+        return;
+    }
+
+    queue_responses[rear & RESPONSE_QUEUE_MASK] = *resp;
 
-    if (queue_rear == RESPONSE_QUEUE_MAX - 1) queue_rear = -1;
+    // The response must be in place before the taking side can see it
+    __DMB();
+    queue_rear = rear + 1;
 
-    queue_rear++;
-    queue_responses[queue_rear] = resp;
-    queue_count++;
+    scheduler_post(Event_Response);
 }
 
-static Response * queue_take() {
-    if (queue_count == 0) return NULL;
+// Copies the oldest response into resp and takes it off the queue.
+// Returns false if there was none.
+static uint8_t queue_take(Response * resp) {
+    uint8_t front = queue_front;
 
-    Response * resp = queue_responses[queue_front];
+    if (queue_rear == front) return false;
 
-    queue_front++;
-    if (queue_front == RESPONSE_QUEUE_MAX) queue_front = 0;
-    queue_count--;
+    __DMB();
+    *resp = queue_responses[front & RESPONSE_QUEUE_MASK];
 
-    return resp;
-} 
\ No newline at end of file
+    // Done reading before the slot is handed back for reuse
+    __DMB();
+    queue_front = front + 1;
+
+    return true;
+}
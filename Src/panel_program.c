@@ -0,0 +1,595 @@
+#include "panel_program.h"
+#include "stdbool.h"
+#include "string.h"
+#include "msgbus.h"
+#include "config.h"
+#include "crc.h"
+
+#define PANEL_COUNT (COMPORT_ID_MAX + 1)
+
+#define CONTROL_MESSAGE_LEN (8U)
+
+_Static_assert(PANEL_PROGRAM_CHUNK_MESSAGE_LEN <= MAX_REQUEST_DATA_BYTES, "Chunks must fit a request");
+_Static_assert(PANEL_PROGRAM_CHUNK_LEN % 4 == 0, "Chunks must be whole words for the CRC unit");
+
+typedef struct {
+    // Offset, chunk and CRC, as sent
+    uint8_t message[PANEL_PROGRAM_CHUNK_MESSAGE_LEN];
+    uint8_t response[PANEL_PROGRAM_RESPONSE_LEN];
+
+    uint32_t offset;
+    uint16_t len;
+
+    // When the request was handed to msgbus, see note_answer
+    uint32_t sequence;
+    uint8_t in_flight;
+} ChunkSlot;
+
+typedef struct {
+    ComportId port;
+    PanelProgramProgress * progress;
+
+    ChunkSlot slots[PANEL_PROGRAM_SLOTS];
+
+    // Begin, Status and Finish go through here, one at a time
+    uint8_t control_message[CONTROL_MESSAGE_LEN];
+    uint8_t control_response[PANEL_PROGRAM_RESPONSE_LEN];
+    uint32_t control_sequence;
+    uint8_t control_in_flight;
+
+    // Counts requests handed to msgbus
+    uint32_t sequence;
+
+    // Offset of the next chunk to send
+    uint32_t next;
+
+    // Bytes the panel took, in order. With rewind set, the chunks sent from
+    // here on go again once the answers to those still in flight are in.
+    uint32_t accepted;
+    uint8_t rewind;
+
+    // Chunks the panel holds before they're in flash
+    uint8_t window;
+
+    // Restarts and stalls since the panel last took a chunk
+    uint8_t retries;
+
+    uint32_t last_heard_at;
+    uint32_t last_polled_at;
+} Programmer;
+
+// Public, so that contents can be inspected during debugging
+PanelProgramProgress panel_program_progress[PANEL_COUNT];
+
+static Programmer programmers[PANEL_COUNT];
+
+static uint8_t const * image = NULL;
+static uint32_t image_len = 0;
+static uint32_t image_crc = 0;
+static uint8_t active = false;
+
+static void advance(Programmer *);
+
+static inline uint32_t read_u32(uint8_t const * data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static inline void write_u32(uint8_t * data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+static inline uint16_t chunk_len(uint32_t offset) {
+    uint32_t left = image_len - offset;
+    return left < PANEL_PROGRAM_CHUNK_LEN ? left : PANEL_PROGRAM_CHUNK_LEN;
+}
+
+static inline uint8_t is_programming(Programmer * programmer) {
+    uint8_t state = programmer->progress->state;
+
+    return state == PanelProgram_Beginning
+        || state == PanelProgram_Sending
+        || state == PanelProgram_Finishing;
+}
+
+static uint8_t chunks_in_flight(Programmer * programmer) {
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < PANEL_PROGRAM_SLOTS; i++) {
+        if (programmer->slots[i].in_flight) count++;
+    }
+
+    return count;
+}
+
+static inline uint8_t in_flight(Programmer * programmer) {
+    return programmer->control_in_flight + chunks_in_flight(programmer);
+}
+
+static inline uint8_t anything_in_flight(Programmer * programmer) {
+    return in_flight(programmer) > 0;
+}
+
+static ChunkSlot * free_slot(Programmer * programmer) {
+    for (uint8_t i = 0; i < PANEL_PROGRAM_SLOTS; i++) {
+        if (!programmer->slots[i].in_flight) return &programmer->slots[i];
+    }
+
+    return NULL;
+}
+
+// The slot whose response buffer the answer went into
+static ChunkSlot * answered_slot(Programmer * programmer, uint8_t * response) {
+    for (uint8_t i = 0; i < PANEL_PROGRAM_SLOTS; i++) {
+        if (programmer->slots[i].response == response) {
+            return &programmer->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Whether the chunk at next fits the panel's window, counting from what's
+// in its flash
+static inline uint8_t window_has_room(Programmer * programmer) {
+    uint32_t end = programmer->next + chunk_len(programmer->next);
+    uint32_t committed = programmer->progress->committed;
+
+    return end <= committed
+        || end - committed <= (uint32_t)programmer->window * PANEL_PROGRAM_CHUNK_LEN;
+}
+
+static void send(
+    Programmer * programmer,
+    Commands command,
+    uint8_t * data,
+    uint16_t len,
+    uint8_t * response,
+    uint32_t * sequence
+) {
+    Request req = request_create(command);
+    req.comport_id = programmer->port;
+    req.send_data = len > 0 ? data : NULL;
+    req.send_data_len = len;
+    req.response_data = response;
+    req.response_len = PANEL_PROGRAM_RESPONSE_LEN;
+
+    // The wait for an answer starts now, not when the last one came
+    if (!anything_in_flight(programmer)) {
+        programmer->last_heard_at = HAL_GetTick();
+    }
+
+    *sequence = programmer->sequence++;
+    msgbus_send_request(req);
+}
+
+static void send_control(Programmer * programmer, Commands command) {
+    uint16_t len = 0;
+
+    if (command == Command_Program_Begin) {
+        write_u32(programmer->control_message, image_len);
+        write_u32(programmer->control_message + 4, image_crc);
+        len = 8;
+    }
+
+    send(
+        programmer,
+        command,
+        programmer->control_message,
+        len,
+        programmer->control_response,
+        &programmer->control_sequence
+    );
+    programmer->control_in_flight = true;
+}
+
+static void send_chunk(Programmer * programmer, ChunkSlot * slot) {
+    slot->offset = programmer->next;
+    slot->len = chunk_len(slot->offset);
+
+    write_u32(slot->message, slot->offset);
+    memcpy(slot->message + 4, image + slot->offset, slot->len);
+    write_u32(
+        slot->message + 4 + slot->len,
+        crc32(slot->message, 4 + slot->len)
+    );
+
+    programmer->next += slot->len;
+
+    send(
+        programmer,
+        Command_Program_Chunk,
+        slot->message,
+        4 + slot->len + 4,
+        slot->response,
+        &slot->sequence
+    );
+    slot->in_flight = true;
+}
+
+// Returns false, having given up on the panel, once it's gone too long
+// without taking any more of the image
+static uint8_t retry(Programmer * programmer) {
+    if (programmer->retries == PANEL_PROGRAM_MAX_RETRIES) {
+        programmer->progress->state = PanelProgram_Failed;
+        return false;
+    }
+
+    programmer->retries++;
+    return true;
+}
+
+// Programming begins again where the panel's flash left off, once whatever
+// is still on its way has been answered
+static void restart(Programmer * programmer) {
+    if (!retry(programmer)) return;
+
+    programmer->progress->restarts++;
+    programmer->progress->state = PanelProgram_Beginning;
+}
+
+// How long an answer can take to come back. Every request queued for the
+// port, and for the port it shares USART2 with, may have to time out first:
+// once, or twice if it's unframed and waits for an ack before its answer.
+static uint32_t request_timeout_ms(ComportId port) {
+    return (msgbus_port_framed(port) ? 1U : 2U) * MSGBUS_PROGRAM_TIMEOUT_TICKS;
+}
+
+static uint32_t answer_deadline_ms(Programmer * programmer) {
+    uint32_t deadline = (in_flight(programmer) + 1U)
+        * request_timeout_ms(programmer->port);
+
+    if (programmer->port == Comport_Up || programmer->port == Comport_Right) {
+        Programmer * other = &programmers[
+            programmer->port == Comport_Up ? Comport_Right : Comport_Up
+        ];
+
+        deadline += in_flight(other) * request_timeout_ms(other->port);
+    }
+
+    return deadline;
+}
+
+// Nothing came back in time, so whatever was on its way is lost. Sends it
+// again rather than beginning again, as the panel still has what it took.
+static void stalled(Programmer * programmer) {
+    memset(programmer->slots, 0, sizeof(programmer->slots));
+    programmer->control_in_flight = false;
+    programmer->progress->stalls++;
+
+    if (!retry(programmer)) return;
+
+    if (programmer->progress->state == PanelProgram_Sending) {
+        programmer->rewind = true;
+    }
+}
+
+// Answers come back in the order the requests went out, so anything sent
+// before the answered request that's still waiting never got through
+static void note_answer(Programmer * programmer, uint32_t sequence) {
+    programmer->last_heard_at = HAL_GetTick();
+
+    for (uint8_t i = 0; i < PANEL_PROGRAM_SLOTS; i++) {
+        ChunkSlot * slot = &programmer->slots[i];
+
+        if (slot->in_flight && (int32_t)(slot->sequence - sequence) < 0) {
+            slot->in_flight = false;
+            programmer->rewind = true;
+        }
+    }
+
+    if (programmer->control_in_flight
+        && (int32_t)(programmer->control_sequence - sequence) < 0) {
+
+        programmer->control_in_flight = false;
+    }
+}
+
+// Takes in what every answer carries, returning its status
+static ProgramStatus take_answer(Programmer * programmer, uint8_t * answer) {
+    PanelProgramProgress * progress = programmer->progress;
+    ProgramStatus status = (ProgramStatus)answer[0];
+
+    progress->last_status = status;
+    progress->committed = read_u32(answer + 4);
+
+    // What's in flash was taken, even if the answers saying so were lost
+    if (status == Program_OK
+        && progress->state == PanelProgram_Sending
+        && progress->committed > programmer->accepted
+        && progress->committed <= image_len) {
+
+        programmer->accepted = progress->committed;
+        programmer->retries = 0;
+        if (programmer->next < programmer->accepted) {
+            programmer->next = programmer->accepted;
+        }
+    }
+
+    return status;
+}
+
+static void send_chunks(Programmer * programmer) {
+    PanelProgramProgress * progress = programmer->progress;
+    ChunkSlot * slot;
+
+    if (programmer->rewind && chunks_in_flight(programmer) == 0) {
+        progress->resent += (programmer->next - programmer->accepted
+            + PANEL_PROGRAM_CHUNK_LEN - 1) / PANEL_PROGRAM_CHUNK_LEN;
+        programmer->next = programmer->accepted;
+        programmer->rewind = false;
+    }
+
+    while (!programmer->rewind
+        && programmer->next < image_len
+        && window_has_room(programmer)
+        && (slot = free_slot(programmer)) != NULL) {
+
+        send_chunk(programmer, slot);
+    }
+
+    if (chunks_in_flight(programmer) == 0
+        && programmer->accepted == image_len
+        && progress->committed == image_len) {
+
+        progress->state = PanelProgram_Finishing;
+        if (!programmer->control_in_flight) {
+            send_control(programmer, Command_Program_Finish);
+        }
+
+        return;
+    }
+
+    if (programmer->control_in_flight
+        || programmer->last_polled_at == HAL_GetTick()) {
+
+        return;
+    }
+
+    // Ask how far the panel's flash has got, once a tick at most, when there's
+    // nothing on its way that would tell. Also ask once the last chunk sent
+    // is overdue: if it was lost, no later answer would show that it was.
+    if (chunks_in_flight(programmer) == 0
+        || HAL_GetTick() - programmer->last_heard_at
+            > MSGBUS_PROGRAM_TIMEOUT_TICKS + 1U) {
+
+        programmer->last_polled_at = HAL_GetTick();
+        send_control(programmer, Command_Program_Status);
+    }
+}
+
+// Sends whatever the panel's programming needs next
+static void advance(Programmer * programmer) {
+    switch (programmer->progress->state) {
+        case PanelProgram_Beginning:
+            // Answers still to come would be for the programming that went
+            // wrong, and would get mixed up with the new one
+            if (!anything_in_flight(programmer)) {
+                send_control(programmer, Command_Program_Begin);
+            }
+
+            break;
+
+        case PanelProgram_Sending:
+            send_chunks(programmer);
+            break;
+
+        case PanelProgram_Finishing:
+            if (!programmer->control_in_flight) {
+                send_control(programmer, Command_Program_Finish);
+            }
+
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void begun(Programmer * programmer, ProgramStatus status) {
+    PanelProgramProgress * progress = programmer->progress;
+    uint32_t resume = progress->committed;
+
+    if (progress->state != PanelProgram_Beginning) return;
+
+    if (status != Program_OK) {
+        restart(programmer);
+        return;
+    }
+
+    // Chunks can only carry on from the end of one
+    if (resume > image_len
+        || (resume % PANEL_PROGRAM_CHUNK_LEN != 0 && resume != image_len)) {
+
+        resume = 0;
+    }
+
+    progress->committed = resume;
+    programmer->next = resume;
+    programmer->accepted = resume;
+    programmer->rewind = false;
+    programmer->window = programmer->control_response[1];
+    if (programmer->window == 0) programmer->window = 1;
+
+    progress->state = PanelProgram_Sending;
+}
+
+// Leaves programming mode once no panel is being programmed any more
+static void check_done() {
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        if (is_programming(&programmers[i])) return;
+    }
+
+    active = false;
+    msgbus_set_programming_mode(false);
+}
+
+static void on_chunk_answer(Response * resp) {
+    Programmer * programmer = &programmers[resp->comport_id];
+    ChunkSlot * slot = answered_slot(programmer, resp->data);
+
+    // From programming that has been given up on
+    if (slot == NULL || !slot->in_flight) return;
+
+    note_answer(programmer, slot->sequence);
+    slot->in_flight = false;
+
+    ProgramStatus status = take_answer(programmer, resp->data);
+
+    if (programmer->progress->state == PanelProgram_Sending) {
+        switch (status) {
+            case Program_OK:
+                if (slot->offset + slot->len <= programmer->accepted) {
+                    // Already known to have been taken
+                } else if (slot->offset == programmer->accepted) {
+                    programmer->accepted += slot->len;
+                    programmer->retries = 0;
+                } else {
+                    programmer->rewind = true;
+                }
+
+                break;
+
+            case Program_Bad_CRC:
+            case Program_Out_Of_Order:
+            case Program_Busy:
+                programmer->rewind = true;
+                break;
+
+            default:
+                restart(programmer);
+                break;
+        }
+    }
+
+    advance(programmer);
+    check_done();
+}
+
+static void on_control_answer(Response * resp) {
+    Programmer * programmer = &programmers[resp->comport_id];
+    PanelProgramProgress * progress = programmer->progress;
+
+    if (!programmer->control_in_flight) return;
+
+    note_answer(programmer, programmer->control_sequence);
+    programmer->control_in_flight = false;
+
+    ProgramStatus status = take_answer(programmer, resp->data);
+
+    switch (resp->request_command) {
+        case Command_Program_Begin:
+            begun(programmer, status);
+            break;
+
+        case Command_Program_Status:
+            if (status != Program_OK && progress->state == PanelProgram_Sending) {
+                restart(programmer);
+            }
+
+            break;
+
+        case Command_Program_Finish:
+            if (progress->state != PanelProgram_Finishing) break;
+
+            if (status == Program_OK) {
+                progress->state = PanelProgram_Done;
+            } else {
+                restart(programmer);
+            }
+
+            break;
+
+        default:
+            break;
+    }
+
+    advance(programmer);
+    check_done();
+}
+
+// Public functions ------------------------------------------------------------
+
+void panel_program_init() {
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        programmers[i].port = (ComportId)i;
+        programmers[i].progress = &panel_program_progress[i];
+    }
+
+    msgbus_set_response_handler(Command_Program_Begin, on_control_answer);
+    msgbus_set_response_handler(Command_Program_Chunk, on_chunk_answer);
+    msgbus_set_response_handler(Command_Program_Status, on_control_answer);
+    msgbus_set_response_handler(Command_Program_Finish, on_control_answer);
+}
+
+uint8_t panel_program_start(
+    uint8_t const * new_image,
+    uint32_t len,
+    uint32_t crc,
+    uint8_t panel_mask
+) {
+    uint8_t any = false;
+
+    if (active || len == 0 || len % 4 != 0) return false;
+
+    image = new_image;
+    image_len = len;
+    image_crc = crc;
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        Programmer * programmer = &programmers[i];
+
+        memset(programmer->slots, 0, sizeof(programmer->slots));
+        programmer->control_in_flight = false;
+        programmer->sequence = 0;
+        programmer->rewind = false;
+        programmer->retries = 0;
+        programmer->last_polled_at = HAL_GetTick() - 1;
+        *programmer->progress = (PanelProgramProgress) { 0 };
+
+        if (!(panel_mask & (1U << i)) || !panel_connected((ComportId)i)) {
+            continue;
+        }
+
+        programmer->progress->state = PanelProgram_Beginning;
+        any = true;
+    }
+
+    if (!any) return false;
+
+    active = true;
+    msgbus_set_programming_mode(true);
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        advance(&programmers[i]);
+    }
+
+    return true;
+}
+
+uint8_t panel_program_active() {
+    return active;
+}
+
+void panel_program_tick(uint32_t now_ms) {
+    if (!active) return;
+
+    for (uint8_t i = 0; i < PANEL_COUNT; i++) {
+        Programmer * programmer = &programmers[i];
+
+        if (!is_programming(programmer)) continue;
+
+        if (anything_in_flight(programmer)
+            && now_ms - programmer->last_heard_at
+                > answer_deadline_ms(programmer)) {
+
+            stalled(programmer);
+        }
+
+        advance(programmer);
+    }
+
+    check_done();
+}
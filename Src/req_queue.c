@@ -1,62 +1,177 @@
 #include "uart.h"
 #include "stdbool.h"
+#include "string.h"
 #include "req_queue.h"
 #include "error_handler.h"
 
+#define QUEUE_INDEX_MASK (MAX_REQ_QUEUE_LENGTH - 1)
+
+_Static_assert((MAX_REQ_QUEUE_LENGTH & QUEUE_INDEX_MASK) == 0, "Queue length must be a power of two");
+_Static_assert(REQ_POOL_SIZE < 0xFF, "Pool indexes must fit in a byte");
+
 Request BlankRequest = {
     Comport_None,
     0x00,
     NULL,
     0x0000,
     NULL,
-    0x0000
+    0x0000,
+    0
 };
 
-static inline uint8_t contains(RequestQueue * queue, Request req) {
-    if (queue->count == 0) return false;
+static Request pool[REQ_POOL_SIZE];
+
+// Key of the request in each pool entry, see request_key
+static uint8_t pool_keys[REQ_POOL_SIZE];
+
+// Stack of free pool entries
+static uint8_t pool_free[REQ_POOL_SIZE];
+static uint8_t pool_free_count = 0;
+
+// Requests are only ever the same if they're for the same command and point
+// at the same data, so those make the key. Fibonacci hashing spreads
+// neighbouring buffers (like the LED segments) over different keys.
+static inline uint8_t request_key(Request * req) {
+    uint8_t * target = request_has_data(req) ? req->send_data : req->response_data;
+    uint32_t value = (uint32_t)(uintptr_t)target ^ ((uint32_t)req->request_command << 24);
+
+    return (value * 2654435761U) >> (32 - 5);
+}
+
+_Static_assert(REQ_QUEUE_KEY_COUNT == (1U << 5), "request_key makes 5 bit keys");
+
+static inline uint8_t entry_at(RequestQueue * queue, uint8_t position) {
+    return queue->entries[(queue->front + position) & QUEUE_INDEX_MASK];
+}
+
+// Pool index of a queued request with the given key, that is equal to req if
+// req isn't NULL. REQ_POOL_SIZE if there's none.
+static uint8_t find(RequestQueue * queue, uint8_t key, Request * req) {
+    for (uint8_t i = 0; i < queue->count; i++) {
+        uint8_t index = entry_at(queue, i);
+
+        if (pool_keys[index] != key) continue;
+        if (req == NULL || request_equals(pool[index], *req)) return index;
+    }
+
+    return REQ_POOL_SIZE;
+}
+
+static inline uint8_t contains(RequestQueue * queue, Request * req, uint8_t key) {
+    uint8_t key_count = queue->key_counts[key];
+
+    if (key_count == 0) return false;
+    if (request_equals(pool[queue->key_owners[key]], *req)) return true;
+    if (key_count == 1) return false;
+
+    // Different requests that happen to share a key; rare enough to just
+    // look through the queue
+    return find(queue, key, req) != REQ_POOL_SIZE;
+}
+
+static inline uint8_t pool_allocate() {
+    if (pool_free_count == 0) {
+        error_panic(Error_App_ReqQueue_PoolEmpty);
+        return 0;
+    }
+
+    return pool_free[--pool_free_count];
+}
+
+static inline void pool_release(uint8_t index) {
+    pool_free[pool_free_count++] = index;
+}
+
+// Public functions ------------------------------------------------------------
 
-    for (uint8_t i = 0; i < MAX_REQ_QUEUE_LENGTH; i++) {
-        if (request_equals(queue->items[i], req)) return true;
+void req_queue_pool_init() {
+    for (uint8_t i = 0; i < REQ_POOL_SIZE; i++) {
+        pool_free[i] = i;
     }
 
-    return false;
+    pool_free_count = REQ_POOL_SIZE;
 }
 
 void req_queue_init(RequestQueue * queue) {
     queue->front = 0;
-    queue->rear = -1;
     queue->count = 0;
 
-    for (uint8_t i = 0; i < MAX_REQ_QUEUE_LENGTH; i++) {
-        queue->items[i] = BlankRequest;
+    memset(queue->key_counts, 0, sizeof(queue->key_counts));
+}
+
+void req_queue_clear(RequestQueue * queue) {
+    while (queue->count > 0) {
+        pool_release(queue->entries[queue->front]);
+        queue->front = (queue->front + 1) & QUEUE_INDEX_MASK;
+        queue->count--;
     }
+
+    queue->front = 0;
+    memset(queue->key_counts, 0, sizeof(queue->key_counts));
+    memset(queue->key_owners, 0, sizeof(queue->key_owners));
 }
 
-void req_queue_add(RequestQueue * queue, Request request) {
+// Adds the request at the rear, whether or not an equal one is queued
+static void append(RequestQueue * queue, Request request, uint8_t key) {
     if (queue->count == MAX_REQ_QUEUE_LENGTH) {
         error_panic(Error_App_ReqQueue_QueueFull);
         return;
     }
 
+    uint8_t index = pool_allocate();
+    pool[index] = request;
+    pool_keys[index] = key;
+
+    queue->entries[(queue->front + queue->count) & QUEUE_INDEX_MASK] = index;
+    queue->count++;
+
+    if (queue->key_counts[key]++ == 0) queue->key_owners[key] = index;
+}
+
+void req_queue_add(RequestQueue * queue, Request request) {
+    uint8_t key = request_key(&request);
+
     // Don't add if the request is already in the queue
-    if (contains(queue, request)) return;
+    if (contains(queue, &request, key)) return;
 
-    if (queue->rear == MAX_REQ_QUEUE_LENGTH - 1) queue->rear = -1;
+    append(queue, request, key);
+}
 
-    queue->rear++;
-    queue->items[queue->rear] = request;
-    queue->count++;
+void req_queue_append(RequestQueue * queue, Request request) {
+    append(queue, request, request_key(&request));
 }
 
 Request req_queue_take(RequestQueue * queue) {
     if (queue->count == 0) return BlankRequest;
 
-    Request req = queue->items[queue->front];
-    queue->items[queue->front] = BlankRequest;
-    queue->front++;
-
-    if (queue->front == MAX_REQ_QUEUE_LENGTH) queue->front = 0;
-    
+    uint8_t index = queue->entries[queue->front];
+    queue->front = (queue->front + 1) & QUEUE_INDEX_MASK;
     queue->count--;
-    return req;
-}
\ No newline at end of file
+
+    uint8_t key = pool_keys[index];
+
+    // Others with the same key are still queued, one of them has to take over
+    if (--queue->key_counts[key] > 0 && queue->key_owners[key] == index) {
+        queue->key_owners[key] = find(queue, key, NULL);
+    }
+
+    // Nothing can reuse the entry before it's copied out below, the queues
+    // are only used from the main thread
+    pool_release(index);
+    return pool[index];
+}
+
+// Returns the request req_queue_take would return next, without taking it,
+// or NULL if the queue is empty
+Request * req_queue_peek(RequestQueue * queue) {
+    if (queue->count == 0) return NULL;
+
+    return &pool[queue->entries[queue->front]];
+}
+
+// Returns the request that was queued last, or NULL if the queue is empty
+Request * req_queue_peek_last(RequestQueue * queue) {
+    if (queue->count == 0) return NULL;
+
+    return &pool[entry_at(queue, queue->count - 1)];
+}
@@ -0,0 +1,110 @@
+#include "scheduler.h"
+#include "stdbool.h"
+#include "critical.h"
+#include "cycles.h"
+
+// Public, so that contents can be inspected during debugging
+EventStats scheduler_stats[EVENT_TYPE_COUNT];
+
+static EventHandler handlers[EVENT_TYPE_COUNT];
+
+// One bit per EventType; bit 0 is the highest priority
+static volatile uint32_t pending = 0;
+
+// Cycle count at which each currently pending event was first posted
+static uint32_t posted_at[EVENT_TYPE_COUNT];
+
+static inline uint32_t event_mask(EventType type) {
+    return 1U << (uint32_t)type;
+}
+
+static inline void record_dispatch(EventType type, uint32_t latency) {
+    EventStats * stats = &scheduler_stats[type];
+
+    stats->dispatched++;
+    stats->last_latency = latency;
+
+    if (latency > stats->max_latency) {
+        stats->max_latency = latency;
+    }
+}
+
+// Public functions ------------------------------------------------------------
+
+void scheduler_init() {
+    cycles_init();
+
+    uint32_t primask = critical_enter();
+    pending = 0;
+
+    for (uint8_t i = 0; i < EVENT_TYPE_COUNT; i++) {
+        handlers[i] = NULL;
+        posted_at[i] = 0;
+        scheduler_stats[i] = (EventStats) { 0 };
+    }
+
+    critical_exit(primask);
+}
+
+void scheduler_set_handler(EventType type, EventHandler handler) {
+    handlers[type] = handler;
+}
+
+void scheduler_post(EventType type) {
+    uint32_t mask = event_mask(type);
+    uint32_t primask = critical_enter();
+
+    if (pending & mask) {
+        scheduler_stats[type].coalesced++;
+    } else {
+        posted_at[type] = cycles_now();
+        pending |= mask;
+    }
+
+    critical_exit(primask);
+}
+
+uint8_t scheduler_dispatch() {
+    uint32_t primask = critical_enter();
+
+    if (pending == 0) {
+        critical_exit(primask);
+        return false;
+    }
+
+    // Lowest set bit is the highest priority pending event
+    EventType type = (EventType)__builtin_ctz(pending);
+    pending &= ~event_mask(type);
+    uint32_t posted = posted_at[type];
+
+    critical_exit(primask);
+
+    record_dispatch(type, cycles_since(posted));
+
+    // Clearing the bit before running the handler means anything posting this
+    // event while the handler runs gets it dispatched again afterwards
+    if (handlers[type] != NULL) {
+        handlers[type]();
+    }
+
+    return true;
+}
+
+void scheduler_run() {
+    while (1) {
+        if (scheduler_dispatch()) continue;
+
+        // Interrupts are masked while checking for work, so a post landing
+        // between the check and the WFI can't be missed. WFI still wakes up
+        // on a pending interrupt with PRIMASK set; it gets serviced as soon
+        // as interrupts are unmasked again.
+        __disable_irq();
+
+        if (pending == 0) {
+            __DSB();
+            __WFI();
+        }
+
+        __enable_irq();
+    }
+}
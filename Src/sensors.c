@@ -0,0 +1,342 @@
+#include "sensors.h"
+#include "stdbool.h"
+#include "string.h"
+#include "cycles.h"
+#include "config.h"
+
+// Longest a batched report can be: every kept sample of every panel
+#define BATCH_MAX_SAMPLES (SENSOR_PANEL_COUNT * SENSOR_HISTORY_LEN)
+
+// Public, so that contents can be inspected during debugging
+PanelSensors panel_sensors[SENSOR_PANEL_COUNT];
+SensorReportStats sensor_report_stats;
+
+// Both formats are built in here
+static union {
+    SensorReport single;
+    uint8_t bytes[SENSOR_REPORT_LEN];
+} report;
+
+static uint16_t next_report_sequence = 0;
+static SensorReportFormat report_format = SensorFormat_Single;
+
+// A sample picked for a batched report
+typedef struct {
+    SensorSample const * sample;
+    uint8_t panel;
+} BatchEntry;
+
+_Static_assert(sizeof(SensorReport) == SENSOR_REPORT_LEN, "Sensor report must fill one HID report");
+_Static_assert(sizeof(SensorBatchHeader) == 8, "Batch header must be packed");
+
+static inline void swap_slots(SensorSample ** a, SensorSample ** b) {
+    SensorSample * temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+static inline void init_panel_sensors(PanelSensors * panel) {
+    memset(panel->slots, 0, sizeof(panel->slots));
+
+    panel->receiving = &panel->slots[0];
+    panel->latest = &panel->slots[1];
+    panel->reporting = &panel->slots[2];
+
+    panel->next_sequence = 0;
+    panel->have_new = false;
+
+    panel->history_newest = 0;
+    panel->history_unreported = 0;
+    panel->reported_sequence = 0xFFFF;
+}
+
+// Copies the sample into the panel's history, see PanelSensors
+static inline void record_history(PanelSensors * panel, SensorSample * sample) {
+    uint32_t spacing =
+        SENSOR_HISTORY_SPACING_US * (SystemCoreClock / 1000000U);
+
+    if (panel->history_unreported > 0
+        && sample->captured_at - panel->history_started_at < spacing) {
+
+        sensor_report_stats.samples_dropped++;
+    } else {
+        panel->history_newest =
+            (panel->history_newest + 1) % SENSOR_HISTORY_LEN;
+        panel->history_started_at = sample->captured_at;
+
+        if (panel->history_unreported == SENSOR_HISTORY_LEN) {
+            // Ring is full, the oldest entry goes
+            sensor_report_stats.samples_dropped++;
+        } else {
+            panel->history_unreported++;
+        }
+    }
+
+    panel->history[panel->history_newest] = *sample;
+}
+
+static inline uint16_t microseconds_between(uint32_t from, uint32_t to) {
+    uint32_t us = (to - from) / (SystemCoreClock / 1000000U);
+    return us > UINT16_MAX ? UINT16_MAX : us;
+}
+
+// Whether every reading of data is within an int8_t of the base's
+static uint8_t fits_delta(uint8_t const * base, uint8_t const * data) {
+    for (uint8_t i = 0; i < SENSOR_VALUES_PER_PANEL; i++) {
+        int32_t delta = (int32_t)sensor_value(data, i) - sensor_value(base, i);
+
+        if (delta < INT8_MIN || delta > INT8_MAX) return false;
+    }
+
+    return true;
+}
+
+// What the entry at index can be sent as a delta against: the panel's
+// previous entry at or after first, or else what the host got last, unless
+// this is a keyframe. NULL if it has to be sent in full.
+static uint8_t const * delta_base(
+    BatchEntry const * entries, uint8_t first, uint8_t index, uint8_t keyframe) {
+
+    uint8_t const * base = NULL;
+    PanelSensors * panel = &panel_sensors[entries[index].panel];
+
+    for (int8_t i = index - 1; i >= (int8_t)first; i--) {
+        if (entries[i].panel == entries[index].panel) {
+            base = entries[i].sample->data;
+            break;
+        }
+    }
+
+    if (base == NULL && !keyframe && panel->reported_sequence != 0xFFFF) {
+        base = panel->reported_data;
+    }
+
+    if (base == NULL || !fits_delta(base, entries[index].sample->data)) {
+        return NULL;
+    }
+
+    return base;
+}
+
+// Bytes entries first to count - 1 take in a batched report
+static uint16_t batch_length(
+    BatchEntry const * entries, uint8_t first, uint8_t count, uint8_t keyframe) {
+
+    uint16_t len = sizeof(SensorBatchHeader);
+
+    for (uint8_t i = first; i < count; i++) {
+        len += delta_base(entries, first, i, keyframe) != NULL
+            ? SENSOR_ENTRY_DELTA_LEN : SENSOR_ENTRY_FULL_LEN;
+    }
+
+    return len;
+}
+
+// Every unreported history entry of every panel, oldest first
+static uint8_t collect_history(BatchEntry * entries, uint32_t now) {
+    uint8_t count = 0;
+
+    for (uint8_t p = 0; p < SENSOR_PANEL_COUNT; p++) {
+        PanelSensors * panel = &panel_sensors[p];
+
+        for (uint8_t n = panel->history_unreported; n > 0; n--) {
+            uint8_t slot = (panel->history_newest + SENSOR_HISTORY_LEN + 1 - n)
+                % SENSOR_HISTORY_LEN;
+
+            BatchEntry entry = { &panel->history[slot], p };
+
+            // Insertion sort on age, the oldest has been around the longest
+            uint8_t i = count++;
+            uint32_t age = now - entry.sample->captured_at;
+
+            while (i > 0 && now - entries[i - 1].sample->captured_at < age) {
+                entries[i] = entries[i - 1];
+                i--;
+            }
+
+            entries[i] = entry;
+        }
+
+        panel->history_unreported = 0;
+        panel->have_new = false;
+    }
+
+    return count;
+}
+
+static void build_batched_report() {
+    BatchEntry entries[BATCH_MAX_SAMPLES];
+    uint32_t now = cycles_now();
+    uint8_t count = collect_history(entries, now);
+    uint8_t keyframe = next_report_sequence % SENSOR_KEYFRAME_INTERVAL == 0;
+
+    // Drop the oldest until the rest fits
+    uint8_t first = 0;
+
+    while (batch_length(entries, first, count, keyframe) > SENSOR_REPORT_LEN) {
+        first++;
+    }
+
+    sensor_report_stats.samples_dropped += first;
+
+    SensorBatchHeader * header = (SensorBatchHeader *)report.bytes;
+    header->format = SensorFormat_Batched;
+    header->count = count - first;
+    header->report_sequence = next_report_sequence++;
+    header->built_at = now;
+
+    uint8_t * out = report.bytes + sizeof(SensorBatchHeader);
+
+    for (uint8_t i = first; i < count; i++) {
+        SensorSample const * sample = entries[i].sample;
+        uint16_t age = microseconds_between(sample->captured_at, now);
+        uint8_t const * base = delta_base(entries, first, i, keyframe);
+        PanelSensors * panel = &panel_sensors[entries[i].panel];
+
+        out[0] = (entries[i].panel << 6)
+            | (base != NULL ? SENSOR_ENTRY_DELTA : 0)
+            | (sample->sequence & SENSOR_ENTRY_SEQUENCE_MASK);
+        out[1] = age & 0xFF;
+        out[2] = age >> 8;
+
+        if (base != NULL) {
+            for (uint8_t v = 0; v < SENSOR_VALUES_PER_PANEL; v++) {
+                out[3 + v] = (uint8_t)(int8_t)
+                    (sensor_value(sample->data, v) - sensor_value(base, v));
+            }
+
+            out += SENSOR_ENTRY_DELTA_LEN;
+            sensor_report_stats.delta_samples++;
+        } else {
+            memcpy(out + 3, sample->data, SENSOR_RESPONSE_LEN);
+            out += SENSOR_ENTRY_FULL_LEN;
+        }
+
+        sensor_report_stats.samples++;
+
+        // Only now, as delta_base() of the panel's next entry in this report
+        // doesn't look at it anyway
+        panel->reported_sequence = sample->sequence;
+        memcpy(panel->reported_data, sample->data, SENSOR_RESPONSE_LEN);
+    }
+
+    // Unused space stays zero rather than keeping old entries around
+    memset(out, 0, report.bytes + SENSOR_REPORT_LEN - out);
+}
+
+static void build_single_report() {
+    uint32_t now = cycles_now();
+    uint32_t newest_age = UINT32_MAX;
+
+    for (uint8_t i = 0; i < SENSOR_PANEL_COUNT; i++) {
+        PanelSensors * panel = &panel_sensors[i];
+
+        // Panels without a new sample keep what's already in the report
+        if (!panel->have_new) continue;
+
+        swap_slots(&panel->latest, &panel->reporting);
+        panel->have_new = false;
+
+        SensorSample * sample = panel->reporting;
+
+        memcpy(report.single.sensors[i], sample->data, SENSOR_RESPONSE_LEN);
+        report.single.sequence[i] = sample->sequence;
+        report.single.captured_at[i] = sample->captured_at;
+
+        // Samples between the one reported last time and this one were
+        // superseded before anyone saw them
+        if (panel->reported_sequence != 0xFFFF) {
+            sensor_report_stats.samples_dropped +=
+                (uint16_t)(sample->sequence - panel->reported_sequence - 1);
+        }
+
+        panel->reported_sequence = sample->sequence;
+        sensor_report_stats.samples++;
+
+        uint32_t age = now - sample->captured_at;
+        if (age < newest_age) newest_age = age;
+    }
+
+    newest_age /= SystemCoreClock / 1000000U;
+
+    report.single.built_at = now;
+    report.single.report_sequence = next_report_sequence++;
+    report.single.newest_age_us =
+        newest_age > UINT16_MAX ? UINT16_MAX : newest_age;
+}
+
+// Public functions ------------------------------------------------------------
+
+void sensors_init() {
+    for (uint8_t i = 0; i < SENSOR_PANEL_COUNT; i++) {
+        init_panel_sensors(&panel_sensors[i]);
+    }
+
+    memset(&report, 0, sizeof(report));
+    next_report_sequence = 0;
+    report_format = SensorFormat_Single;
+    sensor_report_stats = (SensorReportStats) { 0 };
+}
+
+uint8_t * sensors_receive_target(ComportId comport_id) {
+    return panel_sensors[comport_id].receiving->data;
+}
+
+void sensors_process_response(Response * resp) {
+    PanelSensors * panel = &panel_sensors[resp->comport_id];
+
+    // A response that didn't land in the receiving slot belongs to a
+    // sample that's already been superseded; nothing to publish
+    if (resp->data != panel->receiving->data) return;
+
+    panel->receiving->sequence = panel->next_sequence++;
+    panel->receiving->captured_at = resp->completed_at;
+
+    // Newest sample becomes latest; the old latest, never reported, is free
+    // to be received into again
+    swap_slots(&panel->receiving, &panel->latest);
+    panel->have_new = true;
+
+    if (report_format == SensorFormat_Batched) {
+        record_history(panel, panel->latest);
+    }
+}
+
+uint8_t sensors_have_new() {
+    for (uint8_t i = 0; i < SENSOR_PANEL_COUNT; i++) {
+        if (panel_sensors[i].have_new) return true;
+    }
+
+    return false;
+}
+
+void sensors_process_command(uint8_t const * buffer, uint16_t len) {
+    if (len < 2 || buffer[0] != SENSOR_OP_SET_FORMAT) return;
+    if (buffer[1] >= SENSOR_FORMAT_COUNT) return;
+    if (buffer[1] == report_format) return;
+
+    report_format = (SensorReportFormat)buffer[1];
+
+    // Start the new format from a clean report and an empty history
+    memset(&report, 0, sizeof(report));
+
+    for (uint8_t i = 0; i < SENSOR_PANEL_COUNT; i++) {
+        panel_sensors[i].history_unreported = 0;
+        panel_sensors[i].reported_sequence = 0xFFFF;
+    }
+}
+
+SensorReportFormat sensors_report_format() {
+    return report_format;
+}
+
+uint8_t const * sensors_build_report() {
+    if (report_format == SensorFormat_Batched) {
+        build_batched_report();
+    } else {
+        build_single_report();
+    }
+
+    sensor_report_stats.reports++;
+    return report.bytes;
+}
@@ -0,0 +1,307 @@
+#include "settings.h"
+#include "stdbool.h"
+#include "flash_layout.h"
+#include "scheduler.h"
+#include "config.h"
+
+#define PAGE_LEN (FLASH_PAGE_SIZE)
+#define PAGE_COUNT (FLASH_SETTINGS_LEN / PAGE_LEN)
+#define NO_PAGE (0xFFU)
+
+// "SETT", marks a page whose settings are complete
+#define PAGE_MAGIC (0x53455454U)
+
+// Mixed into every record's check, so an all-zero record doesn't pass
+#define RECORD_CHECK_SEED (0x5AA5U)
+
+#define ERASED_HALFWORD (0xFFFFU)
+
+// Records written per Event_Flash_Write. Each is four halfwords, around 50 us
+// apiece while the core stalls, so a step takes under a millisecond.
+#define RECORDS_PER_STEP (4U)
+
+typedef struct {
+    uint32_t magic;
+
+    // One more than that of the page the settings moved on from
+    uint32_t sequence;
+} PageHeader;
+
+typedef struct {
+    uint16_t key;
+    uint16_t check;
+    uint32_t value;
+} Record;
+
+#define RECORDS_PER_PAGE ((PAGE_LEN - sizeof(PageHeader)) / sizeof(Record))
+
+_Static_assert(FLASH_SETTINGS_START + FLASH_SETTINGS_LEN <= FLASH_BASE + 256U * 1024U, "Settings must fit in flash");
+_Static_assert(FLASH_SETTINGS_LEN % PAGE_LEN == 0 && PAGE_COUNT >= 2, "Settings need whole pages, at least two");
+_Static_assert(SETTING_COUNT < RECORDS_PER_PAGE, "Every setting must fit a page with room to spare");
+
+// Public, so that contents can be inspected during debugging
+SettingsStats settings_stats;
+
+uint32_t settings_values[SETTING_COUNT];
+
+// Settings changed in RAM but not in flash yet
+static uint8_t dirty[SETTING_COUNT];
+static uint8_t any_dirty = false;
+static uint32_t changed_at = 0;
+
+// Page that holds the settings, and the next free record on it. NO_PAGE
+// before any settings were ever written.
+static uint8_t current = NO_PAGE;
+static uint32_t sequence = 0;
+static uint16_t next_record = 0;
+
+// While the settings move on to another page: that page, the next setting to
+// look at and the next free record there
+static uint8_t compacting_into = NO_PAGE;
+static uint16_t compact_key = 0;
+static uint16_t compact_record = 0;
+
+static inline uint32_t page_address(uint8_t page) {
+    return FLASH_SETTINGS_START + page * PAGE_LEN;
+}
+
+static inline PageHeader const * page_header(uint8_t page) {
+    return (PageHeader const *)page_address(page);
+}
+
+static inline uint32_t record_address(uint8_t page, uint16_t index) {
+    return page_address(page) + sizeof(PageHeader) + index * sizeof(Record);
+}
+
+static inline Record const * page_record(uint8_t page, uint16_t index) {
+    return (Record const *)record_address(page, index);
+}
+
+static inline uint16_t record_check(uint16_t key, uint32_t value) {
+    return key ^ (uint16_t)value ^ (uint16_t)(value >> 16) ^ RECORD_CHECK_SEED;
+}
+
+static inline uint8_t record_blank(Record const * record) {
+    return record->key == ERASED_HALFWORD
+        && record->check == ERASED_HALFWORD
+        && record->value == 0xFFFFFFFFU;
+}
+
+static inline uint8_t next_page() {
+    return current == NO_PAGE ? 0 : (current + 1) % PAGE_COUNT;
+}
+
+static uint32_t default_value(uint16_t key) {
+    if (key == Setting_Panels_Connected) {
+        return (PANEL_LEFT_CONNECTED << Comport_Left)
+            | (PANEL_DOWN_CONNECTED << Comport_Down)
+            | (PANEL_UP_CONNECTED << Comport_Up)
+            | (PANEL_RIGHT_CONNECTED << Comport_Right);
+    }
+
+    // Step thresholds, the only other settings
+    return SETTING_STEP_THRESHOLDS(STEP_PRESS_THRESHOLD, STEP_RELEASE_THRESHOLD);
+}
+
+static uint8_t page_blank(uint8_t page) {
+    uint32_t const * words = (uint32_t const *)page_address(page);
+
+    for (uint16_t i = 0; i < PAGE_LEN / 4; i++) {
+        if (words[i] != 0xFFFFFFFFU) return false;
+    }
+
+    return true;
+}
+
+static uint8_t erase_page(uint8_t page) {
+    FLASH_EraseInitTypeDef erase = {
+        .TypeErase = FLASH_TYPEERASE_PAGES,
+        .PageAddress = page_address(page),
+        .NbPages = 1
+    };
+    uint32_t page_error;
+
+    settings_stats.erases++;
+    return HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+}
+
+static uint8_t program_halfword(uint32_t address, uint16_t value) {
+    return HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, value) == HAL_OK
+        && *(__IO uint16_t *)address == value;
+}
+
+// Programs the check last: until it's in, the record doesn't count
+static uint8_t write_record(uint8_t page, uint16_t index, uint16_t key) {
+    uint32_t address = record_address(page, index);
+    uint32_t value = settings_values[key];
+
+    settings_stats.records_written++;
+
+    return program_halfword(address + 4, (uint16_t)value)
+        && program_halfword(address + 6, (uint16_t)(value >> 16))
+        && program_halfword(address, key)
+        && program_halfword(address + 2, record_check(key, value));
+}
+
+// Makes the page the settings are moving to the current one. The magic goes
+// in last, as until then the page they came from has to stay the current one.
+static uint8_t write_header(uint8_t page, uint32_t new_sequence) {
+    uint32_t address = page_address(page);
+
+    return program_halfword(address + 4, (uint16_t)new_sequence)
+        && program_halfword(address + 6, (uint16_t)(new_sequence >> 16))
+        && program_halfword(address, (uint16_t)PAGE_MAGIC)
+        && program_halfword(address + 2, (uint16_t)(PAGE_MAGIC >> 16));
+}
+
+static uint8_t start_compaction() {
+    uint8_t page = next_page();
+
+    // Only if a page filled up since startup erased this one
+    if (!page_blank(page) && !erase_page(page)) return false;
+
+    compacting_into = page;
+    compact_key = 0;
+    compact_record = 0;
+    return true;
+}
+
+// Writes the next setting that isn't at its default to the page the settings
+// are moving to, or the header once they're all there
+static uint8_t compact_step() {
+    while (compact_key < SETTING_COUNT) {
+        uint16_t key = compact_key++;
+
+        // Goes in with its latest value, or not at all if that's the default
+        dirty[key] = false;
+        if (settings_values[key] == default_value(key)) continue;
+
+        return write_record(compacting_into, compact_record++, key);
+    }
+
+    if (!write_header(compacting_into, sequence + 1)) return false;
+
+    current = compacting_into;
+    sequence++;
+    next_record = compact_record;
+    compacting_into = NO_PAGE;
+    settings_stats.compactions++;
+    return true;
+}
+
+// Appends the next changed setting to the current page. Returns false if
+// nothing's left to write.
+static uint8_t append_step(uint8_t * ok) {
+    for (uint16_t key = 0; key < SETTING_COUNT; key++) {
+        if (!dirty[key]) continue;
+
+        dirty[key] = false;
+        *ok = write_record(current, next_record++, key);
+        return true;
+    }
+
+    return false;
+}
+
+// Public functions ------------------------------------------------------------
+
+void settings_init() {
+    settings_stats = (SettingsStats) { 0 };
+    any_dirty = false;
+    compacting_into = NO_PAGE;
+    current = NO_PAGE;
+    next_record = 0;
+
+    for (uint16_t key = 0; key < SETTING_COUNT; key++) {
+        settings_values[key] = default_value(key);
+        dirty[key] = false;
+    }
+
+    for (uint8_t page = 0; page < PAGE_COUNT; page++) {
+        PageHeader const * header = page_header(page);
+        if (header->magic != PAGE_MAGIC) continue;
+
+        if (current == NO_PAGE || (int32_t)(header->sequence - sequence) > 0) {
+            current = page;
+            sequence = header->sequence;
+        }
+    }
+
+    if (current != NO_PAGE) {
+        while (next_record < RECORDS_PER_PAGE) {
+            Record const * record = page_record(current, next_record);
+            if (record_blank(record)) break;
+
+            next_record++;
+
+            if (record->key < SETTING_COUNT
+                && record->check == record_check(record->key, record->value)) {
+
+                settings_values[record->key] = record->value;
+            }
+        }
+    }
+
+    // Erased now, so moving on to it doesn't have to wait for the erase
+    uint8_t page = next_page();
+
+    if (!page_blank(page)) {
+        HAL_FLASH_Unlock();
+        if (!erase_page(page)) settings_stats.failures++;
+        HAL_FLASH_Lock();
+        settings_stats.startup_erases++;
+    }
+}
+
+void settings_set(SettingKey key, uint32_t value) {
+    if (key >= SETTING_COUNT || settings_values[key] == value) return;
+
+    settings_values[key] = value;
+    dirty[key] = true;
+    any_dirty = true;
+    changed_at = HAL_GetTick();
+}
+
+void settings_tick(uint32_t now_ms) {
+    if (any_dirty && now_ms - changed_at >= SETTINGS_WRITE_DELAY_MS) {
+        scheduler_post(Event_Flash_Write);
+    }
+}
+
+void settings_write_step() {
+    uint8_t ok = true;
+
+    if (!any_dirty || HAL_GetTick() - changed_at < SETTINGS_WRITE_DELAY_MS) {
+        return;
+    }
+
+    HAL_FLASH_Unlock();
+
+    for (uint8_t i = 0; i < RECORDS_PER_STEP && ok; i++) {
+        if (compacting_into == NO_PAGE
+            && (current == NO_PAGE || next_record == RECORDS_PER_PAGE)) {
+
+            ok = start_compaction();
+            continue;
+        }
+
+        if (compacting_into != NO_PAGE) {
+            ok = compact_step();
+        } else if (!append_step(&ok)) {
+            any_dirty = false;
+            break;
+        }
+    }
+
+    HAL_FLASH_Lock();
+
+    // What's in RAM still counts, it just won't be there after a restart
+    if (!ok) {
+        settings_stats.failures++;
+        compacting_into = NO_PAGE;
+        any_dirty = false;
+        return;
+    }
+
+    if (any_dirty) scheduler_post(Event_Flash_Write);
+}
@@ -0,0 +1,110 @@
+#include "steps.h"
+#include "stdbool.h"
+#include "string.h"
+#include "config.h"
+
+_Static_assert(sizeof(StepThresholds) == 64, "Thresholds must fill one feature report");
+
+// Public, so that contents can be inspected during debugging
+StepStats step_stats;
+
+static StepThresholds thresholds;
+
+// Bit per sensor, set while it's pressed
+static uint8_t pressed_sensors[SENSOR_PANEL_COUNT];
+
+static uint8_t buttons = 0;
+
+// Public functions ------------------------------------------------------------
+
+void steps_init() {
+    for (uint8_t panel = 0; panel < SENSOR_PANEL_COUNT; panel++) {
+        for (uint8_t i = 0; i < STEP_SENSORS_PER_PANEL; i++) {
+            thresholds.press[panel][i] = STEP_PRESS_THRESHOLD;
+            thresholds.release[panel][i] = STEP_RELEASE_THRESHOLD;
+        }
+
+        pressed_sensors[panel] = 0;
+    }
+
+    buttons = 0;
+    step_stats = (StepStats) { 0 };
+}
+
+uint8_t steps_process(ComportId port, uint8_t const * data) {
+    uint8_t panel = (uint8_t)port;
+    uint8_t pressed = pressed_sensors[panel];
+
+    for (uint8_t i = 0; i < STEP_SENSORS_PER_PANEL; i++) {
+        uint16_t value = sensor_value(data, i);
+
+        // Between the two thresholds a sensor keeps the state it had
+        if (value >= thresholds.press[panel][i]) {
+            pressed |= 1U << i;
+        } else if (value < thresholds.release[panel][i]) {
+            pressed &= ~(1U << i);
+        }
+    }
+
+    pressed_sensors[panel] = pressed;
+
+    uint8_t was_down = (buttons >> panel) & 1U;
+    uint8_t is_down = pressed != 0;
+
+    if (was_down == is_down) return false;
+
+    if (is_down) {
+        buttons |= 1U << panel;
+        step_stats.presses[panel]++;
+    } else {
+        buttons &= ~(1U << panel);
+    }
+
+    return true;
+}
+
+uint8_t steps_release_panel(ComportId port) {
+    uint8_t panel = (uint8_t)port;
+    uint8_t was_down = (buttons >> panel) & 1U;
+
+    pressed_sensors[panel] = 0;
+    buttons &= ~(1U << panel);
+
+    return was_down;
+}
+
+uint8_t steps_buttons() {
+    return buttons;
+}
+
+uint16_t steps_get_thresholds(uint8_t * buffer, uint16_t len) {
+    if (len > sizeof(thresholds)) len = sizeof(thresholds);
+
+    memcpy(buffer, &thresholds, len);
+    return len;
+}
+
+uint8_t steps_set_thresholds(uint8_t const * buffer, uint16_t len) {
+    StepThresholds new_thresholds;
+
+    if (len < sizeof(new_thresholds)) {
+        step_stats.bad_thresholds++;
+        return false;
+    }
+
+    memcpy(&new_thresholds, buffer, sizeof(new_thresholds));
+
+    for (uint8_t panel = 0; panel < SENSOR_PANEL_COUNT; panel++) {
+        for (uint8_t i = 0; i < STEP_SENSORS_PER_PANEL; i++) {
+            if (new_thresholds.release[panel][i]
+                > new_thresholds.press[panel][i]) {
+
+                step_stats.bad_thresholds++;
+                return false;
+            }
+        }
+    }
+
+    thresholds = new_thresholds;
+    return true;
+}
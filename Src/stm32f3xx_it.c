@@ -19,6 +19,7 @@
 #include "uart.h"
 #include "stm32f3xx_it.h"
 #include "error_handler.h"
+#include "scheduler.h"
 
 // uart.c
 extern DMA_HandleTypeDef hdma_usart1_l_rx;
@@ -67,7 +68,10 @@ void DebugMon_Handler(void) {  }
 // Pendable request for system service handler
 void PendSV_Handler(void) { }
 
-void SysTick_Handler(void) { HAL_IncTick(); }
+void SysTick_Handler(void) {
+    HAL_IncTick();
+    scheduler_post(Event_Tick);
+}
 
 // STM32F3xx Peripheral Interrupt Handlers -------------------------------------
 
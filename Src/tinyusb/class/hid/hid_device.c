@@ -43,6 +43,7 @@ typedef struct
   uint8_t itf_num;
   uint8_t ep_in;
   uint8_t ep_out;        // optional Out endpoint
+  bool    out_paused;    // OUT endpoint left un-armed, see tud_hid_out_ready_cb
   uint8_t boot_protocol; // Boot mouse or keyboard
   bool    boot_mode;     // default = false (Report)
   uint8_t idle_rate;     // up to application to handle idle rate
@@ -61,28 +62,34 @@ static inline hidd_interface_t* get_interface_by_itfnum(uint8_t itf_num)
 {
   for (uint8_t i=0; i < CFG_TUD_HID; i++ )
   {
+    // Instances not opened yet also have itf_num 0
+    if ( _hidd_itf[i].ep_in == 0 ) continue;
     if ( itf_num == _hidd_itf[i].itf_num ) return &_hidd_itf[i];
   }
 
   return NULL;
 }
 
+static inline uint8_t get_instance(hidd_interface_t const * p_hid)
+{
+  return (uint8_t) (p_hid - _hidd_itf);
+}
+
 //--------------------------------------------------------------------+
 // APPLICATION API
 //--------------------------------------------------------------------+
-bool tud_hid_ready(void)
+bool tud_hid_n_ready(uint8_t instance)
 {
-  uint8_t itf = 0;
-  uint8_t const ep_in = _hidd_itf[itf].ep_in;
+  TU_VERIFY(instance < CFG_TUD_HID);
+  uint8_t const ep_in = _hidd_itf[instance].ep_in;
   return tud_ready() && (ep_in != 0) && usbd_edpt_ready(TUD_OPT_RHPORT, ep_in);
 }
 
-bool tud_hid_report(uint8_t report_id, void const* report, uint8_t len)
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const* report, uint8_t len)
 {
-  TU_VERIFY( tud_hid_ready() );
+  TU_VERIFY( tud_hid_n_ready(instance) );
 
-  uint8_t itf = 0;
-  hidd_interface_t * p_hid = &_hidd_itf[itf];
+  hidd_interface_t * p_hid = &_hidd_itf[instance];
 
   if (report_id)
   {
@@ -101,10 +108,22 @@ bool tud_hid_report(uint8_t report_id, void const* report, uint8_t len)
   return usbd_edpt_xfer(TUD_OPT_RHPORT, p_hid->ep_in, p_hid->epin_buf, len);
 }
 
-bool tud_hid_boot_mode(void)
+bool tud_hid_n_out_resume(uint8_t instance)
 {
-  uint8_t itf = 0;
-  return _hidd_itf[itf].boot_mode;
+  TU_VERIFY(instance < CFG_TUD_HID);
+  hidd_interface_t * p_hid = &_hidd_itf[instance];
+
+  if ( !p_hid->out_paused ) return true;
+  TU_VERIFY( tud_ready() && p_hid->ep_out );
+
+  p_hid->out_paused = false;
+  return usbd_edpt_xfer(TUD_OPT_RHPORT, p_hid->ep_out, p_hid->epout_buf, sizeof(p_hid->epout_buf));
+}
+
+bool tud_hid_n_boot_mode(uint8_t instance)
+{
+  TU_VERIFY(instance < CFG_TUD_HID);
+  return _hidd_itf[instance].boot_mode;
 }
 
 //--------------------------------------------------------------------+
@@ -221,7 +240,7 @@ bool hidd_control_request(uint8_t rhport, tusb_control_request_t const * request
     }
     else if (request->bRequest == TUSB_REQ_GET_DESCRIPTOR && desc_type == HID_DESC_TYPE_REPORT)
     {
-      uint8_t const * desc_report = tud_hid_descriptor_report_cb();
+      uint8_t const * desc_report = tud_hid_descriptor_report_cb(get_instance(p_hid));
       tud_control_xfer(rhport, request, (void*) desc_report, p_hid->report_desc_len);
     }
     else
@@ -240,7 +259,7 @@ bool hidd_control_request(uint8_t rhport, tusb_control_request_t const * request
         uint8_t const report_type = tu_u16_high(request->wValue);
         uint8_t const report_id   = tu_u16_low(request->wValue);
 
-        uint16_t xferlen  = tud_hid_get_report_cb(report_id, (hid_report_type_t) report_type, p_hid->epin_buf, request->wLength);
+        uint16_t xferlen  = tud_hid_get_report_cb(get_instance(p_hid), report_id, (hid_report_type_t) report_type, p_hid->epin_buf, request->wLength);
         TU_ASSERT( xferlen > 0 );
 
         tud_control_xfer(rhport, request, p_hid->epin_buf, xferlen);
@@ -308,7 +327,7 @@ bool hidd_control_complete(uint8_t rhport, tusb_control_request_t const * p_requ
     uint8_t const report_type = tu_u16_high(p_request->wValue);
     uint8_t const report_id   = tu_u16_low(p_request->wValue);
 
-    tud_hid_set_report_cb(report_id, (hid_report_type_t) report_type, p_hid->epout_buf, p_request->wLength);
+    tud_hid_set_report_cb(get_instance(p_hid), report_id, (hid_report_type_t) report_type, p_hid->epout_buf, p_request->wLength);
   }
 
   return true;
@@ -325,12 +344,25 @@ bool hidd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_
   {
     if (itf >= TU_ARRAY_SIZE(_hidd_itf)) return false;
 
-    if ( ep_addr == p_hid->ep_out ) break;
+    if ( ep_addr == p_hid->ep_out || ep_addr == p_hid->ep_in ) break;
   }
 
-  if (ep_addr == p_hid->ep_out)
+  if (ep_addr == p_hid->ep_in)
+  {
+    if (tud_hid_report_complete_cb) tud_hid_report_complete_cb(itf, xferred_bytes);
+  }
+  else if (ep_addr == p_hid->ep_out)
   {
-    tud_hid_set_report_cb(0, HID_REPORT_TYPE_INVALID, p_hid->epout_buf, xferred_bytes);
+    tud_hid_set_report_cb(itf, 0, HID_REPORT_TYPE_INVALID, p_hid->epout_buf, xferred_bytes);
+
+    // Application has no room for another report: leave the endpoint un-armed
+    // so the host gets NAKed until tud_hid_out_resume()
+    if ( tud_hid_out_ready_cb && !tud_hid_out_ready_cb(itf) )
+    {
+      p_hid->out_paused = true;
+      return true;
+    }
+
     TU_ASSERT(usbd_edpt_xfer(rhport, p_hid->ep_out, p_hid->epout_buf, sizeof(p_hid->epout_buf)));
   }
 
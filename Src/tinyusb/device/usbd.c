@@ -882,7 +882,7 @@ void dcd_event_handler(dcd_event_t const * event, bool in_isr)
     break;
 
     case DCD_EVENT_SOF:
-      return;   // skip SOF event for now
+      // not queued for tud_task, only passed on to tud_event_hook_cb below
     break;
 
     case DCD_EVENT_SUSPEND:
@@ -909,6 +909,8 @@ void dcd_event_handler(dcd_event_t const * event, bool in_isr)
       osal_queue_send(_usbd_q, event, in_isr);
     break;
   }
+
+  if (tud_event_hook_cb) tud_event_hook_cb(event->rhport, event->event_id, in_isr);
 }
 
 void dcd_event_bus_signal (uint8_t rhport, dcd_eventid_t eid, bool in_isr)
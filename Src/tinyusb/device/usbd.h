@@ -110,6 +110,12 @@ TU_ATTR_WEAK void tud_resume_cb(void);
 TU_ATTR_WEAK bool tud_vendor_control_request_cb(uint8_t rhport, tusb_control_request_t const * request);
 TU_ATTR_WEAK bool tud_vendor_control_complete_cb(uint8_t rhport, tusb_control_request_t const * request);
 
+// Invoked from dcd_event_handler() every time the DCD signals an event, after
+// it has been queued (usually in ISR context). Lets an event-driven application
+// know that tud_task() has work to do. DCD_EVENT_SOF is passed on too, but is
+// never queued.
+TU_ATTR_WEAK void tud_event_hook_cb(uint8_t rhport, uint32_t eventid, bool in_isr);
+
 
 //--------------------------------------------------------------------+
 // Binary Device Object Store (BOS) Descriptor Templates
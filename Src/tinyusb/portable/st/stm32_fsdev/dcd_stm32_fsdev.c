@@ -73,7 +73,7 @@
  * - Packet buffer memory is copied in the interrupt.
  *   - This is better for performance, but means interrupts are disabled for longer
  *   - DMA may be the best choice, but it could also be pushed to the USBD task.
- * - No double-buffering
+ * - Double-buffering only for bulk OUT endpoints (DCD_STM32_DOUBLE_BUFFER_BULK_OUT)
  * - No DMA
  * - No provision to control the D+ pull-up using GPIO on devices without an internal pull-up.
  * - Minimal error handling
@@ -125,6 +125,7 @@
 
 #include "device/dcd.h"
 #include "portable/st/stm32_fsdev/dcd_stm32_fsdev_pvt_st.h"
+#include "portable/st/stm32_fsdev/dcd_stm32_fsdev_pma.h"
 
 
 /*****************************************************
@@ -146,6 +147,15 @@
 #  define DCD_STM32_BTABLE_LENGTH (PMA_LENGTH - DCD_STM32_BTABLE_BASE)
 #endif
 
+// Bulk OUT endpoints get two PMA buffers, so the host can send the next packet
+// while the stack hasn't queued the next transfer yet, instead of being NAKed.
+// The hardware can only do this for bulk (and isochronous) endpoints. Both
+// buffer descriptors of the endpoint number are taken, so it can't have an IN
+// endpoint too.
+#ifndef DCD_STM32_DOUBLE_BUFFER_BULK_OUT
+#  define DCD_STM32_DOUBLE_BUFFER_BULK_OUT 1u
+#endif
+
 /***************************************************
  * Checks, structs, defines, function definitions, etc.
  */
@@ -164,6 +174,14 @@ typedef struct
   uint16_t total_len;
   uint16_t queued_len;
   uint16_t max_packet_size;
+
+  // Double-buffered OUT endpoints only. One buffer is the driver's, the
+  // other the hardware's, and the two swap when the driver toggles SW_BUF.
+  // Packets wait in them while no transfer is queued.
+  bool double_buffered;
+  bool armed;   // a transfer is queued
+  bool unread;  // the driver's buffer holds a packet not read yet
+  bool filled;  // the hardware's buffer holds one, it NAKs until they swap
 } xfer_ctl_t;
 
 static xfer_ctl_t xfer_status[MAX_EP_COUNT][2];
@@ -184,6 +202,8 @@ static void dcd_handle_bus_reset(void);
 static bool dcd_write_packet_memory(uint16_t dst, const void *__restrict src, size_t wNBytes);
 static bool dcd_read_packet_memory(void *__restrict dst, uint16_t src, size_t wNBytes);
 static void dcd_transmit_packet(xfer_ctl_t * xfer, uint16_t ep_ix);
+static void dcd_receive_double_buffered(xfer_ctl_t * xfer, uint32_t ep_ix, bool in_isr);
+static void dcd_reset_double_buffered(xfer_ctl_t * xfer, uint32_t ep_ix);
 static void dcd_ep_ctr_handler(void);
 
 
@@ -425,6 +445,12 @@ static void dcd_ep_ctr_rx_handler(uint32_t wIstr)
       dcd_event_setup_received(0, (uint8_t*)userMemBuf, true);
     }
   }
+  else if (xfer->double_buffered)
+  {
+    pcd_clear_rx_ep_ctr(USB, EPindex);
+    xfer->filled = true;
+    dcd_receive_double_buffered(xfer, EPindex, true);
+  }
   else
   {
     // Clear RX CTR interrupt flag
@@ -619,7 +645,33 @@ bool dcd_edpt_open (uint8_t rhport, tusb_desc_endpoint_t const * p_endpoint_desc
   pcd_set_ep_address(USB, epnum, epnum);
   // Be normal, for now, instead of only accepting zero-byte packets (on control endpoint)
   // or being double-buffered (bulk endpoints)
-  pcd_clear_ep_kind(USB,0);
+  pcd_clear_ep_kind(USB,epnum);
+
+  xfer_ctl_t * xfer = xfer_ctl_ptr(epnum, dir);
+  xfer->double_buffered = DCD_STM32_DOUBLE_BUFFER_BULK_OUT &&
+      dir == TUSB_DIR_OUT && p_endpoint_desc->bmAttributes.xfer == TUSB_XFER_BULK;
+  xfer->armed = false;
+
+  if (xfer->double_buffered)
+  {
+    TU_ASSERT(ep_buf_ptr + 2u*epMaxPktSize <= DCD_STM32_BTABLE_BASE + DCD_STM32_BTABLE_LENGTH);
+
+    // Buffer 0 takes the TX descriptor, buffer 1 the RX one. Both receive.
+    pcd_set_ep_kind(USB, epnum);
+    *pcd_ep_tx_address_ptr(USB, epnum) = ep_buf_ptr;
+    pcd_set_ep_cnt_rx_reg(pcd_ep_tx_cnt_ptr(USB, epnum), epMaxPktSize);
+    *pcd_ep_rx_address_ptr(USB, epnum) = (uint16_t)(ep_buf_ptr + epMaxPktSize);
+    pcd_set_ep_rx_cnt(USB, epnum, epMaxPktSize);
+
+    dcd_reset_double_buffered(xfer, epnum);
+    pcd_set_ep_rx_status(USB, epnum, USB_EP_RX_NAK);
+
+    xfer->max_packet_size = epMaxPktSize;
+    ep_buf_ptr = (uint16_t)(ep_buf_ptr + 2u*epMaxPktSize);
+    return true;
+  }
+
+  TU_ASSERT(ep_buf_ptr + epMaxPktSize <= DCD_STM32_BTABLE_BASE + DCD_STM32_BTABLE_LENGTH);
 
   if(dir == TUSB_DIR_IN)
   {
@@ -636,13 +688,13 @@ bool dcd_edpt_open (uint8_t rhport, tusb_desc_endpoint_t const * p_endpoint_desc
     pcd_set_ep_rx_status(USB, epnum, USB_EP_RX_NAK);
   }
 
-  xfer_ctl_ptr(epnum, dir)->max_packet_size = epMaxPktSize;
+  xfer->max_packet_size = epMaxPktSize;
   ep_buf_ptr = (uint16_t)(ep_buf_ptr + p_endpoint_desc->wMaxPacketSize.size); // increment buffer pointer
 
   return true;
 }
 
-// Currently, single-buffered, and only 64 bytes at a time (max)
+// IN endpoints are single-buffered, and only 64 bytes at a time (max)
 
 static void dcd_transmit_packet(xfer_ctl_t * xfer, uint16_t ep_ix)
 {
@@ -660,6 +712,65 @@ static void dcd_transmit_packet(xfer_ctl_t * xfer, uint16_t ep_ix)
   pcd_set_ep_tx_status(USB, ep_ix, USB_EP_TX_VALID);
 }
 
+// DTOG_RX picks the buffer the hardware fills and DTOG_TX (SW_BUF) the one the
+// driver has. The hardware starts on buffer 0, with the driver's empty.
+static void dcd_reset_double_buffered(xfer_ctl_t * xfer, uint32_t ep_ix)
+{
+  pcd_clear_rx_dtog(USB, ep_ix);
+  pcd_clear_tx_dtog(USB, ep_ix);
+  pcd_tx_dtog(USB, ep_ix);
+
+  xfer->unread = false;
+  xfer->filled = false;
+}
+
+// Takes the hardware's buffer once the driver's is read, swapping it for the
+// empty one so the host can send again, and reads packets into the transfer
+// while one is queued
+static void dcd_receive_double_buffered(xfer_ctl_t * xfer, uint32_t ep_ix, bool in_isr)
+{
+  while (true)
+  {
+    if (!xfer->unread && xfer->filled)
+    {
+      pcd_tx_dtog(USB, ep_ix);
+      xfer->filled = false;
+      xfer->unread = true;
+    }
+
+    if (!xfer->unread || !xfer->armed)
+    {
+      return;
+    }
+
+    bool buf1 = (pcd_get_endpoint(USB, ep_ix) & USB_EP_DTOG_TX) != 0u;
+    uint16_t addr = buf1 ? *pcd_ep_rx_address_ptr(USB, ep_ix) : *pcd_ep_tx_address_ptr(USB, ep_ix);
+    uint32_t count = buf1 ? pcd_get_ep_rx_cnt(USB, ep_ix) : pcd_get_ep_tx_cnt(USB, ep_ix);
+    uint32_t remaining = (uint32_t)xfer->total_len - (uint32_t)xfer->queued_len;
+
+    // Single-buffered endpoints limit the count register to what's left. Here
+    // the packet is already in, so a short transfer gets cut.
+    if (count > remaining)
+    {
+      count = remaining;
+    }
+
+    if (count != 0u)
+    {
+      dcd_read_packet_memory(&(xfer->buffer[xfer->queued_len]), addr, count);
+      xfer->queued_len = (uint16_t)(xfer->queued_len + count);
+    }
+
+    xfer->unread = false;
+
+    if ((count < xfer->max_packet_size) || (xfer->queued_len == xfer->total_len))
+    {
+      xfer->armed = false;
+      dcd_event_xfer_complete(0, (uint8_t)ep_ix, xfer->queued_len, XFER_RESULT_SUCCESS, in_isr);
+    }
+  }
+}
+
 bool dcd_edpt_xfer (uint8_t rhport, uint8_t ep_addr, uint8_t * buffer, uint16_t total_bytes)
 {
   (void) rhport;
@@ -673,7 +784,23 @@ bool dcd_edpt_xfer (uint8_t rhport, uint8_t ep_addr, uint8_t * buffer, uint16_t
   xfer->total_len = total_bytes;
   xfer->queued_len = 0;
 
-  if ( dir == TUSB_DIR_OUT )
+  if (xfer->double_buffered)
+  {
+    // Packets that came in while no transfer was queued are read right here,
+    // with the interrupt kept out of the buffers meanwhile
+    dcd_int_disable(rhport);
+    xfer->armed = true;
+    dcd_receive_double_buffered(xfer, epnum, false);
+
+    // Stays valid from here on, the buffers do the flow control
+    if ((pcd_get_endpoint(USB, epnum) & USB_EPRX_STAT) != USB_EP_RX_VALID)
+    {
+      pcd_set_ep_rx_status(USB, epnum, USB_EP_RX_VALID);
+    }
+
+    dcd_int_enable(rhport);
+  }
+  else if ( dir == TUSB_DIR_OUT )
   {
     // A setup token can occur immediately after an OUT STATUS packet so make sure we have a valid
     // buffer for the control endpoint.
@@ -728,79 +855,40 @@ void dcd_edpt_clear_stall (uint8_t rhport, uint8_t ep_addr)
     /* Reset to DATA0 if clearing stall condition. */
     pcd_clear_rx_dtog(USB,ep_addr);
 
+    xfer_ctl_t * xfer = xfer_ctl_ptr(ep_addr, TUSB_DIR_OUT);
+    if (xfer->double_buffered)
+    {
+      dcd_reset_double_buffered(xfer, ep_addr);
+    }
+
     pcd_set_ep_rx_status(USB,ep_addr, USB_EP_RX_NAK);
   }
 }
 
-// Packet buffer access can only be 8- or 16-bit.
+// Packet buffer access can only be 8- or 16-bit, see dcd_stm32_fsdev_pma.h
 /**
   * @brief Copy a buffer from user memory area to packet memory area (PMA).
-  *        This uses byte-access for user memory (so support non-aligned buffers)
-  *        and 16-bit access for packet memory.
   * @param   dst, byte address in PMA; must be 16-bit aligned
-  * @param   src pointer to user memory area.
-  * @param   wPMABufAddr address into PMA.
+  * @param   src pointer to user memory area, any alignment
   * @param   wNBytes no. of bytes to be copied.
   * @retval None
   */
 static bool dcd_write_packet_memory(uint16_t dst, const void *__restrict src, size_t wNBytes)
 {
-  uint32_t n =  ((uint32_t)wNBytes + 1U) >> 1U;
-  uint32_t i;
-  uint16_t temp1, temp2;
-  const uint8_t * srcVal;
-
-  // The GCC optimizer will combine access to 32-bit sizes if we let it. Force
-  // it volatile so that it won't do that.
-  __IO uint16_t *pdwVal;
-
-  srcVal = src;
-  pdwVal = &pma[PMA_STRIDE*(dst>>1)];
-
-  for (i = n; i != 0; i--)
-  {
-    temp1 = (uint16_t) *srcVal;
-    srcVal++;
-    temp2 = temp1 | ((uint16_t)((uint16_t) ((*srcVal) << 8U))) ;
-    *pdwVal = temp2;
-    pdwVal += PMA_STRIDE;
-    srcVal++;
-  }
+  pma_copy_to(&pma[PMA_STRIDE*(dst>>1)], src, wNBytes);
   return true;
 }
 
 /**
-  * @brief Copy a buffer from user memory area to packet memory area (PMA).
-  *        Uses byte-access of system memory and 16-bit access of packet memory
+  * @brief Copy a buffer from packet memory area (PMA) to user memory area.
+  * @param   dst pointer to user memory area, any alignment
+  * @param   src, byte address in PMA; must be 16-bit aligned
   * @param   wNBytes no. of bytes to be copied.
   * @retval None
   */
 static bool dcd_read_packet_memory(void *__restrict dst, uint16_t src, size_t wNBytes)
 {
-  uint32_t n = (uint32_t)wNBytes >> 1U;
-  uint32_t i;
-  // The GCC optimizer will combine access to 32-bit sizes if we let it. Force
-  // it volatile so that it won't do that.
-  __IO const uint16_t *pdwVal;
-  uint32_t temp;
-
-  pdwVal = &pma[PMA_STRIDE*(src>>1)];
-  uint8_t *dstVal = (uint8_t*)dst;
-
-  for (i = n; i != 0U; i--)
-  {
-    temp = *pdwVal;
-    pdwVal += PMA_STRIDE;
-    *dstVal++ = ((temp >> 0) & 0xFF);
-    *dstVal++ = ((temp >> 8) & 0xFF);
-  }
-
-  if (wNBytes % 2)
-  {
-    temp = *pdwVal;
-    pdwVal += PMA_STRIDE;
-    *dstVal++ = ((temp >> 0) & 0xFF);
-  }
+  pma_copy_from(dst, &pma[PMA_STRIDE*(src>>1)], wNBytes);
   return true;
 }
 
@@ -0,0 +1,190 @@
+/*
+ * Copy kernels between user memory and the USB packet memory area (PMA).
+ *
+ * The PMA can only be accessed 8 or 16 bits at a time, and with PMA_STRIDE 2
+ * every halfword sits in its own 32-bit slot, so the PMA side can't get any
+ * wider. What these save over a halfword-at-a-time loop is on the user memory
+ * side: when the buffer is word aligned, a word is loaded or stored per two
+ * PMA halfwords instead of two separate bytes each, and the loops are unrolled
+ * to 16 bytes so a 64 byte packet is four iterations.
+ *
+ * Kept apart from the driver so Sim/bench_pma_copy.c can build them against
+ * an array standing in for the PMA. The includer defines __IO and PMA_STRIDE.
+ */
+
+#ifndef _TUSB_DCD_STM32_FSDEV_PMA_H_
+#define _TUSB_DCD_STM32_FSDEV_PMA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Word accesses through memcpy, which compiles to a single LDR/STR but doesn't
+// fall foul of strict aliasing for byte buffers
+static inline uint32_t pma_load_aligned(const uint8_t * src)
+{
+  uint32_t word;
+  memcpy(&word, __builtin_assume_aligned(src, 4), 4);
+  return word;
+}
+
+static inline void pma_store_aligned(uint8_t * dst, uint32_t word)
+{
+  memcpy(__builtin_assume_aligned(dst, 4), &word, 4);
+}
+
+static inline uint32_t pma_load_bytes(const uint8_t * src)
+{
+  return (uint32_t)src[0] | ((uint32_t)src[1] << 8) |
+         ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static inline void pma_store_bytes(uint8_t * dst, uint32_t word)
+{
+  dst[0] = (uint8_t)word;
+  dst[1] = (uint8_t)(word >> 8);
+  dst[2] = (uint8_t)(word >> 16);
+  dst[3] = (uint8_t)(word >> 24);
+}
+
+// Two PMA halfwords from one word of user memory, low half first
+static inline void pma_put_word(__IO uint16_t * pma_buf, uint32_t word)
+{
+  pma_buf[0] = (uint16_t)word;
+  pma_buf[PMA_STRIDE] = (uint16_t)(word >> 16);
+}
+
+static inline uint32_t pma_get_word(__IO const uint16_t * pma_buf)
+{
+  return (uint32_t)pma_buf[0] | ((uint32_t)pma_buf[PMA_STRIDE] << 16);
+}
+
+/**
+  * @brief Copies len bytes from user memory to the PMA.
+  * @param pma_buf first halfword of the PMA buffer
+  * @param src     user memory, any alignment
+  * @param len     bytes to copy. With an odd count, the last halfword's high
+  *                byte is written as zero.
+  */
+static inline void pma_copy_to(__IO uint16_t * pma_buf, const uint8_t * src, size_t len)
+{
+  size_t words = len >> 2;
+
+  if (((uintptr_t)src & 3u) == 0)
+  {
+    for (; words >= 4; words -= 4)
+    {
+      pma_put_word(pma_buf, pma_load_aligned(src));
+      pma_put_word(pma_buf + 2*PMA_STRIDE, pma_load_aligned(src + 4));
+      pma_put_word(pma_buf + 4*PMA_STRIDE, pma_load_aligned(src + 8));
+      pma_put_word(pma_buf + 6*PMA_STRIDE, pma_load_aligned(src + 12));
+      pma_buf += 8*PMA_STRIDE;
+      src += 16;
+    }
+
+    for (; words != 0; words--)
+    {
+      pma_put_word(pma_buf, pma_load_aligned(src));
+      pma_buf += 2*PMA_STRIDE;
+      src += 4;
+    }
+  }
+  else
+  {
+    for (; words >= 4; words -= 4)
+    {
+      pma_put_word(pma_buf, pma_load_bytes(src));
+      pma_put_word(pma_buf + 2*PMA_STRIDE, pma_load_bytes(src + 4));
+      pma_put_word(pma_buf + 4*PMA_STRIDE, pma_load_bytes(src + 8));
+      pma_put_word(pma_buf + 6*PMA_STRIDE, pma_load_bytes(src + 12));
+      pma_buf += 8*PMA_STRIDE;
+      src += 16;
+    }
+
+    for (; words != 0; words--)
+    {
+      pma_put_word(pma_buf, pma_load_bytes(src));
+      pma_buf += 2*PMA_STRIDE;
+      src += 4;
+    }
+  }
+
+  // Up to three bytes left
+  if (len & 2u)
+  {
+    *pma_buf = (uint16_t)(src[0] | (src[1] << 8));
+    pma_buf += PMA_STRIDE;
+    src += 2;
+  }
+
+  if (len & 1u)
+  {
+    *pma_buf = src[0];
+  }
+}
+
+/**
+  * @brief Copies len bytes from the PMA to user memory.
+  * @param dst     user memory, any alignment
+  * @param pma_buf first halfword of the PMA buffer
+  * @param len     bytes to copy
+  */
+static inline void pma_copy_from(uint8_t * dst, __IO const uint16_t * pma_buf, size_t len)
+{
+  size_t words = len >> 2;
+
+  if (((uintptr_t)dst & 3u) == 0)
+  {
+    for (; words >= 4; words -= 4)
+    {
+      pma_store_aligned(dst, pma_get_word(pma_buf));
+      pma_store_aligned(dst + 4, pma_get_word(pma_buf + 2*PMA_STRIDE));
+      pma_store_aligned(dst + 8, pma_get_word(pma_buf + 4*PMA_STRIDE));
+      pma_store_aligned(dst + 12, pma_get_word(pma_buf + 6*PMA_STRIDE));
+      pma_buf += 8*PMA_STRIDE;
+      dst += 16;
+    }
+
+    for (; words != 0; words--)
+    {
+      pma_store_aligned(dst, pma_get_word(pma_buf));
+      pma_buf += 2*PMA_STRIDE;
+      dst += 4;
+    }
+  }
+  else
+  {
+    for (; words >= 4; words -= 4)
+    {
+      pma_store_bytes(dst, pma_get_word(pma_buf));
+      pma_store_bytes(dst + 4, pma_get_word(pma_buf + 2*PMA_STRIDE));
+      pma_store_bytes(dst + 8, pma_get_word(pma_buf + 4*PMA_STRIDE));
+      pma_store_bytes(dst + 12, pma_get_word(pma_buf + 6*PMA_STRIDE));
+      pma_buf += 8*PMA_STRIDE;
+      dst += 16;
+    }
+
+    for (; words != 0; words--)
+    {
+      pma_store_bytes(dst, pma_get_word(pma_buf));
+      pma_buf += 2*PMA_STRIDE;
+      dst += 4;
+    }
+  }
+
+  if (len & 2u)
+  {
+    uint16_t half = *pma_buf;
+    dst[0] = (uint8_t)half;
+    dst[1] = (uint8_t)(half >> 8);
+    pma_buf += PMA_STRIDE;
+    dst += 2;
+  }
+
+  if (len & 1u)
+  {
+    dst[0] = (uint8_t)*pma_buf;
+  }
+}
+
+#endif /* _TUSB_DCD_STM32_FSDEV_PMA_H_ */
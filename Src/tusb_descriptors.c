@@ -25,6 +25,8 @@
 
 #include "tusb.h"
 #include "debug_leds.h"
+#include "tusb_vendor.h"
+#include "tusb_hid.h"
 
 /* A combination of interfaces must have a unique product id, since PC will save
  * device driver after the first plug.
@@ -48,7 +50,7 @@
 tusb_desc_device_t const desc_device = {
     .bLength            = sizeof(tusb_desc_device_t),
     .bDescriptorType    = TUSB_DESC_DEVICE,
-    .bcdUSB             = 0x0200,
+    .bcdUSB             = 0x0210, // 2.1 for the BOS descriptor
     .bDeviceClass       = 0x00,
     .bDeviceSubClass    = 0x00,
     .bDeviceProtocol    = 0x00,
@@ -56,7 +58,8 @@ tusb_desc_device_t const desc_device = {
 
     .idVendor           = USBD_VID,
     .idProduct          = USBD_PID_FS,
-    .bcdDevice          = 0x0200,
+    .bcdDevice          = 0x0221, // Changed with every change of interfaces,
+                                  // so Windows reads the descriptors again
 
     .iManufacturer      = 0x01,
     .iProduct           = 0x02,
@@ -93,14 +96,50 @@ uint8_t const desc_hid_report[] = {
     0x95, 0x40,        //   Report Count (64)
     0x91, 0x02,        //   Output (Data,Array,Abs,No Wrap,Linear,Preferred State,
                        //   No Null Position,Non-volatile)
+    0x19, 0x01,
+    0x29, 0x40,
+    0x75, 0x08,
+    0x95, 0x40,        //   Report Count (64)
+    0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,
+                       //   No Null Position,Non-volatile)
+                       //   Latency histograms, see latency.h
+    0xC0,              // End Collection
+};
+
+// Gamepad with a button per panel, in ComportId order: left, down, up, right.
+// The feature report holds the step detection thresholds, see steps.h.
+uint8_t const desc_gamepad_report[] = {
+    0x05, 0x01,        // Usage Page (Generic Desktop)
+    0x09, 0x05,        // Usage (Game Pad)
+    0xA1, 0x01,        // Collection (Application)
+    0x05, 0x09,        //   Usage Page (Button)
+    0x19, 0x01,        //   Usage Minimum (Button 1)
+    0x29, 0x04,        //   Usage Maximum (Button 4)
+    0x15, 0x00,        //   Logical Minimum (0)
+    0x25, 0x01,        //   Logical Maximum (1)
+    0x75, 0x01,        //   Report Size (1)
+    0x95, 0x04,        //   Report Count (4)
+    0x81, 0x02,        //   Input (Data,Var,Abs)
+    0x75, 0x04,        //   Report Size (4)
+    0x95, 0x01,        //   Report Count (1)
+    0x81, 0x03,        //   Input (Const,Var,Abs): padding to a byte
+    0x06, 0x00, 0xFF,  //   Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,        //   Usage (0x01)
+    0x15, 0x00,        //   Logical Minimum (0)
+    0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+    0x75, 0x08,        //   Report Size (8)
+    0x95, 0x40,        //   Report Count (64)
+    0xB1, 0x02,        //   Feature (Data,Var,Abs)
+                       //   Step detection thresholds
     0xC0,              // End Collection
 };
 
 // Invoked when received GET HID REPORT DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
-uint8_t const * tud_hid_descriptor_report_cb(void) {
-  return desc_hid_report;
+uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance) {
+    if (instance == USB_GAMEPAD_INSTANCE) return desc_gamepad_report;
+    return desc_hid_report;
 }
 
 //--------------------------------------------------------------------+
@@ -113,9 +152,9 @@ uint8_t const desc_configuration[] = {
     // https://www.keil.com/pack/doc/mw/USB/html/_u_s_b__configuration__descriptor.html
     TUD_CONFIG_DESC_LEN, // bLength: Config Descriptor size: 9 bytes
     TUSB_DESC_CONFIGURATION, // bDescriptorType: configuration
-    41, // wTotalLength: (low byte) Total size of full descriptor: 41 bytes
+    100, // wTotalLength: (low byte) Total size of full descriptor: 100 bytes
     0, // wTotalLength (high byte)
-    1, // bNumInterfaces
+    4, // bNumInterfaces
     1, // bConfigurationValue: Selected configuration id
     0, // iConfiguration: index of string descriptor describing this config
     0xC0, // bmAttributes: 1100 0000 - Self-powered, no remote wakeup
@@ -186,8 +225,84 @@ uint8_t const desc_configuration[] = {
     64,   // wMaxPacketSize: (lobyte) 64 bytes
     0,    // wMaxPacketSize: (hibyte)
     1,    // bInterval: Polling interval expressed in ms
+
+    // Interface descriptor, vendor specific ----------------------------------
+    // Bulk LED data, see led_stream.h. Windows binds WinUSB to it by itself
+    // thanks to the MS OS 2.0 descriptors below.
+    9, // bLength: Interface descriptor size
+    TUSB_DESC_INTERFACE, // bDescriptorType
+    USB_VENDOR_INTERFACE, // bInterfaceNumber: 0-based index
+    0, // bAlternateSetting
+    1, // bNumEndpoints: 1. LED data: host->device
+    TUSB_CLASS_VENDOR_SPECIFIC, // bInterfaceClass
+    0x00, // bInterfaceSubClass
+    0x00, // bInterfaceProtocol
+    0,    // iInterface
+
+    // Endpoint descriptor -----------------------------------------------------
+    7, // bLength: endpoint descriptor size
+    TUSB_DESC_ENDPOINT, // bDescriptorType
+    0x02, // 0000 0010 bEndpointAddress
+          // |||| \\\\- Endpoint number 
+          // |\\\- Reserved, forced 0
+          // \- Direction: 0 = OUT endpoint (host->device)
+    0x02, // 0000 0010 bmAttributes
+          // |||| ||\\- Transfer type: Bulk
+          // \\\\ \\- Reserved, forced 0
+    64,   // wMaxPacketSize: (lobyte) 64 bytes
+    0,    // wMaxPacketSize: (hibyte)
+    0,    // bInterval: Ignored for bulk endpoints
+
+    // Interface descriptor, gamepad HID --------------------------------------
+    // Buttons from step detection, so games can use the pad without any host
+    // software
+    9, // bLength: Interface descriptor size
+    TUSB_DESC_INTERFACE, // bDescriptorType
+    USB_GAMEPAD_INTERFACE, // bInterfaceNumber: 0-based index
+    0, // bAlternateSetting
+    1, // bNumEndpoints: 1. Buttons: device->host
+    0x03, // bInterfaceClass: Human-Interface-Device (HID)
+    0x00, // bInterfaceSubClass: No boot
+    0x00, // bInterfaceProtocol: None
+    0,    // iInterface
+
+    // Gamepad HID Descriptor --------------------------------------------------
+    9, // bLength: HID descriptor size
+    TUSB_DESC_CS_DEVICE, // bDescriptorType: HID
+    0x11, // bcdHID: Version of the HID specification, binary coded decimal
+    0x01, // bcdHID: high byte (version 1.11)
+    0x00, // bCountryCode: None / not supported
+    0x01, // bNumDescriptors: number of class descriptors to follow
+    TUSB_DESC_CS_CONFIGURATION, // bDescriptionType: class specific config
+    sizeof(desc_gamepad_report), // wDescriptorLength for report desc.
+    0x00, // wDescriptorLength
+
+    // Endpoint descriptor -----------------------------------------------------
+    // Not endpoint 2: IN and OUT of an endpoint number share a single type on
+    // this USB peripheral, and 0x02 is bulk
+    7, // bLength: endpoint descriptor size
+    TUSB_DESC_ENDPOINT, // bDescriptorType
+    0x83, // 1000 0011 bEndpointAddress
+          // |||| \\- Endpoint number
+          // |\\- Reserved, forced 0
+          // \- Direction: 1 = IN endpoint (device->host)
+    0x03, // 0000 0011 bmAttributes
+          // |||| ||\- Transfer type: Interrupt
+          // \\ \- Reserved, forced 0
+    8,    // wMaxPacketSize: (lobyte) 8 bytes, room for the 1 byte report
+          // that keeps packet buffers aligned
+    0,    // wMaxPacketSize: (hibyte)
+    1,    // bInterval: Polling interval expressed in ms
+
+    // Interface and functional descriptor, DFU runtime ------------------------
+    // Lets dfu-util restart the board into the ROM bootloader, see update.h.
+    // Attributes: will detach by itself, download capable. The transfer size
+    // is the ROM bootloader's business, its own descriptors have the real one.
+    TUD_DFU_RT_DESCRIPTOR(USB_DFU_INTERFACE, 0, 0x09, 1000, 2048),
 };
 
+TU_VERIFY_STATIC(sizeof(desc_configuration) == 100, "Incorrect size");
+
 // Invoked when received GET CONFIGURATION DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
@@ -196,6 +311,91 @@ uint8_t const * tud_descriptor_configuration_cb(uint8_t index) {
     return desc_configuration;
 }
 
+//--------------------------------------------------------------------+
+// BOS Descriptor
+//--------------------------------------------------------------------+
+
+#define BOS_TOTAL_LEN (TUD_BOS_DESC_LEN + TUD_BOS_MICROSOFT_OS_DESC_LEN)
+
+// Only points at the MS OS 2.0 descriptor set; Windows asks for it with a
+// vendor request, see tud_vendor_control_request_cb in tusb_vendor_impl.c
+uint8_t const desc_bos[] = {
+    // total length, number of device caps
+    TUD_BOS_DESCRIPTOR(BOS_TOTAL_LEN, 1),
+
+    // Microsoft OS 2.0 descriptor
+    TUD_BOS_MS_OS_20_DESCRIPTOR(MS_OS_20_DESC_LEN, USB_VENDOR_REQUEST_MICROSOFT)
+};
+
+// Invoked when received GET BOS DESCRIPTOR
+// Application return pointer to descriptor
+uint8_t const * tud_descriptor_bos_cb(void) {
+    return desc_bos;
+}
+
+//--------------------------------------------------------------------+
+// Microsoft OS 2.0 Descriptor Set
+//--------------------------------------------------------------------+
+
+// Marks the vendor interface as WinUSB compatible, and gives it a device
+// interface GUID host software can find it by. The DFU interface gets WinUSB
+// too, so dfu-util can reach it without installing a driver.
+uint8_t const desc_ms_os_20[] = {
+    // Set header: length, type, windows version, total length
+    U16_TO_U8S_LE(0x000A), U16_TO_U8S_LE(MS_OS_20_SET_HEADER_DESCRIPTOR), 
+    U32_TO_U8S_LE(0x06030000), U16_TO_U8S_LE(MS_OS_20_DESC_LEN),
+
+    // Configuration subset header: length, type, configuration index, 
+    // reserved, configuration total length
+    U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_CONFIGURATION),
+    0, 0, U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0A),
+
+    // Function subset header: length, type, first interface, reserved, 
+    // subset length
+    U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_FUNCTION),
+    USB_VENDOR_INTERFACE, 0, 
+    U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0A - 0x08 - MS_OS_20_DFU_FUNCTION_LEN),
+
+    // Compatible ID descriptor: length, type, compatible ID, sub compatible ID
+    U16_TO_U8S_LE(0x0014), U16_TO_U8S_LE(MS_OS_20_FEATURE_COMPATBLE_ID), 
+    'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+    // Registry property descriptor: length, type
+    U16_TO_U8S_LE(
+        MS_OS_20_DESC_LEN - 0x0A - 0x08 - 0x08 - 0x14 
+        - MS_OS_20_DFU_FUNCTION_LEN
+    ),
+    U16_TO_U8S_LE(MS_OS_20_FEATURE_REG_PROPERTY),
+
+    // wPropertyDataType: REG_MULTI_SZ, wPropertyNameLength, 
+    // PropertyName: "DeviceInterfaceGUIDs" in UTF-16
+    U16_TO_U8S_LE(0x0007), U16_TO_U8S_LE(0x002A),
+    'D', 0, 'e', 0, 'v', 0, 'i', 0, 'c', 0, 'e', 0, 'I', 0, 'n', 0, 
+    't', 0, 'e', 0, 'r', 0, 'f', 0, 'a', 0, 'c', 0, 'e', 0, 'G', 0, 
+    'U', 0, 'I', 0, 'D', 0, 's', 0, 0, 0,
+
+    // wPropertyDataLength, 
+    // PropertyData: "{3C1E3A4B-8A1B-4F6C-9E07-5D2B7C6A0F31}" in UTF-16
+    U16_TO_U8S_LE(0x0050),
+    '{', 0, '3', 0, 'C', 0, '1', 0, 'E', 0, '3', 0, 'A', 0, '4', 0, 
+    'B', 0, '-', 0, '8', 0, 'A', 0, '1', 0, 'B', 0, '-', 0, '4', 0, 
+    'F', 0, '6', 0, 'C', 0, '-', 0, '9', 0, 'E', 0, '0', 0, '7', 0, 
+    '-', 0, '5', 0, 'D', 0, '2', 0, 'B', 0, '7', 0, 'C', 0, '6', 0, 
+    'A', 0, '0', 0, 'F', 0, '3', 0, '1', 0, '}', 0, 0, 0, 0, 0,
+
+    // Function subset header for the DFU interface, as above
+    U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_FUNCTION),
+    USB_DFU_INTERFACE, 0, U16_TO_U8S_LE(MS_OS_20_DFU_FUNCTION_LEN),
+
+    // Compatible ID descriptor, as above
+    U16_TO_U8S_LE(0x0014), U16_TO_U8S_LE(MS_OS_20_FEATURE_COMPATBLE_ID), 
+    'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+TU_VERIFY_STATIC(sizeof(desc_ms_os_20) == MS_OS_20_DESC_LEN, "Incorrect size");
+
 //--------------------------------------------------------------------+
 // String Descriptors
 //--------------------------------------------------------------------+
@@ -1,10 +1,54 @@
 #include "hid_device.h"
+#include "device/dcd.h"
 #include "tusb_hid.h"
+#include "scheduler.h"
+#include "latency.h"
+#include "sensors.h"
+#include "string.h"
+#include "config.h"
+#include "steps.h"
+#include "settings.h"
 
-#define PACKET_SIZE (64U)
+#define OUT_SLOT_MASK (USB_OUT_SLOT_COUNT - 1)
 
-static uint8_t usb_buffer[PACKET_SIZE];
-static bool have_packet = false;
+_Static_assert((USB_OUT_SLOT_COUNT & OUT_SLOT_MASK) == 0, "Slot count must be a power of two");
+_Static_assert(USB_OUT_SLOT_COUNT <= 128, "Slot count must fit the free-running indexes");
+
+// Public, so that contents can be inspected during debugging
+UsbOutStats usb_out_stats;
+
+// Ring of OUT reports, filled by tud_hid_set_report_cb and drained with
+// usb_get_packet/usb_release_packet. The indexes run freely and wrap at 256;
+// their difference is the number of slots in use.
+static uint8_t out_slots[USB_OUT_SLOT_COUNT][USB_PACKET_SIZE];
+static uint8_t out_front = 0;
+static uint8_t out_rear = 0;
+
+static inline uint8_t out_count() {
+    return (uint8_t)(out_rear - out_front);
+}
+
+static inline void out_add(uint8_t const * buffer, uint16_t bufsize) {
+    // Only reports from SET_REPORT requests can get here with the ring full,
+    // the OUT endpoint isn't re-armed while it is (see tud_hid_out_ready_cb)
+    if (out_count() == USB_OUT_SLOT_COUNT) {
+        usb_out_stats.overflows++;
+        return;
+    }
+
+    uint8_t * slot = out_slots[out_rear & OUT_SLOT_MASK];
+
+    if (bufsize > USB_PACKET_SIZE) bufsize = USB_PACKET_SIZE;
+    memcpy(slot, buffer, bufsize);
+    memset(slot + bufsize, 0, USB_PACKET_SIZE - bufsize);
+
+    out_rear++;
+    usb_out_stats.received++;
+
+    if (out_count() > usb_out_stats.max_depth) {
+        usb_out_stats.max_depth = out_count();
+    }
+}
 
 uint8_t const report_descriptor[] = {
     0x06, 0x00, 0xFF,  // Usage Page (Vendor Defined 0xFF00)
@@ -24,6 +68,13 @@ uint8_t const report_descriptor[] = {
     0x95, 0x40,        //   Report Count (64)
     0x91, 0x02,        //   Output (Data,Array,Abs,No Wrap,Linear,Preferred State,
                       //   No Null Position,Non-volatile)
+    0x19, 0x01,
+    0x29, 0x40,
+    0x75, 0x08,
+    0x95, 0x40,        //   Report Count (64)
+    0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,
+                      //   No Null Position,Non-volatile)
+                      //   Latency histograms, see latency.h
     0xC0,              // End Collection
 };
 
@@ -32,11 +83,25 @@ uint8_t const report_descriptor[] = {
 // Application must fill buffer report's content and return its length.
 // Return zero will cause the stack to STALL request
 uint16_t tud_hid_get_report_cb(
+    uint8_t instance,
     uint8_t report_id,
     hid_report_type_t report_type,
     uint8_t * buffer,
     uint16_t reqlen
 ) {
+    if (instance == USB_GAMEPAD_INSTANCE) {
+        if (report_type == HID_REPORT_TYPE_FEATURE) {
+            return steps_get_thresholds(buffer, reqlen);
+        }
+
+        buffer[0] = steps_buttons();
+        return USB_GAMEPAD_REPORT_LEN;
+    }
+
+    if (report_type == HID_REPORT_TYPE_FEATURE) {
+        return latency_build_report(buffer, reqlen);
+    }
+
     uint16_t report_length = 
         sizeof(report_descriptor) / sizeof(report_descriptor[0]);
 
@@ -48,25 +113,99 @@ uint16_t tud_hid_get_report_cb(
 }
 
 
+// Keeps thresholds set through the feature report across restarts
+static void save_step_thresholds() {
+    StepThresholds thresholds;
+    steps_get_thresholds((uint8_t *)&thresholds, sizeof(thresholds));
+
+    for (uint8_t panel = 0; panel < SENSOR_PANEL_COUNT; panel++) {
+        for (uint8_t i = 0; i < STEP_SENSORS_PER_PANEL; i++) {
+            settings_set(
+                Setting_Step_Thresholds + panel * STEP_SENSORS_PER_PANEL + i,
+                SETTING_STEP_THRESHOLDS(
+                    thresholds.press[panel][i],
+                    thresholds.release[panel][i]
+                )
+            );
+        }
+    }
+}
+
 // Invoked when received SET_REPORT control request or
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
 void tud_hid_set_report_cb(
+    uint8_t instance,
     uint8_t report_id,
     hid_report_type_t report_type,
     uint8_t const * buffer,
     uint16_t bufsize
 ) {
-    if (report_id == 0 && report_type == 0) {
-        for (uint16_t i = 0; i < bufsize; i++) {
-            usb_buffer[i] = buffer[i];
+    if (instance == USB_GAMEPAD_INSTANCE) {
+        if (report_type == HID_REPORT_TYPE_FEATURE
+            && steps_set_thresholds(buffer, bufsize)) {
+
+            save_step_thresholds();
         }
 
-        have_packet = true;
+        return;
+    }
+
+    if (report_id == 0 && report_type == 0) {
+        out_add(buffer, bufsize);
+        scheduler_post(Event_LED_Packet);
+    } else if (report_type == HID_REPORT_TYPE_FEATURE) {
+        latency_process_command(buffer, bufsize);
+        sensors_process_command(buffer, bufsize);
+    }
+}
+
+// Invoked after every report received on the OUT endpoint. Returning false
+// keeps the host NAKed until usb_release_packet() frees up a slot.
+bool tud_hid_out_ready_cb(uint8_t instance) {
+    if (out_count() < USB_OUT_SLOT_COUNT) return true;
+
+    usb_out_stats.pauses++;
+    return false;
+}
+
+// Invoked when the host has read the last sensor or gamepad report; the IN
+// endpoint can take the next one
+void tud_hid_report_complete_cb(uint8_t instance, uint16_t len) {
+    // Button changes that came in while the gamepad endpoint was busy are
+    // sent from the same event as sensor reports
+    if (instance == USB_GAMEPAD_INSTANCE || !USB_SOF_REPORT_PACING) {
+        scheduler_post(Event_Sensor_Report);
     }
 }
 
+// Invoked by TinyUSB whenever it has queued an event for tud_task.
+// Start-of-frame isn't queued, it only paces sensor reports if enabled.
+void tud_event_hook_cb(uint8_t rhport, uint32_t eventid, bool in_isr) {
+    if (eventid == DCD_EVENT_SOF) {
+        if (USB_SOF_REPORT_PACING) scheduler_post(Event_Sensor_Report);
+        return;
+    }
+
+    scheduler_post(Event_USB);
+}
+
+// Public functions ------------------------------------------------------------
+
 uint8_t * usb_get_packet() {
-    if (!have_packet) return NULL;
+    if (out_count() == 0) return NULL;
+
+    return out_slots[out_front & OUT_SLOT_MASK];
+}
+
+void usb_release_packet() {
+    if (out_count() == 0) return;
+
+    out_front++;
 
-    return usb_buffer;
-}
\ No newline at end of file
+    // Endpoint may have been left un-armed because the ring was full
+    tud_hid_out_resume();
+}
+
+uint8_t usb_pending_packets() {
+    return out_count();
+}
@@ -0,0 +1,134 @@
+#include "tusb.h"
+#include "tusb_vendor.h"
+#include "scheduler.h"
+#include "update.h"
+#include "panel_program.h"
+#include "settings.h"
+#include "discovery.h"
+
+// Sends data to the host. Stalls a request that isn't IN, as its data stage
+// would otherwise be written over the data.
+static bool send_to_host(
+    uint8_t rhport,
+    tusb_control_request_t const * request,
+    void * data,
+    uint16_t len
+) {
+    if (request->bmRequestType_bit.direction != TUSB_DIR_IN) return false;
+
+    return tud_control_xfer(rhport, request, data, len);
+}
+
+// Starts programming the panels in the request's wValue mask with the stored
+// panel image. Returns false, stalling the request, if it can't, or if the
+// request isn't OUT without a data stage.
+static bool program_panels(uint8_t rhport, tusb_control_request_t const * request) {
+    uint8_t const * image;
+    uint32_t len;
+    uint32_t crc;
+
+    if (request->bmRequestType_bit.direction != TUSB_DIR_OUT) return false;
+    if (request->wLength != 0) return false;
+
+    if (!update_panel_image(&image, &len, &crc)) return false;
+    if (!panel_program_start(image, len, crc, request->wValue)) return false;
+
+    return tud_control_status(rhport, request);
+}
+
+// Data stage of USB_VENDOR_REQUEST_SETTING
+static uint32_t setting_value;
+
+// Reads a setting, or takes the value for one, which is set once it's in
+static bool setting(uint8_t rhport, tusb_control_request_t const * request) {
+    if (request->wValue >= SETTING_COUNT) return false;
+
+    // A shorter data stage would leave part of the last value in place
+    if (request->wLength != sizeof(setting_value)) return false;
+
+    if (request->bmRequestType_bit.direction == TUSB_DIR_IN) {
+        setting_value = settings_get((SettingKey)request->wValue);
+    }
+
+    return tud_control_xfer(
+        rhport,
+        request,
+        &setting_value,
+        sizeof(setting_value)
+    );
+}
+
+// Invoked when received a control request with the vendor type.
+// Supported are the MS OS 2.0 descriptor set, and the requests for firmware
+// updates, panel programming, settings and panel status; anything else gets
+// stalled.
+bool tud_vendor_control_request_cb(
+    uint8_t rhport,
+    tusb_control_request_t const * request
+) {
+    if (request->bRequest == USB_VENDOR_REQUEST_UPDATE_STATUS) {
+        return send_to_host(
+            rhport,
+            request,
+            (void *)&update_status,
+            sizeof(update_status)
+        );
+    }
+
+    if (request->bRequest == USB_VENDOR_REQUEST_PROGRAM_PANELS) {
+        return program_panels(rhport, request);
+    }
+
+    if (request->bRequest == USB_VENDOR_REQUEST_PANEL_PROGRAM_STATUS) {
+        return send_to_host(
+            rhport,
+            request,
+            (void *)panel_program_progress,
+            sizeof(panel_program_progress)
+        );
+    }
+
+    if (request->bRequest == USB_VENDOR_REQUEST_SETTING) {
+        return setting(rhport, request);
+    }
+
+    if (request->bRequest == USB_VENDOR_REQUEST_PANEL_STATUS) {
+        return send_to_host(
+            rhport,
+            request,
+            (void *)discovery_ports,
+            sizeof(discovery_ports)
+        );
+    }
+
+    if (request->bRequest != USB_VENDOR_REQUEST_MICROSOFT) return false;
+    if (request->wIndex != USB_MS_OS_20_DESCRIPTOR_INDEX) return false;
+
+    return send_to_host(
+        rhport, 
+        request, 
+        (void *)desc_ms_os_20, 
+        MS_OS_20_DESC_LEN
+    );
+}
+
+// Invoked when a vendor control request above has completed
+bool tud_vendor_control_complete_cb(
+    uint8_t rhport,
+    tusb_control_request_t const * request
+) {
+    (void) rhport;
+
+    if (request->bRequest == USB_VENDOR_REQUEST_SETTING
+        && request->bmRequestType_bit.direction == TUSB_DIR_OUT) {
+
+        settings_set((SettingKey)request->wValue, setting_value);
+    }
+
+    return true;
+}
+
+// Invoked when LED data came in on the vendor bulk endpoint
+void tud_vendor_rx_cb(uint8_t itf) {
+    scheduler_post(Event_LED_Packet);
+}
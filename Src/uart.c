@@ -2,6 +2,8 @@
 #include "stdbool.h"
 #include "error_handler.h"
 #include "config.h"
+#include "critical.h"
+#include "cycles.h"
 
 #define RS485_CK_DR_PINS_B (GPIO_PIN_2 | GPIO_PIN_7 | GPIO_PIN_9 | GPIO_PIN_13)
 #define RS485_TX_DR_PINS_B (GPIO_PIN_0 | GPIO_PIN_14 | GPIO_PIN_6)
@@ -19,26 +21,28 @@
 #define UART2_RIGHT_PINS_A GPIO_PIN_15
 #define UART2_RIGHT_PINS_B GPIO_PIN_3
 
+// All pins USART2 could be connected to
+#define UART2_MUX_PINS_A (UART2_UP_PINS_A | UART2_RIGHT_PINS_A)
+#define UART2_MUX_PINS_B (UART2_UP_PINS_B | UART2_RIGHT_PINS_B)
+
+// 2-bit field values of GPIOx->MODER
+#define MODER_AF (0x02U)
+#define MODER_ANALOG (0x03U)
+
 #define PANEL_LEFT_INITIALIZED (HAL_GPIO_ReadPin(GPIOA, GPIO_PIN_8))
 #define PANEL_UP_INITIALIZED (HAL_GPIO_ReadPin(GPIOA, GPIO_PIN_4))
 #define PANEL_DOWN_INITIALIZED (HAL_GPIO_ReadPin(GPIOB, GPIO_PIN_12))
 #define PANEL_RIGHT_INITIALIZED (HAL_GPIO_ReadPin(GPIOB, GPIO_PIN_5))
 
-#define ALL_INITIALIZED (\
-    (!PANEL_LEFT_CONNECTED || PANEL_LEFT_INITIALIZED) && \
-    (!PANEL_UP_CONNECTED || PANEL_UP_INITIALIZED) && \
-    (!PANEL_DOWN_CONNECTED || PANEL_DOWN_INITIALIZED) && \
-    (!PANEL_RIGHT_CONNECTED || PANEL_DOWN_INITIALIZED) \
-)
-
 /**
  * Notes regarding UART / USART
  * 
  * Initially the boards were designed to use USART (so including a clock),
  * but it appears that the controller used on the panel boards is unable to
  * run in "slave" usart mode. Thus, the clock line referred to as CK is largely
- * unused, except for waiting for panel boards to indicate they are ready, at
- * which time they'll write this line high.
+ * unused, except for panel boards to indicate they are ready, at which time
+ * they'll write this line high. discovery.c polls it through
+ * uart_panel_ready.
  */
 
 UART_HandleTypeDef huart1_l; // Left
@@ -55,6 +59,25 @@ DMA_HandleTypeDef hdma_usart3_d_tx;
 // up or right connector, this indicates which one is configured on USART2
 ComportId switched_comport = Comport_None;
 
+// Cycles taken by uart_connect_port to switch USART2 over, for the last
+// switch and the slowest one so far.
+// Public, so that contents can be inspected during debugging
+uint32_t usart2_switch_cycles_last = 0;
+uint32_t usart2_switch_cycles_max = 0;
+
+// GPIO mode register contents for the USART2 pins with one connector
+// connected (alternate function) and the other disconnected (analog).
+// Only the bits under UART2_MUX_PINS_A/B are used.
+typedef struct {
+    uint32_t moder_a;
+    uint32_t moder_b;
+} Usart2MuxImage;
+
+static Usart2MuxImage mux_image_up;
+static Usart2MuxImage mux_image_right;
+static uint32_t mux_moder_mask_a;
+static uint32_t mux_moder_mask_b;
+
 static SendCompleteHandler send_complete_handler = NULL;
 static ReceiveCompleteHandler receive_complete_handler = NULL;
 
@@ -62,6 +85,9 @@ static void init_gpio();
 static void init_rs485();
 static void init_periph(UART_HandleTypeDef *, USART_TypeDef *, IRQn_Type);
 static void init_dma_interrupts();
+static void init_usart2_mux();
+static void connect_port_fast(ComportId);
+static void connect_port_reinit(ComportId);
 
 static UART_HandleTypeDef * get_uart_handle(ComportId);
 
@@ -120,8 +146,17 @@ void uart_init() {
     uart_handles[Comport_Up] = &huart2_u_r;
     uart_handles[Comport_Right] = &huart2_u_r;
 
-    // Wait for all panel boards marked as connected to signal their readiness
-    while (!ALL_INITIALIZED);
+    init_usart2_mux();
+}
+
+uint8_t uart_panel_ready(ComportId comport_id) {
+    switch (comport_id) {
+        case Comport_Left: return PANEL_LEFT_INITIALIZED;
+        case Comport_Down: return PANEL_DOWN_INITIALIZED;
+        case Comport_Up: return PANEL_UP_INITIALIZED;
+        case Comport_Right: return PANEL_RIGHT_INITIALIZED;
+        default: return false;
+    }
 }
 
 void uart_send(ComportId comport_id, uint8_t * data_ptr, uint16_t data_len) {
@@ -161,6 +196,59 @@ void uart_connect_port(ComportId comport_id) {
     // Don't do anything if the switched uart already matches this one
     if (switched_comport == comport_id) return;
 
+    uint32_t started_at = cycles_now();
+
+    if (UART_FAST_MUX) {
+        connect_port_fast(comport_id);
+    } else {
+        connect_port_reinit(comport_id);
+    }
+
+    switched_comport = comport_id;
+
+    usart2_switch_cycles_last = cycles_since(started_at);
+
+    if (usart2_switch_cycles_last > usart2_switch_cycles_max) {
+        usart2_switch_cycles_max = usart2_switch_cycles_last;
+    }
+}
+
+// Both connectors share USART2's configuration and DMA channels, so all that
+// really changes between them is which pins are in alternate function mode.
+// Everything else stays configured; this is a couple of register writes.
+static void connect_port_fast(ComportId comport_id) {
+    Usart2MuxImage * image = comport_id == Comport_Up
+        ? &mux_image_up
+        : &mux_image_right;
+
+    // msgbus only switches with both ports idle or done, but a transfer
+    // that was given up on could still be running; don't carry it over
+    if (huart2_u_r.gState != HAL_UART_STATE_READY
+        || huart2_u_r.RxState != HAL_UART_STATE_READY) {
+        HAL_UART_Abort(&huart2_u_r);
+    }
+
+    uint32_t primask = critical_enter();
+
+    // Stop the receiver while pins move, so the switch itself can't clock
+    // in a garbage byte from either connector
+    CLEAR_BIT(USART2->CR1, USART_CR1_RE);
+
+    GPIOA->MODER = (GPIOA->MODER & ~mux_moder_mask_a) | image->moder_a;
+    GPIOB->MODER = (GPIOB->MODER & ~mux_moder_mask_b) | image->moder_b;
+
+    // Drop anything the old connector left behind
+    USART2->RQR = USART_RQR_RXFRQ;
+    USART2->ICR = USART_ICR_ORECF | USART_ICR_FECF | USART_ICR_NCF;
+
+    SET_BIT(USART2->CR1, USART_CR1_RE);
+
+    critical_exit(primask);
+}
+
+// Original switching method: tears USART2 and its DMA down completely and
+// sets everything up again for the other connector.
+static void connect_port_reinit(ComportId comport_id) {
     HAL_NVIC_DisableIRQ(USART2_IRQn);
 
     HAL_UART_MspDeInit(&huart2_u_r);
@@ -215,7 +303,6 @@ void uart_connect_port(ComportId comport_id) {
     
     init_periph(&huart2_u_r, USART2, USART2_IRQn);
     HAL_UART_MspInit(&huart2_u_r);
-    switched_comport = comport_id;
 }
 
 // Initialization
@@ -248,8 +335,8 @@ static void init_gpio() {
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
-    // A 4: USART2-0_CK;, Clock input for "up" -- used for wait init (input)
-    // A 8: USART1_CK, Clock input for "left" -- used for wait init (input)
+    // A 4: USART2-0_CK;, Clock input for "up" -- panel ready (input)
+    // A 8: USART1_CK, Clock input for "left" -- panel ready (input)
     GPIO_InitStruct.Pin = GPIO_PIN_4|GPIO_PIN_8;
     GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
     GPIO_InitStruct.Pull = GPIO_NOPULL;
@@ -267,8 +354,8 @@ static void init_gpio() {
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
-    // B 12: USART3_CK, Clock input for "down" -- used for wait init (input)
-    // B 5: USART2-1_CK, Clock input for "right" -- used for wait init (input)
+    // B 12: USART3_CK, Clock input for "down" -- panel ready (input)
+    // B 5: USART2-1_CK, Clock input for "right" -- panel ready (input)
     GPIO_InitStruct.Pin = GPIO_PIN_12|GPIO_PIN_5;
     GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
     GPIO_InitStruct.Pull = GPIO_NOPULL;
@@ -320,6 +407,62 @@ static void init_periph(
     }
 }
 
+// Builds the MODER bits putting each of the given pins in the given mode
+static inline uint32_t moder_bits(uint32_t pins, uint32_t mode) {
+    uint32_t bits = 0;
+
+    for (uint32_t pin = 0; pin < 16; pin++) {
+        if (pins & (1U << pin)) bits |= mode << (pin * 2);
+    }
+
+    return bits;
+}
+
+// Sets the given pins to USART2's alternate function at high speed, without
+// changing their mode
+static inline void set_usart2_af(GPIO_TypeDef * gpio, uint32_t pins) {
+    for (uint32_t pin = 0; pin < 16; pin++) {
+        if (!(pins & (1U << pin))) continue;
+
+        uint32_t afr_shift = (pin & 0x07U) * 4;
+        MODIFY_REG(
+            gpio->AFR[pin >> 3],
+            0x0FU << afr_shift,
+            (uint32_t)GPIO_AF7_USART2 << afr_shift
+        );
+
+        MODIFY_REG(gpio->PUPDR, 0x03U << (pin * 2), 0);
+        CLEAR_BIT(gpio->OTYPER, 1U << pin);
+        SET_BIT(gpio->OSPEEDR, 0x03U << (pin * 2));
+    }
+}
+
+// Precomputes what connect_port_fast writes, and sets up everything about the
+// USART2 pins that doesn't change between connectors. Leaves both connectors
+// disconnected.
+static void init_usart2_mux() {
+    mux_moder_mask_a = moder_bits(UART2_MUX_PINS_A, MODER_ANALOG);
+    mux_moder_mask_b = moder_bits(UART2_MUX_PINS_B, MODER_ANALOG);
+
+    mux_image_up.moder_a = moder_bits(UART2_UP_PINS_A, MODER_AF)
+        | moder_bits(UART2_RIGHT_PINS_A, MODER_ANALOG);
+    mux_image_up.moder_b = moder_bits(UART2_UP_PINS_B, MODER_AF)
+        | moder_bits(UART2_RIGHT_PINS_B, MODER_ANALOG);
+
+    mux_image_right.moder_a = moder_bits(UART2_RIGHT_PINS_A, MODER_AF)
+        | moder_bits(UART2_UP_PINS_A, MODER_ANALOG);
+    mux_image_right.moder_b = moder_bits(UART2_RIGHT_PINS_B, MODER_AF)
+        | moder_bits(UART2_UP_PINS_B, MODER_ANALOG);
+
+    GPIOA->MODER |= mux_moder_mask_a;
+    GPIOB->MODER |= mux_moder_mask_b;
+
+    set_usart2_af(GPIOA, UART2_MUX_PINS_A);
+    set_usart2_af(GPIOB, UART2_MUX_PINS_B);
+
+    switched_comport = Comport_None;
+}
+
 static void init_dma_interrupts() {
     __HAL_RCC_DMA1_CLK_ENABLE();
 
@@ -0,0 +1,440 @@
+#include "update.h"
+#include "stdbool.h"
+#include "string.h"
+#include "flash_layout.h"
+#include "led_stream.h"
+#include "scheduler.h"
+#include "crc.h"
+#include "panel_program.h"
+
+// Where ST's ROM bootloader lives on the STM32F303xC, see AN2606
+#define SYSTEM_MEMORY_START (0x1FFFD800U)
+
+// Left in RAM across the restart by update_request_bootloader()
+#define BOOTLOADER_MAGIC (0xB007DF00U)
+#define BOOTLOADER_DELAY_MS (50U)
+
+#define PAGE_LEN (FLASH_PAGE_SIZE)
+
+// Halfwords programmed per Event_Flash_Write. The core stalls while the flash
+// is busy, around 50 us per halfword, so this limits how long other events
+// have to wait.
+#define HALFWORDS_PER_STEP (32U)
+
+// End of RAM, the initial stack pointer of any firmware for this board
+#define RAM_END (SRAM_BASE + 40U * 1024U)
+
+// Marks a panel image whose info has been written
+#define PANEL_IMAGE_MAGIC (0x50414E4CU)
+
+_Static_assert(UPDATE_MAX_MESSAGE_LEN <= LED_STREAM_MAX_PAYLOAD, "Update messages must fit the stream");
+_Static_assert(PAGE_LEN % UPDATE_BLOCK_LEN == 0, "Blocks must not straddle pages");
+_Static_assert(sizeof(UpdateStatus) == 16, "Status must be packed");
+
+typedef struct {
+    uint8_t data[PAGE_LEN];
+
+    // Offset of the page in the image
+    uint32_t offset;
+
+    // Filled and waiting for, or being written by, the flash writer
+    uint8_t full;
+} PageBuffer;
+
+// Kept at FLASH_PANEL_IMAGE_INFO once a panel image has been checked
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    uint32_t crc;
+} PanelImageInfo;
+
+// Public, so that contents can be inspected during debugging
+UpdateStatus update_status;
+
+// Blocks go into one page buffer while the writer works on the other
+static PageBuffer pages[2];
+static uint8_t filling = 0;
+static uint8_t writing = 0;
+
+// Halfwords of the page being written that are done, 0 when it still needs
+// erasing
+static uint16_t halfwords_written = 0;
+
+static UpdateTarget target = UpdateTarget_Firmware;
+static uint32_t staging_start = FLASH_STAGING_START;
+static uint32_t image_len = 0;
+static uint32_t image_crc = 0;
+static uint8_t finish_requested = false;
+
+static uint32_t bootloader_at = 0;
+static uint8_t bootloader_pending = false;
+
+__attribute__((section(".noinit")))
+static uint32_t bootloader_request;
+
+static inline uint32_t read_u32(uint8_t const * data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint8_t fail(UpdateError error) {
+    update_status.state = UpdateState_Failed;
+    update_status.error = error;
+    HAL_FLASH_Lock();
+
+    // The stream may be waiting on the writer, which is done now
+    scheduler_post(Event_LED_Packet);
+    return false;
+}
+
+// Copies the staged image over the running firmware and restarts into it.
+// Runs from RAM, as it overwrites the flash everything else runs from: it
+// can't call anything in flash, the HAL included, and it doesn't return. If
+// power goes in the middle of it, the ROM bootloader can still be reached
+// with the BOOT0 pin.
+__attribute__((section(".RamFunc"), noinline, long_call))
+static void install_image(uint32_t len) {
+    __disable_irq();
+
+    for (uint32_t page = 0; page < len; page += PAGE_LEN) {
+        while (FLASH->SR & FLASH_SR_BSY);
+
+        FLASH->CR |= FLASH_CR_PER;
+        FLASH->AR = FLASH_APP_START + page;
+        FLASH->CR |= FLASH_CR_STRT;
+        while (FLASH->SR & FLASH_SR_BSY);
+        FLASH->CR &= ~FLASH_CR_PER;
+
+        FLASH->CR |= FLASH_CR_PG;
+
+        for (uint32_t i = page; i < page + PAGE_LEN && i < len; i += 2) {
+            *(__IO uint16_t *)(FLASH_APP_START + i) =
+                *(uint16_t const *)(FLASH_STAGING_START + i);
+            while (FLASH->SR & FLASH_SR_BSY);
+        }
+
+        FLASH->CR &= ~FLASH_CR_PG;
+    }
+
+    __DSB();
+    SCB->AIRCR = (0x5FAUL << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+    __DSB();
+    while (1);
+}
+
+// Whether the image starts with a vector table for this board: a stack in
+// RAM and a reset handler within the image
+static uint8_t image_plausible(uint32_t len) {
+    uint32_t const * vectors = (uint32_t const *)FLASH_STAGING_START;
+    uint32_t reset = vectors[1] & ~1U;
+
+    return vectors[0] > SRAM_BASE && vectors[0] <= RAM_END
+        && (vectors[1] & 1U) != 0
+        && reset >= FLASH_APP_START && reset < FLASH_APP_START + len;
+}
+
+// Writes the info that makes the panel image usable, now that it's checked
+static void store_panel_image() {
+    PanelImageInfo info = {
+        .magic = PANEL_IMAGE_MAGIC,
+        .len = image_len,
+        .crc = image_crc
+    };
+    uint32_t const * words = (uint32_t const *)&info;
+
+    for (uint8_t i = 0; i < sizeof(info) / 4; i++) {
+        uint32_t address = FLASH_PANEL_IMAGE_INFO + i * 4U;
+
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, words[i]) != HAL_OK
+            || *(__IO uint32_t *)address != words[i]) {
+
+            fail(UpdateError_Flash);
+            return;
+        }
+    }
+
+    HAL_FLASH_Lock();
+    update_status.state = UpdateState_Stored;
+}
+
+static void verify_and_install() {
+    update_status.crc = crc32((uint8_t const *)staging_start, image_len);
+
+    if (update_status.crc != image_crc) {
+        fail(UpdateError_Bad_CRC);
+        return;
+    }
+
+    // Panel firmware only has to get to the panels as it is
+    if (target == UpdateTarget_Panel_Image) {
+        store_panel_image();
+        return;
+    }
+
+    if (!image_plausible(image_len)) {
+        fail(UpdateError_Bad_Image);
+        return;
+    }
+
+    update_status.state = UpdateState_Installing;
+    install_image(image_len);
+}
+
+// Erases the page being written, if it hasn't been yet, and programs the next
+// few halfwords. Returns false if that failed.
+static uint8_t write_some(PageBuffer * page) {
+    uint32_t address = staging_start + page->offset;
+    uint32_t len = image_len - page->offset;
+    if (len > PAGE_LEN) len = PAGE_LEN;
+
+    if (halfwords_written == 0) {
+        FLASH_EraseInitTypeDef erase = {
+            .TypeErase = FLASH_TYPEERASE_PAGES,
+            .PageAddress = address,
+            .NbPages = 1
+        };
+        uint32_t page_error;
+
+        if (HAL_FLASHEx_Erase(&erase, &page_error) != HAL_OK) return false;
+    }
+
+    for (uint8_t i = 0; i < HALFWORDS_PER_STEP; i++) {
+        uint32_t offset = halfwords_written * 2U;
+        if (offset >= len) break;
+
+        uint16_t value = page->data[offset] | (page->data[offset + 1] << 8);
+
+        if (HAL_FLASH_Program(
+            FLASH_TYPEPROGRAM_HALFWORD, address + offset, value) != HAL_OK) {
+            return false;
+        }
+
+        if (*(__IO uint16_t *)(address + offset) != value) return false;
+
+        halfwords_written++;
+    }
+
+    if (halfwords_written * 2U >= len) {
+        page->full = false;
+        halfwords_written = 0;
+        writing ^= 1;
+        update_status.written += len;
+
+        // There's room for the next page now, in case the stream stopped
+        scheduler_post(Event_LED_Packet);
+    }
+
+    return true;
+}
+
+static uint8_t process_begin(uint8_t const * data, uint16_t len) {
+    if (len != 9 && len != 10) return fail(UpdateError_Bad_Message);
+
+    image_len = read_u32(data + 1);
+    image_crc = read_u32(data + 5);
+    target = len == 10 ? (UpdateTarget)data[9] : UpdateTarget_Firmware;
+
+    update_status = (UpdateStatus) { .state = UpdateState_Receiving };
+    pages[0].full = false;
+    pages[1].full = false;
+    filling = 0;
+    writing = 0;
+    halfwords_written = 0;
+    finish_requested = false;
+
+    switch (target) {
+        case UpdateTarget_Firmware:
+            staging_start = FLASH_STAGING_START;
+            break;
+
+        case UpdateTarget_Panel_Image:
+            staging_start = FLASH_PANEL_IMAGE_START;
+            break;
+
+        default:
+            return fail(UpdateError_Bad_Message);
+    }
+
+    uint32_t max_len = target == UpdateTarget_Firmware
+        ? FLASH_STAGING_LEN
+        : FLASH_PANEL_IMAGE_MAX;
+
+    if (image_len == 0 || image_len % 4 != 0 || image_len > max_len) {
+        return fail(UpdateError_Bad_Length);
+    }
+
+    // The panels may be getting the image that's there now
+    if (target == UpdateTarget_Panel_Image && panel_program_active()) {
+        return fail(UpdateError_Busy);
+    }
+
+    HAL_FLASH_Unlock();
+
+    // The old panel image is gone as soon as the new one starts going in
+    if (target == UpdateTarget_Panel_Image) {
+        FLASH_EraseInitTypeDef erase = {
+            .TypeErase = FLASH_TYPEERASE_PAGES,
+            .PageAddress = FLASH_PANEL_IMAGE_INFO,
+            .NbPages = 1
+        };
+        uint32_t page_error;
+
+        if (HAL_FLASHEx_Erase(&erase, &page_error) != HAL_OK) {
+            return fail(UpdateError_Flash);
+        }
+    }
+
+    return true;
+}
+
+static uint8_t process_data(uint8_t const * data, uint16_t len) {
+    // The rest of a failed update, keep the reason it failed
+    if (update_status.state != UpdateState_Receiving) return false;
+
+    if (len < 5 || finish_requested) return fail(UpdateError_Bad_Message);
+
+    uint32_t offset = read_u32(data + 1);
+    uint16_t block_len = len - 5;
+    uint8_t last = offset + block_len == image_len;
+
+    if (offset != update_status.received
+        || block_len == 0
+        || block_len > UPDATE_BLOCK_LEN
+        || (block_len != UPDATE_BLOCK_LEN && !last)
+        || offset + block_len > image_len) {
+
+        return fail(UpdateError_Out_Of_Order);
+    }
+
+    // update_blocked() kept this from coming in while the buffer is taken
+    PageBuffer * page = &pages[filling];
+    uint32_t in_page = offset % PAGE_LEN;
+
+    memcpy(page->data + in_page, data + 5, block_len);
+    update_status.received += block_len;
+
+    if (in_page + block_len == PAGE_LEN || last) {
+        page->offset = offset - in_page;
+        page->full = true;
+        filling ^= 1;
+        scheduler_post(Event_Flash_Write);
+    }
+
+    return true;
+}
+
+static uint8_t process_finish() {
+    if (update_status.state != UpdateState_Receiving) return false;
+    if (update_status.received != image_len) {
+        return fail(UpdateError_Bad_Message);
+    }
+
+    finish_requested = true;
+    scheduler_post(Event_Flash_Write);
+    return true;
+}
+
+// Public functions ------------------------------------------------------------
+
+void update_check_bootloader() {
+    if (bootloader_request != BOOTLOADER_MAGIC) return;
+    bootloader_request = 0;
+
+    uint32_t const * system_memory = (uint32_t const *)SYSTEM_MEMORY_START;
+
+    // Map the ROM at 0 as if the board had booted into it with BOOT0
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE)
+        | SYSCFG_CFGR1_MEM_MODE_0;
+
+    __set_MSP(system_memory[0]);
+    ((void (*)(void))system_memory[1])();
+}
+
+void update_init() {
+    update_status = (UpdateStatus) { 0 };
+    pages[0].full = false;
+    pages[1].full = false;
+    finish_requested = false;
+    bootloader_pending = false;
+}
+
+uint8_t update_process_message(uint8_t const * data, uint16_t len) {
+    if (len < 1) return fail(UpdateError_Bad_Message);
+
+    switch ((UpdateOp)data[0]) {
+        case Update_Begin:
+            return process_begin(data, len);
+
+        case Update_Data:
+            return process_data(data, len);
+
+        case Update_Finish:
+            return process_finish();
+
+        case Update_Abort:
+            update_status.state = UpdateState_Idle;
+            HAL_FLASH_Lock();
+            scheduler_post(Event_LED_Packet);
+            return true;
+
+        default:
+            return fail(UpdateError_Bad_Message);
+    }
+}
+
+uint8_t update_panel_image(
+    uint8_t const ** image,
+    uint32_t * len,
+    uint32_t * crc
+) {
+    PanelImageInfo const * info = (PanelImageInfo const *)FLASH_PANEL_IMAGE_INFO;
+
+    // Erased as soon as an update starts overwriting the image
+    if (info->magic != PANEL_IMAGE_MAGIC || info->len > FLASH_PANEL_IMAGE_MAX) {
+        return false;
+    }
+
+    *image = (uint8_t const *)FLASH_PANEL_IMAGE_START;
+    *len = info->len;
+    *crc = info->crc;
+    return true;
+}
+
+uint8_t update_blocked() {
+    return update_status.state == UpdateState_Receiving && pages[filling].full;
+}
+
+void update_write_step() {
+    if (update_status.state != UpdateState_Receiving) return;
+
+    PageBuffer * page = &pages[writing];
+
+    if (!page->full) {
+        // Everything's in flash once neither buffer has anything left
+        if (finish_requested && update_status.written == image_len) {
+            verify_and_install();
+        }
+
+        return;
+    }
+
+    if (!write_some(page)) {
+        fail(UpdateError_Flash);
+        return;
+    }
+
+    scheduler_post(Event_Flash_Write);
+}
+
+void update_request_bootloader() {
+    bootloader_at = HAL_GetTick() + BOOTLOADER_DELAY_MS;
+    bootloader_pending = true;
+}
+
+void update_tick(uint32_t now_ms) {
+    if (!bootloader_pending) return;
+    if ((int32_t)(now_ms - bootloader_at) < 0) return;
+
+    bootloader_request = BOOTLOADER_MAGIC;
+    NVIC_SystemReset();
+}